@@ -0,0 +1,345 @@
+// bcache.rs
+// Block buffer cache
+// The file system asks for 1 KiB blocks by (device, block number). We keep
+// the most recently used ones in memory so that we don't go out to the
+// block device for the same block over and over again, which we used to do
+// for every indirect zone on every read.
+// Writes land in the cache and are marked dirty. They go out to the disk
+// later, in sync(), which puts every run of neighboring dirty blocks into
+// one request.
+
+use crate::{buffer::Buffer,
+            cpu::memcpy,
+            fs::BLOCK_SIZE,
+            lock::Mutex,
+            syscall::{syscall_block_read, syscall_block_write}};
+use alloc::{collections::BTreeMap, vec::Vec};
+
+// 128 KiB of cached blocks.
+pub const CACHE_BLOCKS: usize = 128;
+// Pinned blocks (superblocks and indirect zones) are never evicted. We
+// don't let them take more than half of the cache, otherwise a big enough
+// file would pin everything and we'd have nowhere to put data.
+pub const MAX_PINNED: usize = CACHE_BLOCKS / 2;
+// The most blocks we'll read or write in one request to the block device.
+pub const MAX_READ_AHEAD: usize = 16;
+// Dirty blocks can't be evicted until they're written, so once this many
+// pile up, the next write syncs first. This leaves at least
+// CACHE_BLOCKS - MAX_PINNED - MAX_DIRTY clean blocks to evict.
+pub const MAX_DIRTY: usize = CACHE_BLOCKS / 4;
+
+struct CacheEntry {
+	dev:       usize,
+	block:     u32,
+	data:      Buffer,
+	last_used: usize,
+	pinned:    bool,
+	dirty:     bool,
+	// Goes up on every write. sync() uses it to tell whether a block was
+	// written again while its old contents were on the way to the disk.
+	version:   usize,
+}
+
+struct BlockCache {
+	// (device, block) -> index into entries
+	map:     BTreeMap<(usize, u32), usize>,
+	entries: Vec<CacheEntry>,
+	// A tick that goes up on every access. The entry with the smallest
+	// last_used is the least recently used.
+	tick:    usize,
+	pinned:  usize,
+	dirty:   usize,
+	// Goes up on every write(). A read that saw it change while it was at
+	// the disk may have read a block from before that write, so it doesn't
+	// cache what it read.
+	writes:  usize,
+}
+
+static mut BLOCK_CACHE: Option<BlockCache> = None;
+// Readers are kernel processes, which can be preempted. We never hold this
+// across a block device read, only while we touch the map.
+static mut BLOCK_CACHE_MUTEX: Mutex = Mutex::new();
+
+impl BlockCache {
+	fn new() -> Self {
+		Self { map:     BTreeMap::new(),
+		       entries: Vec::with_capacity(CACHE_BLOCKS),
+		       tick:    0,
+		       pinned:  0,
+		       dirty:   0,
+		       writes:  0, }
+	}
+
+	/// Copy a cached block into dst. Returns false if it isn't cached.
+	fn get(&mut self, dev: usize, block: u32, dst: *mut u8, pin: bool) -> bool {
+		self.tick = self.tick.wrapping_add(1);
+		if let Some(&idx) = self.map.get(&(dev, block)) {
+			let tick = self.tick;
+			if pin && !self.entries[idx].pinned && self.pinned < MAX_PINNED {
+				self.entries[idx].pinned = true;
+				self.pinned += 1;
+			}
+			let ent = &mut self.entries[idx];
+			ent.last_used = tick;
+			unsafe {
+				memcpy(dst, ent.data.get(), BLOCK_SIZE as usize);
+			}
+			true
+		}
+		else {
+			false
+		}
+	}
+
+	/// Put a block into the cache, evicting the least recently used
+	/// clean, unpinned block if we're full. A dirty block has to be written
+	/// by sync() before it goes anywhere. Returns false if there was no room.
+	fn put(&mut self, dev: usize, block: u32, src: *const u8, pin: bool, dirty: bool) -> bool {
+		self.tick = self.tick.wrapping_add(1);
+		let pin = pin && self.pinned < MAX_PINNED;
+		let idx = if let Some(&idx) = self.map.get(&(dev, block)) {
+			idx
+		}
+		else if self.entries.len() < CACHE_BLOCKS {
+			self.entries.push(CacheEntry { dev,
+			                               block,
+			                               data: Buffer::new(BLOCK_SIZE as usize),
+			                               last_used: 0,
+			                               pinned: false,
+			                               dirty: false,
+			                               version: 0 });
+			self.entries.len() - 1
+		}
+		else {
+			// This is the slow part, but it's a scan of CACHE_BLOCKS
+			// entries in memory instead of a trip to the disk.
+			let mut victim = None;
+			let mut oldest = usize::MAX;
+			for (i, ent) in self.entries.iter().enumerate() {
+				if !ent.pinned && !ent.dirty && ent.last_used < oldest {
+					oldest = ent.last_used;
+					victim = Some(i);
+				}
+			}
+			match victim {
+				Some(i) => {
+					let ent = &self.entries[i];
+					self.map.remove(&(ent.dev, ent.block));
+					i
+				},
+				// MAX_PINNED and MAX_DIRTY keep this from happening, but
+				// don't cache rather than panic if it does.
+				None => return false,
+			}
+		};
+		let tick = self.tick;
+		let ent = &mut self.entries[idx];
+		ent.dev = dev;
+		ent.block = block;
+		ent.last_used = tick;
+		unsafe {
+			memcpy(ent.data.get_mut(), src, BLOCK_SIZE as usize);
+		}
+		if pin && !ent.pinned {
+			ent.pinned = true;
+			self.pinned += 1;
+		}
+		if dirty {
+			ent.version = ent.version.wrapping_add(1);
+			if !ent.dirty {
+				ent.dirty = true;
+				self.dirty += 1;
+			}
+		}
+		self.map.insert((dev, block), idx);
+		true
+	}
+
+	/// Copy out every dirty block on dev, grouped into runs of neighboring
+	/// blocks. Each run comes back as (first block, data, versions).
+	fn dirty_runs(&self, dev: usize) -> Vec<(u32, Buffer, Vec<usize>)> {
+		let mut blocks = Vec::with_capacity(self.dirty);
+		// The map is ordered, so these come out sorted by block number.
+		for (&(_, block), &idx) in self.map.range((dev, 0)..=(dev, u32::MAX)) {
+			if self.entries[idx].dirty {
+				blocks.push((block, idx));
+			}
+		}
+		let mut runs = Vec::new();
+		let mut i = 0;
+		while i < blocks.len() {
+			let mut count = 1;
+			while i + count < blocks.len()
+			      && count < MAX_READ_AHEAD
+			      && blocks[i + count].0 == blocks[i].0 + count as u32
+			{
+				count += 1;
+			}
+			let mut data = Buffer::new(BLOCK_SIZE as usize * count);
+			let mut versions = Vec::with_capacity(count);
+			for j in 0..count {
+				let ent = &self.entries[blocks[i + j].1];
+				unsafe {
+					memcpy(data.get_mut().add(j * BLOCK_SIZE as usize), ent.data.get(), BLOCK_SIZE as usize);
+				}
+				versions.push(ent.version);
+			}
+			runs.push((blocks[i].0, data, versions));
+			i += count;
+		}
+		runs
+	}
+
+	/// The disk has this version of the block now. If nobody wrote it again in
+	/// the meantime, it's clean.
+	fn written(&mut self, dev: usize, block: u32, version: usize) {
+		if let Some(&idx) = self.map.get(&(dev, block)) {
+			let ent = &mut self.entries[idx];
+			if ent.dirty && ent.version == version {
+				ent.dirty = false;
+				self.dirty -= 1;
+			}
+		}
+	}
+
+	fn contains(&self, dev: usize, block: u32) -> bool {
+		self.map.contains_key(&(dev, block))
+	}
+}
+
+pub fn init() {
+	unsafe {
+		if BLOCK_CACHE.is_none() {
+			BLOCK_CACHE = Some(BlockCache::new());
+		}
+	}
+}
+
+/// Run f with the cache locked. If there is no cache, f doesn't run and
+/// we return the default.
+fn with_cache<R, F: FnOnce(&mut BlockCache) -> R>(default: R, f: F) -> R {
+	unsafe {
+		BLOCK_CACHE_MUTEX.sleep_lock();
+		let ret = match BLOCK_CACHE.as_mut() {
+			Some(cache) => f(cache),
+			None => default,
+		};
+		BLOCK_CACHE_MUTEX.unlock();
+		ret
+	}
+}
+
+/// Is this block already in memory?
+pub fn is_cached(dev: usize, block: u32) -> bool {
+	with_cache(false, |c| c.contains(dev, block))
+}
+
+/// Read one block into dst, which must hold at least BLOCK_SIZE bytes.
+/// Pinned blocks stay in the cache for good, so use this for metadata that
+/// every read needs, like indirect zones. Returns the block device's
+/// status, and dst is only good if that's 0. This must be called from a
+/// process since it might block.
+pub fn read(dev: usize, block: u32, dst: *mut u8, pin: bool) -> u8 {
+	let mut writes = 0;
+	if with_cache(false, |c| {
+		writes = c.writes;
+		c.get(dev, block, dst, pin)
+	}) {
+		return 0;
+	}
+	let status = syscall_block_read(dev, dst, BLOCK_SIZE, block * BLOCK_SIZE);
+	// Whatever is in dst after a failed read isn't the block, and it has
+	// to stay out of the cache so that the next read tries the disk again.
+	if status != 0 {
+		return status;
+	}
+	// Someone may have written this block while we were reading it. Theirs
+	// is newer than what's on the disk, so keep it. It may even have been
+	// written, synced and evicted already, so we don't cache anything if
+	// there was a write at all.
+	with_cache((), |c| {
+		if !c.contains(dev, block) && c.writes == writes {
+			c.put(dev, block, dst, pin, false);
+		}
+	});
+	status
+}
+
+/// Read count physically contiguous blocks starting at block using a
+/// single block device request, then cache each of them. The caller has
+/// already decided these are worth having (read-ahead). dst must hold at
+/// least count * BLOCK_SIZE bytes. Like read(), nothing is cached unless
+/// the status is 0. A block that was written while we were reading comes
+/// out of dst as the cache has it, not as we read it.
+pub fn read_run(dev: usize, block: u32, count: usize, dst: *mut u8) -> u8 {
+	let count = if count > MAX_READ_AHEAD {
+		MAX_READ_AHEAD
+	}
+	else {
+		count
+	};
+	let writes = with_cache(0, |c| c.writes);
+	let status = syscall_block_read(dev, dst, BLOCK_SIZE * count as u32, block * BLOCK_SIZE);
+	if status != 0 {
+		return status;
+	}
+	// As in read(), a write while we were at the disk means any of these
+	// may be stale, and a cached (maybe dirty) block is newer than ours.
+	with_cache((), |c| {
+		let raced = c.writes != writes;
+		for i in 0..count {
+			let b = block + i as u32;
+			let data = unsafe { dst.add(i * BLOCK_SIZE as usize) };
+			if c.contains(dev, b) {
+				c.get(dev, b, data, false);
+			}
+			else if !raced {
+				c.put(dev, b, data, false, false);
+			}
+		}
+	});
+	status
+}
+
+/// Write one block from src, which must hold BLOCK_SIZE bytes. This only
+/// goes as far as the cache. The block goes to the disk on the next sync(),
+/// and until then, reads get it from the cache. This must be called from a
+/// process since it might block.
+pub fn write(dev: usize, block: u32, src: *const u8, pin: bool) -> u8 {
+	if with_cache(false, |c| c.dirty >= MAX_DIRTY) {
+		sync(dev);
+	}
+	if with_cache(false, |c| {
+		c.writes = c.writes.wrapping_add(1);
+		c.put(dev, block, src, pin, true)
+	}) {
+		return 0;
+	}
+	// No room to keep it, so it goes straight to the disk.
+	syscall_block_write(dev, src as *mut u8, BLOCK_SIZE, block * BLOCK_SIZE)
+}
+
+/// Write every dirty block on dev to the disk. Neighboring dirty blocks
+/// go out together, so a file written a block at a time still turns into a
+/// few big requests. Returns the last non-zero status, if any.
+pub fn sync(dev: usize) -> u8 {
+	// Copy everything out first. We don't hold the cache across the writes,
+	// so others can keep reading and writing it while they're in flight.
+	let mut runs = with_cache(Vec::new(), |c| c.dirty_runs(dev));
+	let mut status = 0;
+	for (block, data, versions) in runs.iter_mut() {
+		let st = syscall_block_write(dev, data.get_mut(), BLOCK_SIZE * versions.len() as u32, *block * BLOCK_SIZE);
+		if st != 0 {
+			// Leave these dirty. Maybe the next sync does better.
+			status = st;
+			continue;
+		}
+		with_cache((), |c| {
+			for (i, &v) in versions.iter().enumerate() {
+				c.written(dev, *block + i as u32, v);
+			}
+		});
+	}
+	status
+}
+
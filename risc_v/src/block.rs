@@ -3,12 +3,13 @@
 // Stephen Marz
 // 10 March 2020
 
-use crate::{kmem::{kfree, kmalloc},
+use crate::{ioring,
             page::{zalloc, PAGE_SIZE},
             process::{add_kernel_process_args,
                       get_by_pid,
                       set_running,
                       set_waiting},
+            trace,
             virtio,
             virtio::{Descriptor,
                      MmioOffsets,
@@ -16,7 +17,7 @@ use crate::{kmem::{kfree, kmalloc},
                      StatusField,
                      VIRTIO_RING_SIZE}};
 use core::mem::size_of;
-use alloc::boxed::Box;
+use alloc::{boxed::Box, collections::VecDeque, vec::Vec};
 
 #[repr(C)]
 pub struct Geometry {
@@ -72,29 +73,67 @@ pub struct Header {
 	sector:   u64,
 }
 
-#[repr(C)]
-pub struct Data {
-	data: *mut u8,
-}
-
 #[repr(C)]
 pub struct Status {
 	status: u8,
 }
 
+/// One piece of a scatter-gather list. Each segment gets its own data
+/// descriptor, so the pieces don't have to be next to each other in
+/// memory, but together they cover consecutive sectors on the disk.
+#[derive(Copy, Clone)]
+pub struct Segment {
+	pub addr: *mut u8,
+	pub len:  u32,
+}
+
+// The most data segments we'll put into one request. Each request also
+// needs a header and a status descriptor.
+pub const MAX_SEGMENTS: usize = 16;
+
 #[repr(C)]
 pub struct Request {
 	header: Header,
-	data:   Data,
 	status: Status,
-	head:   u16,
 
 	// Do not change anything above this line.
-	// This is the PID of watcher. We store the PID
+	// These are the descriptors this request is using, so that we can
+	// give them back when it finishes.
+	descs:    Vec<u16>,
+	// These are the PIDs of the watchers. We store the PID
 	// because it is possible that the process DIES
 	// before we get here. If we used a pointer, we
-	// may dereference invalid memory.
-	watcher: u16,
+	// may dereference invalid memory. A merged request can have
+	// more than one.
+	watchers: Vec<u16>,
+	// Asynchronous requests from an I/O ring, which get a completion
+	// entry instead of being woken up.
+	completions: Vec<Completion>,
+}
+
+/// Where to post the result of a request that came from an I/O ring
+/// (ioring.rs). Merged requests keep one of these for each original, so
+/// that every submission gets its own completion.
+#[derive(Copy, Clone)]
+pub struct Completion {
+	pub pid:       u16,
+	// Which of pid's submissions this is, to ioring.rs
+	pub tag:       u64,
+	pub user_data: u64,
+	pub bytes:     u32,
+}
+
+// A request that hasn't gone to the device yet, either because the ring
+// was out of descriptors or because others were already waiting. While
+// a request waits here, later requests for the sectors right after it
+// are merged into it.
+struct Staged {
+	write:    bool,
+	sector:   u64,
+	sectors:  u64,
+	segments:    Vec<Segment>,
+	watchers:    Vec<u16>,
+	completions: Vec<Completion>,
 }
 
 // Internal block device structure
@@ -105,9 +144,11 @@ pub struct Request {
 pub struct BlockDevice {
 	queue:        *mut Queue,
 	dev:          *mut u32,
-	idx:          u16,
 	ack_used_idx: u16,
 	read_only:    bool,
+	// Descriptors that aren't part of an in-flight request.
+	free_descs:   VecDeque<u16>,
+	staged:       VecDeque<Staged>,
 }
 
 // Type values
@@ -247,11 +288,16 @@ pub fn setup_block_device(ptr: *mut u32) -> bool {
 		// We need to store all of this data as a "BlockDevice"
 		// structure We will be referring to this structure when
 		// making block requests AND when handling responses.
-		let bd = BlockDevice { queue:        queue_ptr,
-		                       dev:          ptr,
-		                       idx:          0,
+		let mut free_descs = VecDeque::with_capacity(VIRTIO_RING_SIZE);
+		for i in 0..VIRTIO_RING_SIZE {
+			free_descs.push_back(i as u16);
+		}
+		let bd = BlockDevice { queue: queue_ptr,
+		                       dev: ptr,
 		                       ack_used_idx: 0,
-		                       read_only:    ro, };
+		                       read_only: ro,
+		                       free_descs,
+		                       staged: VecDeque::new(), };
 		BLOCK_DEVICES[idx] = Some(bd);
 
 		// 8. Set the DRIVER_OK status bit. Device is now "live"
@@ -263,42 +309,172 @@ pub fn setup_block_device(ptr: *mut u32) -> bool {
 	}
 }
 
-pub fn fill_next_descriptor(bd: &mut BlockDevice, desc: Descriptor) -> u16 {
-	unsafe {
-		// The ring structure increments here first. This allows us to
-		// skip index 0, which then in the used ring will show that .id
-		// > 0. This is one way to error check. We will eventually get
-		// back to 0 as this index is cyclical. However, it shows if the
-		// first read/write actually works.
-		bd.idx = (bd.idx + 1) % VIRTIO_RING_SIZE as u16;
-		(*bd.queue).desc[bd.idx as usize] = desc;
-		if (*bd.queue).desc[bd.idx as usize].flags
-		   & virtio::VIRTIO_DESC_F_NEXT
-		   != 0
-		{
-			// If the next flag is set, we need another descriptor.
-			(*bd.queue).desc[bd.idx as usize].next =
-				(bd.idx + 1) % VIRTIO_RING_SIZE as u16;
+/// Put a staged request onto the ring. This needs a descriptor for the
+/// header, one per segment, and one for the status. If there aren't that
+/// many free, we hand the request back so it can stay staged. This doesn't
+/// notify the device, so several requests can go out with one notify.
+unsafe fn submit(bd: &mut BlockDevice, st: Staged) -> Result<(), Staged> {
+	let needed = st.segments.len() + 2;
+	if bd.free_descs.len() < needed {
+		return Err(st);
+	}
+	let mut rq = Box::new(Request { header:   Header { blktype:  if st.write {
+		                                                   VIRTIO_BLK_T_OUT
+	                                                   }
+	                                                   else {
+		                                                   VIRTIO_BLK_T_IN
+	                                                   },
+	                                                   reserved: 0,
+	                                                   sector:   st.sector, },
+	                                // We put 111 in the status. Whenever the device
+	                                // finishes, it will write into status. If we read
+	                                // status and it is 111, we know that it wasn't written
+	                                // to by the device.
+	                                status:   Status { status: 111 },
+	                                descs:    Vec::with_capacity(needed),
+	                                watchers: st.watchers,
+	                                completions: st.completions, });
+	for _ in 0..needed {
+		rq.descs.push(bd.free_descs.pop_front().unwrap());
+	}
+	let header_addr = &rq.header as *const Header as u64;
+	let status_addr = &rq.status as *const Status as u64;
+	// A write is an "out" direction, whereas a read is an
+	// "in" direction. For a read, the device writes into our buffers.
+	let data_flags = if st.write {
+		0
+	}
+	else {
+		virtio::VIRTIO_DESC_F_WRITE
+	};
+	for (i, &idx) in rq.descs.iter().enumerate() {
+		let (addr, len, flags) = if i == 0 {
+			(header_addr, size_of::<Header>() as u32, virtio::VIRTIO_DESC_F_NEXT)
+		}
+		else if i == needed - 1 {
+			(status_addr, size_of::<Status>() as u32, virtio::VIRTIO_DESC_F_WRITE)
+		}
+		else {
+			let seg = st.segments[i - 1];
+			(seg.addr as u64, seg.len, virtio::VIRTIO_DESC_F_NEXT | data_flags)
+		};
+		let next = if i + 1 < needed {
+			rq.descs[i + 1]
 		}
-		bd.idx
+		else {
+			0
+		};
+		(*bd.queue).desc[idx as usize] = Descriptor { addr, len, flags, next };
+	}
+	let head = rq.descs[0];
+	// The header is the first thing in the request, so the head
+	// descriptor's address is how pending() finds the request again.
+	let _ = Box::into_raw(rq);
+	(*bd.queue).avail.ring[(*bd.queue).avail.idx as usize % VIRTIO_RING_SIZE] = head;
+	// The descriptors have to be written before the device can see the
+	// new avail index.
+	core::sync::atomic::fence(core::sync::atomic::Ordering::SeqCst);
+	(*bd.queue).avail.idx = (*bd.queue).avail.idx.wrapping_add(1);
+	Ok(())
+}
+
+/// Send as many staged requests as will fit. Returns true if we gave the
+/// device anything, in which case the caller needs to notify it.
+unsafe fn submit_staged(bd: &mut BlockDevice) -> bool {
+	let mut submitted = false;
+	while let Some(st) = bd.staged.pop_front() {
+		match submit(bd, st) {
+			Ok(()) => submitted = true,
+			Err(st) => {
+				// Keep the order. The next completion will free up
+				// more descriptors.
+				bd.staged.push_front(st);
+				break;
+			},
+		}
+	}
+	submitted
+}
+
+/// Add a request to the staged list, merging it into a staged request for
+/// the sectors right before or right after it if there is one.
+fn stage(bd: &mut BlockDevice, st: Staged) {
+	for prev in bd.staged.iter_mut() {
+		if prev.write != st.write || prev.segments.len() + st.segments.len() > MAX_SEGMENTS {
+			continue;
+		}
+		if prev.sector + prev.sectors == st.sector {
+			prev.segments.extend_from_slice(&st.segments);
+			prev.sectors += st.sectors;
+			prev.watchers.extend_from_slice(&st.watchers);
+			prev.completions.extend_from_slice(&st.completions);
+			return;
+		}
+		if st.sector + st.sectors == prev.sector {
+			let mut segments = st.segments.clone();
+			segments.extend_from_slice(&prev.segments);
+			prev.segments = segments;
+			prev.sector = st.sector;
+			prev.sectors += st.sectors;
+			prev.watchers.extend_from_slice(&st.watchers);
+			prev.completions.extend_from_slice(&st.completions);
+			return;
+		}
+	}
+	bd.staged.push_back(st);
+}
+
+fn notify(bd: &mut BlockDevice) {
+	unsafe {
+		// The only queue a block device has is 0, which is the
+		// request queue.
+		bd.dev.add(MmioOffsets::QueueNotify.scale32()).write_volatile(0);
 	}
 }
+
 /// This is now a common block operation for both reads and writes. Therefore,
 /// when one thing needs to change, we can change it for both reads and writes.
-/// There is a lot of error checking that I haven't done. The block device reads
-/// sectors at a time, which are 512 bytes. Therefore, our buffer must be
-/// capable of storing multiples of 512 bytes depending on the size. The size is
-/// also a multiple of 512, but we don't really check that.
+/// The segments are read from or written to consecutive sectors starting at
+/// offset. The block device reads sectors at a time, which are 512 bytes, so
+/// every segment has to be a multiple of 512 bytes.
 /// We DO however, check that we aren't writing to an R/O device. This would
 /// cause a I/O error if we tried to write to a R/O device.
-pub fn block_op(dev: usize,
-                buffer: *mut u8,
-                size: u32,
-                offset: u64,
-                write: bool,
-                watcher: u16)
-                -> Result<u32, BlockErrors>
+/// The request goes straight to the device if nothing is waiting ahead of it.
+/// Otherwise, it's staged (and possibly merged) until pending() frees up room.
+/// Either way, the watcher is woken up when the data has been transferred.
+pub fn block_op_sg(dev: usize,
+                   segments: &[Segment],
+                   offset: u64,
+                   write: bool,
+                   watcher: u16)
+                   -> Result<u32, BlockErrors>
+{
+	queue_op(dev, segments, offset, write, watcher, None)
+}
+
+/// Like block_op_sg, but nobody waits. When the transfer is done, the
+/// result is posted to the I/O ring named by completion.
+pub fn block_op_async(dev: usize,
+                      segments: &[Segment],
+                      offset: u64,
+                      write: bool,
+                      completion: Completion)
+                      -> Result<u32, BlockErrors>
+{
+	queue_op(dev, segments, offset, write, 0, Some(completion))
+}
+
+fn queue_op(dev: usize,
+            segments: &[Segment],
+            offset: u64,
+            write: bool,
+            watcher: u16,
+            completion: Option<Completion>)
+            -> Result<u32, BlockErrors>
 {
+	if dev == 0 || dev > 8 {
+		return Err(BlockErrors::BlockDeviceNotFound);
+	}
 	unsafe {
 		if let Some(bdev) = BLOCK_DEVICES[dev - 1].as_mut() {
 			// Check to see if we are trying to write to a read only
@@ -307,72 +483,44 @@ pub fn block_op(dev: usize,
 				println!("Trying to write to read/only!");
 				return Err(BlockErrors::ReadOnly);
 			}
-			if size % 512 != 0 {
+			if segments.len() == 0 || segments.len() > MAX_SEGMENTS || offset % 512 != 0 {
 				return Err(BlockErrors::InvalidArgument);
 			}
-			let sector = offset / 512;
+			let mut size = 0u32;
+			for seg in segments.iter() {
+				if seg.len % 512 != 0 {
+					return Err(BlockErrors::InvalidArgument);
+				}
+				size += seg.len;
+			}
 			// TODO: Before we get here, we are NOT allowed to
 			// schedule a read or write OUTSIDE of the disk's size.
 			// So, we can read capacity from the configuration space
 			// to ensure we stay within bounds.
-			let blk_request_size = size_of::<Request>();
-			let blk_request =
-				kmalloc(blk_request_size) as *mut Request;
-			let desc =
-				Descriptor { addr:  &(*blk_request).header
-				                    as *const Header
-				                    as u64,
-				             len:   size_of::<Header>() as u32,
-				             flags: virtio::VIRTIO_DESC_F_NEXT,
-				             next:  0, };
-			let head_idx = fill_next_descriptor(bdev, desc);
-			(*blk_request).header.sector = sector;
-			// A write is an "out" direction, whereas a read is an
-			// "in" direction.
-			(*blk_request).header.blktype = if write {
-				VIRTIO_BLK_T_OUT
+			let mut watchers = Vec::new();
+			// A PID of 0 means that we don't have a watcher.
+			if watcher > 0 {
+				watchers.push(watcher);
+			}
+			let mut completions = Vec::new();
+			if let Some(c) = completion {
+				completions.push(c);
+			}
+			let st = Staged { write,
+			                  sector: offset / 512,
+			                  sectors: size as u64 / 512,
+			                  segments: segments.to_vec(),
+			                  watchers,
+			                  completions };
+			if bdev.staged.is_empty() {
+				match submit(bdev, st) {
+					Ok(()) => notify(bdev),
+					Err(st) => stage(bdev, st),
+				}
 			}
 			else {
-				VIRTIO_BLK_T_IN
-			};
-			// We put 111 in the status. Whenever the device
-			// finishes, it will write into status. If we read
-			// status and it is 111, we know that it wasn't written
-			// to by the device.
-			(*blk_request).data.data = buffer;
-			(*blk_request).header.reserved = 0;
-			(*blk_request).status.status = 111;
-			(*blk_request).watcher = watcher;
-			let desc =
-				Descriptor { addr:  buffer as u64,
-				             len:   size,
-				             flags: virtio::VIRTIO_DESC_F_NEXT
-				                    | if !write {
-					                    virtio::VIRTIO_DESC_F_WRITE
-				                    }
-				                    else {
-					                    0
-				                    },
-				             next:  0, };
-			let _data_idx = fill_next_descriptor(bdev, desc);
-			let desc =
-				Descriptor { addr:  &(*blk_request).status
-				                    as *const Status
-				                    as u64,
-				             len:   size_of::<Status>() as u32,
-				             flags: virtio::VIRTIO_DESC_F_WRITE,
-				             next:  0, };
-			let _status_idx = fill_next_descriptor(bdev, desc);
-			(*bdev.queue).avail.ring[(*bdev.queue).avail.idx
-			                         as usize
-			                         % virtio::VIRTIO_RING_SIZE] = head_idx;
-			(*bdev.queue).avail.idx =
-				(*bdev.queue).avail.idx.wrapping_add(1);
-			// The only queue a block device has is 0, which is the
-			// request queue.
-			bdev.dev
-			    .add(MmioOffsets::QueueNotify.scale32())
-			    .write_volatile(0);
+				stage(bdev, st);
+			}
 			Ok(size)
 		}
 		else {
@@ -381,6 +529,17 @@ pub fn block_op(dev: usize,
 	}
 }
 
+pub fn block_op(dev: usize,
+                buffer: *mut u8,
+                size: u32,
+                offset: u64,
+                write: bool,
+                watcher: u16)
+                -> Result<u32, BlockErrors>
+{
+	block_op_sg(dev, &[Segment { addr: buffer, len: size }], offset, write, watcher)
+}
+
 pub fn read(dev: usize,
             buffer: *mut u8,
             size: u32,
@@ -404,7 +563,9 @@ pub fn write(dev: usize,
 /// This is how the device tells us that it's finished a request.
 pub fn pending(bd: &mut BlockDevice) {
 	// Here we need to check the used ring and then free the resources
-	// given by the descriptor id.
+	// given by the descriptor id. We take everything the device has
+	// finished in one go, then refill the ring from the staged requests
+	// with a single notify.
 	unsafe {
 		let ref queue = *bd.queue;
 		while bd.ack_used_idx != queue.used.idx {
@@ -413,21 +574,37 @@ pub fn pending(bd: &mut BlockDevice) {
 			bd.ack_used_idx = bd.ack_used_idx.wrapping_add(1);
 			// Requests stay resident on the heap until this
 			// function, so we can recapture the address here
-			let rq = queue.desc[elem.id as usize].addr
-			         as *const Request;
+			let rq = Box::from_raw(queue.desc[elem.id as usize].addr
+			                       as *mut Request);
+			for &d in rq.descs.iter() {
+				bd.free_descs.push_back(d);
+			}
+			trace::record(trace::EV_BLOCK_DONE,
+			              rq.watchers.first().copied().unwrap_or(0),
+			              rq.status.status as u32);
 
-			// A process might be waiting for this interrupt. Awaken
-			// the process attached here.
-			let pid_of_watcher = (*rq).watcher;
-			// A PID of 0 means that we don't have a watcher.
-			if pid_of_watcher > 0 {
-				set_running(pid_of_watcher);
-				let proc = get_by_pid(pid_of_watcher);
-				(*(*proc).frame).regs[10] = (*rq).status.status as usize;
-				// TODO: Set GpA0 to the value of the return
-				// status.
+			// Processes might be waiting for this interrupt. Awaken
+			// the processes attached here and give them the status in A0.
+			for &pid in rq.watchers.iter() {
+				set_running(pid);
+				let proc = get_by_pid(pid);
+				if !proc.is_null() {
+					(*(*proc).frame).regs[10] = rq.status.status as usize;
+				}
 			}
-			kfree(rq as *mut u8);
+			for c in rq.completions.iter() {
+				let res = if rq.status.status == 0 {
+					c.bytes as i64
+				}
+				else {
+					-ioring::EIO
+				};
+				ioring::complete(c.pid, c.tag, c.user_data, res);
+			}
+			// rq drops here, which frees the request.
+		}
+		if submit_staged(bd) {
+			notify(bd);
 		}
 	}
 }
@@ -474,6 +651,18 @@ fn read_proc(args_addr: usize) {
 	// syscall_exit();
 }
 
+/// We couldn't start a kernel process for pid's request, which it's
+/// waiting on, so wake it with a status that isn't OK in A0.
+fn fail_waiting(pid: u16) {
+	set_running(pid);
+	let proc = get_by_pid(pid);
+	if !proc.is_null() {
+		unsafe {
+			(*(*proc).frame).regs[10] = -1isize as usize;
+		}
+	}
+}
+
 pub fn process_read(pid: u16,
                     dev: usize,
                     buffer: *mut u8,
@@ -489,12 +678,14 @@ pub fn process_read(pid: u16,
 		size,
 		offset,
 	};
-	let boxed_args = Box::new(args);
+	let boxed_args = Box::into_raw(Box::new(args));
 	set_waiting(pid);
-	let _ = add_kernel_process_args(
-	                                read_proc,
-	                                Box::into_raw(boxed_args) as usize,
-	);
+	if add_kernel_process_args(read_proc, boxed_args as usize) == 0 {
+		unsafe {
+			drop(Box::from_raw(boxed_args));
+		}
+		fail_waiting(pid);
+	}
 }
 
 fn write_proc(args_addr: usize) {
@@ -524,10 +715,12 @@ pub fn process_write(pid: u16,
 		size,
 		offset,
 	};
-	let boxed_args = Box::new(args);
+	let boxed_args = Box::into_raw(Box::new(args));
 	set_waiting(pid);
-	let _ = add_kernel_process_args(
-	                                write_proc,
-	                                Box::into_raw(boxed_args) as usize,
-	);
+	if add_kernel_process_args(write_proc, boxed_args as usize) == 0 {
+		unsafe {
+			drop(Box::from_raw(boxed_args));
+		}
+		fail_waiting(pid);
+	}
 }
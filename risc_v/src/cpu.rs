@@ -4,6 +4,9 @@
 // Stephen Marz
 // 14 October 2019
 
+use crate::{lock::KERNEL_LOCK,
+            page::{map, EntryBits, Table}};
+
 // The frequency of QEMU is 10 MHz
 pub const FREQ: u64 = 10_000_000;
 // Let's do this 250 times per second for switching
@@ -188,6 +191,37 @@ pub fn mstatus_read() -> usize {
 	}
 }
 
+/// Run f with machine interrupts off and the kernel lock held. Block
+/// completions and the like come in through interrupts, and system calls
+/// can be running on the other harts, so a kernel process that shares
+/// something with them has to do both while it touches it. In the trap
+/// handler, both are already the case and this costs next to nothing.
+/// f must not block.
+pub fn without_interrupts<R, F: FnOnce() -> R>(f: F) -> R {
+	let mstatus = mstatus_read();
+	mstatus_write(mstatus & !(1 << 3));
+	unsafe {
+		KERNEL_LOCK.lock();
+	}
+	let ret = f();
+	unsafe {
+		KERNEL_LOCK.unlock();
+	}
+	mstatus_write(mstatus);
+	ret
+}
+
+/// Run f with machine interrupts off on this hart only. This is for state
+/// that belongs to a hart, which no other hart touches, so it doesn't need
+/// the kernel lock. f must not block.
+pub fn without_local_interrupts<R, F: FnOnce() -> R>(f: F) -> R {
+	let mstatus = mstatus_read();
+	mstatus_write(mstatus & !(1 << 3));
+	let ret = f();
+	mstatus_write(mstatus);
+	ret
+}
+
 pub fn stvec_write(val: usize) {
 	unsafe {
 		llvm_asm!("csrw	stvec, $0" ::"r"(val));
@@ -310,12 +344,44 @@ pub fn satp_fence_asid(asid: usize) {
 	}
 }
 
+// The most harts we'll run on. Each one gets 64 KiB of the kernel stack
+// for its trap handler (see boot.S and trap.S), and this many of those fit.
+pub const MAX_HARTS: usize = 8;
+
+// Writing 1 to a hart's MSIP register in the CLINT gives it a software
+// interrupt. That's how one hart tells another one to look at its run
+// queue. The hart clears it once it has.
+const MMIO_MSIP: *mut u32 = 0x0200_0000 as *mut u32;
+
+pub fn send_ipi(hart: usize) {
+	unsafe {
+		MMIO_MSIP.add(hart).write_volatile(1);
+	}
+}
+
+pub fn clear_ipi(hart: usize) {
+	unsafe {
+		MMIO_MSIP.add(hart).write_volatile(0);
+	}
+}
+
 const MMIO_MTIME: *const u64 = 0x0200_BFF8 as *const u64;
+// mtime is the only register in its page of the CLINT, so we can hand that
+// page to user processes, read-only, at TIME_PAGE_VADDR. Reading the clock
+// is then a load instead of a trip through syscall 1062.
+const MMIO_MTIME_PAGE: usize = 0x0200_B000;
+pub const TIME_PAGE_VADDR: usize = 0x3200_0000;
 
 pub fn get_mtime() -> usize {
 	unsafe { (*MMIO_MTIME) as usize }
 }
 
+/// Map the page holding mtime into a user process' table. mtime shows up
+/// at TIME_PAGE_VADDR + 0xff8.
+pub fn map_time_page(table: &mut Table) {
+	map(table, TIME_PAGE_VADDR, MMIO_MTIME_PAGE, EntryBits::UserRead.val(), 0);
+}
+
 /// Copy one data from one memory location to another.
 pub unsafe fn memcpy(dest: *mut u8, src: *const u8, bytes: usize) {
 	let bytes_as_8 = bytes / 8;
@@ -326,8 +392,7 @@ pub unsafe fn memcpy(dest: *mut u8, src: *const u8, bytes: usize) {
 		*(dest_as_8.add(i)) = *(src_as_8.add(i));
 	}
 	let bytes_completed = bytes_as_8 * 8;
-	let bytes_remaining = bytes - bytes_completed;
-	for i in bytes_completed..bytes_remaining {
+	for i in bytes_completed..bytes {
 		*(dest.add(i)) = *(src.add(i));
 	}
 }
@@ -0,0 +1,118 @@
+// dcache.rs
+// Directory entry cache
+// A path is looked up one name at a time: (device, directory inode, name)
+// gives an inode number. We remember each answer, including "there's
+// nothing by that name", in a hash table, so opening a path we've seen
+// before doesn't go to the disk or even the block cache. Entries only come
+// in as lookups find them, so there's nothing to walk at boot, and whoever
+// changes a directory throws its entries out.
+
+use crate::cpu::without_interrupts;
+use alloc::{string::String, vec::Vec};
+
+// This must be a power of two.
+pub const DCACHE_BUCKETS: usize = 256;
+// How many entries a bucket holds before it drops its least recently
+// used one. This bounds the cache at DCACHE_BUCKETS * BUCKET_DEPTH entries.
+pub const BUCKET_DEPTH: usize = 4;
+
+struct Dentry {
+	dev:    usize,
+	parent: u32,
+	hash:   u32,
+	name:   String,
+	// 0 if the directory doesn't have this name
+	inode:  u32,
+}
+
+impl Dentry {
+	fn is(&self, dev: usize, parent: u32, hash: u32, name: &str) -> bool {
+		// Compare the hash first so that we only compare names that are
+		// very likely to match.
+		self.hash == hash && self.parent == parent && self.dev == dev && self.name == name
+	}
+}
+
+struct DentryCache {
+	// Each bucket is kept most recently used first.
+	buckets: Vec<Vec<Dentry>>,
+}
+
+// open() looks in here from the trap handler, and the file system fills it
+// from kernel processes, which do it with interrupts off so that the two
+// never overlap.
+static mut DCACHE: Option<DentryCache> = None;
+
+/// FNV-1a over the name, seeded with where it lives.
+fn hash(dev: usize, parent: u32, name: &str) -> u32 {
+	let mut h = 0x811c_9dc5u32 ^ (dev as u32) ^ parent.wrapping_mul(0x9e37_79b9);
+	for b in name.bytes() {
+		h ^= b as u32;
+		h = h.wrapping_mul(0x0100_0193);
+	}
+	h
+}
+
+pub fn init() {
+	unsafe {
+		if DCACHE.is_none() {
+			let mut buckets = Vec::with_capacity(DCACHE_BUCKETS);
+			for _ in 0..DCACHE_BUCKETS {
+				buckets.push(Vec::with_capacity(BUCKET_DEPTH));
+			}
+			DCACHE = Some(DentryCache { buckets });
+		}
+	}
+}
+
+/// Look up name in directory parent. None means we don't know. Some(0)
+/// means we know it isn't there.
+pub fn get(dev: usize, parent: u32, name: &str) -> Option<u32> {
+	let h = hash(dev, parent, name);
+	without_interrupts(|| unsafe {
+		let cache = DCACHE.as_mut()?;
+		let bucket = &mut cache.buckets[h as usize & (DCACHE_BUCKETS - 1)];
+		let i = bucket.iter().position(|d| d.is(dev, parent, h, name))?;
+		// Move it to the front. A bucket is only a few entries long.
+		bucket[..=i].rotate_right(1);
+		Some(bucket[0].inode)
+	})
+}
+
+/// Remember what name in directory parent is. Use 0 for not there.
+pub fn insert(dev: usize, parent: u32, name: &str, inode: u32) {
+	let h = hash(dev, parent, name);
+	// Do the allocation before we turn interrupts off.
+	let mut entry = Some(Dentry { dev,
+	                              parent,
+	                              hash: h,
+	                              name: String::from(name),
+	                              inode });
+	without_interrupts(|| unsafe {
+		if let Some(cache) = DCACHE.as_mut() {
+			let bucket = &mut cache.buckets[h as usize & (DCACHE_BUCKETS - 1)];
+			if let Some(i) = bucket.iter().position(|d| d.is(dev, parent, h, name)) {
+				bucket[i].inode = inode;
+				bucket[..=i].rotate_right(1);
+			}
+			else {
+				if bucket.len() >= BUCKET_DEPTH {
+					bucket.pop();
+				}
+				bucket.insert(0, entry.take().unwrap());
+			}
+		}
+	});
+}
+
+/// Forget everything we know about the names in directory parent. This is
+/// for when the directory itself changes.
+pub fn invalidate_dir(dev: usize, parent: u32) {
+	without_interrupts(|| unsafe {
+		if let Some(cache) = DCACHE.as_mut() {
+			for bucket in cache.buckets.iter_mut() {
+				bucket.retain(|d| d.dev != dev || d.parent != parent);
+			}
+		}
+	});
+}
@@ -5,10 +5,25 @@
 // Stephen Marz
 
 use crate::{buffer::Buffer,
-            cpu::{build_satp, memcpy, satp_fence_asid, CpuMode, Registers, SatpMode, TrapFrame},
-            page::{map, zalloc, EntryBits, Table, PAGE_SIZE},
-            process::{Process, ProcessData, ProcessState, NEXT_PID, STACK_ADDR, STACK_PAGES}};
-use alloc::collections::VecDeque;
+            cpu::{build_satp, map_time_page, memcpy, satp_fence_asid, CpuMode, Registers, SatpMode, TrapFrame},
+            fs::{Inode, MinixFileSystem},
+            lock::Mutex,
+            page::{align_val, dealloc, leaf_bits, map, zalloc, EntryBits, Table, PAGE_SIZE},
+            process::{add_kernel_process_args,
+                      delete_process,
+                      next_pid,
+                      set_running,
+                      set_waiting,
+                      Fault,
+                      Process,
+                      ProcessData,
+                      ProcessState,
+                      STACK_ADDR,
+                      STACK_PAGES}};
+use alloc::{boxed::Box, collections::{BTreeMap, VecDeque}, string::String, vec::Vec};
+use core::{mem::size_of,
+           ptr::null_mut,
+           sync::atomic::{AtomicUsize, Ordering}};
 // Every ELF file starts with ELF "magic", which is a sequence of four bytes 0x7f followed by capital ELF, which is 0x45, 0x4c, and 0x46 respectively.
 pub const MAGIC: u32 = 0x464c_457f;
 
@@ -64,11 +79,6 @@ pub const PH_SEG_TYPE_DYNAMIC: u32 = 2;
 pub const PH_SEG_TYPE_INTERP: u32 = 3;
 pub const PH_SEG_TYPE_NOTE: u32 = 4;
 
-pub struct Program {
-	pub header: ProgramHeader,
-	pub data:   Buffer
-}
-
 pub enum LoadErrors {
 	Magic,
 	Machine,
@@ -76,175 +86,475 @@ pub enum LoadErrors {
 	FileRead
 }
 
-pub struct File {
-	pub header:   Header,
-	pub programs: VecDeque<Program>
+// We used to read the whole executable into memory and copy every
+// segment into the process before it could run. Now, exec only reads the
+// headers. The rest of the file is read a page at a time when the process
+// first touches it, and the pages of the file stay with the Image, so
+// every process running the same program shares them. Read-only pages
+// (.text, .rodata) are mapped straight to the Image's copy. Writable
+// pages (.data, .bss) are private, so they're copied out of the Image.
+
+/// A program that one or more processes are running.
+pub struct Image {
+	dev:      usize,
+	inode:    Inode,
+	header:   Header,
+	// Only the PT_LOAD segments with something in them.
+	segments: Vec<ProgramHeader>,
+	// One physical page per page of the file, or 0 if we haven't read
+	// that page yet. The trap handler reads these while a kernel process
+	// might be filling one in, so they're atomic.
+	pages:    Vec<AtomicUsize>,
+	// Processes using this image, plus any page_in() that isn't done.
+	users:    AtomicUsize,
 }
 
-impl File {
-	pub fn load(buffer: &Buffer) -> Result<Self, LoadErrors> {
-		let elf_hdr;
-		unsafe {
-			// Load the ELF
-			elf_hdr = (buffer.get() as *const Header).as_ref().unwrap();
+// Images by (block device, path). Only exec, which runs in a kernel
+// process, looks in here. Everybody else gets to an Image through a
+// process that's already using it.
+static mut IMAGES: Option<BTreeMap<(usize, String), Box<Image>>> = None;
+// Images that were replaced because the file changed underneath them, but
+// that something is still running.
+static mut RETIRED: Option<Vec<Box<Image>>> = None;
+static mut IMAGES_MUTEX: Mutex = Mutex::new();
+
+/// The page table bits for a segment's flags.
+fn segment_bits(ph: &ProgramHeader) -> usize {
+	// We start off with the user bit set.
+	let mut bits = EntryBits::User.val();
+	// This sucks, but we check each bit in the flags to see
+	// if we need to add it to the PH permissions.
+	if ph.flags & PROG_EXECUTE != 0 {
+		bits |= EntryBits::Execute.val();
+	}
+	if ph.flags & PROG_READ != 0 {
+		bits |= EntryBits::Read.val();
+	}
+	if ph.flags & PROG_WRITE != 0 {
+		bits |= EntryBits::Write.val();
+	}
+	bits
+}
+
+/// Does segment ph have anything in the page starting at page_va?
+fn overlaps(ph: &ProgramHeader, page_va: usize) -> bool {
+	ph.vaddr < page_va + PAGE_SIZE && ph.vaddr + ph.memsz > page_va
+}
+
+/// The part of the page at page_va that comes out of the file for segment
+/// ph, as (file offset, length, offset into the page). Anything past filesz
+/// is .bss, which is zero.
+fn file_part(ph: &ProgramHeader, page_va: usize) -> Option<(usize, usize, usize)> {
+	let start = if page_va > ph.vaddr { page_va } else { ph.vaddr };
+	let file_end = ph.vaddr + ph.filesz;
+	let end = if page_va + PAGE_SIZE < file_end { page_va + PAGE_SIZE } else { file_end };
+	if start >= end {
+		None
+	}
+	else {
+		Some((ph.off + start - ph.vaddr, end - start, start - page_va))
+	}
+}
+
+impl Image {
+	/// Read and check the ELF header and the program headers. Nothing
+	/// else in the file is read. This may block.
+	fn new(dev: usize, inode: Inode) -> Result<Self, LoadErrors> {
+		let header_size = size_of::<Header>();
+		let mut buffer = Buffer::new(header_size);
+		if (MinixFileSystem::read(dev, &inode, buffer.get_mut(), header_size as u32, 0) as usize) < header_size {
+			return Err(LoadErrors::FileRead);
 		}
+		let header = unsafe { *(buffer.get() as *const Header) };
 		// The ELF magic is 0x75, followed by ELF
-		if elf_hdr.magic != MAGIC {
+		if header.magic != MAGIC {
 			return Err(LoadErrors::Magic);
 		}
 		// We need to make sure we're built for RISC-V
-		if elf_hdr.machine != MACHINE_RISCV {
+		if header.machine != MACHINE_RISCV {
 			return Err(LoadErrors::Machine);
 		}
 		// ELF has several types. However, we can only load
 		// executables.
-		if elf_hdr.obj_type != TYPE_EXEC {
+		if header.obj_type != TYPE_EXEC || header.phnum == 0 {
 			return Err(LoadErrors::TypeExec);
 		}
-		let ph_tab = unsafe { buffer.get().add(elf_hdr.phoff) } as *const ProgramHeader;
-		// There are phnum number of program headers. We need to go through
-		// each one and load it into memory, if necessary.
-		let mut ret = Self { header:   *elf_hdr,
-		                     programs: VecDeque::new() };
-		for i in 0..elf_hdr.phnum as usize {
-			unsafe {
-				let ph = ph_tab.add(i).as_ref().unwrap();
-				// If the segment isn't marked as LOAD (loaded into memory),
-				// then there is no point to this. Most executables use a LOAD
-				// type for their program headers.
-				if ph.seg_type != PH_SEG_TYPE_LOAD {
-					continue;
-				}
-				// If there's nothing in this section, don't load it.
-				if ph.memsz == 0 {
-					continue;
-				}
-				let mut ph_buffer = Buffer::new(ph.memsz);
-
-				memcpy(ph_buffer.get_mut(), buffer.get().add(ph.off), ph.memsz);
-				ret.programs.push_back(Program { header: *ph,
-				                                 data:   ph_buffer });
+		// There are phnum number of program headers. These are usually in
+		// the same block as the header, so this comes out of the block
+		// cache.
+		let ph_size = header.phnum as usize * size_of::<ProgramHeader>();
+		let mut ph_buffer = Buffer::new(ph_size);
+		if (MinixFileSystem::read(dev, &inode, ph_buffer.get_mut(), ph_size as u32, header.phoff as u32) as usize) < ph_size {
+			return Err(LoadErrors::FileRead);
+		}
+		let ph_tab = ph_buffer.get() as *const ProgramHeader;
+		let mut segments = Vec::new();
+		for i in 0..header.phnum as usize {
+			let ph = unsafe { *ph_tab.add(i) };
+			// If the segment isn't marked as LOAD (loaded into memory),
+			// or there's nothing in it, then there is no point to this.
+			// Most executables use a LOAD type for their program headers.
+			if ph.seg_type != PH_SEG_TYPE_LOAD || ph.memsz == 0 {
+				continue;
 			}
+			// The part that comes from the file has to be in the file.
+			if ph.filesz > ph.memsz || ph.off + ph.filesz > inode.size as usize {
+				return Err(LoadErrors::FileRead);
+			}
+			segments.push(ph);
 		}
-		Ok(ret)
-	}
-
-	// load
-	pub fn load_proc(buffer: &Buffer) -> Result<Process, LoadErrors> {
-		let elf_fl = Self::load(&buffer);
-		if elf_fl.is_err() {
-			return Err(elf_fl.err().unwrap());
-		}
-		let elf_fl = elf_fl.ok().unwrap();
-		let mut sz = 0usize;
-		// Get the size, in memory, that we're going to need for the program storage.
-		for p in elf_fl.programs.iter() {
-			sz += p.header.memsz;
-		}
-		// We add two pages since we could possibly split the front and back pages, hence
-		// necessitating the need for two extra pages. This can get wasteful, but for now
-		// if we don't do this, we could end up mapping into the MMU table!
-		let program_pages = (sz + PAGE_SIZE * 2) / PAGE_SIZE;
-		// I did this to demonstrate the expressive nature of Rust. Kinda cool, no?
-		let my_pid = unsafe {
-			let p = NEXT_PID + 1;
-			NEXT_PID += 1;
-			p
-		};
-		let mut my_proc = Process { frame:       zalloc(1) as *mut TrapFrame,
-		                            stack:       zalloc(STACK_PAGES),
-		                            pid:         my_pid,
-		                            mmu_table:        zalloc(1) as *mut Table,
-		                            state:       ProcessState::Running,
-		                            data:        ProcessData::new(),
-		                            sleep_until: 0,
-									program:     zalloc(program_pages),
-									brk:         0,
-								 };
-
-		let program_mem = my_proc.program;
-		let table = unsafe { my_proc.mmu_table.as_mut().unwrap() };
-		// The ELF has several "program headers". This usually mimics the .text,
-		// .rodata, .data, and .bss sections, but not necessarily.
-		// What we do here is map the program headers into the process' page
-		// table.
-		for p in elf_fl.programs.iter() {
-			// The program header table starts where the ELF header says it is
-			// given by the field phoff (program header offset).
-			// Copy the buffer we got from the filesystem into the program
-			// memory we're going to map to the user. The memsz field in the
-			// program header tells us how many bytes will need to be loaded.
-			// The ph.off is the offset to load this into.
-			unsafe {
-				memcpy(program_mem.add(p.header.off), p.data.get(), p.header.memsz);
+		let file_pages = (inode.size as usize + PAGE_SIZE - 1) / PAGE_SIZE;
+		let mut pages = Vec::with_capacity(file_pages);
+		for _ in 0..file_pages {
+			pages.push(AtomicUsize::new(0));
+		}
+		Ok(Self { dev,
+		          inode,
+		          header,
+		          segments,
+		          pages,
+		          users: AtomicUsize::new(0) })
+	}
+
+	/// Is this image still the file that inode describes?
+	fn matches(&self, inode: &Inode) -> bool {
+		self.inode.size == inode.size && self.inode.mtime == inode.mtime && self.inode.zones == inode.zones
+	}
+
+	/// The physical address of a page of the file, or 0 if it isn't in
+	/// memory.
+	fn resident(&self, page: usize) -> usize {
+		if page < self.pages.len() {
+			self.pages[page].load(Ordering::Acquire)
+		}
+		else {
+			0
+		}
+	}
+
+	/// The first page of the file in [off, off + len) that isn't in memory.
+	fn missing(&self, off: usize, len: usize) -> Option<usize> {
+		let mut page = off / PAGE_SIZE;
+		while page * PAGE_SIZE < off + len {
+			if self.resident(page) == 0 {
+				return Some(page);
 			}
-			// We start off with the user bit set.
-			let mut bits = EntryBits::User.val();
-			// This sucks, but we check each bit in the flags to see
-			// if we need to add it to the PH permissions.
-			if p.header.flags & PROG_EXECUTE != 0 {
-				bits |= EntryBits::Execute.val();
+			page += 1;
+		}
+		None
+	}
+
+	/// Copy len bytes of the file at off into dst. All of those pages have
+	/// to be in memory already (see missing()).
+	unsafe fn copy_out(&self, dst: *mut u8, off: usize, len: usize) {
+		let mut done = 0;
+		while done < len {
+			let o = off + done;
+			let in_page = PAGE_SIZE - o % PAGE_SIZE;
+			let n = if in_page < len - done { in_page } else { len - done };
+			let src = self.resident(o / PAGE_SIZE) + o % PAGE_SIZE;
+			memcpy(dst.add(done), src as *const u8, n);
+			done += n;
+		}
+	}
+
+	/// Bring one page of the file into memory. This has to be called from a
+	/// process since it might block. This returns false if we couldn't
+	/// read the page, in which case nothing is cached.
+	fn read_page(&self, page: usize) -> bool {
+		if page >= self.pages.len() || self.resident(page) != 0 {
+			return true;
+		}
+		// zalloc means whatever is past the end of the file is zero.
+		let new_page = zalloc(1);
+		if new_page.is_null() {
+			return false;
+		}
+		// Everyone who shares this image would get the page as it is, so a
+		// short read has to fail rather than leave zeros in the program.
+		let left = self.inode.size as usize - page * PAGE_SIZE;
+		let want = if left < PAGE_SIZE { left } else { PAGE_SIZE };
+		let got = MinixFileSystem::read(self.dev, &self.inode, new_page, want as u32, (page * PAGE_SIZE) as u32);
+		if got as usize != want {
+			dealloc(new_page);
+			return false;
+		}
+		// Somebody else may have read the same page while we were waiting on
+		// the block device. If so, theirs might be mapped already, so we
+		// keep it and throw ours away.
+		if self.pages[page].compare_exchange(0, new_page as usize, Ordering::AcqRel, Ordering::Acquire).is_err() {
+			dealloc(new_page);
+		}
+		true
+	}
+
+	/// Find the image for the program at path, reading its headers if we
+	/// don't already have it. This has to be called from a process since
+	/// it might block. The caller is counted as a user of the image, so
+	/// give it to load_proc() or release() it.
+	pub fn open(dev: usize, path: &str, inode: &Inode) -> Result<*mut Image, LoadErrors> {
+		unsafe {
+			IMAGES_MUTEX.sleep_lock();
+			if IMAGES.is_none() {
+				IMAGES = Some(BTreeMap::new());
+				RETIRED = Some(Vec::new());
 			}
-			if p.header.flags & PROG_READ != 0 {
-				bits |= EntryBits::Read.val();
+			let images = IMAGES.as_mut().unwrap();
+			let retired = RETIRED.as_mut().unwrap();
+			let key = (dev, String::from(path));
+			let stale = match images.get(&key) {
+				Some(image) => !image.matches(inode),
+				None => false,
+			};
+			if stale {
+				retired.push(images.remove(&key).unwrap());
 			}
-			if p.header.flags & PROG_WRITE != 0 {
-				bits |= EntryBits::Write.val();
+			let ret = if let Some(image) = images.get_mut(&key) {
+				Ok(&mut **image as *mut Image)
 			}
-			// Now we map the program counter. The virtual address
-			// is provided in the ELF program header.
-			let pages = (p.header.memsz + PAGE_SIZE) / PAGE_SIZE;
-			for i in 0..pages {
-				let vaddr = p.header.vaddr + i * PAGE_SIZE;
-				// The ELF specifies a paddr, but not when we
-				// use the vaddr!
-				let paddr = program_mem as usize + p.header.off + i * PAGE_SIZE;
-				// There is no checking here! This is very dangerous, and I have already
-				// been bitten by it. I mapped too far and mapped userspace into the MMU
-				// table, which is AWFUL!
-				map(table, vaddr, paddr, bits, 0);
-				if vaddr > my_proc.brk {
-					my_proc.brk = vaddr;
+			else {
+				match Image::new(dev, *inode) {
+					Ok(image) => {
+						let mut image = Box::new(image);
+						let ptr = &mut *image as *mut Image;
+						images.insert(key, image);
+						Ok(ptr)
+					},
+					Err(e) => Err(e),
 				}
-				// println!("DEBUG: Map 0x{:08x} to 0x{:08x} {:02x}", vaddr, paddr, bits);
+			};
+			if let Ok(image) = ret {
+				(*image).users.fetch_add(1, Ordering::AcqRel);
 			}
-			my_proc.brk += 0x1000;
-		}
-		// This will map all of the program pages. Notice that in linker.lds in
-		// userspace we set the entry point address to 0x2000_0000. This is the
-		// same address as PROCESS_STARTING_ADDR, and they must match.
-		// Map the stack
-		let ptr = my_proc.stack as *mut u8;
-		for i in 0..STACK_PAGES {
-			let vaddr = STACK_ADDR + i * PAGE_SIZE;
-			let paddr = ptr as usize + i * PAGE_SIZE;
-			// We create the stack. We don't load a stack from the disk.
-			// This is why I don't need to make the stack executable.
-			map(table, vaddr, paddr, EntryBits::UserReadWrite.val(), 0);
-		}
-		// Set everything up in the trap frame
-		unsafe {
-			// The program counter is a virtual memory address and is loaded
-			// into mepc when we execute mret.
-			(*my_proc.frame).pc = elf_fl.header.entry_addr;
-			// Stack pointer. The stack starts at the bottom and works its
-			// way up, so we have to set the stack pointer to the bottom.
-			(*my_proc.frame).regs[Registers::Sp as usize] = STACK_ADDR as usize + STACK_PAGES * PAGE_SIZE - 0x1000;
-			// USER MODE! This is how we set what'll go into mstatus when we
-			// run the process.
-			(*my_proc.frame).mode = CpuMode::User as usize;
-			(*my_proc.frame).pid = my_proc.pid as usize;
-			// The SATP register is used for the MMU, so we need to
-			// map our table into that register. The switch_to_user
-			// function will load .satp into the actual register
-			// when the time comes.
-			(*my_proc.frame).satp = build_satp(SatpMode::Sv39, my_proc.pid as usize, my_proc.mmu_table as usize);
-		}
-		// The ASID field of the SATP register is only 16-bits, and we reserved
-		// 0 for the kernel, even though we run the kernel in machine mode for
-		// now. Since we don't reuse PIDs, this means that we can only spawn
-		// 65534 processes.
-		satp_fence_asid(my_pid as usize);
-		Ok(my_proc)
+			// Now that we hold the image we want, get rid of the ones nobody
+			// is running anymore. We wait until now so that running the same
+			// program again right after it exits doesn't read it all again.
+			let unused: Vec<(usize, String)> = images.iter()
+			                                         .filter(|(_, image)| image.users.load(Ordering::Acquire) == 0)
+			                                         .map(|(k, _)| k.clone())
+			                                         .collect();
+			for k in unused.iter() {
+				images.remove(k);
+			}
+			retired.retain(|image| image.users.load(Ordering::Acquire) != 0);
+			IMAGES_MUTEX.unlock();
+			ret
+		}
+	}
+}
+
+impl Drop for Image {
+	fn drop(&mut self) {
+		for page in self.pages.iter() {
+			let paddr = page.load(Ordering::Acquire);
+			if paddr != 0 {
+				dealloc(paddr as *mut u8);
+			}
+		}
+	}
+}
+
+/// Another process is using an image, such as the child of a fork().
+pub fn acquire(image: *mut Image) {
+	unsafe {
+		(*image).users.fetch_add(1, Ordering::AcqRel);
+	}
+}
+
+/// A process stopped using an image. The image is freed by the next
+/// exec after nobody is using it.
+pub fn release(image: *mut Image) {
+	unsafe {
+		(*image).users.fetch_sub(1, Ordering::AcqRel);
+	}
+}
+
+/// Map the program page holding vaddr. This is called from the trap
+/// handler, so it never goes to the block device. If a page of the file
+/// that we need isn't in memory, this returns Fault::Load and the caller
+/// uses page_in() to get it.
+pub fn fault_in(image: &Image, table: &mut Table, pages: &mut VecDeque<usize>, vaddr: usize) -> Fault {
+	let page_va = vaddr & !(PAGE_SIZE - 1);
+	let mut bits = 0;
+	let mut count = 0;
+	let mut first = None;
+	for ph in image.segments.iter() {
+		if overlaps(ph, page_va) {
+			bits |= segment_bits(ph);
+			count += 1;
+			if first.is_none() {
+				first = Some(ph);
+			}
+		}
+	}
+	let ph = match first {
+		Some(ph) => ph,
+		None => return Fault::Bad,
+	};
+	// With only the user bit, map() would make this a branch.
+	if bits & EntryBits::ReadWriteExecute.val() == 0 {
+		return Fault::Bad;
+	}
+	// A read-only page that's all file (no .bss) can be the image's own
+	// copy. The linker lines up vaddr and off within a page for us, so the
+	// page of the file is the page of memory.
+	if count == 1
+	   && ph.flags & PROG_WRITE == 0
+	   && ph.vaddr % PAGE_SIZE == ph.off % PAGE_SIZE
+	   && (ph.filesz == ph.memsz || page_va + PAGE_SIZE <= ph.vaddr + ph.filesz)
+	{
+		let file_page = (ph.off + page_va - ph.vaddr) / PAGE_SIZE;
+		let paddr = image.resident(file_page);
+		if paddr == 0 {
+			return Fault::Load(file_page);
+		}
+		map(table, page_va, paddr, bits, 0);
+		return Fault::Mapped;
+	}
+	// Everything else gets a private page, so we need every part of the
+	// file that goes in it.
+	for ph in image.segments.iter().filter(|ph| overlaps(ph, page_va)) {
+		if let Some((off, len, _)) = file_part(ph, page_va) {
+			if let Some(page) = image.missing(off, len) {
+				return Fault::Load(page);
+			}
+		}
+	}
+	let new_page = zalloc(1);
+	if new_page.is_null() {
+		return Fault::Bad;
+	}
+	for ph in image.segments.iter().filter(|ph| overlaps(ph, page_va)) {
+		if let Some((off, len, dst)) = file_part(ph, page_va) {
+			unsafe {
+				image.copy_out(new_page.add(dst), off, len);
+			}
+		}
+	}
+	pages.push_back(new_page as usize);
+	map(table, page_va, new_page as usize, bits, 0);
+	Fault::Mapped
+}
+
+struct PageInArgs {
+	pid:   u16,
+	image: *mut Image,
+	page:  usize,
+}
+
+// This is the kernel process that reads in a page for a process waiting
+// on it.
+fn page_in_proc(args_addr: usize) {
+	let args = unsafe { Box::from_raw(args_addr as *mut PageInArgs) };
+	let ok = unsafe { (*args.image).read_page(args.page) };
+	release(args.image);
+	if ok {
+		// The process backed up to the instruction (or system call) that
+		// faulted, so it'll find the page this time.
+		set_running(args.pid);
+	}
+	else {
+		// Trying again would just fault again, so this is a real fault.
+		println!("Couldn't read page {} of the program for PID {}", args.page, args.pid);
+		delete_process(args.pid);
+	}
+}
+
+/// Read a page of the file for pid, which waits until it's in. The caller
+/// has to set the process up to try again. This returns false if we
+/// couldn't start the read right now, in which case the process should just
+/// try again later without waiting.
+pub fn page_in(pid: u16, image: *mut Image, page: usize) -> bool {
+	unsafe {
+		(*image).users.fetch_add(1, Ordering::AcqRel);
+		let args = Box::into_raw(Box::new(PageInArgs { pid, image, page }));
+		if add_kernel_process_args(page_in_proc, args as usize) == 0 {
+			drop(Box::from_raw(args));
+			release(image);
+			return false;
+		}
+	}
+	set_waiting(pid);
+	true
+}
+
+/// Make a process to run image. Nothing in the program is mapped yet; it
+/// faults in as the process runs. The process takes over the caller's
+/// reference to image. This returns None, and leaves the reference with
+/// the caller, if there's no PID left.
+pub fn load_proc(image: *mut Image) -> Option<Process> {
+	let image_ref = unsafe { &*image };
+	let my_pid = next_pid()?;
+	let mut my_proc = Process { frame:       zalloc(1) as *mut TrapFrame,
+	                            stack:       zalloc(STACK_PAGES),
+	                            pid:         my_pid,
+	                            mmu_table:   zalloc(1) as *mut Table,
+	                            state:       ProcessState::Running,
+	                            data:        ProcessData::new(),
+	                            sleep_until: 0,
+	                            program:     null_mut(),
+	                            brk:         0,
+	                            heap_start:  0,
+	                            image,
+	                            leader:      null_mut(),
+	                            clear_tid:   0,
+	};
+	let table = unsafe { my_proc.mmu_table.as_mut().unwrap() };
+	// The heap starts on the page after the highest segment and is empty
+	// until brk() moves the break.
+	for ph in image_ref.segments.iter() {
+		if ph.vaddr + ph.memsz > my_proc.brk {
+			my_proc.brk = ph.vaddr + ph.memsz;
+		}
+	}
+	my_proc.brk = align_val(my_proc.brk, 12);
+	my_proc.heap_start = my_proc.brk;
+	// If somebody else is running this program, a lot of its read-only
+	// pages are already in memory. Mapping those now costs nothing and
+	// saves us a page fault each. Anything that isn't in memory, or is
+	// writable, waits for a fault.
+	for ph in image_ref.segments.iter().filter(|ph| ph.flags & PROG_WRITE == 0) {
+		let mut page_va = ph.vaddr & !(PAGE_SIZE - 1);
+		while page_va < ph.vaddr + ph.memsz {
+			if leaf_bits(table, page_va).is_none() {
+				let _ = fault_in(image_ref, table, &mut my_proc.data.pages, page_va);
+			}
+			page_va += PAGE_SIZE;
+		}
+	}
+	// The clock, so that reading the time doesn't need a system call.
+	map_time_page(table);
+	// Map the stack
+	let ptr = my_proc.stack as *mut u8;
+	for i in 0..STACK_PAGES {
+		let vaddr = STACK_ADDR + i * PAGE_SIZE;
+		let paddr = ptr as usize + i * PAGE_SIZE;
+		// We create the stack. We don't load a stack from the disk.
+		// This is why I don't need to make the stack executable.
+		map(table, vaddr, paddr, EntryBits::UserReadWrite.val(), 0);
+	}
+	// Set everything up in the trap frame
+	unsafe {
+		// The program counter is a virtual memory address and is loaded
+		// into mepc when we execute mret.
+		(*my_proc.frame).pc = image_ref.header.entry_addr;
+		// Stack pointer. The stack starts at the bottom and works its
+		// way up, so we have to set the stack pointer to the bottom.
+		(*my_proc.frame).regs[Registers::Sp as usize] = STACK_ADDR as usize + STACK_PAGES * PAGE_SIZE - 0x1000;
+		// USER MODE! This is how we set what'll go into mstatus when we
+		// run the process.
+		(*my_proc.frame).mode = CpuMode::User as usize;
+		(*my_proc.frame).pid = my_proc.pid as usize;
+		// The SATP register is used for the MMU, so we need to
+		// map our table into that register. The switch_to_user
+		// function will load .satp into the actual register
+		// when the time comes.
+		(*my_proc.frame).satp = build_satp(SatpMode::Sv39, my_proc.pid as usize, my_proc.mmu_table as usize);
 	}
+	// The ASID field of the SATP register is only 16-bits, and we reserved
+	// 0 for the kernel, even though we run the kernel in machine mode for
+	// now. A PID can belong to an earlier process, so the hart may still
+	// remember its translations.
+	satp_fence_asid(my_pid as usize);
+	Some(my_proc)
 }
@@ -3,12 +3,15 @@
 // Stephen Marz
 // 16 March 2020
 
-use crate::{cpu::Registers,
-            process::{add_kernel_process_args, get_by_pid, set_running, set_waiting},
-            syscall::syscall_block_read};
+use crate::{bcache,
+            cpu::{without_interrupts, Registers},
+            dcache,
+            lock::Mutex,
+            page::{pin, unpin, user_runs, EntryBits},
+            process::{add_kernel_process_args, get_by_pid, set_running, set_waiting, Descriptor}};
 
 use crate::{buffer::Buffer, cpu::memcpy};
-use alloc::{boxed::Box, collections::BTreeMap, string::String};
+use alloc::{boxed::Box, collections::BTreeMap, string::String, vec::Vec};
 use core::mem::size_of;
 
 pub const MAGIC: u16 = 0x4d5a;
@@ -20,6 +23,7 @@ pub const S_IFREG: u16 = 0o100_000;
 /// us all the information we need to read the file system and navigate
 /// the file system, including where to find the inodes and zones (blocks).
 #[repr(C)]
+#[derive(Copy, Clone)]
 pub struct SuperBlock {
 	pub ninodes:         u32,
 	pub pad0:            u16,
@@ -65,12 +69,24 @@ pub struct DirEntry {
 	pub name:  [u8; 60]
 }
 
+/// An open file. The inode is a number so that everyone who has the file
+/// open sees the same, current inode, which changes as the file is written.
+#[derive(Copy, Clone)]
+pub struct OpenFile {
+	pub dev:    usize,
+	pub inode:  u32,
+	pub offset: u32,
+}
+
 /// The MinixFileSystem implements the FileSystem trait for the VFS.
 pub struct MinixFileSystem;
-// The plan for this in the future is to have a single inode cache. What we
-// will do is have a cache of Node structures which will combine the Inode
-// with the block drive.
-static mut MFS_INODE_CACHE: [Option<BTreeMap<String, Inode>>; 8] = [None, None, None, None, None, None, None, None];
+// Inode numbers to inodes. open() runs in the trap handler, so it can't go
+// to the disk. Between this and the dentry cache, it usually doesn't have
+// to. write() keeps these current.
+static mut MFS_INODES: [Option<BTreeMap<u32, Inode>>; 8] = [None, None, None, None, None, None, None, None];
+// Writers change the zone map and inodes with a read, modify, write, so
+// only one of them at a time.
+static mut MFS_WRITE_MUTEX: Mutex = Mutex::new();
 
 impl MinixFileSystem {
 	/// Inodes are the meta-data of a file, including the mode (permissions and type) and
@@ -82,100 +98,91 @@ impl MinixFileSystem {
 		// So, we need to have memory available that's at least 512 bytes, even if
 		// we only want 10 bytes or 32 bytes (size of an Inode).
 		let mut buffer = Buffer::new(1024);
-
-		// Here is a little memory trick. We have a reference and it will refer to the
-		// top portion of our buffer. Since we won't be using the super block and inode
-		// simultaneously, we can overlap the memory regions.
-
-		// For Rust-ers, I'm showing two ways here. The first way is to get a reference
-		// from a pointer. You will see the &* a lot in Rust for references. Rust
-		// makes dereferencing a pointer cumbersome, which lends to not using them.
-		let super_block = unsafe { &*(buffer.get_mut() as *mut SuperBlock) };
 		// I opted for a pointer here instead of a reference because we will be offsetting the inode by a certain amount.
 		let inode = buffer.get_mut() as *mut Inode;
-		// Read from the block device. The size is 1 sector (512 bytes) and our offset is past
-		// the boot block (first 1024 bytes). This is where the superblock sits.
-		syc_read(bdev, buffer.get_mut(), 512, 1024);
-		if super_block.magic == MAGIC {
-			// If we get here, we successfully read what we think is the super block.
-			// The math here is 2 - one for the boot block, one for the super block. Then we
-			// have to skip the bitmaps blocks. We have a certain number of inode map blocks (imap)
-			// and zone map blocks (zmap).
-			// The inode comes to us as a NUMBER, not an index. So, we need to subtract 1.
-			let inode_offset = (2 + super_block.imap_blocks + super_block.zmap_blocks) as usize * BLOCK_SIZE as usize
-			                   + ((inode_num as usize - 1) / (BLOCK_SIZE as usize / size_of::<Inode>())) * BLOCK_SIZE as usize;
-
+		if let Some(super_block) = Self::super_block(bdev) {
+			let (block, index) = Self::inode_location(&super_block, inode_num);
 			// Now, we read the inode itself.
-			// The block driver requires that our offset be a multiple of 512. We do that with the
-			// inode_offset. However, we're going to be reading a group of inodes.
-			syc_read(bdev, buffer.get_mut(), 1024, inode_offset as u32);
-
-			// There are 1024 / size_of<Inode>() inodes in each read that we can do. However, we need to figure out which inode in that group we need to read. We just take the % of this to find out.
-			let read_this_node = (inode_num as usize - 1) % (BLOCK_SIZE as usize / size_of::<Inode>());
+			// The block driver requires that our offset be a multiple of 512. We do that
+			// by reading the whole block. However, we're going to be reading a group of inodes.
+			if bcache::read(bdev, block, buffer.get_mut(), false) != 0 {
+				return None;
+			}
 
-			// We copy the inode over. This might not be the best thing since the Inode will
-			// eventually have to change after writing.
-			return unsafe { Some(*(inode.add(read_this_node))) };
+			// We copy the inode over. Writers change it with put_inode().
+			return unsafe { Some(*(inode.add(index))) };
 		}
 		// If we get here, some result wasn't OK. Either the super block
 		// or the inode itself.
 		None
 	}
-}
 
-impl MinixFileSystem {
-	/// Init is where we would cache the superblock and inode to avoid having to read
-	/// it over and over again, like we do for read right now.
-	fn cache_at(btm: &mut BTreeMap<String, Inode>, cwd: &String, inode_num: u32, bdev: usize) {
-		let ino = Self::get_inode(bdev, inode_num).unwrap();
-		let mut buf = Buffer::new(((ino.size + BLOCK_SIZE - 1) & !BLOCK_SIZE) as usize);
-		let dirents = buf.get() as *const DirEntry;
-		let sz = Self::read(bdev, &ino, buf.get_mut(), BLOCK_SIZE, 0);
-		let num_dirents = sz as usize / size_of::<DirEntry>();
-		// We start at 2 because the first two entries are . and ..
-		for i in 2..num_dirents {
+	/// Write an inode back. It goes through the block cache like the rest of a
+	/// write, so it reaches the disk with the file's data.
+	fn put_inode(bdev: usize, inode_num: u32, node: &Inode) -> bool {
+		let mut buffer = Buffer::new(BLOCK_SIZE as usize);
+		if let Some(super_block) = Self::super_block(bdev) {
+			let (block, index) = Self::inode_location(&super_block, inode_num);
+			// The rest of the block is other inodes, so we can't write it
+			// back if we couldn't read it.
+			if bcache::read(bdev, block, buffer.get_mut(), false) != 0 {
+				return false;
+			}
 			unsafe {
-				let ref d = *dirents.add(i);
-				let d_ino = Self::get_inode(bdev, d.inode).unwrap();
-				let mut new_cwd = String::with_capacity(120);
-				for i in cwd.bytes() {
-					new_cwd.push(i as char);
-				}
-				// Add a directory separator between this inode and the next.
-				// If we're the root (inode 1), we don't want to double up the
-				// frontslash, so only do it for non-roots.
-				if inode_num != 1 {
-					new_cwd.push('/');
-				}
-				for i in 0..60 {
-					if d.name[i] == 0 {
-						break;
-					}
-					new_cwd.push(d.name[i] as char);
-				}
-				new_cwd.shrink_to_fit();
-				if d_ino.mode & S_IFDIR != 0 {
-					// This is a directory, cache these. This is a recursive call,
-					// which I don't really like.
-					Self::cache_at(btm, &new_cwd, d.inode, bdev);
-				}
-				else {
-					btm.insert(new_cwd, d_ino);
-				}
+				(buffer.get_mut() as *mut Inode).add(index).write(*node);
 			}
+			bcache::write(bdev, block, buffer.get(), false);
+			return true;
 		}
+		false
 	}
 
+	/// Read the superblock. The superblock is block 1, right past the boot
+	/// block (first 1024 bytes). Everything needs it, so we pin it in the cache.
+	fn super_block(bdev: usize) -> Option<SuperBlock> {
+		let mut buffer = Buffer::new(BLOCK_SIZE as usize);
+		if bcache::read(bdev, 1, buffer.get_mut(), true) != 0 {
+			return None;
+		}
+		let super_block = unsafe { *(buffer.get() as *const SuperBlock) };
+		if super_block.magic == MAGIC {
+			Some(super_block)
+		}
+		else {
+			None
+		}
+	}
+
+	/// Which block an inode is in, and which inode in that block it is.
+	fn inode_location(super_block: &SuperBlock, inode_num: u32) -> (u32, usize) {
+		// The math here is 2 - one for the boot block, one for the super block. Then we
+		// have to skip the bitmaps blocks. We have a certain number of inode map blocks (imap)
+		// and zone map blocks (zmap).
+		// The inode comes to us as a NUMBER, not an index. So, we need to subtract 1.
+		let per_block = BLOCK_SIZE as usize / size_of::<Inode>();
+		let block = (2 + super_block.imap_blocks + super_block.zmap_blocks) as usize + (inode_num as usize - 1) / per_block;
+		// There are 1024 / size_of<Inode>() inodes in each block. However, we need to
+		// figure out which inode in that group we need. We just take the % of this to find out.
+		(block as u32, (inode_num as usize - 1) % per_block)
+	}
+
+	/// The inode we know about, without going to the disk. This is current
+	/// even while the file is being written.
+	pub fn cached_inode(bdev: usize, inode_num: u32) -> Option<Inode> {
+		unsafe { MFS_INODES[bdev - 1].as_ref().and_then(|m| m.get(&inode_num).copied()) }
+	}
+}
+
+impl MinixFileSystem {
 	// Run this ONLY in a process!
 	pub fn init(bdev: usize) {
-		if unsafe { MFS_INODE_CACHE[bdev - 1].is_none() } {
-			let mut btm = BTreeMap::new();
-			let cwd = String::from("/");
-
-			// Let's look at the root (inode #1)
-			Self::cache_at(&mut btm, &cwd, 1, bdev);
+		if unsafe { MFS_INODES[bdev - 1].is_none() } {
+			bcache::init();
+			dcache::init();
+			// There's nothing else to do here. Paths and inodes are cached
+			// as they're looked up, so a big disk doesn't make booting slow.
 			unsafe {
-				MFS_INODE_CACHE[bdev - 1] = Some(btm);
+				MFS_INODES[bdev - 1] = Some(BTreeMap::new());
 			}
 		}
 		else {
@@ -183,237 +190,301 @@ impl MinixFileSystem {
 		}
 	}
 
-	/// The goal of open is to traverse the path given by path. If we cache the inodes
-	/// in RAM, it might make this much quicker. For now, this doesn't do anything since
-	/// we're just testing read based on if we know the Inode we're looking for.
-	pub fn open(bdev: usize, path: &str) -> Result<Inode, FsError> {
-		if let Some(cache) = unsafe { MFS_INODE_CACHE[bdev - 1].take() } {
-			let ret;
-			if let Some(inode) = cache.get(path) {
-				ret = Ok(*inode);
+	/// The inode, from MFS_INODES if we have it, otherwise from the disk, in
+	/// which case we keep it for next time. This must be called from a
+	/// process since it might block.
+	fn inode(bdev: usize, inode_num: u32) -> Option<Inode> {
+		if let Some(inode) = Self::cached_inode(bdev, inode_num) {
+			return Some(inode);
+		}
+		let inode = Self::get_inode(bdev, inode_num)?;
+		without_interrupts(|| unsafe {
+			if let Some(inodes) = MFS_INODES[bdev - 1].as_mut() {
+				inodes.insert(inode_num, inode);
 			}
-			else {
-				ret = Err(FsError::FileNotFound);
+		});
+		Some(inode)
+	}
+
+	/// Look for name in a directory and return its inode number, or 0 if
+	/// it isn't there. This must be called from a process since it might
+	/// block.
+	fn dir_lookup(bdev: usize, dir_num: u32, name: &str) -> Result<u32, FsError> {
+		let dir = Self::inode(bdev, dir_num).ok_or(FsError::FileNotFound)?;
+		if dir.mode & S_IFDIR == 0 {
+			return Err(FsError::IsFile);
+		}
+		let name = name.as_bytes();
+		if name.len() > 60 {
+			return Ok(0);
+		}
+		let mut buf = Buffer::new(BLOCK_SIZE as usize);
+		let dirents = buf.get() as *const DirEntry;
+		let mut offset = 0;
+		while offset < dir.size {
+			let sz = Self::read(bdev, &dir, buf.get_mut(), BLOCK_SIZE, offset);
+			if sz == 0 {
+				break;
 			}
-			unsafe {
-				MFS_INODE_CACHE[bdev - 1].replace(cache);
+			for i in 0..sz as usize / size_of::<DirEntry>() {
+				let d = unsafe { &*dirents.add(i) };
+				// A name is padded with zeroes unless it takes all 60 bytes.
+				if d.inode != 0 && &d.name[..name.len()] == name && (name.len() == 60 || d.name[name.len()] == 0) {
+					return Ok(d.inode);
+				}
 			}
-			ret
+			offset += sz;
 		}
-		else {
-			Err(FsError::FileNotFound)
+		Ok(0)
+	}
+
+	/// Turn a path into an inode number, one directory at a time from the root
+	/// (inode #1). Each step goes through the dentry cache, and whatever we
+	/// have to read from the disk ends up in it. The inode at the end of the
+	/// path is cached too, since whoever asked wants that next. This must be
+	/// called from a process since it might block.
+	pub fn lookup(bdev: usize, path: &str) -> Result<u32, FsError> {
+		let mut inode_num = 1;
+		for name in path.split('/').filter(|n| !n.is_empty() && *n != ".") {
+			let next = match dcache::get(bdev, inode_num, name) {
+				Some(n) => n,
+				None => {
+					// Something in the middle of the path that isn't a directory
+					// doesn't have name either. Remember that too, or
+					// lookup_cached would never find out.
+					let n = Self::dir_lookup(bdev, inode_num, name).unwrap_or(0);
+					dcache::insert(bdev, inode_num, name, n);
+					n
+				}
+			};
+			if next == 0 {
+				return Err(FsError::FileNotFound);
+			}
+			inode_num = next;
+		}
+		Self::inode(bdev, inode_num).ok_or(FsError::FileNotFound)?;
+		Ok(inode_num)
+	}
+
+	/// lookup() without going to the disk, for the trap handler. None means
+	/// some part of the path isn't cached yet, and lookup() has to run in a
+	/// process first.
+	pub fn lookup_cached(bdev: usize, path: &str) -> Option<Result<u32, FsError>> {
+		let mut inode_num = 1;
+		for name in path.split('/').filter(|n| !n.is_empty() && *n != ".") {
+			match dcache::get(bdev, inode_num, name)? {
+				0 => return Some(Err(FsError::FileNotFound)),
+				n => inode_num = n,
+			}
+		}
+		Some(Ok(inode_num))
+	}
+
+	/// Like lookup_cached, but for the inode itself.
+	pub fn open_cached(bdev: usize, path: &str) -> Option<Result<Inode, FsError>> {
+		match Self::lookup_cached(bdev, path)? {
+			Ok(n) => Self::cached_inode(bdev, n).map(Ok),
+			Err(e) => Some(Err(e)),
 		}
 	}
 
 	pub fn read(bdev: usize, inode: &Inode, buffer: *mut u8, size: u32, offset: u32) -> u32 {
-		// Our strategy here is to use blocks to see when we need to start reading
-		// based on the offset. That's offset_block. Then, the actual byte within
-		// that block that we need is offset_byte.
-		let mut blocks_seen = 0u32;
-		let offset_block = offset / BLOCK_SIZE;
+		// We go straight to the block we need instead of walking every zone from the
+		// start of the file. The offset tells us which block in the file (lblock) and
+		// which byte in that block (offset_byte) to start at.
+		let mut lblock = offset / BLOCK_SIZE;
 		let mut offset_byte = offset % BLOCK_SIZE;
-		// First, the _size parameter (now in bytes_left) is the size of the buffer, not
-		// necessarily the size of the file. If our buffer is bigger than the file, we're OK.
-		// If our buffer is smaller than the file, then we can only read up to the buffer size.
-		let mut bytes_left = if size > inode.size {
-			inode.size
+		// The size parameter (now in bytes_left) is the size of the buffer, not
+		// necessarily the size of the file. We can't read past the end of the file,
+		// and we can't read more than the buffer can hold.
+		if offset >= inode.size {
+			return 0;
+		}
+		let mut bytes_left = if size > inode.size - offset {
+			inode.size - offset
 		}
 		else {
 			size
 		};
+		let file_blocks = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 		let mut bytes_read = 0u32;
-		// The block buffer automatically drops when we quit early due to an error or we've read enough. This will be the holding port when we go out and read a block. Recall that even if we want 10 bytes, we have to read the entire block (really only 512 bytes of the block) first. So, we use the block_buffer as the middle man, which is then copied into the buffer.
+		// The block buffer is the middle man between the cache and the caller's
+		// buffer, since we usually want part of a block.
 		let mut block_buffer = Buffer::new(BLOCK_SIZE as usize);
-		// Triply indirect zones point to a block of pointers (BLOCK_SIZE / 4). Each one of those pointers points to another block of pointers (BLOCK_SIZE / 4). Each one of those pointers yet again points to another block of pointers (BLOCK_SIZE / 4). This is why we have indirect, iindirect (doubly), and iiindirect (triply).
-		let mut indirect_buffer = Buffer::new(BLOCK_SIZE as usize);
-		let mut iindirect_buffer = Buffer::new(BLOCK_SIZE as usize);
-		let mut iiindirect_buffer = Buffer::new(BLOCK_SIZE as usize);
-		// I put the pointers *const u32 here. That means we will allocate the indirect, doubly indirect, and triply indirect even for small files. I initially had these in their respective scopes, but that required us to recreate the indirect buffer for doubly indirect and both the indirect and doubly indirect buffers for the triply indirect. Not sure which is better, but I probably wasted brain cells on this.
-		let izones = indirect_buffer.get() as *const u32;
-		let iizones = iindirect_buffer.get() as *const u32;
-		let iiizones = iiindirect_buffer.get() as *const u32;
-
-		// ////////////////////////////////////////////
-		// // DIRECT ZONES
-		// ////////////////////////////////////////////
-		// In Rust, our for loop automatically "declares" i from 0 to < 7. The syntax
-		// 0..7 means 0 through to 7 but not including 7. If we want to include 7, we
-		// would use the syntax 0..=7.
-		for i in 0..7 {
-			// There are 7 direct zones in the Minix 3 file system. So, we can just read them one by one. Any zone that has the value 0 is skipped and we check the next zones. This might happen as we start writing and truncating.
-			if inode.zones[i] == 0 {
-				continue;
+		// When we have to go to the disk, we get as many contiguous zones as we can
+		// in one request. This holds them.
+		let mut run_buffer = Buffer::new((BLOCK_SIZE as usize) * bcache::MAX_READ_AHEAD);
+		let mut zones = ZoneWalker::new();
+		while bytes_left > 0 {
+			let zone = match zones.zone(bdev, inode, lblock) {
+				Some(z) => z,
+				None => break,
+			};
+			let read_this_many = if BLOCK_SIZE - offset_byte > bytes_left {
+				bytes_left
 			}
-			// We really use this to keep track of when we need to actually start reading
-			// But an if statement probably takes more time than just incrementing it.
-			if offset_block <= blocks_seen {
-				// If we get here, then our offset is within our window that we want to see.
-				// We need to go to the direct pointer's index. That'll give us a block INDEX.
-				// That makes it easy since all we have to do is multiply the block size
-				// by whatever we get. If it's 0, we skip it and move on.
-				let zone_offset = inode.zones[i] * BLOCK_SIZE;
-				// We read the zone, which is where the data is located. The zone offset is simply the block
-				// size times the zone number. This makes it really easy to read!
-				syc_read(bdev, block_buffer.get_mut(), BLOCK_SIZE, zone_offset);
-
-				// There's a little bit of math to see how much we need to read. We don't want to read
-				// more than the buffer passed in can handle, and we don't want to read if we haven't
-				// taken care of the offset. For example, an offset of 10000 with a size of 2 means we
-				// can only read bytes 10,000 and 10,001.
-				let read_this_many = if BLOCK_SIZE - offset_byte > bytes_left {
-					bytes_left
+			else {
+				BLOCK_SIZE - offset_byte
+			};
+			unsafe {
+				if zone == 0 {
+					// A zone of 0 is a hole in the file, which reads as zeroes.
+					buffer.add(bytes_read as usize).write_bytes(0, read_this_many as usize);
 				}
-				else {
-					BLOCK_SIZE - offset_byte
-				};
-				// Once again, here we actually copy the bytes into the final destination, the buffer. This memcpy
-				// is written in cpu.rs.
-				unsafe {
+				else if bcache::is_cached(bdev, zone) {
+					// It can be evicted before we get to it, in which case
+					// this goes to the disk after all.
+					if bcache::read(bdev, zone, block_buffer.get_mut(), false) != 0 {
+						break;
+					}
 					memcpy(buffer.add(bytes_read as usize), block_buffer.get().add(offset_byte as usize), read_this_many as usize);
 				}
-				// Regardless of whether we have an offset or not, we reset the offset byte back to 0. This
-				// probably will get set to 0 many times, but who cares?
-				offset_byte = 0;
-				// Reset the statistics to see how many bytes we've read versus how many are left.
-				bytes_read += read_this_many;
-				bytes_left -= read_this_many;
-				// If no more bytes are left, then we're done.
-				if bytes_left == 0 {
-					return bytes_read;
-				}
-			}
-			// The blocks_seen is for the offset. We need to skip a certain number of blocks FIRST before getting
-			// to the offset. The reason we need to read the zones is because we need to skip zones of 0, and they
-			// do not contribute as a "seen" block.
-			blocks_seen += 1;
-		}
-		// ////////////////////////////////////////////
-		// // SINGLY INDIRECT ZONES
-		// ////////////////////////////////////////////
-		// Each indirect zone is a list of pointers, each 4 bytes. These then
-		// point to zones where the data can be found. Just like with the direct zones,
-		// we need to make sure the zone isn't 0. A zone of 0 means skip it.
-		if inode.zones[7] != 0 {
-			syc_read(bdev, indirect_buffer.get_mut(), BLOCK_SIZE, BLOCK_SIZE * inode.zones[7]);
-			let izones = indirect_buffer.get() as *const u32;
-			for i in 0..NUM_IPTRS {
-				// Where do I put unsafe? Dereferencing the pointers and memcpy are the unsafe functions.
-				unsafe {
-					if izones.add(i).read() != 0 {
-						if offset_block <= blocks_seen {
-							syc_read(bdev, block_buffer.get_mut(), BLOCK_SIZE, BLOCK_SIZE * izones.add(i).read());
-							let read_this_many = if BLOCK_SIZE - offset_byte > bytes_left {
-								bytes_left
-							}
-							else {
-								BLOCK_SIZE - offset_byte
-							};
-							memcpy(buffer.add(bytes_read as usize), block_buffer.get().add(offset_byte as usize), read_this_many as usize);
-							bytes_read += read_this_many;
-							bytes_left -= read_this_many;
-							offset_byte = 0;
-							if bytes_left == 0 {
-								return bytes_read;
-							}
+				else {
+					// Read-ahead. We want the rest of this request, and at least
+					// READ_AHEAD blocks since whoever is reading this file is
+					// probably going to keep going. We can only put zones that are
+					// next to each other on the disk into the same request, and
+					// there's no reason to read what's already cached.
+					let wanted = (offset_byte + bytes_left + BLOCK_SIZE - 1) / BLOCK_SIZE;
+					let wanted = if wanted < READ_AHEAD {
+						READ_AHEAD
+					}
+					else {
+						wanted
+					};
+					let mut count = 1u32;
+					while (count as usize) < bcache::MAX_READ_AHEAD && count < wanted && lblock + count < file_blocks {
+						match zones.zone(bdev, inode, lblock + count) {
+							Some(z) if z == zone + count && !bcache::is_cached(bdev, z) => count += 1,
+							_ => break,
 						}
-						blocks_seen += 1;
 					}
+					// A read error cuts the read short here.
+					if bcache::read_run(bdev, zone, count as usize, run_buffer.get_mut()) != 0 {
+						break;
+					}
+					memcpy(buffer.add(bytes_read as usize), run_buffer.get().add(offset_byte as usize), read_this_many as usize);
 				}
 			}
+			// Only the first block has an offset into it.
+			offset_byte = 0;
+			bytes_read += read_this_many;
+			bytes_left -= read_this_many;
+			lblock += 1;
+		}
+		bytes_read
+	}
+
+	/// Write size bytes from buffer into the file at offset, growing the file
+	/// if we go past its end. New zones come out of the zone map as we need
+	/// them. Everything, data, inode, and bitmaps, goes into the block
+	/// cache and out to the disk with the next sync. Returns the number of
+	/// bytes written, which is short if the disk fills up. This must be
+	/// called from a process since it might block.
+	pub fn write(bdev: usize, inode_num: u32, buffer: *const u8, size: u32, offset: u32) -> u32 {
+		unsafe {
+			MFS_WRITE_MUTEX.sleep_lock();
+		}
+		let written = Self::write_locked(bdev, inode_num, buffer, size, offset);
+		unsafe {
+			MFS_WRITE_MUTEX.unlock();
 		}
-		// ////////////////////////////////////////////
-		// // DOUBLY INDIRECT ZONES
-		// ////////////////////////////////////////////
-		if inode.zones[8] != 0 {
-			syc_read(bdev, indirect_buffer.get_mut(), BLOCK_SIZE, BLOCK_SIZE * inode.zones[8]);
+		written
+	}
+
+	fn write_locked(bdev: usize, inode_num: u32, buffer: *const u8, size: u32, offset: u32) -> u32 {
+		let super_block = match Self::super_block(bdev) {
+			Some(sb) => sb,
+			None => return 0,
+		};
+		let mut inode = match Self::get_inode(bdev, inode_num) {
+			Some(i) => i,
+			None => return 0,
+		};
+		// Don't go past the biggest file the file system allows.
+		let end = offset as u64 + size as u64;
+		let end = if end > super_block.max_size as u64 {
+			super_block.max_size as u64
+		}
+		else {
+			end
+		};
+		if end <= offset as u64 {
+			return 0;
+		}
+		let mut bytes_left = (end - offset as u64) as u32;
+		let old_size = inode.size;
+		let mut lblock = offset / BLOCK_SIZE;
+		let mut offset_byte = offset % BLOCK_SIZE;
+		let mut bytes_written = 0u32;
+		let mut block_buffer = Buffer::new(BLOCK_SIZE as usize);
+		let mut zones = ZoneAllocator::new(bdev, &super_block);
+		while bytes_left > 0 {
+			let (zone, fresh) = match zones.zone_for_write(&mut inode, lblock) {
+				Some(z) => z,
+				None => break,
+			};
+			let write_this_many = if BLOCK_SIZE - offset_byte > bytes_left {
+				bytes_left
+			}
+			else {
+				BLOCK_SIZE - offset_byte
+			};
 			unsafe {
-				for i in 0..NUM_IPTRS {
-					if izones.add(i).read() != 0 {
-						syc_read(bdev, iindirect_buffer.get_mut(), BLOCK_SIZE, BLOCK_SIZE * izones.add(i).read());
-						for j in 0..NUM_IPTRS {
-							if iizones.add(j).read() != 0 {
-								// Notice that this inner code is the same for all end-zone pointers. I'm thinking about
-								// moving this out of here into a function of its own, but that might make it harder
-								// to follow.
-								if offset_block <= blocks_seen {
-									syc_read(bdev, block_buffer.get_mut(), BLOCK_SIZE, BLOCK_SIZE * iizones.add(j).read());
-									let read_this_many = if BLOCK_SIZE - offset_byte > bytes_left {
-										bytes_left
-									}
-									else {
-										BLOCK_SIZE - offset_byte
-									};
-									memcpy(
-									       buffer.add(bytes_read as usize),
-									       block_buffer.get().add(offset_byte as usize),
-									       read_this_many as usize
-									);
-									bytes_read += read_this_many;
-									bytes_left -= read_this_many;
-									offset_byte = 0;
-									if bytes_left == 0 {
-										return bytes_read;
-									}
-								}
-								blocks_seen += 1;
+				let dst = block_buffer.get_mut();
+				if write_this_many < BLOCK_SIZE {
+					// Only part of this block changes, so we need the rest of it.
+					// A zone we just got is all zeroes as far as the file is
+					// concerned, whatever is on the disk.
+					if fresh {
+						dst.write_bytes(0, BLOCK_SIZE as usize);
+					}
+					else {
+						if bcache::read(bdev, zone, dst, false) != 0 {
+							break;
+						}
+						// Anything between the old end of the file and where we
+						// start writing now reads as zeroes.
+						let block_start = lblock * BLOCK_SIZE;
+						if old_size < block_start + offset_byte {
+							let from = if old_size > block_start {
+								old_size - block_start
 							}
+							else {
+								0
+							};
+							dst.add(from as usize).write_bytes(0, (offset_byte - from) as usize);
 						}
 					}
 				}
+				memcpy(dst.add(offset_byte as usize), buffer.add(bytes_written as usize), write_this_many as usize);
+				bcache::write(bdev, zone, dst, false);
 			}
+			offset_byte = 0;
+			bytes_written += write_this_many;
+			bytes_left -= write_this_many;
+			lblock += 1;
 		}
-		// ////////////////////////////////////////////
-		// // TRIPLY INDIRECT ZONES
-		// ////////////////////////////////////////////
-		if inode.zones[9] != 0 {
-			syc_read(bdev, indirect_buffer.get_mut(), BLOCK_SIZE, BLOCK_SIZE * inode.zones[9]);
-			unsafe {
-				for i in 0..NUM_IPTRS {
-					if izones.add(i).read() != 0 {
-						syc_read(bdev, iindirect_buffer.get_mut(), BLOCK_SIZE, BLOCK_SIZE * izones.add(i).read());
-						for j in 0..NUM_IPTRS {
-							if iizones.add(j).read() != 0 {
-								syc_read(bdev, iiindirect_buffer.get_mut(), BLOCK_SIZE, BLOCK_SIZE * iizones.add(j).read());
-								for k in 0..NUM_IPTRS {
-									if iiizones.add(k).read() != 0 {
-										// Hey look! This again.
-										if offset_block <= blocks_seen {
-											syc_read(bdev, block_buffer.get_mut(), BLOCK_SIZE, BLOCK_SIZE * iiizones.add(k).read());
-											let read_this_many = if BLOCK_SIZE - offset_byte > bytes_left {
-												bytes_left
-											}
-											else {
-												BLOCK_SIZE - offset_byte
-											};
-											memcpy(
-											       buffer.add(bytes_read as usize),
-											       block_buffer.get().add(offset_byte as usize),
-											       read_this_many as usize
-											);
-											bytes_read += read_this_many;
-											bytes_left -= read_this_many;
-											offset_byte = 0;
-											if bytes_left == 0 {
-												return bytes_read;
-											}
-										}
-										blocks_seen += 1;
-									}
-								}
-							}
-						}
-					}
+		// One write of each bitmap block we touched, no matter how many zones
+		// we took out of it.
+		zones.finish();
+		if bytes_written > 0 || zones.allocated > 0 {
+			if offset + bytes_written > inode.size {
+				inode.size = offset + bytes_written;
+			}
+			Self::put_inode(bdev, inode_num, &inode);
+			without_interrupts(|| unsafe {
+				if let Some(inodes) = MFS_INODES[bdev - 1].as_mut() {
+					inodes.insert(inode_num, inode);
 				}
+			});
+			// The names in a directory are its data, so whatever we knew
+			// about them may be wrong now.
+			if inode.mode & S_IFDIR != 0 {
+				dcache::invalidate_dir(bdev, inode_num);
 			}
 		}
-		// Anyone else love this stairstep style? I probably should put the pointers in a function by themselves,
-		// but I think that'll make it more difficult to see what's actually happening.
-
-		bytes_read
-	}
-
-	pub fn write(&mut self, _desc: &Inode, _buffer: *const u8, _offset: u32, _size: u32) -> u32 {
-		0
+		bytes_written
 	}
 
 	pub fn stat(&self, inode: &Inode) -> Stat {
@@ -424,11 +495,258 @@ impl MinixFileSystem {
 	}
 }
 
-/// This is a wrapper function around the syscall_block_read. This allows me to do
-/// other things before I call the system call (or after). However, all the things I
-/// wanted to do are no longer there, so this is a worthless function.
-fn syc_read(bdev: usize, buffer: *mut u8, size: u32, offset: u32) -> u8 {
-	syscall_block_read(bdev, buffer, size, offset)
+/// How many blocks we try to read ahead of a sequential read.
+const READ_AHEAD: u32 = 8;
+
+/// Turns a block number in a file into a zone number on the disk. Direct zones
+/// come right out of the inode. Everything else goes through one, two, or three
+/// levels of indirect zones. Those come from the block cache (pinned, since every
+/// read needs them), and we keep the last one we used at each level so that a
+/// sequential read only looks each of them up once.
+struct ZoneWalker {
+	buffers: [Buffer; 3],
+	loaded:  [u32; 3],
+}
+
+impl ZoneWalker {
+	fn new() -> Self {
+		Self { buffers: [Buffer::new(BLOCK_SIZE as usize), Buffer::new(BLOCK_SIZE as usize), Buffer::new(BLOCK_SIZE as usize)],
+		       loaded:  [0; 3], }
+	}
+
+	/// Get pointer number index out of the indirect zone at this level, or
+	/// None if we couldn't read it.
+	fn ptr(&mut self, bdev: usize, level: usize, zone: u32, index: u32) -> Option<u32> {
+		if zone == 0 {
+			return Some(0);
+		}
+		if self.loaded[level] != zone {
+			if bcache::read(bdev, zone, self.buffers[level].get_mut(), true) != 0 {
+				self.loaded[level] = 0;
+				return None;
+			}
+			self.loaded[level] = zone;
+		}
+		unsafe { Some((self.buffers[level].get() as *const u32).add(index as usize).read()) }
+	}
+
+	/// Returns the zone for block lblock of the file (0 for a hole), or None if
+	/// lblock is past anything the inode can point to or an indirect zone
+	/// on the way couldn't be read.
+	fn zone(&mut self, bdev: usize, inode: &Inode, lblock: u32) -> Option<u32> {
+		let n = NUM_IPTRS as u32;
+		let mut idx = lblock;
+		// 7 direct zones
+		if idx < 7 {
+			return Some(inode.zones[idx as usize]);
+		}
+		idx -= 7;
+		// Singly indirect
+		if idx < n {
+			return self.ptr(bdev, 0, inode.zones[7], idx);
+		}
+		idx -= n;
+		// Doubly indirect
+		if idx < n * n {
+			let z = self.ptr(bdev, 0, inode.zones[8], idx / n)?;
+			return self.ptr(bdev, 1, z, idx % n);
+		}
+		idx -= n * n;
+		// Triply indirect
+		if (idx as u64) < (n as u64) * (n as u64) * (n as u64) {
+			let z = self.ptr(bdev, 0, inode.zones[9], idx / (n * n))?;
+			let z = self.ptr(bdev, 1, z, (idx / n) % n)?;
+			return self.ptr(bdev, 2, z, idx % n);
+		}
+		None
+	}
+}
+
+// Where each device's zone map search starts. Right past the last zone we
+// handed out, so that a file written a bit at a time still gets zones that
+// are next to each other, and we don't scan the full part of the map again.
+static mut ZONE_HINT: [u32; 8] = [0; 8];
+const BITS_PER_BLOCK: u32 = BLOCK_SIZE * 8;
+
+/// Hands out free zones for a write. The zone map is a bitmap, one bit per
+/// data zone. We hold on to the bitmap block we're working in and only write
+/// it back when we move on or finish, so a write that needs many zones
+/// costs one read and one write of each bitmap block it touches instead of
+/// one of each per zone.
+struct ZoneAllocator {
+	bdev:            usize,
+	zmap_start:      u32,
+	first_data_zone: u32,
+	// Bit 0 is never used, so zone first_data_zone is bit 1.
+	bits:            u32,
+	map:             Buffer,
+	loaded:          Option<u32>,
+	dirty:           bool,
+	allocated:       u32,
+	indirect:        Buffer,
+	zero:            Buffer,
+}
+
+impl ZoneAllocator {
+	fn new(bdev: usize, super_block: &SuperBlock) -> Self {
+		let mut zero = Buffer::new(BLOCK_SIZE as usize);
+		unsafe {
+			zero.get_mut().write_bytes(0, BLOCK_SIZE as usize);
+		}
+		let bits = super_block.zones - super_block.first_data_zone as u32 + 1;
+		let max_bits = super_block.zmap_blocks as u32 * BITS_PER_BLOCK;
+		Self { bdev,
+		       zmap_start: 2 + super_block.imap_blocks as u32,
+		       first_data_zone: super_block.first_data_zone as u32,
+		       bits: if bits > max_bits { max_bits } else { bits },
+		       map: Buffer::new(BLOCK_SIZE as usize),
+		       loaded: None,
+		       dirty: false,
+		       allocated: 0,
+		       indirect: Buffer::new(BLOCK_SIZE as usize),
+		       zero }
+	}
+
+	fn flush(&mut self) {
+		if self.dirty {
+			if let Some(b) = self.loaded {
+				bcache::write(self.bdev, self.zmap_start + b, self.map.get(), false);
+			}
+			self.dirty = false;
+		}
+	}
+
+	/// Returns false if we couldn't read the bitmap block.
+	fn load(&mut self, b: u32) -> bool {
+		if self.loaded != Some(b) {
+			self.flush();
+			if bcache::read(self.bdev, self.zmap_start + b, self.map.get_mut(), false) != 0 {
+				self.loaded = None;
+				return false;
+			}
+			self.loaded = Some(b);
+		}
+		true
+	}
+
+	/// The first clear bit in [from, to), a 64-bit word at a time. A bitmap
+	/// block we can't read has nothing free as far as we know.
+	fn find_free(&mut self, from: u32, to: u32) -> Option<u32> {
+		let mut bit = from;
+		while bit < to {
+			if !self.load(bit / BITS_PER_BLOCK) {
+				return None;
+			}
+			let in_block = bit % BITS_PER_BLOCK;
+			let word = unsafe { (self.map.get() as *const u64).add((in_block / 64) as usize).read() };
+			// Pretend the bits below where we started are taken.
+			let word = word | ((1u64 << (in_block % 64)) - 1);
+			let base = bit - in_block % 64;
+			if word != u64::MAX {
+				let found = base + (!word).trailing_zeros();
+				return if found < to { Some(found) } else { None };
+			}
+			bit = base + 64;
+		}
+		None
+	}
+
+	/// Take a zone out of the zone map. Returns None if the disk is full.
+	fn alloc(&mut self) -> Option<u32> {
+		let hint = unsafe { ZONE_HINT[self.bdev - 1] };
+		let hint = if hint < 1 || hint >= self.bits { 1 } else { hint };
+		let bit = match self.find_free(hint, self.bits) {
+			Some(b) => b,
+			None => self.find_free(1, hint)?,
+		};
+		// find_free left us in the block this bit is in.
+		let in_block = bit % BITS_PER_BLOCK;
+		unsafe {
+			let byte = self.map.get_mut().add((in_block / 8) as usize);
+			byte.write(byte.read() | 1 << (in_block % 8));
+			ZONE_HINT[self.bdev - 1] = bit + 1;
+		}
+		self.dirty = true;
+		self.allocated += 1;
+		Some(self.first_data_zone + bit - 1)
+	}
+
+	/// A new indirect zone has to be all zeroes (holes) before anyone
+	/// follows it.
+	fn zero_indirect(&mut self, zone: u32) {
+		bcache::write(self.bdev, zone, self.zero.get(), true);
+	}
+
+	/// Like ZoneWalker::zone, but zones the write needs that aren't there
+	/// yet, including indirect zones along the way, are allocated. Also
+	/// returns whether the data zone is new, in which case what's on the
+	/// disk there is garbage. Returns None if lblock is past what an inode
+	/// can point to or the disk is full.
+	fn zone_for_write(&mut self, inode: &mut Inode, lblock: u32) -> Option<(u32, bool)> {
+		let n = NUM_IPTRS as u32;
+		let mut idx = lblock;
+		// Which inode zone we start from, and the index at each indirect level.
+		let (slot, path, depth) = if idx < 7 {
+			(idx as usize, [0; 3], 0)
+		}
+		else {
+			idx -= 7;
+			if idx < n {
+				(7, [idx, 0, 0], 1)
+			}
+			else {
+				idx -= n;
+				if idx < n * n {
+					(8, [idx / n, idx % n, 0], 2)
+				}
+				else {
+					idx -= n * n;
+					if (idx as u64) < (n as u64) * (n as u64) * (n as u64) {
+						(9, [idx / (n * n), (idx / n) % n, idx % n], 3)
+					}
+					else {
+						return None;
+					}
+				}
+			}
+		};
+		// Once we allocate one zone on the way down, everything under it is
+		// new too.
+		let mut fresh = false;
+		if inode.zones[slot] == 0 {
+			let z = self.alloc()?;
+			if depth > 0 {
+				self.zero_indirect(z);
+			}
+			inode.zones[slot] = z;
+			fresh = true;
+		}
+		let mut zone = inode.zones[slot];
+		for level in 0..depth {
+			if bcache::read(self.bdev, zone, self.indirect.get_mut(), true) != 0 {
+				return None;
+			}
+			let ptr = unsafe { (self.indirect.get_mut() as *mut u32).add(path[level] as usize) };
+			let mut next = unsafe { ptr.read() };
+			if next == 0 {
+				next = self.alloc()?;
+				if level + 1 < depth {
+					self.zero_indirect(next);
+				}
+				unsafe {
+					ptr.write(next);
+				}
+				bcache::write(self.bdev, zone, self.indirect.get(), true);
+				fresh = true;
+			}
+			zone = next;
+		}
+		Some((zone, fresh))
+	}
+
+	fn finish(&mut self) {
+		self.flush();
+	}
 }
 
 // We have to start a process when reading from a file since the block
@@ -466,6 +784,18 @@ fn read_proc(args_addr: usize) {
 	set_running(args.pid);
 }
 
+/// We couldn't start a kernel process for pid's system call, which is
+/// waiting on it, so fail the call with -1.
+fn fail_waiting(pid: u16) {
+	unsafe {
+		let ptr = get_by_pid(pid);
+		if !ptr.is_null() {
+			(*(*ptr).frame).regs[Registers::A0 as usize] = -1isize as usize;
+		}
+	}
+	set_running(pid);
+}
+
 /// System calls will call process_read, which will spawn off a kernel process to read
 /// the requested data.
 pub fn process_read(pid: u16, dev: usize, node: u32, buffer: *mut u8, size: u32, offset: u32) {
@@ -476,9 +806,211 @@ pub fn process_read(pid: u16, dev: usize, node: u32, buffer: *mut u8, size: u32,
 	                      size,
 	                      offset,
 	                      node };
-	let boxed_args = Box::new(args);
+	let boxed_args = Box::into_raw(Box::new(args));
 	set_waiting(pid);
-	let _ = add_kernel_process_args(read_proc, Box::into_raw(boxed_args) as usize);
+	if add_kernel_process_args(read_proc, boxed_args as usize) == 0 {
+		unsafe {
+			drop(Box::from_raw(boxed_args));
+		}
+		fail_waiting(pid);
+	}
+}
+
+/// Read or write part of a file through a user buffer, one physically
+/// contiguous run at a time. The buffer has to be mapped already (see
+/// fault_in_user in syscall.rs), since we can't fault it in from here.
+/// Its pages are pinned while we block on the device, so they stay ours
+/// even if the process exits or unmaps them meanwhile.
+/// Returns None if the process is gone. This must be called from a process
+/// since it might block.
+pub unsafe fn user_rw(pid: u16, file: &OpenFile, vaddr: usize, len: usize, offset: u32, write: bool) -> Option<u32> {
+	// Translate and pin together, so nothing can free a page in between.
+	let buffer = without_interrupts(|| {
+		let proc = get_by_pid(pid);
+		if proc.is_null() {
+			return None;
+		}
+		if (*(*proc).frame).satp >> 60 == 0 {
+			return Some((alloc::vec![(vaddr, len)], Vec::new()));
+		}
+		let table = (*proc).mmu_table.as_ref().unwrap();
+		// Writing the file reads the buffer, and reading it writes.
+		let access = if write { EntryBits::Read.val() } else { EntryBits::Write.val() };
+		let mut runs = Vec::new();
+		user_runs(table, vaddr, len, access, |paddr, run| runs.push((paddr, run)));
+		let pins = pin(&runs);
+		Some((runs, pins))
+	});
+	let (runs, pins) = buffer?;
+	let done = runs_rw(file, &runs, offset, write);
+	unpin(pins);
+	Some(done)
+}
+
+/// user_rw() on a buffer that's already been translated into (physical
+/// address, length) runs. We stop at the first short run. Returns how
+/// many bytes we got through.
+pub unsafe fn runs_rw(file: &OpenFile, runs: &[(usize, usize)], offset: u32, write: bool) -> u32 {
+	let mut total = 0u32;
+	for &(paddr, run) in runs.iter() {
+		let done = if write {
+			MinixFileSystem::write(file.dev, file.inode, paddr as *const u8, run as u32, offset + total)
+		}
+		else {
+			// Get the inode for every run. The file might be growing under us.
+			match MinixFileSystem::cached_inode(file.dev, file.inode).or_else(|| MinixFileSystem::get_inode(file.dev, file.inode)) {
+				Some(inode) => MinixFileSystem::read(file.dev, &inode, paddr as *mut u8, run as u32, offset + total),
+				None => 0,
+			}
+		};
+		total += done;
+		if (done as usize) < run {
+			break;
+		}
+	}
+	total
+}
+
+struct WriteArgs {
+	pid:    u16,
+	fd:     u16,
+	buffer: usize,
+	size:   u32,
+	// None means write() at the descriptor's offset and move it along.
+	// Some is pwrite(), which leaves the descriptor alone.
+	offset: Option<u32>,
+}
+
+fn write_proc(args_addr: usize) {
+	let args = unsafe { Box::from_raw(args_addr as *mut WriteArgs) };
+	unsafe {
+		// Other harts may be changing the descriptors, so we only look at
+		// them with the kernel lock.
+		let file = without_interrupts(|| {
+			let ptr = get_by_pid(args.pid);
+			if ptr.is_null() {
+				return None;
+			}
+			Some((*ptr).owner().data.fdesc.get(&args.fd).cloned())
+		});
+		let file = match file {
+			None => return,
+			Some(Some(Descriptor::File(f))) => f,
+			Some(_) => {
+				fail_waiting(args.pid);
+				return;
+			}
+		};
+		let offset = args.offset.unwrap_or(file.offset);
+		let written = match user_rw(args.pid, &file, args.buffer, args.size as usize, offset, true) {
+			Some(w) => w,
+			None => return,
+		};
+		// We might have blocked for a while, so look the process up again.
+		let gone = without_interrupts(|| {
+			let ptr = get_by_pid(args.pid);
+			if ptr.is_null() {
+				return true;
+			}
+			if args.offset.is_none() {
+				if let Some(Descriptor::File(f)) = (*ptr).owner().data.fdesc.get_mut(&args.fd) {
+					f.offset = offset + written;
+				}
+			}
+			(*(*ptr).frame).regs[Registers::A0 as usize] = written as usize;
+			false
+		});
+		if gone {
+			return;
+		}
+	}
+	set_running(args.pid);
+}
+
+/// System calls will call process_write to write to a file. Like reads,
+/// this happens in a kernel process, which puts the data in the block
+/// cache and might have to wait on the block device while it does.
+pub fn process_write(pid: u16, fd: u16, buffer: usize, size: u32, offset: Option<u32>) {
+	let args = WriteArgs { pid,
+	                       fd,
+	                       buffer,
+	                       size,
+	                       offset };
+	let boxed_args = Box::into_raw(Box::new(args));
+	set_waiting(pid);
+	if add_kernel_process_args(write_proc, boxed_args as usize) == 0 {
+		unsafe {
+			drop(Box::from_raw(boxed_args));
+		}
+		fail_waiting(pid);
+	}
+}
+
+struct LookupArgs {
+	pid:  u16,
+	dev:  usize,
+	path: String,
+}
+
+fn lookup_proc(args_addr: usize) {
+	let args = unsafe { Box::from_raw(args_addr as *mut LookupArgs) };
+	// Whether or not it's there, the answer is cached now, which is all the
+	// caller needs.
+	let _ = MinixFileSystem::lookup(args.dev, &args.path);
+	set_running(args.pid);
+}
+
+/// open() and execv() call this when lookup_cached() can't answer. A kernel
+/// process does the lookup, filling the caches, and wakes pid back up. The
+/// system call should back up so that it runs again, and this time,
+/// lookup_cached() knows.
+pub fn process_lookup(pid: u16, dev: usize, path: String) {
+	let boxed_args = Box::into_raw(Box::new(LookupArgs { pid, dev, path }));
+	set_waiting(pid);
+	if add_kernel_process_args(lookup_proc, boxed_args as usize) == 0 {
+		// The system call just runs again, and we'll try again.
+		unsafe {
+			drop(Box::from_raw(boxed_args));
+		}
+		set_running(pid);
+	}
+}
+
+struct SyncArgs {
+	// Who's waiting on this, if anyone.
+	pid: Option<u16>,
+	dev: usize,
+}
+
+fn sync_proc(args_addr: usize) {
+	let args = unsafe { Box::from_raw(args_addr as *mut SyncArgs) };
+	let status = bcache::sync(args.dev);
+	if let Some(pid) = args.pid {
+		unsafe {
+			let ptr = get_by_pid(pid);
+			if !ptr.is_null() {
+				(*(*ptr).frame).regs[Registers::A0 as usize] = if status == 0 { 0 } else { -1isize as usize };
+			}
+		}
+		set_running(pid);
+	}
+}
+
+/// Write everything dirty on dev to the disk. If pid is given, it waits
+/// until that's done (fsync). Otherwise, it happens in the background.
+pub fn process_sync(pid: Option<u16>, dev: usize) {
+	if let Some(pid) = pid {
+		set_waiting(pid);
+	}
+	let boxed_args = Box::into_raw(Box::new(SyncArgs { pid, dev }));
+	if add_kernel_process_args(sync_proc, boxed_args as usize) == 0 {
+		unsafe {
+			drop(Box::from_raw(boxed_args));
+		}
+		if let Some(pid) = pid {
+			fail_waiting(pid);
+		}
+	}
 }
 
 /// Stats on a file. This generally mimics an inode
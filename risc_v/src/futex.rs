@@ -0,0 +1,59 @@
+// futex.rs
+// Fast user-space locking
+// A futex is a 32-bit word in a process' memory. User space takes and
+// gives back its locks on that word with atomics, and only makes a system
+// call when it has to wait or has somebody to wake. Waiters are keyed on
+// the page table and the virtual address, so threads that share an
+// address space meet on the same word.
+
+use crate::{cpu::without_interrupts, process::set_running};
+use alloc::collections::{BTreeMap, VecDeque};
+
+// The operations the futex system call (98) takes in A1.
+pub const FUTEX_WAIT: usize = 0;
+pub const FUTEX_WAKE: usize = 1;
+
+// (page table, virtual address) -> the PIDs waiting there, in the order
+// they came.
+static mut FUTEXES: Option<BTreeMap<(usize, usize), VecDeque<u16>>> = None;
+
+/// Put pid in line on the futex at uaddr. The caller has already checked
+/// the word under the kernel lock, so a wake() can't slip in between, and
+/// it's up to the caller to stop running pid.
+pub fn wait(space: usize, uaddr: usize, pid: u16) {
+	without_interrupts(|| unsafe {
+		FUTEXES.get_or_insert_with(BTreeMap::new)
+		       .entry((space, uaddr))
+		       .or_insert_with(VecDeque::new)
+		       .push_back(pid);
+	});
+}
+
+/// Wake up to n of the waiters on the futex at uaddr. This returns how many
+/// we woke.
+pub fn wake(space: usize, uaddr: usize, n: usize) -> usize {
+	without_interrupts(|| unsafe {
+		let futexes = match FUTEXES.as_mut() {
+			Some(f) => f,
+			None => return 0,
+		};
+		let mut woken = 0;
+		if let Some(waiters) = futexes.get_mut(&(space, uaddr)) {
+			while woken < n {
+				match waiters.pop_front() {
+					// Anyone who has died since doesn't count.
+					Some(pid) => {
+						if set_running(pid) {
+							woken += 1;
+						}
+					},
+					None => break,
+				}
+			}
+			if waiters.is_empty() {
+				futexes.remove(&(space, uaddr));
+			}
+		}
+		woken
+	})
+}
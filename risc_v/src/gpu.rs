@@ -4,11 +4,15 @@
 // 12 May 2020
 
 #![allow(dead_code)]
-use crate::{page::{zalloc, PAGE_SIZE},
+use crate::{cpu::{get_mtime, FREQ},
+            page::{zalloc, PAGE_SIZE},
 			kmem::{kmalloc, kfree},
+            process::set_running,
+            trace,
             virtio,
             virtio::{MmioOffsets, Queue, StatusField, VIRTIO_RING_SIZE, Descriptor, VIRTIO_DESC_F_WRITE, VIRTIO_DESC_F_NEXT}};
 use core::{mem::size_of, ptr::null_mut};
+use alloc::vec::Vec;
 // use alloc::boxed::Box;
 
 const F_VIRGL: u32 = 0;
@@ -66,6 +70,18 @@ struct CtrlHeader {
 	padding: u32
 }
 
+impl CtrlHeader {
+	fn new(ctrl_type: CtrlType) -> Self {
+		Self { ctrl_type, flags: 0, fence_id: 0, ctx_id: 0, padding: 0 }
+	}
+
+	/// A header that asks the device to tell us (through fence_id) when
+	/// this command and everything before it is done.
+	fn fenced(ctrl_type: CtrlType, fence_id: u64) -> Self {
+		Self { ctrl_type, flags: FLAG_FENCE, fence_id, ctx_id: 0, padding: 0 }
+	}
+}
+
 const MAX_SCANOUTS: usize = 16;
 #[repr(C)]
 #[derive(Clone, Copy)]
@@ -82,6 +98,47 @@ impl Rect {
 			x, y, width, height
 		}
 	}
+
+	pub fn is_empty(&self) -> bool {
+		self.width == 0 || self.height == 0
+	}
+
+	pub fn area(&self) -> u64 {
+		self.width as u64 * self.height as u64
+	}
+
+	/// Two rectangles "touch" if they overlap or share an edge. Either way,
+	/// we can merge them without picking up any pixels that aren't dirty
+	/// along the shared edge.
+	pub fn touches(&self, other: &Rect) -> bool {
+		self.x <= other.x + other.width
+		&& other.x <= self.x + self.width
+		&& self.y <= other.y + other.height
+		&& other.y <= self.y + self.height
+	}
+
+	/// The smallest rectangle that covers both self and other.
+	pub fn union(&self, other: &Rect) -> Rect {
+		let x1 = if self.x < other.x { self.x } else { other.x };
+		let y1 = if self.y < other.y { self.y } else { other.y };
+		let sx2 = self.x + self.width;
+		let ox2 = other.x + other.width;
+		let sy2 = self.y + self.height;
+		let oy2 = other.y + other.height;
+		let x2 = if sx2 > ox2 { sx2 } else { ox2 };
+		let y2 = if sy2 > oy2 { sy2 } else { oy2 };
+		Rect::new(x1, y1, x2 - x1, y2 - y1)
+	}
+
+	/// Clip this rectangle to a width x height screen.
+	pub fn clip(&self, width: u32, height: u32) -> Rect {
+		if self.x >= width || self.y >= height {
+			return Rect::new(0, 0, 0, 0);
+		}
+		let w = if self.width > width - self.x { width - self.x } else { self.width };
+		let h = if self.height > height - self.y { height - self.y } else { self.height };
+		Rect::new(self.x, self.y, w, h)
+	}
 }
 #[repr(C)]
 struct DisplayOne {
@@ -246,14 +303,74 @@ impl<RqT, RmT, RpT> Request3<RqT, RmT, RpT> {
 	}
 }
 
+// The damage ring is a single page shared with user space. The user
+// draws straight into the framebuffer and records what it touched by
+// pushing rectangles at head. When it calls present, the kernel consumes
+// everything from tail to head, merges the rectangles, and sends as few
+// transfers as it can with a single flush and a single notify.
+pub const DAMAGE_RING_SIZE: usize = (PAGE_SIZE - 16) / size_of::<Rect>();
+// Past this many disjoint rectangles, transfers cost more than the pixels
+// we'd save, so we start folding rectangles together.
+pub const MAX_DAMAGE_RECTS: usize = 8;
+
+#[repr(C)]
+pub struct DamageRing {
+	// Next slot the user will fill. Only the user writes this.
+	pub head: u32,
+	// Next slot the kernel will consume. Only the kernel writes this.
+	pub tail: u32,
+	// The user sets this when the ring is full. The kernel then treats the
+	// whole screen as dirty and clears the flag.
+	pub overflow: u32,
+	// The user sets this while rects[head] holds a rectangle it's still
+	// growing and hasn't published yet. We never look at it.
+	pub staged: u32,
+	pub rects: [Rect; DAMAGE_RING_SIZE],
+}
+
+// A process can also ask for a swapchain: SWAP_MAX_BUFFERS or fewer whole
+// frames of its own, each backing a resource of its own. It draws a frame
+// into one buffer while another is on the screen, and presents the finished
+// buffer with one transfer, a set scanout and a flush. The flush is fenced,
+// and once the device has finished it, it's done with the buffer, so the
+// process can draw into that one again. Presents are paced to one a frame,
+// since there is no vertical blank to wait for.
+pub const SWAP_MAX_BUFFERS: usize = 3;
+// The framebuffer is resource 1. The swapchain's buffers come after.
+const SWAP_RESOURCE: u32 = 2;
+// Where a process sees the swapchain, one buffer after another.
+pub const SWAP_VADDR: usize = 0x3400_0000;
+// The refresh rate we pretend to have
+pub const FRAME_RATE: u64 = 60;
+
 pub struct Device {
 	queue:        *mut Queue,
 	dev:          *mut u32,
 	idx:          u16,
 	ack_used_idx: u16,
 	framebuffer:  *mut Pixel,
+	damage:       *mut DamageRing,
+	// Damage from the kernel's side, like write() on /dev/fb. present()
+	// merges it with the ring.
+	pending:      [Rect; MAX_DAMAGE_RECTS],
+	pending_count: usize,
 	width:        u32,
 	height:       u32,
+	// The resource that's on the screen
+	scanout:      u32,
+	// The swapchain, if somebody asked for it. Buffer i starts
+	// i * swap_stride bytes into swap.
+	swap:         *mut Pixel,
+	swap_count:   usize,
+	swap_stride:  usize,
+	// The fence the next present gets, and the last one the device
+	// finished. Fences finish in order.
+	fence_next:   u64,
+	fence_done:   u64,
+	// (fence, PID) for everybody waiting on a fence
+	waiters:      Vec<(u64, u16)>,
+	// The mtime the next present can go out at
+	next_frame:   usize,
 }
 
 impl Device {
@@ -263,13 +380,27 @@ impl Device {
 		       idx:          0,
 			   ack_used_idx: 0, 
 			   framebuffer:  null_mut(),
+			   damage:       null_mut(),
+			   pending:      [Rect::new(0, 0, 0, 0); MAX_DAMAGE_RECTS],
+			   pending_count: 0,
 			   width: 640,
-			   height: 480
+			   height: 480,
+			   scanout: 1,
+			   swap: null_mut(),
+			   swap_count: 0,
+			   swap_stride: 0,
+			   fence_next: 1,
+			   fence_done: 0,
+			   waiters: Vec::new(),
+			   next_frame: 0,
 		}
 	}
 	pub fn get_framebuffer(&self) -> *mut Pixel {
 		self.framebuffer
 	}
+	pub fn get_damage(&self) -> *mut DamageRing {
+		self.damage
+	}
 	pub fn get_width(&self) -> u32 {
 		self.width
 	}
@@ -580,6 +711,8 @@ pub fn transfer(gdev: usize, x: u32, y: u32, width: u32, height: u32) {
 			(*dev.queue).avail.idx =
 				(*dev.queue).avail.idx.wrapping_add(1);
 		}
+		// A swapchain may have had the screen.
+		set_scanout(&mut dev, 1);
 		// Step 5: Flush
 		let rq = Request::new(ResourceFlush {
 			hdr: CtrlHeader {
@@ -625,6 +758,362 @@ pub fn transfer(gdev: usize, x: u32, y: u32, width: u32, height: u32) {
 	}
 }
 
+/// Put a request/response pair onto the control queue. This does NOT
+/// notify the device, so several of these can go out with one notify.
+fn queue_request<RqT>(dev: &mut Device, rq: *mut Request<RqT, CtrlHeader>) {
+	let desc_rq = Descriptor {
+		addr: unsafe { &(*rq).request as *const RqT as u64 },
+		len: size_of::<RqT>() as u32,
+		flags: VIRTIO_DESC_F_NEXT,
+		next: (dev.idx + 1) % VIRTIO_RING_SIZE as u16,
+	};
+	let desc_resp = Descriptor {
+		addr: unsafe { &(*rq).response as *const CtrlHeader as u64 },
+		len: size_of::<CtrlHeader>() as u32,
+		flags: VIRTIO_DESC_F_WRITE,
+		next: 0,
+	};
+	unsafe {
+		let head = dev.idx;
+		(*dev.queue).desc[dev.idx as usize] = desc_rq;
+		dev.idx = (dev.idx + 1) % VIRTIO_RING_SIZE as u16;
+		(*dev.queue).desc[dev.idx as usize] = desc_resp;
+		dev.idx = (dev.idx + 1) % VIRTIO_RING_SIZE as u16;
+		(*dev.queue).avail.ring[(*dev.queue).avail.idx as usize % VIRTIO_RING_SIZE] = head;
+		(*dev.queue).avail.idx =
+			(*dev.queue).avail.idx.wrapping_add(1);
+	}
+}
+
+/// The same for commands with an array after them, like attach backing.
+fn queue_request3<RqT, RmT>(dev: &mut Device, rq: *mut Request3<RqT, RmT, CtrlHeader>) {
+	let desc_rq = Descriptor {
+		addr: unsafe { &(*rq).request as *const RqT as u64 },
+		len: size_of::<RqT>() as u32,
+		flags: VIRTIO_DESC_F_NEXT,
+		next: (dev.idx + 1) % VIRTIO_RING_SIZE as u16,
+	};
+	let desc_mem = Descriptor {
+		addr: unsafe { &(*rq).mementries as *const RmT as u64 },
+		len: size_of::<RmT>() as u32,
+		flags: VIRTIO_DESC_F_NEXT,
+		next: (dev.idx + 2) % VIRTIO_RING_SIZE as u16,
+	};
+	let desc_resp = Descriptor {
+		addr: unsafe { &(*rq).response as *const CtrlHeader as u64 },
+		len: size_of::<CtrlHeader>() as u32,
+		flags: VIRTIO_DESC_F_WRITE,
+		next: 0,
+	};
+	unsafe {
+		let head = dev.idx;
+		(*dev.queue).desc[dev.idx as usize] = desc_rq;
+		dev.idx = (dev.idx + 1) % VIRTIO_RING_SIZE as u16;
+		(*dev.queue).desc[dev.idx as usize] = desc_mem;
+		dev.idx = (dev.idx + 1) % VIRTIO_RING_SIZE as u16;
+		(*dev.queue).desc[dev.idx as usize] = desc_resp;
+		dev.idx = (dev.idx + 1) % VIRTIO_RING_SIZE as u16;
+		(*dev.queue).avail.ring[(*dev.queue).avail.idx as usize % VIRTIO_RING_SIZE] = head;
+		(*dev.queue).avail.idx =
+			(*dev.queue).avail.idx.wrapping_add(1);
+	}
+}
+
+/// Put resource_id on the screen, if it isn't already. This is queued
+/// like everything else.
+fn set_scanout(dev: &mut Device, resource_id: u32) {
+	if dev.scanout == resource_id {
+		return;
+	}
+	let rq = Request::new(SetScanout {
+		hdr: CtrlHeader::new(CtrlType::CmdSetScanout),
+		r: Rect::new(0, 0, dev.width, dev.height),
+		scanout_id: 0,
+		resource_id,
+	});
+	queue_request(dev, rq);
+	dev.scanout = resource_id;
+}
+
+fn notify(dev: &mut Device) {
+	unsafe {
+		dev.dev
+		.add(MmioOffsets::QueueNotify.scale32())
+		.write_volatile(0);
+	}
+}
+
+/// Add r to the list of merged damage rectangles. Anything r touches gets
+/// folded into it, and if that makes the merged rectangle touch another
+/// one, we keep going. If we're out of room, r is merged into whichever
+/// rectangle grows the least.
+fn add_damage(list: &mut [Rect; MAX_DAMAGE_RECTS], count: &mut usize, r: Rect) {
+	let mut r = r;
+	let mut i = 0;
+	while i < *count {
+		if list[i].touches(&r) {
+			r = list[i].union(&r);
+			// Take it out of the list and start over, since the bigger r
+			// might now touch something we already looked at.
+			*count -= 1;
+			list[i] = list[*count];
+			i = 0;
+		}
+		else {
+			i += 1;
+		}
+	}
+	if *count < MAX_DAMAGE_RECTS {
+		list[*count] = r;
+		*count += 1;
+	}
+	else {
+		let mut best = 0;
+		let mut best_growth = u64::max_value();
+		for i in 0..*count {
+			let growth = list[i].union(&r).area() - list[i].area();
+			if growth < best_growth {
+				best = i;
+				best_growth = growth;
+			}
+		}
+		let merged = list[best].union(&r);
+		*count -= 1;
+		list[best] = list[*count];
+		add_damage(list, count, merged);
+	}
+}
+
+/// Drain the device's damage ring and push everything the user drew since
+/// the last present to the host. We send one transfer per merged rectangle,
+/// but only one flush (of the bounding rectangle) and one notify.
+pub fn present(gdev: usize) {
+	if let Some(mut dev) = unsafe { GPU_DEVICES[gdev-1].take() } {
+		let mut list = dev.pending;
+		let mut count = dev.pending_count;
+		dev.pending_count = 0;
+		unsafe {
+			let ring = dev.damage.as_mut().unwrap();
+			if ring.overflow != 0 {
+				// The user lost track, so redraw everything.
+				add_damage(&mut list, &mut count, Rect::new(0, 0, dev.width, dev.height));
+				ring.overflow = 0;
+			}
+			// The user owns head, so only read it once.
+			let head = (&ring.head as *const u32).read_volatile() as usize % DAMAGE_RING_SIZE;
+			let mut tail = ring.tail as usize % DAMAGE_RING_SIZE;
+			while tail != head {
+				let r = ring.rects[tail].clip(dev.width, dev.height);
+				if !r.is_empty() {
+					add_damage(&mut list, &mut count, r);
+				}
+				tail = (tail + 1) % DAMAGE_RING_SIZE;
+			}
+			(&mut ring.tail as *mut u32).write_volatile(tail as u32);
+		}
+		if count > 0 {
+			let mut bounds = list[0];
+			for i in 0..count {
+				let r = list[i];
+				bounds = bounds.union(&r);
+				let rq = Request::new(TransferToHost2d {
+					hdr: CtrlHeader {
+						ctrl_type: CtrlType::CmdTransferToHost2d,
+						flags: 0,
+						fence_id: 0,
+						ctx_id: 0,
+						padding: 0,
+					},
+					r,
+					// The offset is where in the backing store this rectangle
+					// starts.
+					offset: (r.y as u64 * dev.width as u64 + r.x as u64) * size_of::<Pixel>() as u64,
+					resource_id: 1,
+					padding: 0,
+				});
+				queue_request(&mut dev, rq);
+			}
+			set_scanout(&mut dev, 1);
+			let rq = Request::new(ResourceFlush {
+				hdr: CtrlHeader {
+					ctrl_type: CtrlType::CmdResourceFlush,
+					flags: 0,
+					fence_id: 0,
+					ctx_id: 0,
+					padding: 0,
+				},
+				r: bounds,
+				resource_id: 1,
+				padding: 0,
+			});
+			queue_request(&mut dev, rq);
+			unsafe {
+				dev.dev
+				.add(MmioOffsets::QueueNotify.scale32())
+				.write_volatile(0);
+			}
+		}
+		unsafe {
+			GPU_DEVICES[gdev-1].replace(dev);
+		}
+	}
+}
+
+/// Copy into the framebuffer at a byte offset, which is what write() on
+/// /dev/fb does, and then present the rows that changed. copy gets where in
+/// the framebuffer to start and how many bytes are left from there, and
+/// returns how many it copied. We return that too.
+pub fn write_framebuffer<F: FnOnce(*mut u8, usize) -> usize>(gdev: usize, offset: usize, copy: F) -> usize {
+	let copied = if let Some(mut dev) = unsafe { GPU_DEVICES[gdev-1].take() } {
+		let pitch = dev.width as usize * size_of::<Pixel>();
+		let fb_bytes = pitch * dev.height as usize;
+		let copied = if offset < fb_bytes {
+			copy(unsafe { (dev.framebuffer as *mut u8).add(offset) }, fb_bytes - offset)
+		}
+		else {
+			0
+		};
+		if copied > 0 {
+			// Transfers are by rectangle, so we send the whole rows. That's
+			// one rectangle no matter how many rows the write covers.
+			let first = offset / pitch;
+			let last = (offset + copied - 1) / pitch;
+			let r = Rect::new(0, first as u32, dev.width, (last - first + 1) as u32);
+			add_damage(&mut dev.pending, &mut dev.pending_count, r);
+		}
+		unsafe {
+			GPU_DEVICES[gdev-1].replace(dev);
+		}
+		copied
+	}
+	else {
+		0
+	};
+	if copied > 0 {
+		present(gdev);
+	}
+	copied
+}
+
+/// Give the device a swapchain of count buffers, or up to
+/// SWAP_MAX_BUFFERS. A device only ever has one, so if it already has one,
+/// we hand that back. This gives back (first buffer, how many, bytes from
+/// one buffer to the next). Each buffer starts on a page so that they can
+/// be mapped into a process.
+pub fn swapchain(gdev: usize, count: usize) -> Option<(*mut Pixel, usize, usize)> {
+	let mut dev = unsafe { GPU_DEVICES[gdev-1].take() }?;
+	if dev.swap.is_null() && count > 0 {
+		let count = if count > SWAP_MAX_BUFFERS { SWAP_MAX_BUFFERS } else { count };
+		let bytes = dev.width as usize * dev.height as usize * size_of::<Pixel>();
+		let stride = (bytes + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+		let swap = zalloc(count * stride / PAGE_SIZE) as *mut Pixel;
+		if !swap.is_null() {
+			for i in 0..count {
+				let resource_id = SWAP_RESOURCE + i as u32;
+				let rq = Request::new(ResourceCreate2d {
+					hdr: CtrlHeader::new(CtrlType::CmdResourceCreate2d),
+					resource_id,
+					format: Formats::R8G8B8A8Unorm,
+					width: dev.width,
+					height: dev.height,
+				});
+				queue_request(&mut dev, rq);
+				let rq = Request3::new(AttachBacking {
+					hdr: CtrlHeader::new(CtrlType::CmdResourceAttachBacking),
+					resource_id,
+					nr_entries: 1,
+				},
+				MemEntry {
+					addr: swap as u64 + (i * stride) as u64,
+					length: bytes as u32,
+					padding: 0,
+				});
+				queue_request3(&mut dev, rq);
+			}
+			notify(&mut dev);
+			dev.swap = swap;
+			dev.swap_count = count;
+			dev.swap_stride = stride;
+		}
+	}
+	let ret = if dev.swap.is_null() { None } else { Some((dev.swap, dev.swap_count, dev.swap_stride)) };
+	unsafe {
+		GPU_DEVICES[gdev-1].replace(dev);
+	}
+	ret
+}
+
+/// How many mtime ticks until the next present can go out, which is 0 if
+/// it can go now.
+pub fn frame_delay(gdev: usize) -> usize {
+	match unsafe { GPU_DEVICES[gdev-1].as_ref() } {
+		Some(dev) => dev.next_frame.saturating_sub(get_mtime()),
+		None => 0,
+	}
+}
+
+/// Put swapchain buffer index on the screen: transfer all of it, make it
+/// the scanout, and flush. This gives back the fence the flush carries.
+/// Once that fence is done, the buffer can be drawn into again.
+pub fn present_buffer(gdev: usize, index: usize) -> Option<u64> {
+	let mut dev = unsafe { GPU_DEVICES[gdev-1].take() }?;
+	let ret = if index < dev.swap_count {
+		let resource_id = SWAP_RESOURCE + index as u32;
+		let screen = Rect::new(0, 0, dev.width, dev.height);
+		let rq = Request::new(TransferToHost2d {
+			hdr: CtrlHeader::new(CtrlType::CmdTransferToHost2d),
+			r: screen,
+			offset: 0,
+			resource_id,
+			padding: 0,
+		});
+		queue_request(&mut dev, rq);
+		set_scanout(&mut dev, resource_id);
+		let fence = dev.fence_next;
+		dev.fence_next += 1;
+		let rq = Request::new(ResourceFlush {
+			hdr: CtrlHeader::fenced(CtrlType::CmdResourceFlush, fence),
+			r: screen,
+			resource_id,
+			padding: 0,
+		});
+		queue_request(&mut dev, rq);
+		notify(&mut dev);
+		// The next frame is a frame after this one was due, unless we're
+		// already more than a frame late, in which case it's a frame from
+		// now.
+		let now = get_mtime();
+		let period = (FREQ / FRAME_RATE) as usize;
+		dev.next_frame = if dev.next_frame + period < now { now } else { dev.next_frame } + period;
+		Some(fence)
+	}
+	else {
+		None
+	};
+	unsafe {
+		GPU_DEVICES[gdev-1].replace(dev);
+	}
+	ret
+}
+
+/// Whether the device has finished fence. If it hasn't, pid is woken up
+/// when it does.
+pub fn fence_wait(gdev: usize, fence: u64, pid: u16) -> bool {
+	match unsafe { GPU_DEVICES[gdev-1].as_mut() } {
+		Some(dev) => {
+			if fence <= dev.fence_done || fence >= dev.fence_next {
+				// Done, or a fence that we never handed out.
+				true
+			}
+			else {
+				dev.waiters.push((fence, pid));
+				false
+			}
+		},
+		None => true,
+	}
+}
+
 pub fn setup_gpu_device(ptr: *mut u32) -> bool {
 	unsafe {
 		// We can get the index of the device based on its address.
@@ -719,8 +1208,19 @@ pub fn setup_gpu_device(ptr: *mut u32) -> bool {
 			idx: 0,
 			ack_used_idx: 0,
 			framebuffer: page_alloc,
+			damage: zalloc(1) as *mut DamageRing,
+			pending: [Rect::new(0, 0, 0, 0); MAX_DAMAGE_RECTS],
+			pending_count: 0,
 			width: 640,
 			height: 480,
+			scanout: 1,
+			swap: null_mut(),
+			swap_count: 0,
+			swap_stride: 0,
+			fence_next: 1,
+			fence_done: 0,
+			waiters: Vec::new(),
+			next_frame: 0,
 		};
 
 		GPU_DEVICES[idx] = Some(dev);
@@ -739,12 +1239,29 @@ pub fn pending(dev: &mut Device) {
 				[dev.ack_used_idx as usize % VIRTIO_RING_SIZE];
 			// println!("Ack {}, elem {}, len {}", dev.ack_used_idx, elem.id, elem.len);
 			let ref desc = queue.desc[elem.id as usize];
+			// Every request starts with its header, which says whether it
+			// carried a fence.
+			let hdr = desc.addr as *const CtrlHeader;
+			if (*hdr).flags & FLAG_FENCE != 0 && (*hdr).fence_id > dev.fence_done {
+				dev.fence_done = (*hdr).fence_id;
+			}
 			// Requests stay resident on the heap until this
 			// function, so we can recapture the address here
 			kfree(desc.addr as *mut u8);
 			dev.ack_used_idx = dev.ack_used_idx.wrapping_add(1);
+			trace::record(trace::EV_GPU_DONE, 0, elem.id);
 
 		}
+		let done = dev.fence_done;
+		dev.waiters.retain(|&(fence, pid)| {
+			if fence <= done {
+				set_running(pid);
+				false
+			}
+			else {
+				true
+			}
+		});
 	}
 }
 
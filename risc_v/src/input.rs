@@ -5,7 +5,9 @@
 use crate::virtio::{Queue, MmioOffsets, MMIO_VIRTIO_START, StatusField, VIRTIO_RING_SIZE, Descriptor, VIRTIO_DESC_F_WRITE, VIRTIO_F_RING_EVENT_IDX};
 use crate::kmem::kmalloc;
 use crate::page::{PAGE_SIZE, zalloc};
+use crate::process::{get_by_pid, set_running, set_waiting};
 use core::mem::size_of;
+use core::sync::atomic::{fence, Ordering};
 use alloc::collections::VecDeque;
 
 pub static mut ABS_EVENTS: Option<VecDeque<Event>> = None;
@@ -15,6 +17,57 @@ pub static mut KEY_EVENTS: Option<VecDeque<Event>> = None;
 
 const EVENT_BUFFER_ELEMENTS: usize = 64;
 
+// How many events the 1002/1004 queues keep. Readers of the event ring
+// never drain them, so once they're full, we drop the oldest event.
+const ABS_EVENTS_MAX: usize = 100;
+const KEY_EVENTS_MAX: usize = 10;
+
+// Every process that asks for one gets its own event ring, which is a
+// single page shared between us and the process. The interrupt handler
+// writes events straight into it, so the process doesn't need a system
+// call per event, and it doesn't have to sleep-poll either: it calls
+// wait (1009), and we wake it up when the next batch arrives.
+pub const EVENT_RING_VADDR: usize = 0x3100_0000;
+// head and tail are free running u32s, so the slot is head % size, and
+// that only stays in order across the wrap if the size divides 2^32. 256
+// is the most that fits in the page after the header.
+pub const EVENT_RING_SIZE: usize = 256;
+
+/// The layout of the shared page. We only ever write head and dropped,
+/// the process only ever writes tail. Both are free running, so the
+/// number of waiting events is head - tail.
+#[repr(C)]
+pub struct EventRing {
+	pub head:    u32,
+	pub tail:    u32,
+	pub dropped: u32,
+	padding:     u32,
+	pub events:  [Event; EVENT_RING_SIZE],
+}
+
+impl EventRing {
+	pub fn pending(&self) -> u32 {
+		unsafe {
+			let head = (&self.head as *const u32).read_volatile();
+			let tail = (&self.tail as *const u32).read_volatile();
+			head.wrapping_sub(tail)
+		}
+	}
+}
+
+/// A process attached to the event rings. Like the block driver's
+/// watcher, we keep the PID and not a pointer to the process, since it
+/// can die at any time. The ring page itself belongs to the process (it's
+/// in its pages list), so it goes away with it, and delete_process()
+/// takes the listener out with detach() before the PID can be reused.
+struct EventListener {
+	pid:     u16,
+	ring:    *mut EventRing,
+	waiting: bool,
+}
+
+static mut EVENT_LISTENERS: Option<VecDeque<EventListener>> = None;
+
 pub enum InputType {
 	None,
 	Abs(u32, u32, u32, u32, u32),
@@ -230,10 +283,15 @@ pub fn setup_input_device(ptr: *mut u32) -> bool {
 			repopulate_event(&mut dev, i);
 		}
 		INPUT_DEVICES[idx] = Some(dev);
-		ABS_EVENTS = Some(VecDeque::with_capacity(100));
+		ABS_EVENTS = Some(VecDeque::with_capacity(ABS_EVENTS_MAX));
 		// ABS_OBSERVERS = Some(VecDeque::new());
-		KEY_EVENTS = Some(VecDeque::with_capacity(10));
+		KEY_EVENTS = Some(VecDeque::with_capacity(KEY_EVENTS_MAX));
 		// KEY_OBSERVERS = Some(VecDeque::new());
+		// The keyboard and the tablet are separate devices, but they
+		// share one set of listeners.
+		if EVENT_LISTENERS.is_none() {
+			EVENT_LISTENERS = Some(VecDeque::new());
+		}
 
 		true
 	}
@@ -268,14 +326,21 @@ fn pending(dev: &mut Device) {
 			// println!("Type = {:x}, Code = {:x}, Value = {:x}", event.event_type, event.code, event.value);
 			repopulate_event(dev, elem.id as usize);
 			dev.event_ack_used_idx = dev.event_ack_used_idx.wrapping_add(1);
+			deliver(event);
 			match event.event_type {
 				EventType::Abs => {
 					let mut ev = ABS_EVENTS.take().unwrap();
+					if ev.len() >= ABS_EVENTS_MAX {
+						ev.pop_front();
+					}
 					ev.push_back(*event);
 					ABS_EVENTS.replace(ev);	
 				},
 				EventType::Key => {
 					let mut ev = KEY_EVENTS.take().unwrap();
+					if ev.len() >= KEY_EVENTS_MAX {
+						ev.pop_front();
+					}
 					ev.push_back(*event);
 					KEY_EVENTS.replace(ev);	
 				},
@@ -284,6 +349,9 @@ fn pending(dev: &mut Device) {
 				}
 			}
 		}
+		// Wake up the listeners once for the whole batch rather than
+		// once per event.
+		wake_listeners();
 		// Next, the status queue
 		let ref queue = *dev.status_queue;
 		while dev.status_ack_used_idx != queue.used.idx {
@@ -297,6 +365,115 @@ fn pending(dev: &mut Device) {
 	}
 }
 
+/// Copy an event into every listener's ring. If a ring is full, the
+/// process isn't keeping up, so we count the event as dropped instead
+/// of overwriting ones it hasn't seen yet.
+unsafe fn deliver(event: &Event) {
+	if let Some(listeners) = EVENT_LISTENERS.take() {
+		for l in listeners.iter() {
+			let ring = &mut *l.ring;
+			if ring.pending() as usize >= EVENT_RING_SIZE {
+				ring.dropped = ring.dropped.wrapping_add(1);
+				continue;
+			}
+			let head = ring.head;
+			ring.events[head as usize % EVENT_RING_SIZE] = *event;
+			// The event has to be visible before the new head is.
+			fence(Ordering::Release);
+			(&mut ring.head as *mut u32).write_volatile(head.wrapping_add(1));
+		}
+		EVENT_LISTENERS.replace(listeners);
+	}
+}
+
+/// Wake up any process waiting in wait_events() that now has something
+/// to read. Its wait system call returns the number of events ready.
+unsafe fn wake_listeners() {
+	if let Some(mut listeners) = EVENT_LISTENERS.take() {
+		for l in listeners.iter_mut() {
+			let ready = (*l.ring).pending();
+			if l.waiting && ready > 0 {
+				let proc = get_by_pid(l.pid);
+				if !proc.is_null() {
+					(*(*proc).frame).regs[10] = ready as usize;
+					set_running(l.pid);
+				}
+				l.waiting = false;
+			}
+		}
+		EVENT_LISTENERS.replace(listeners);
+	}
+}
+
+/// Get the event ring for this process, creating it if this is the first
+/// time. The returned pointer is the physical address of the page; the
+/// caller maps it (or doesn't, if the process has no MMU).
+pub unsafe fn attach(pid: u16) -> *mut EventRing {
+	let proc = get_by_pid(pid);
+	if proc.is_null() {
+		return core::ptr::null_mut();
+	}
+	if let Some(mut listeners) = EVENT_LISTENERS.take() {
+		let mut ring = core::ptr::null_mut();
+		for l in listeners.iter() {
+			if l.pid == pid {
+				ring = l.ring;
+				break;
+			}
+		}
+		if ring.is_null() {
+			ring = zalloc(1) as *mut EventRing;
+			// The process owns the page, so it'll be freed when the
+			// process is dropped.
+			(*proc).owner().data.pages.push_back(ring as usize);
+			listeners.push_back(EventListener { pid,
+			                                    ring,
+			                                    waiting: false });
+		}
+		EVENT_LISTENERS.replace(listeners);
+		ring
+	}
+	else {
+		// No input devices, so there will never be any events.
+		core::ptr::null_mut()
+	}
+}
+
+/// Stop delivering events to pid, which is exiting. Its ring page is about
+/// to be freed with the rest of its pages.
+pub unsafe fn detach(pid: u16) {
+	if let Some(listeners) = EVENT_LISTENERS.as_mut() {
+		listeners.retain(|l| l.pid != pid);
+	}
+}
+
+/// Block until this process' ring has at least one event. If there are
+/// already events, this returns how many without blocking. Otherwise, the
+/// process is put to waiting and this returns 0. The real count is put
+/// into the process' A0 when it's woken up by wake_listeners().
+/// If the process never attached, this returns -1.
+pub unsafe fn wait_events(pid: u16) -> isize {
+	let mut ret = -1;
+	if let Some(mut listeners) = EVENT_LISTENERS.take() {
+		for l in listeners.iter_mut() {
+			if l.pid == pid {
+				let ready = (*l.ring).pending();
+				if ready > 0 {
+					ret = ready as isize;
+				}
+				else {
+					l.waiting = true;
+					set_waiting(pid);
+					ret = 0;
+				}
+				break;
+			}
+		}
+		EVENT_LISTENERS.replace(listeners);
+	}
+	ret
+}
+
 pub fn handle_interrupt(idx: usize) {
 	unsafe {
 		if let Some(bdev) = INPUT_DEVICES[idx].as_mut() {
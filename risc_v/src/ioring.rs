@@ -0,0 +1,474 @@
+// ioring.rs
+// Asynchronous submission and completion rings
+// A process that sets up a ring (syscall 1020) shares two pages with us:
+// a submission queue it fills in and a completion queue we fill in. One
+// io_enter (syscall 1021) hands us every submission in the queue, and can
+// wait for completions. Block requests go straight to the block driver
+// and post their completion from the interrupt. File requests need the
+// file system, which blocks, so they are run one after another by a
+// single kernel process per ring, instead of one per request.
+//
+// Every buffer is translated when it's submitted, and we hold a share of
+// the pages behind it (see page::share) until it completes, so that
+// nothing the device or the worker writes into can be freed under it. A
+// process with requests in flight isn't deleted until the last of them
+// completes.
+
+use crate::{block,
+            block::{Completion, Segment, MAX_SEGMENTS},
+            cpu::without_interrupts,
+            fs::{self, OpenFile},
+            page::{map, pin, unpin, user_runs, zalloc, EntryBits, PAGE_SIZE},
+            process::{add_kernel_process_args, delete_process, get_by_pid, set_running, set_waiting, Descriptor, ProcessState}};
+use alloc::{collections::{BTreeMap, VecDeque}, vec::Vec};
+use core::sync::atomic::{fence, Ordering};
+
+// These must match startlib/ioring.h.
+pub const IORING_VADDR: usize = 0x3300_0000;
+pub const IORING_PAGES: usize = 2;
+pub const SQ_ENTRIES: usize = 64;
+pub const CQ_ENTRIES: usize = 128;
+
+pub const OP_NOP: u8 = 0;
+pub const OP_BLOCK_READ: u8 = 1;
+pub const OP_BLOCK_WRITE: u8 = 2;
+pub const OP_FILE_READ: u8 = 3;
+pub const OP_FILE_WRITE: u8 = 4;
+
+// Results are a byte count or a negative errno, like the system calls.
+pub const EBADF: i64 = 9;
+pub const EIO: i64 = 5;
+pub const EFAULT: i64 = 14;
+pub const EINVAL: i64 = 22;
+pub const ENOSYS: i64 = 38;
+pub const ECANCELED: i64 = 125;
+
+/// One submission. For block ops, fd is the block device and offset is in
+/// bytes, and both the buffer and the length must be multiples of 512.
+#[repr(C)]
+#[derive(Copy, Clone)]
+pub struct Sqe {
+	pub op:        u8,
+	pub pad:       [u8; 3],
+	pub fd:        u32,
+	pub addr:      u64,
+	pub len:       u32,
+	pub pad1:      u32,
+	pub offset:    u64,
+	pub user_data: u64,
+}
+
+#[repr(C)]
+#[derive(Copy, Clone)]
+pub struct Cqe {
+	pub user_data: u64,
+	pub res:       i64,
+}
+
+/// The shared pages. The process owns sq_tail and cq_head, we own
+/// sq_head and cq_tail. They only ever go up and wrap around.
+#[repr(C)]
+pub struct Ring {
+	pub sq_head:     u32,
+	pub sq_tail:     u32,
+	pub cq_head:     u32,
+	pub cq_tail:     u32,
+	// Completions we couldn't post because the queue was full
+	pub cq_overflow: u32,
+	pub pad:         [u32; 3],
+	pub sqes:        [Sqe; SQ_ENTRIES],
+	pub cqes:        [Cqe; CQ_ENTRIES],
+}
+
+struct FileOp {
+	write:     bool,
+	file:      OpenFile,
+	// The buffer, as (physical address, length) runs
+	runs:      Vec<(usize, usize)>,
+	offset:    u32,
+	user_data: u64,
+	tag:       u64,
+}
+
+struct IoContext {
+	ring:     *mut Ring,
+	// Submissions that haven't completed yet
+	inflight: usize,
+	file_ops: VecDeque<FileOp>,
+	// Is a kernel process working through file_ops?
+	worker:   bool,
+	// If the process is waiting in io_enter, how many completions it
+	// wants to see before it wakes up.
+	wait_for: usize,
+	// The pages each submission in flight holds, by its tag
+	pins:     BTreeMap<u64, Vec<usize>>,
+	next_tag: u64,
+}
+
+static mut IO_CONTEXTS: Option<BTreeMap<u16, IoContext>> = None;
+
+fn ready(ring: &Ring) -> usize {
+	unsafe { (&ring.cq_tail as *const u32).read_volatile().wrapping_sub((&ring.cq_head as *const u32).read_volatile()) as usize }
+}
+
+unsafe fn post(ring: &mut Ring, user_data: u64, res: i64) {
+	if ready(ring) >= CQ_ENTRIES {
+		ring.cq_overflow = ring.cq_overflow.wrapping_add(1);
+		return;
+	}
+	let tail = ring.cq_tail;
+	ring.cqes[tail as usize % CQ_ENTRIES] = Cqe { user_data, res };
+	// The entry has to be visible before the new tail is.
+	fence(Ordering::Release);
+	(&mut ring.cq_tail as *mut u32).write_volatile(tail.wrapping_add(1));
+}
+
+/// Wake up the owner if it's waiting and has what it asked for, or if
+/// there's nothing left that could complete.
+unsafe fn maybe_wake(pid: u16, ctx: &mut IoContext) {
+	if ctx.wait_for == 0 {
+		return;
+	}
+	let ready = ready(&*ctx.ring);
+	if ready >= ctx.wait_for || ctx.inflight == 0 {
+		ctx.wait_for = 0;
+		let proc = get_by_pid(pid);
+		if !proc.is_null() {
+			(*(*proc).frame).regs[10] = ready;
+			set_running(pid);
+		}
+	}
+}
+
+unsafe fn is_dead(pid: u16) -> bool {
+	let proc = get_by_pid(pid);
+	proc.is_null() || match (*proc).state {
+		ProcessState::Dead => true,
+		_ => false,
+	}
+}
+
+/// Post the completion of submission tag to pid's ring. This is called
+/// from the block interrupt, so it doesn't take a lock. If this was the
+/// last thing a dead process was waiting on, we finish deleting it.
+pub unsafe fn complete(pid: u16, tag: u64, user_data: u64, res: i64) {
+	let mut reap = false;
+	if let Some(mut contexts) = IO_CONTEXTS.take() {
+		if let Some(ctx) = contexts.get_mut(&pid) {
+			if let Some(pins) = ctx.pins.remove(&tag) {
+				unpin(pins);
+			}
+			if ctx.inflight > 0 {
+				ctx.inflight -= 1;
+			}
+			if is_dead(pid) {
+				reap = ctx.inflight == 0;
+			}
+			else {
+				post(&mut *ctx.ring, user_data, res);
+				maybe_wake(pid, ctx);
+			}
+		}
+		IO_CONTEXTS.replace(contexts);
+	}
+	if reap {
+		delete_process(pid);
+	}
+}
+
+/// pid is being deleted. Drop the file ops that haven't started, and
+/// return whether anything is still in flight, in which case
+/// delete_process() has to wait for complete() to call it again.
+pub unsafe fn cancel(pid: u16) -> bool {
+	let mut busy = false;
+	if let Some(mut contexts) = IO_CONTEXTS.take() {
+		if let Some(ctx) = contexts.get_mut(&pid) {
+			while let Some(op) = ctx.file_ops.pop_front() {
+				if let Some(pins) = ctx.pins.remove(&op.tag) {
+					unpin(pins);
+				}
+				ctx.inflight -= 1;
+			}
+			busy = ctx.inflight > 0;
+		}
+		IO_CONTEXTS.replace(contexts);
+	}
+	busy
+}
+
+/// Forget pid's ring. Its pages go with the process, and a new process
+/// that gets the PID starts without one.
+pub unsafe fn remove(pid: u16) {
+	if let Some(mut contexts) = IO_CONTEXTS.take() {
+		if let Some(ctx) = contexts.remove(&pid) {
+			for (_, pins) in ctx.pins {
+				unpin(pins);
+			}
+		}
+		IO_CONTEXTS.replace(contexts);
+	}
+}
+
+/// Whether pid has submissions that haven't completed.
+pub unsafe fn in_flight(pid: u16) -> bool {
+	match IO_CONTEXTS.as_ref() {
+		Some(contexts) => contexts.get(&pid).map_or(false, |ctx| ctx.inflight > 0),
+		None => false,
+	}
+}
+
+/// Give pid a ring, or return the one it already has. The ring pages
+/// belong to the process and are freed with it. Returns the address the
+/// process should use, or 0 if it doesn't exist.
+pub unsafe fn setup(pid: u16) -> usize {
+	let proc = get_by_pid(pid);
+	if proc.is_null() {
+		return 0;
+	}
+	if IO_CONTEXTS.is_none() {
+		IO_CONTEXTS = Some(BTreeMap::new());
+	}
+	let mut contexts = IO_CONTEXTS.take().unwrap();
+	let ring = match contexts.get(&pid) {
+		Some(ctx) => ctx.ring,
+		None => {
+			let ring = zalloc(IORING_PAGES) as *mut Ring;
+			(*proc).owner().data.pages.push_back(ring as usize);
+			contexts.insert(pid,
+			                IoContext { ring,
+			                            inflight: 0,
+			                            file_ops: VecDeque::new(),
+			                            worker: false,
+			                            wait_for: 0,
+			                            pins: BTreeMap::new(),
+			                            next_tag: 0 });
+			ring
+		},
+	};
+	IO_CONTEXTS.replace(contexts);
+	if (*(*proc).frame).satp >> 60 != 0 {
+		let table = (*proc).mmu_table.as_mut().unwrap();
+		for i in 0..IORING_PAGES {
+			map(table, IORING_VADDR + i * PAGE_SIZE, ring as usize + i * PAGE_SIZE, EntryBits::UserReadWrite.val(), 0);
+		}
+		IORING_VADDR
+	}
+	else {
+		ring as usize
+	}
+}
+
+/// The (physical address, length) runs behind a user's virtual buffer,
+/// which we write into if written is set. Returns EFAULT if part of it
+/// isn't mapped for that.
+unsafe fn buffer_runs(pid: u16, addr: usize, len: usize, written: bool) -> Result<Vec<(usize, usize)>, i64> {
+	let proc = get_by_pid(pid);
+	if proc.is_null() {
+		return Err(EFAULT);
+	}
+	if (*(*proc).frame).satp >> 60 == 0 {
+		// A kernel process's buffer is already physical, and it's kernel
+		// memory that the process looks after itself.
+		return Ok(alloc::vec![(addr, len)]);
+	}
+	let table = (*proc).mmu_table.as_ref().unwrap();
+	let access = if written { EntryBits::Write.val() } else { EntryBits::Read.val() };
+	let mut runs = Vec::new();
+	if user_runs(table, addr, len, access, |paddr, run| runs.push((paddr, run))) != len {
+		return Err(EFAULT);
+	}
+	Ok(runs)
+}
+
+/// Pin runs for a new submission from a user process, and give back its
+/// tag.
+unsafe fn track(pid: u16, ctx: &mut IoContext, runs: &[(usize, usize)]) -> u64 {
+	let tag = ctx.next_tag;
+	ctx.next_tag = ctx.next_tag.wrapping_add(1);
+	if (*(*get_by_pid(pid)).frame).satp >> 60 != 0 {
+		ctx.pins.insert(tag, pin(runs));
+	}
+	tag
+}
+
+/// Start one submission. Returns the result if it's already done, or
+/// None if the completion will be posted later.
+unsafe fn start(pid: u16, ctx: &mut IoContext, sqe: &Sqe) -> Option<i64> {
+	match sqe.op {
+		OP_NOP => Some(0),
+		OP_BLOCK_READ | OP_BLOCK_WRITE => {
+			if sqe.addr % 512 != 0 || sqe.len % 512 != 0 || sqe.len == 0 {
+				return Some(-EINVAL);
+			}
+			let runs = match buffer_runs(pid, sqe.addr as usize, sqe.len as usize, sqe.op == OP_BLOCK_READ) {
+				Ok(r) => r,
+				Err(e) => return Some(-e),
+			};
+			if runs.len() > MAX_SEGMENTS {
+				return Some(-EINVAL);
+			}
+			let segments: Vec<Segment> = runs.iter()
+			                                 .map(|&(addr, len)| Segment { addr: addr as *mut u8, len: len as u32 })
+			                                 .collect();
+			let tag = track(pid, ctx, &runs);
+			let completion = Completion { pid,
+			                              tag,
+			                              user_data: sqe.user_data,
+			                              bytes: sqe.len };
+			let err = match block::block_op_async(sqe.fd as usize, &segments, sqe.offset, sqe.op == OP_BLOCK_WRITE, completion) {
+				Ok(_) => {
+					ctx.inflight += 1;
+					return None;
+				},
+				Err(block::BlockErrors::BlockDeviceNotFound) => -EBADF,
+				Err(_) => -EINVAL,
+			};
+			if let Some(pins) = ctx.pins.remove(&tag) {
+				unpin(pins);
+			}
+			Some(err)
+		},
+		OP_FILE_READ | OP_FILE_WRITE => {
+			// Files only go up to 4 GiB, and we won't cut the offset down
+			// to fit.
+			if sqe.offset > u32::MAX as u64 {
+				return Some(-EINVAL);
+			}
+			let proc = get_by_pid(pid);
+			let file = match (*proc).owner().data.fdesc.get(&(sqe.fd as u16)) {
+				Some(Descriptor::File(f)) => *f,
+				_ => return Some(-EBADF),
+			};
+			let runs = match buffer_runs(pid, sqe.addr as usize, sqe.len as usize, sqe.op == OP_FILE_READ) {
+				Ok(r) => r,
+				Err(e) => return Some(-e),
+			};
+			let tag = track(pid, ctx, &runs);
+			ctx.file_ops.push_back(FileOp { write: sqe.op == OP_FILE_WRITE,
+			                                file,
+			                                runs,
+			                                tag,
+			                                offset: sqe.offset as u32,
+			                                user_data: sqe.user_data });
+			ctx.inflight += 1;
+			if !ctx.worker {
+				// If there's no PID for a worker, the op waits for the
+				// next submission to try again.
+				ctx.worker = add_kernel_process_args(file_worker, pid as usize) != 0;
+			}
+			None
+		},
+		_ => Some(-EINVAL),
+	}
+}
+
+/// io_enter: start everything in pid's submission queue. If min_complete
+/// is more than what's already in the completion queue, the process waits
+/// until it is (or until nothing is left in flight). Returns the number
+/// of completions ready, -1 if there is no ring, or -EINVAL if the queue
+/// claims to hold more than SQ_ENTRIES entries. The caller has made sure
+/// that every buffer in the queue is mapped.
+pub unsafe fn enter(pid: u16, min_complete: usize) -> isize {
+	let mut contexts = match IO_CONTEXTS.take() {
+		Some(c) => c,
+		None => return -1,
+	};
+	let ret = if let Some(ctx) = contexts.get_mut(&pid) {
+		let ring = &mut *ctx.ring;
+		let tail = (&ring.sq_tail as *const u32).read_volatile();
+		// Don't read the entries until we've seen the tail.
+		fence(Ordering::Acquire);
+		let mut head = ring.sq_head;
+		// The process can write both ends, and we hold the kernel lock the
+		// whole time we're in here.
+		if tail.wrapping_sub(head) as usize > SQ_ENTRIES {
+			IO_CONTEXTS.replace(contexts);
+			return -EINVAL as isize;
+		}
+		while head != tail {
+			let sqe = ring.sqes[head as usize % SQ_ENTRIES];
+			head = head.wrapping_add(1);
+			if let Some(res) = start(pid, ctx, &sqe) {
+				post(&mut *ctx.ring, sqe.user_data, res);
+			}
+		}
+		(&mut (*ctx.ring).sq_head as *mut u32).write_volatile(head);
+		let ready = ready(&*ctx.ring);
+		if ready < min_complete && ctx.inflight > 0 {
+			// A0 is filled in when we wake it up.
+			ctx.wait_for = min_complete;
+			set_waiting(pid);
+			0
+		}
+		else {
+			ready as isize
+		}
+	}
+	else {
+		-1
+	};
+	IO_CONTEXTS.replace(contexts);
+	ret
+}
+
+/// Every buffer in pid's submission queue, as (address, length, written
+/// by us), so that the system call can fault them in before enter().
+pub unsafe fn pending_buffers(pid: u16) -> Vec<(usize, usize, bool)> {
+	let mut bufs = Vec::new();
+	if let Some(contexts) = IO_CONTEXTS.as_ref() {
+		if let Some(ctx) = contexts.get(&pid) {
+			let ring = &*ctx.ring;
+			let tail = (&ring.sq_tail as *const u32).read_volatile();
+			let mut head = ring.sq_head;
+			// Something bigger would be a bad tail, which enter() refuses,
+			// so there's no point faulting more.
+			let mut n = 0;
+			while head != tail && n < SQ_ENTRIES {
+				let sqe = &ring.sqes[head as usize % SQ_ENTRIES];
+				if sqe.op != OP_NOP && sqe.len > 0 {
+					bufs.push((sqe.addr as usize, sqe.len as usize, sqe.op == OP_BLOCK_READ || sqe.op == OP_FILE_READ));
+				}
+				head = head.wrapping_add(1);
+				n += 1;
+			}
+		}
+	}
+	bufs
+}
+
+/// Run one file op. This can block in the file system.
+unsafe fn run_file_op(pid: u16, op: &FileOp) -> i64 {
+	// Nobody is going to see this one.
+	if is_dead(pid) {
+		return -ECANCELED;
+	}
+	fs::runs_rw(&op.file, &op.runs, op.offset, op.write) as i64
+}
+
+/// The kernel process that works through a ring's file ops. It quits when
+/// it runs out, and the next file op starts a new one.
+fn file_worker(pid: usize) {
+	let pid = pid as u16;
+	loop {
+		let op = without_interrupts(|| unsafe {
+			let mut op = None;
+			if let Some(mut contexts) = IO_CONTEXTS.take() {
+				if let Some(ctx) = contexts.get_mut(&pid) {
+					op = ctx.file_ops.pop_front();
+					if op.is_none() {
+						ctx.worker = false;
+					}
+				}
+				IO_CONTEXTS.replace(contexts);
+			}
+			op
+		});
+		match op {
+			Some(op) => {
+				let res = unsafe { run_file_op(pid, &op) };
+				without_interrupts(|| unsafe { complete(pid, op.tag, op.user_data, res) });
+			},
+			None => break,
+		}
+	}
+}
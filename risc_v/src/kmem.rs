@@ -3,8 +3,15 @@
 // Stephen Marz
 // 7 October 2019
 
-use crate::page::{align_val, zalloc, Table, PAGE_SIZE};
-use core::{mem::size_of, ptr::null_mut};
+use crate::{cpu::{mhartid_read, without_interrupts, without_local_interrupts, MAX_HARTS},
+            lock::Mutex,
+            page::{align_val, alloc, zalloc, Table, PAGE_SIZE}};
+use core::{mem::size_of, ptr::null_mut, sync::atomic::{AtomicUsize, Ordering}};
+
+extern "C" {
+	static HEAP_START: usize;
+	static HEAP_SIZE: usize;
+}
 
 #[repr(usize)]
 enum AllocListFlags {
@@ -72,6 +79,165 @@ pub fn get_num_allocations() -> usize {
 	unsafe { KMEM_ALLOC }
 }
 
+pub fn get_num_slab_pages() -> usize {
+	SLAB_PAGES.load(Ordering::Relaxed)
+}
+
+// ///////////////////////////////////
+// / SLAB CACHES
+// ///////////////////////////////////
+
+// Almost everything the kernel allocates is small: boxed requests, buffers,
+// strings, and the nodes of VecDeques and BTreeMaps. Those come out of a
+// slab cache for their size class instead of the list above, which has to
+// be walked from the start every time. A slab is a page from the page
+// allocator cut into objects of one size, and a free object holds a
+// pointer to the next one, so kmalloc and kfree are a push or a pop.
+//
+// Each hart keeps its own free objects of each size, which it only touches
+// with its interrupts off, so the common case takes no lock at all, and a
+// hart keeps handing out the objects it freed most recently, which are
+// likely still in its cache. A hart that frees more than it keeps gives
+// half of them to the depot, where the other harts can get at them, and
+// a hart that runs out takes from the depot before it cuts a new slab.
+// Slabs aren't given back to the page allocator.
+
+// The smallest class is 2^SLAB_MIN_ORDER bytes (64), then 128, up to 4096.
+const SLAB_MIN_ORDER: usize = 6;
+const SLAB_CLASSES: usize = 7;
+// How many bytes of each class a hart keeps before it gives some back.
+const HART_CACHE_BYTES: usize = 4 * PAGE_SIZE;
+
+struct FreeObject {
+	next: *mut FreeObject,
+}
+
+#[derive(Clone, Copy)]
+struct FreeList {
+	head:  *mut FreeObject,
+	count: usize,
+}
+
+impl FreeList {
+	unsafe fn push(&mut self, obj: *mut FreeObject) {
+		(*obj).next = self.head;
+		self.head = obj;
+		self.count += 1;
+	}
+
+	unsafe fn pop(&mut self) -> *mut u8 {
+		let obj = self.head;
+		if !obj.is_null() {
+			self.head = (*obj).next;
+			self.count -= 1;
+		}
+		obj as *mut u8
+	}
+
+	/// Move up to n objects from other onto us.
+	unsafe fn take(&mut self, other: &mut FreeList, n: usize) {
+		for _ in 0..n {
+			let obj = other.pop() as *mut FreeObject;
+			if obj.is_null() {
+				break;
+			}
+			self.push(obj);
+		}
+	}
+}
+
+const EMPTY_LIST: FreeList = FreeList { head: null_mut(), count: 0 };
+
+static mut HART_CACHES: [[FreeList; SLAB_CLASSES]; MAX_HARTS] = [[EMPTY_LIST; SLAB_CLASSES]; MAX_HARTS];
+static mut DEPOT: [FreeList; SLAB_CLASSES] = [EMPTY_LIST; SLAB_CLASSES];
+// Only ever held with interrupts off, and never while we wait on anything
+// else, so it's a plain spin lock.
+static mut DEPOT_LOCK: Mutex = Mutex::new();
+// One byte for every page of the heap: 0 if it isn't a slab, or its class
+// plus 1. This is how kfree() knows where a pointer came from.
+static mut SLAB_MAP: *mut u8 = null_mut();
+static SLAB_PAGES: AtomicUsize = AtomicUsize::new(0);
+
+/// The class that sz bytes go in, or None if it's too big for a slab.
+fn slab_class(sz: usize) -> Option<usize> {
+	// The number of bits in sz - 1 is the order of the next power of two.
+	let order = 64 - (sz.max(1) - 1).leading_zeros() as usize;
+	let class = order.saturating_sub(SLAB_MIN_ORDER);
+	if class < SLAB_CLASSES { Some(class) } else { None }
+}
+
+fn class_size(class: usize) -> usize {
+	1 << (class + SLAB_MIN_ORDER)
+}
+
+/// How many objects of class a hart keeps.
+fn hart_cache_max(class: usize) -> usize {
+	(HART_CACHE_BYTES / class_size(class)).max(2)
+}
+
+/// The slab class of the page ptr is in, if it's in one.
+unsafe fn slab_of(ptr: *mut u8) -> Option<usize> {
+	let addr = ptr as usize;
+	if SLAB_MAP.is_null() || addr < HEAP_START || addr >= HEAP_START + HEAP_SIZE {
+		return None;
+	}
+	match *SLAB_MAP.add((addr - HEAP_START) / PAGE_SIZE) {
+		0 => None,
+		c => Some(c as usize - 1),
+	}
+}
+
+/// Put more objects of class on this hart's list, from the depot if it has
+/// any, or else from a new slab. This returns false if we're out of pages.
+unsafe fn slab_refill(cache: &mut FreeList, class: usize) -> bool {
+	// Before init(), everything comes from the list.
+	if SLAB_MAP.is_null() {
+		return false;
+	}
+	DEPOT_LOCK.spin_lock();
+	cache.take(&mut DEPOT[class], hart_cache_max(class) / 2);
+	DEPOT_LOCK.unlock();
+	if cache.count != 0 {
+		return true;
+	}
+	// The page allocator takes the kernel lock, so we can't be holding the
+	// depot when we get here.
+	let page = alloc(1);
+	if page.is_null() {
+		return false;
+	}
+	*SLAB_MAP.add((page as usize - HEAP_START) / PAGE_SIZE) = class as u8 + 1;
+	SLAB_PAGES.fetch_add(1, Ordering::Relaxed);
+	let size = class_size(class);
+	for i in (0..PAGE_SIZE / size).rev() {
+		cache.push(page.add(i * size) as *mut FreeObject);
+	}
+	true
+}
+
+fn slab_alloc(class: usize) -> *mut u8 {
+	without_local_interrupts(|| unsafe {
+		let cache = &mut HART_CACHES[mhartid_read()][class];
+		if cache.head.is_null() && !slab_refill(cache, class) {
+			return null_mut();
+		}
+		cache.pop()
+	})
+}
+
+fn slab_free(ptr: *mut u8, class: usize) {
+	without_local_interrupts(|| unsafe {
+		let cache = &mut HART_CACHES[mhartid_read()][class];
+		cache.push(ptr as *mut FreeObject);
+		let max = hart_cache_max(class);
+		if cache.count > max {
+			DEPOT_LOCK.spin_lock();
+			DEPOT[class].take(cache, max / 2);
+			DEPOT_LOCK.unlock();
+		}
+	})
+}
+
 /// Initialize kernel's memory
 /// This is not to be used to allocate memory
 /// for user processes. If that's the case, use
@@ -86,6 +252,9 @@ pub fn init() {
 		(*KMEM_HEAD).set_free();
 		(*KMEM_HEAD).set_size(KMEM_ALLOC * PAGE_SIZE);
 		KMEM_PAGE_TABLE = zalloc(1) as *mut Table;
+		let map_pages = align_val(HEAP_SIZE / PAGE_SIZE, 12) / PAGE_SIZE;
+		SLAB_MAP = zalloc(map_pages);
+		assert!(!SLAB_MAP.is_null());
 	}
 }
 
@@ -106,60 +275,77 @@ pub fn kzmalloc(sz: usize) -> *mut u8 {
 
 /// Allocate sub-page level allocation based on bytes
 pub fn kmalloc(sz: usize) -> *mut u8 {
-	unsafe {
-		let size = align_val(sz, 3) + size_of::<AllocList>();
-		let mut head = KMEM_HEAD;
-		// .add() uses pointer arithmetic, so we type-cast into a u8
-		// so that we multiply by an absolute size (KMEM_ALLOC *
-		// PAGE_SIZE).
-		let tail = (KMEM_HEAD as *mut u8).add(KMEM_ALLOC * PAGE_SIZE)
-		           as *mut AllocList;
+	if let Some(class) = slab_class(sz) {
+		let ret = slab_alloc(class);
+		if !ret.is_null() {
+			return ret;
+		}
+		// Out of pages. The list might still have room.
+	}
+	// All harts share the one list of chunks, so we walk it with the
+	// kernel lock held.
+	without_interrupts(|| {
+		unsafe {
+			let size = align_val(sz, 3) + size_of::<AllocList>();
+			let mut head = KMEM_HEAD;
+			// .add() uses pointer arithmetic, so we type-cast into a u8
+			// so that we multiply by an absolute size (KMEM_ALLOC *
+			// PAGE_SIZE).
+			let tail = (KMEM_HEAD as *mut u8).add(KMEM_ALLOC * PAGE_SIZE)
+			           as *mut AllocList;
 
-		while head < tail {
-			if (*head).is_free() && size <= (*head).get_size() {
-				let chunk_size = (*head).get_size();
-				let rem = chunk_size - size;
-				(*head).set_taken();
-				if rem > size_of::<AllocList>() {
-					let next = (head as *mut u8).add(size)
-					           as *mut AllocList;
-					// There is space remaining here.
-					(*next).set_free();
-					(*next).set_size(rem);
-					(*head).set_size(size);
+			while head < tail {
+				if (*head).is_free() && size <= (*head).get_size() {
+					let chunk_size = (*head).get_size();
+					let rem = chunk_size - size;
+					(*head).set_taken();
+					if rem > size_of::<AllocList>() {
+						let next = (head as *mut u8).add(size)
+						           as *mut AllocList;
+						// There is space remaining here.
+						(*next).set_free();
+						(*next).set_size(rem);
+						(*head).set_size(size);
+					}
+					else {
+						// If we get here, take the entire chunk
+						(*head).set_size(chunk_size);
+					}
+					return head.add(1) as *mut u8;
 				}
 				else {
-					// If we get here, take the entire chunk
-					(*head).set_size(chunk_size);
+					// If we get here, what we saw wasn't a free
+					// chunk, move on to the next.
+					head = (head as *mut u8).add((*head).get_size())
+					       as *mut AllocList;
 				}
-				return head.add(1) as *mut u8;
-			}
-			else {
-				// If we get here, what we saw wasn't a free
-				// chunk, move on to the next.
-				head = (head as *mut u8).add((*head).get_size())
-				       as *mut AllocList;
 			}
 		}
-	}
-	// If we get here, we didn't find any free chunks--i.e. there isn't
-	// enough memory for this. TODO: Add on-demand page allocation.
-	null_mut()
+		// If we get here, we didn't find any free chunks--i.e. there isn't
+		// enough memory for this. TODO: Add on-demand page allocation.
+		null_mut()
+	})
 }
 
 /// Free a sub-page level allocation
 pub fn kfree(ptr: *mut u8) {
-	unsafe {
-		if !ptr.is_null() {
-			let p = (ptr as *mut AllocList).offset(-1);
-			if (*p).is_taken() {
-				(*p).set_free();
+	if let Some(class) = unsafe { slab_of(ptr) } {
+		slab_free(ptr, class);
+		return;
+	}
+	without_interrupts(|| {
+		unsafe {
+			if !ptr.is_null() {
+				let p = (ptr as *mut AllocList).offset(-1);
+				if (*p).is_taken() {
+					(*p).set_free();
+				}
+				// After we free, see if we can combine adjacent free
+				// spots to see if we can reduce fragmentation.
+				coalesce();
 			}
-			// After we free, see if we can combine adjacent free
-			// spots to see if we can reduce fragmentation.
-			coalesce();
 		}
-	}
+	})
 }
 
 /// Merge smaller chunks into a bigger chunk
@@ -3,7 +3,8 @@
 // Stephen Marz
 // 26 Apr 2020
 
-use crate::syscall::syscall_sleep;
+use crate::{cpu::mhartid_read, syscall::syscall_sleep};
+use core::sync::atomic::{spin_loop_hint, AtomicUsize, Ordering};
 
 pub const DEFAULT_LOCK_SLEEP: usize = 10000;
 #[repr(u32)]
@@ -60,3 +61,56 @@ impl<'a> Mutex {
 		}
 	}
 }
+
+/// The big kernel lock. With more than one hart, user programs run in
+/// parallel, but only one hart at a time runs kernel code that touches
+/// shared state: the trap handler holds this from the time it comes in
+/// until it goes back out to a process, and without_interrupts() takes it
+/// around anything a kernel process shares with the trap handler. A hart
+/// can take it more than once, so those can nest.
+/// Never make a system call while holding it. The trap handler would
+/// switch to another process and take the lock with it.
+pub struct KernelLock {
+	// The hart that has it, plus one, or 0 if nobody does
+	owner: AtomicUsize,
+	depth: usize,
+}
+
+pub static mut KERNEL_LOCK: KernelLock = KernelLock::new();
+
+impl KernelLock {
+	pub const fn new() -> Self {
+		Self { owner: AtomicUsize::new(0), depth: 0 }
+	}
+
+	pub fn lock(&mut self) {
+		let me = mhartid_read() + 1;
+		if self.owner.load(Ordering::Relaxed) == me {
+			self.depth += 1;
+			return;
+		}
+		while self.owner.compare_exchange(0, me, Ordering::Acquire, Ordering::Relaxed).is_err() {
+			spin_loop_hint();
+		}
+		self.depth = 1;
+	}
+
+	pub fn unlock(&mut self) {
+		if self.owner.load(Ordering::Relaxed) != mhartid_read() + 1 {
+			return;
+		}
+		self.depth -= 1;
+		if self.depth == 0 {
+			self.owner.store(0, Ordering::Release);
+		}
+	}
+
+	/// Let go no matter how many times this hart took it. The trap handler
+	/// does this on its way out to a process.
+	pub fn release(&mut self) {
+		if self.owner.load(Ordering::Relaxed) == mhartid_read() + 1 {
+			self.depth = 0;
+			self.owner.store(0, Ordering::Release);
+		}
+	}
+}
@@ -19,6 +19,7 @@
 extern crate alloc;
 // This is experimental and requires alloc_prelude as a feature
 // use alloc::prelude::v1::*;
+use core::sync::atomic::{spin_loop_hint, AtomicBool, Ordering};
 
 // ///////////////////////////////////
 // / RUST MACROS
@@ -63,6 +64,8 @@ fn panic(info: &core::panic::PanicInfo) -> ! {
 	else {
 		println!("no information available.");
 	}
+	// Nobody is going to take the UART's interrupts now.
+	uart::tx_flush();
 	abort();
 }
 #[no_mangle]
@@ -82,8 +85,11 @@ extern "C" {
 /// a frame. Since it will jump to another program counter,
 /// it will never return back here. We don't care if we leak
 /// the stack, since we will recapture the stack during m_trap.
+/// This is also where a hart lets go of the kernel lock: whatever it
+/// switches to runs outside of the kernel, or takes the lock for itself.
 fn rust_switch_to_user(frame: usize) -> ! {
 	unsafe {
+		lock::KERNEL_LOCK.release();
 		switch_to_user(frame);
 	}
 }
@@ -117,13 +123,31 @@ extern "C" fn kinit() {
 	// We schedule the next context switch using a multiplier of 1
 	// Block testing code removed.
 	trap::schedule_next_context_switch(1);
+	sched::start_hart(0);
+	// Let the other harts go. They've been waiting in kinit_hart().
+	SMP_READY.store(true, Ordering::Release);
 	rust_switch_to_user(sched::schedule());
 	// switch_to_user will not return, so we should never get here
 }
+
+// Set once hart 0 has the kernel ready. Nobody else touches the kernel
+// until then.
+static SMP_READY: AtomicBool = AtomicBool::new(false);
+
 #[no_mangle]
-extern "C" fn kinit_hart(_hartid: usize) {
-	// We aren't going to do anything here until we get SMP going.
-	// All non-0 harts initialize here.
+extern "C" fn kinit_hart(hartid: usize) {
+	// All non-0 harts initialize here, on their own piece of the boot
+	// stack, with interrupts off. Hart 0 may not have even cleared the BSS
+	// yet, so don't touch anything but SMP_READY until it's set.
+	while !SMP_READY.load(Ordering::Acquire) {
+		spin_loop_hint();
+	}
+	cpu::clear_ipi(hartid);
+	sched::start_hart(hartid);
+	trap::schedule_next_context_switch(1);
+	// We don't have a process yet, so this is likely our idle loop. Either
+	// way, the timer or an IPI brings us back to the scheduler.
+	rust_switch_to_user(sched::schedule());
 }
 
 // ///////////////////////////////////
@@ -131,19 +155,24 @@ extern "C" fn kinit_hart(_hartid: usize) {
 // ///////////////////////////////////
 
 pub mod assembly;
+pub mod bcache;
 pub mod block;
 pub mod buffer;
 pub mod console;
 pub mod cpu;
+pub mod dcache;
 pub mod elf;
 pub mod fs;
+pub mod futex;
 pub mod gpu;
 pub mod input;
+pub mod ioring;
 pub mod kmem;
 pub mod lock;
 pub mod page;
 pub mod plic;
 pub mod process;
+pub mod profile;
 pub mod rng;
 pub mod sched;
 pub mod syscall;
@@ -152,5 +181,6 @@ pub mod uart;
 pub mod vfs;
 pub mod virtio;
 pub mod test;
+pub mod trace;
 
 
@@ -3,6 +3,8 @@
 // Stephen Marz
 // 6 October 2019
 
+use crate::cpu::{memcpy, without_interrupts};
+use alloc::vec::Vec;
 use core::{mem::size_of, ptr::null_mut};
 
 // ////////////////////////////////
@@ -33,6 +35,9 @@ pub enum PageBits {
 	Empty = 0,
 	Taken = 1 << 0,
 	Last = 1 << 1,
+	// The first page of a free block, which is on the free list for its
+	// order.
+	Free = 1 << 2,
 }
 
 impl PageBits {
@@ -48,6 +53,11 @@ impl PageBits {
 // associated with it. However, there structure is much larger.
 pub struct Page {
 	flags: u8,
+	// For a Free page, the block is 2^order pages long.
+	order: u8,
+	// On the first page of an allocation, how many owners it has besides
+	// whoever allocated it (see share()).
+	shares: u16,
 }
 
 impl Page {
@@ -71,6 +81,8 @@ impl Page {
 	// Clear the Page structure and all associated allocations.
 	pub fn clear(&mut self) {
 		self.flags = PageBits::Empty.val();
+		self.order = 0;
+		self.shares = 0;
 	}
 
 	// Set a certain flag. We ran into trouble here since PageBits
@@ -83,6 +95,181 @@ impl Page {
 	pub fn clear_flag(&mut self, flag: PageBits) {
 		self.flags &= !(flag.val());
 	}
+
+	// Whether this is the start of a free block of 2^order pages.
+	fn is_free_block(&self, order: usize) -> bool {
+		self.flags == PageBits::Free.val() && self.order as usize == order
+	}
+}
+
+// The page allocator is a buddy allocator. Free memory is kept in blocks
+// of 2^order pages, each aligned to its own size, on one list per order.
+// To allocate, we take the smallest block that's big enough, splitting a
+// bigger one in halves if we have to. When a block is freed and its buddy
+// (the other half of the block they were split from) is free too, the two
+// go back together, and so on up. Both take at most MAX_ORDER steps.
+//
+// Allocations don't have to be a power of two. We take the block that
+// fits and give the pages past the end straight back, so 35 pages cost 35
+// pages. Taken pages are marked Taken, and the last one Last, like always,
+// so dealloc() still only needs the pointer.
+
+// The biggest block is 2^MAX_ORDER pages (128 MiB).
+pub const MAX_ORDER: usize = 15;
+
+// A free block's first page holds its links in the list for its order.
+struct FreeBlock {
+	next: *mut FreeBlock,
+	prev: *mut FreeBlock,
+}
+
+static mut FREE_LISTS: [*mut FreeBlock; MAX_ORDER + 1] = [null_mut(); MAX_ORDER + 1];
+static mut STATS: PageStats = PageStats { total_pages: 0,
+                                          free_pages:  0,
+                                          allocs:      0,
+                                          frees:       0,
+                                          zero_pool:   0,
+                                          zero_hits:   0,
+                                          zero_misses: 0,
+                                          slab_pages:  0,
+                                          shared_pages: 0,
+                                          cow_copies:  0,
+                                          free_blocks: [0; MAX_ORDER + 1], };
+// The end of the memory we hand out
+static mut ALLOC_END: usize = 0;
+
+/// How the page allocator is doing. free_blocks[k] is how many free blocks
+/// of 2^k pages there are, which shows how fragmented memory is: lots of
+/// free pages but no big blocks means a big allocation can fail anyway.
+/// This must match startlib/memstats.h.
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct PageStats {
+	pub total_pages: u64,
+	pub free_pages:  u64,
+	pub allocs:      u64,
+	pub frees:       u64,
+	// Zeroed pages ready for zalloc(1), and how often it found one
+	pub zero_pool:   u64,
+	pub zero_hits:   u64,
+	pub zero_misses: u64,
+	// Filled in by whoever asks, from kmem.
+	pub slab_pages:  u64,
+	// Pages that fork() didn't have to copy: one for each extra owner
+	// of each page. And how many copies a write to one has made since.
+	pub shared_pages: u64,
+	pub cow_copies:  u64,
+	pub free_blocks: [u64; MAX_ORDER + 1],
+}
+
+pub fn stats() -> PageStats {
+	without_interrupts(|| unsafe { STATS })
+}
+
+unsafe fn page_of(addr: usize) -> *mut Page {
+	(HEAP_START as *mut Page).add((addr - ALLOC_START) / PAGE_SIZE)
+}
+
+unsafe fn list_push(order: usize, addr: usize) {
+	let block = addr as *mut FreeBlock;
+	(*block).prev = null_mut();
+	(*block).next = FREE_LISTS[order];
+	if !FREE_LISTS[order].is_null() {
+		(*FREE_LISTS[order]).prev = block;
+	}
+	FREE_LISTS[order] = block;
+	let p = page_of(addr);
+	(*p).flags = PageBits::Free.val();
+	(*p).order = order as u8;
+	STATS.free_blocks[order] += 1;
+}
+
+unsafe fn list_remove(order: usize, addr: usize) {
+	let block = addr as *mut FreeBlock;
+	if (*block).prev.is_null() {
+		FREE_LISTS[order] = (*block).next;
+	}
+	else {
+		(*(*block).prev).next = (*block).next;
+	}
+	if !(*block).next.is_null() {
+		(*(*block).next).prev = (*block).prev;
+	}
+	(*page_of(addr)).clear();
+	STATS.free_blocks[order] -= 1;
+}
+
+/// Free the block of 2^order pages at addr, joining it with its buddy for
+/// as long as the buddy is free too.
+unsafe fn free_block(mut addr: usize, mut order: usize) {
+	while order < MAX_ORDER {
+		// Blocks are aligned to their size in physical memory, so the
+		// buddy is the address with the order's bit flipped.
+		let buddy = addr ^ (PAGE_SIZE << order);
+		if buddy < ALLOC_START || buddy + (PAGE_SIZE << order) > ALLOC_END || !(*page_of(buddy)).is_free_block(order) {
+			break;
+		}
+		list_remove(order, buddy);
+		addr = if buddy < addr { buddy } else { addr };
+		order += 1;
+	}
+	list_push(order, addr);
+}
+
+/// Free [start, end), which doesn't have to be a block, as the biggest
+/// aligned blocks it's made of.
+unsafe fn free_range(mut start: usize, end: usize) {
+	while start < end {
+		let mut order = 0;
+		while order < MAX_ORDER
+		      && start & ((PAGE_SIZE << (order + 1)) - 1) == 0
+		      && start + (PAGE_SIZE << (order + 1)) <= end
+		{
+			order += 1;
+		}
+		free_block(start, order);
+		start += PAGE_SIZE << order;
+	}
+}
+
+/// The smallest order whose blocks hold pages pages.
+fn order_for(pages: usize) -> usize {
+	let mut order = 0;
+	while (1 << order) < pages {
+		order += 1;
+	}
+	order
+}
+
+/// Take pages pages from a block of at least 2^order, so that they're
+/// aligned to 2^order pages.
+unsafe fn alloc_order(pages: usize, order: usize) -> *mut u8 {
+	if order > MAX_ORDER {
+		return null_mut();
+	}
+	let mut have = order;
+	while have <= MAX_ORDER && FREE_LISTS[have].is_null() {
+		have += 1;
+	}
+	if have > MAX_ORDER {
+		return null_mut();
+	}
+	let addr = FREE_LISTS[have] as usize;
+	list_remove(have, addr);
+	// Split it until it's the size we want. The top halves go back.
+	while have > order {
+		have -= 1;
+		list_push(have, addr + (PAGE_SIZE << have));
+	}
+	for i in 0..pages {
+		(*page_of(addr + i * PAGE_SIZE)).set_flag(PageBits::Taken);
+	}
+	(*page_of(addr + (pages - 1) * PAGE_SIZE)).set_flag(PageBits::Last);
+	// Whatever we don't need of the block goes back.
+	free_range(addr + pages * PAGE_SIZE, addr + (PAGE_SIZE << order));
+	STATS.free_pages -= pages as u64;
+	STATS.allocs += 1;
+	addr as *mut u8
 }
 
 /// Initialize the allocation system. There are several ways that we can
@@ -91,6 +278,8 @@ impl Page {
 /// allocation) 2. Bookkeeping list (structure contains a taken and length)
 /// 3. Allocate one Page structure per 4096 bytes (this is what I chose)
 /// 4. Others
+/// The Page structures say what's taken. The free lists above them are
+/// what make finding free pages quick.
 pub fn init() {
 	unsafe {
 		// let desc_per_page = PAGE_SIZE / size_of::<Page>();
@@ -112,64 +301,145 @@ pub fn init() {
 		                        + num_pages * size_of::<Page>(),
 		                        PAGE_ORDER,
 		);
+		ALLOC_END = (HEAP_START + HEAP_SIZE) & !(PAGE_SIZE - 1);
+		STATS.total_pages = ((ALLOC_END - ALLOC_START) / PAGE_SIZE) as u64;
+		STATS.free_pages = STATS.total_pages;
+		free_range(ALLOC_START, ALLOC_END);
 	}
 }
 
 /// Allocate a page or multiple pages
 /// pages: the number of PAGE_SIZE pages to allocate
 pub fn alloc(pages: usize) -> *mut u8 {
-	// We have to find a contiguous allocation of pages
+	// Every hart allocates pages, so the free lists are covered by the
+	// kernel lock.
 	assert!(pages > 0);
-	unsafe {
-		// We create a Page structure for each page on the heap. We
-		// actually might have more since HEAP_SIZE moves and so does
-		// the size of our structure, but we'll only waste a few bytes.
-		let num_pages = HEAP_SIZE / PAGE_SIZE;
-		let ptr = HEAP_START as *mut Page;
-		for i in 0..num_pages - pages {
-			let mut found = false;
-			// Check to see if this Page is free. If so, we have our
-			// first candidate memory address.
-			if (*ptr.add(i)).is_free() {
-				// It was FREE! Yay!
-				found = true;
-				for j in i..i + pages {
-					// Now check to see if we have a
-					// contiguous allocation for all of the
-					// request pages. If not, we should
-					// check somewhere else.
-					if (*ptr.add(j)).is_taken() {
-						found = false;
-						break;
-					}
-				}
+	without_interrupts(|| unsafe { alloc_order(pages, order_for(pages)) })
+}
+
+/// Allocate pages where the first page's address is a multiple of
+/// 2^order bytes. A 2 MiB megapage, for example, has to be backed by
+/// memory aligned to 2 MiB (order 21). Blocks are aligned to their size,
+/// so this is a block of at least that size.
+pub fn alloc_aligned(pages: usize, order: usize) -> *mut u8 {
+	assert!(pages > 0 && order >= PAGE_ORDER);
+	let block = order_for(pages).max(order - PAGE_ORDER);
+	without_interrupts(|| unsafe { alloc_order(pages, block) })
+}
+
+/// Zero pages pages at ptr.
+fn zero_pages(ptr: *mut u8, pages: usize) {
+	let size = (PAGE_SIZE * pages) / 8;
+	let big_ptr = ptr as *mut u64;
+	for i in 0..size {
+		// We use big_ptr so that we can force an
+		// sd (store doubleword) instruction rather than
+		// the sb. This means 8x fewer stores than before.
+		// Typically we have to be concerned about remaining
+		// bytes, but fortunately 4096 % 8 = 0, so we
+		// won't have any remaining bytes.
+		unsafe {
+			(*big_ptr.add(i)) = 0;
+		}
+	}
+}
+
+/// The zeroing version of alloc_aligned().
+pub fn zalloc_aligned(pages: usize, order: usize) -> *mut u8 {
+	let ret = alloc_aligned(pages, order);
+	if !ret.is_null() {
+		zero_pages(ret, pages);
+	}
+	ret
+}
+
+// Most zallocs are a single page, for page tables, trap frames and the
+// like, and all of them were zeroed right then. Instead, the init process
+// zeroes pages ahead of time when it has nothing better to do (see
+// fill_zero_pool), and zalloc(1) takes one that's ready if it can. The
+// pages in the pool are taken as far as the free lists know.
+pub const ZERO_POOL_SIZE: usize = 64;
+static mut ZERO_POOL: [usize; ZERO_POOL_SIZE] = [0; ZERO_POOL_SIZE];
+static mut ZERO_COUNT: usize = 0;
+
+/// Zero up to n more pages for the pool. This doesn't hold the kernel lock
+/// while it zeroes, so call it where it's fine to be interrupted.
+pub fn fill_zero_pool(n: usize) {
+	for _ in 0..n {
+		if unsafe { ZERO_COUNT } >= ZERO_POOL_SIZE {
+			return;
+		}
+		let page = alloc(1);
+		if page.is_null() {
+			return;
+		}
+		zero_pages(page, 1);
+		let kept = without_interrupts(|| unsafe {
+			if ZERO_COUNT < ZERO_POOL_SIZE {
+				ZERO_POOL[ZERO_COUNT] = page as usize;
+				ZERO_COUNT += 1;
+				STATS.zero_pool = ZERO_COUNT as u64;
+				true
 			}
-			// We've checked to see if there are enough contiguous
-			// pages to form what we need. If we couldn't, found
-			// will be false, otherwise it will be true, which means
-			// we've found valid memory we can allocate.
-			if found {
-				for k in i..i + pages - 1 {
-					(*ptr.add(k)).set_flag(PageBits::Taken);
-				}
-				// The marker for the last page is
-				// PageBits::Last This lets us know when we've
-				// hit the end of this particular allocation.
-				(*ptr.add(i+pages-1)).set_flag(PageBits::Taken);
-				(*ptr.add(i+pages-1)).set_flag(PageBits::Last);
-				// The Page structures themselves aren't the
-				// useful memory. Instead, there is 1 Page
-				// structure per 4096 bytes starting at
-				// ALLOC_START.
-				return (ALLOC_START + PAGE_SIZE * i)
-				       as *mut u8;
+			else {
+				false
 			}
+		});
+		if !kept {
+			dealloc(page);
+			return;
 		}
 	}
+}
 
-	// If we get here, that means that no contiguous allocation was
-	// found.
-	null_mut()
+// The heap maps whole 2 MiB megapages when it can (see fault_in_heap in
+// process.rs). That happens in the trap handler, with the kernel lock held,
+// where zeroing 2 MiB would hold up every hart. So the init process zeroes
+// a few ahead of time too, and a heap fault only takes one that's ready.
+pub const MEGAPAGE_ORDER: usize = 21;
+pub const MEGAPAGE_PAGES: usize = 1 << (MEGAPAGE_ORDER - PAGE_ORDER);
+pub const MEGA_POOL_SIZE: usize = 2;
+static mut MEGA_POOL: [usize; MEGA_POOL_SIZE] = [0; MEGA_POOL_SIZE];
+static mut MEGA_COUNT: usize = 0;
+
+/// Zero one more megapage for the pool, if it has room. Like
+/// fill_zero_pool(), this zeroes without the kernel lock.
+pub fn fill_zero_megapages() {
+	if unsafe { MEGA_COUNT } >= MEGA_POOL_SIZE {
+		return;
+	}
+	let page = alloc_aligned(MEGAPAGE_PAGES, MEGAPAGE_ORDER);
+	if page.is_null() {
+		return;
+	}
+	zero_pages(page, MEGAPAGE_PAGES);
+	let kept = without_interrupts(|| unsafe {
+		if MEGA_COUNT < MEGA_POOL_SIZE {
+			MEGA_POOL[MEGA_COUNT] = page as usize;
+			MEGA_COUNT += 1;
+			true
+		}
+		else {
+			false
+		}
+	});
+	if !kept {
+		dealloc(page);
+	}
+}
+
+/// A zeroed, 2 MiB aligned megapage from the pool, or null if none is
+/// ready. This never zeroes anything itself.
+pub fn take_zeroed_megapage() -> *mut u8 {
+	without_interrupts(|| unsafe {
+		if MEGA_COUNT > 0 {
+			MEGA_COUNT -= 1;
+			MEGA_POOL[MEGA_COUNT] as *mut u8
+		}
+		else {
+			null_mut()
+		}
+	})
 }
 
 /// Allocate and zero a page or multiple pages
@@ -177,60 +447,191 @@ pub fn alloc(pages: usize) -> *mut u8 {
 /// Each page is PAGE_SIZE which is calculated as 1 << PAGE_ORDER
 /// On RISC-V, this typically will be 4,096 bytes.
 pub fn zalloc(pages: usize) -> *mut u8 {
+	if pages == 1 {
+		let ready = without_interrupts(|| unsafe {
+			if ZERO_COUNT > 0 {
+				ZERO_COUNT -= 1;
+				STATS.zero_pool = ZERO_COUNT as u64;
+				STATS.zero_hits += 1;
+				ZERO_POOL[ZERO_COUNT] as *mut u8
+			}
+			else {
+				STATS.zero_misses += 1;
+				null_mut()
+			}
+		});
+		if !ready.is_null() {
+			return ready;
+		}
+	}
 	// Allocate and zero a page.
 	// First, let's get the allocation
 	let ret = alloc(pages);
 	if !ret.is_null() {
-		let size = (PAGE_SIZE * pages) / 8;
-		let big_ptr = ret as *mut u64;
-		for i in 0..size {
-			// We use big_ptr so that we can force an
-			// sd (store doubleword) instruction rather than
-			// the sb. This means 8x fewer stores than before.
-			// Typically we have to be concerned about remaining
-			// bytes, but fortunately 4096 % 8 = 0, so we
-			// won't have any remaining bytes.
-			unsafe {
-				(*big_ptr.add(i)) = 0;
-			}
-		}
+		zero_pages(ret, pages);
 	}
 	ret
 }
 
 /// Deallocate a page by its pointer
-/// The way we've structured this, it will automatically coalesce
-/// contiguous pages.
+/// The pages go back to the free lists as blocks, joined with whatever
+/// free blocks are next to them. If the allocation was shared, this only
+/// gives up the caller's share, and the last owner frees it.
 pub fn dealloc(ptr: *mut u8) {
-	// Make sure we don't try to free a null pointer.
-	assert!(!ptr.is_null());
-	unsafe {
-		let addr =
-			HEAP_START + (ptr as usize - ALLOC_START) / PAGE_SIZE;
-		// Make sure that the address makes sense. The address we
-		// calculate here is the page structure, not the HEAP address!
-		assert!(addr >= HEAP_START && addr < ALLOC_START);
-		let mut p = addr as *mut Page;
-		// println!("PTR in is {:p}, addr is 0x{:x}", ptr, addr);
-		assert!((*p).is_taken(), "Freeing a non-taken page?");
-		// Keep clearing pages until we hit the last page.
-		while (*p).is_taken() && !(*p).is_last() {
+	without_interrupts(|| {
+		// Make sure we don't try to free a null pointer.
+		assert!(!ptr.is_null());
+		unsafe {
+			let start = ptr as usize;
+			// Make sure that the address makes sense.
+			assert!(start >= ALLOC_START && start < ALLOC_END);
+			let mut p = page_of(start);
+			// println!("PTR in is {:p}, addr is 0x{:x}", ptr, addr);
+			assert!((*p).is_taken(), "Freeing a non-taken page?");
+			if (*p).shares > 0 {
+				(*p).shares -= 1;
+				STATS.shared_pages -= alloc_pages(start) as u64;
+				return;
+			}
+			// Keep clearing pages until we hit the last page.
+			let mut pages = 1;
+			while (*p).is_taken() && !(*p).is_last() {
+				(*p).clear();
+				p = p.add(1);
+				pages += 1;
+			}
+			// If the following assertion fails, it is most likely
+			// caused by a double-free.
+			assert!(
+			        (*p).is_last() == true,
+			        "Possible double-free detected! (Not taken found \
+			         before last)"
+			);
+			// If we get here, we've taken care of all previous pages and
+			// we are on the last page.
 			(*p).clear();
+			free_range(start, start + pages * PAGE_SIZE);
+			STATS.free_pages += pages as u64;
+			STATS.frees += 1;
+		}
+	})
+}
+
+/// How many pages are in the allocation that starts at start.
+unsafe fn alloc_pages(start: usize) -> usize {
+	let mut p = page_of(start);
+	let mut pages = 1;
+	while !(*p).is_last() {
+		p = p.add(1);
+		pages += 1;
+	}
+	pages
+}
+
+// fork() doesn't copy a process' memory. Both processes map the same pages
+// until one of them writes to one, and each page has an owner per process
+// mapping it. Every owner calls dealloc() when it's done, like always.
+
+/// Add an owner to the allocation at ptr.
+pub fn share(ptr: *mut u8) {
+	without_interrupts(|| unsafe {
+		let p = page_of(ptr as usize);
+		assert!((*p).is_taken(), "Sharing a non-taken page?");
+		(*p).shares += 1;
+		STATS.shared_pages += alloc_pages(ptr as usize) as u64;
+	})
+}
+
+/// The start of the allocation that the page at addr is part of, which is
+/// what share() and dealloc() take. Returns None if addr isn't memory we
+/// allocated, such as a device's.
+pub fn alloc_start(addr: usize) -> Option<usize> {
+	without_interrupts(|| unsafe {
+		if addr < ALLOC_START || addr >= ALLOC_END || !(*page_of(addr)).is_taken() {
+			return None;
+		}
+		// Every allocation ends with a Last page, so we go back until we
+		// hit the one before ours.
+		let mut start = addr & !(PAGE_SIZE - 1);
+		while start > ALLOC_START {
+			let prev = page_of(start - PAGE_SIZE);
+			if !(*prev).is_taken() || (*prev).is_last() {
+				break;
+			}
+			start -= PAGE_SIZE;
+		}
+		Some(start)
+	})
+}
+
+/// Whether anyone else owns the allocation at ptr.
+pub fn is_shared(ptr: *mut u8) -> bool {
+	without_interrupts(|| unsafe { (*page_of(ptr as usize)).shares > 0 })
+}
+
+/// Make each page of the allocation at ptr its own allocation, so that
+/// they can be shared and freed one at a time.
+pub fn split(ptr: *mut u8) {
+	without_interrupts(|| unsafe {
+		let mut p = page_of(ptr as usize);
+		assert!((*p).is_taken() && (*p).shares == 0);
+		while !(*p).is_last() {
+			(*p).set_flag(PageBits::Last);
 			p = p.add(1);
+			STATS.allocs += 1;
 		}
-		// If the following assertion fails, it is most likely
-		// caused by a double-free.
-		assert!(
-		        (*p).is_last() == true,
-		        "Possible double-free detected! (Not taken found \
-		         before last)"
-		);
-		// If we get here, we've taken care of all previous pages and
-		// we are on the last page.
-		(*p).clear();
+	})
+}
+
+/// Hold a share of every allocation behind runs. Memory that isn't the
+/// page allocator's, like a device's, can't be freed anyway.
+pub fn pin(runs: &[(usize, usize)]) -> Vec<usize> {
+	let mut pins: Vec<usize> = Vec::new();
+	for &(paddr, len) in runs.iter() {
+		let mut page = paddr & !(PAGE_SIZE - 1);
+		while page < paddr + len {
+			if let Some(start) = alloc_start(page) {
+				// A run through a megapage is all one allocation.
+				if pins.last() != Some(&start) {
+					share(start as *mut u8);
+					pins.push(start);
+				}
+			}
+			page += PAGE_SIZE;
+		}
+	}
+	pins
+}
+
+/// Give back the shares that pin() took.
+pub fn unpin(pins: Vec<usize>) {
+	for start in pins {
+		dealloc(start as *mut u8);
 	}
 }
 
+/// Get a copy of the allocation at ptr, which is pages pages aligned to
+/// 2^order bytes, that belongs to the caller alone. The caller's share of
+/// ptr goes with it. If nobody else has ptr, it already is that, so we
+/// don't copy. Returns null if we're out of memory, in which case the
+/// caller keeps its share.
+pub fn unshare(ptr: *mut u8, pages: usize, order: usize) -> *mut u8 {
+	if !is_shared(ptr) {
+		return ptr;
+	}
+	let copy = alloc_aligned(pages, order);
+	if copy.is_null() {
+		return copy;
+	}
+	unsafe {
+		memcpy(copy, ptr, pages * PAGE_SIZE);
+	}
+	// If the other owners let go while we copied, this frees it.
+	dealloc(ptr);
+	without_interrupts(|| unsafe { STATS.cow_copies += 1 });
+	copy
+}
+
 /// Print all page allocations
 /// This is mainly used for debugging.
 pub fn print_page_allocations() {
@@ -252,7 +653,7 @@ pub fn print_page_allocations() {
 			if (*beg).is_taken() {
 				let start = beg as usize;
 				let memaddr = ALLOC_START
-				              + (start - HEAP_START)
+				              + (start - HEAP_START) / size_of::<Page>()
 				                * PAGE_SIZE;
 				print!("0x{:x} => ", memaddr);
 				loop {
@@ -261,13 +662,13 @@ pub fn print_page_allocations() {
 						let end = beg as usize;
 						let memaddr = ALLOC_START
 						              + (end
-						                 - HEAP_START)
+						                 - HEAP_START) / size_of::<Page>()
 						                * PAGE_SIZE
 						              + PAGE_SIZE - 1;
 						print!(
 						       "0x{:x}: {:>3} page(s)",
 						       memaddr,
-						       (end - start + 1)
+						       (end - start) / size_of::<Page>() + 1
 						);
 						println!(".");
 						break;
@@ -310,6 +711,10 @@ pub enum EntryBits {
 	Global = 1 << 5,
 	Access = 1 << 6,
 	Dirty = 1 << 7,
+	// The two bits after Dirty are left to software. We use the first one
+	// to mark a page that's shared read-only until the next store to it
+	// (see process::fork).
+	Cow = 1 << 8,
 
 	// Convenience combinations
 	ReadWrite = 1 << 1 | 1 << 2,
@@ -317,6 +722,7 @@ pub enum EntryBits {
 	ReadWriteExecute = 1 << 1 | 1 << 2 | 1 << 3,
 
 	// User Convenience Combinations
+	UserRead = 1 << 1 | 1 << 4,
 	UserReadWrite = 1 << 1 | 1 << 2 | 1 << 4,
 	UserReadExecute = 1 << 1 | 1 << 3 | 1 << 4,
 	UserReadWriteExecute = 1 << 1 | 1 << 2 | 1 << 3 | 1 << 4,
@@ -499,11 +905,24 @@ pub fn unmap(root: &mut Table) {
 	}
 }
 
-/// Walk the page table to convert a virtual address to a
-/// physical address.
-/// If a page fault would occur, this returns None
-/// Otherwise, it returns Some with the physical address.
-pub fn virt_to_phys(root: &Table, vaddr: usize) -> Option<usize> {
+/// Returns true if nothing is mapped anywhere in the 2 MiB region that
+/// holds vaddr, meaning we could put a megapage (level 1 leaf) there.
+pub fn megapage_free(root: &Table, vaddr: usize) -> bool {
+	let ref lv2 = root.entries[(vaddr >> 30) & 0x1ff];
+	if lv2.is_invalid() {
+		return true;
+	}
+	if lv2.is_leaf() {
+		return false;
+	}
+	let table_lv1 = ((lv2.get_entry() & !0x3ff) << 2) as *const Table;
+	unsafe { (*table_lv1).entries[(vaddr >> 21) & 0x1ff].is_invalid() }
+}
+
+/// Walk the page table down to the leaf that maps vaddr. This gives back
+/// the leaf and the level it was found at, or None if a page fault would
+/// occur.
+fn walk(root: &Table, vaddr: usize) -> Option<(&Entry, usize)> {
 	// Walk the page table pointed to by root
 	let vpn = [
 	           // VPN[0] = vaddr[20:12]
@@ -522,14 +941,7 @@ pub fn virt_to_phys(root: &Table, vaddr: usize) -> Option<usize> {
 		}
 		else if v.is_leaf() {
 			// According to RISC-V, a leaf can be at any level.
-
-			// The offset mask masks off the PPN. Each PPN is 9
-			// bits and they start at bit #12. So, our formula
-			// 12 + i * 9
-			let off_mask = (1 << (12 + i * 9)) - 1;
-			let vaddr_pgoff = vaddr & off_mask;
-			let addr = ((v.get_entry() << 2) as usize) & !off_mask;
-			return Some(addr | vaddr_pgoff);
+			return Some((v, i));
 		}
 		// Set v to the next entry which is pointed to by this
 		// entry. However, the address was shifted right by 2 places
@@ -545,3 +957,160 @@ pub fn virt_to_phys(root: &Table, vaddr: usize) -> Option<usize> {
 	// found a leaf.
 	None
 }
+
+/// Walk the page table to convert a virtual address to a
+/// physical address.
+/// If a page fault would occur, this returns None
+/// Otherwise, it returns Some with the physical address.
+pub fn virt_to_phys(root: &Table, vaddr: usize) -> Option<usize> {
+	walk(root, vaddr).map(|(v, i)| {
+		// The offset mask masks off the PPN. Each PPN is 9
+		// bits and they start at bit #12. So, our formula
+		// 12 + i * 9
+		let off_mask = (1 << (12 + i * 9)) - 1;
+		let vaddr_pgoff = vaddr & off_mask;
+		let addr = ((v.get_entry() << 2) as usize) & !off_mask;
+		addr | vaddr_pgoff
+	})
+}
+
+/// The leaf that maps vaddr and its level, so that it can be changed in
+/// place. The caller has to fence the address space afterward.
+pub fn leaf_mut(root: &mut Table, vaddr: usize) -> Option<(&mut Entry, usize)> {
+	// The same walk as walk(), but we keep a mutable entry.
+	let mut v = &mut root.entries[(vaddr >> 30) & 0x1ff];
+	for i in (0..=2).rev() {
+		if v.is_invalid() {
+			break;
+		}
+		else if v.is_leaf() {
+			return Some((v, i));
+		}
+		let entry = ((v.get_entry() & !0x3ff) << 2) as *mut Entry;
+		v = unsafe { &mut *entry.add((vaddr >> (12 + 9 * (i - 1))) & 0x1ff) };
+	}
+	None
+}
+
+/// Call f with the virtual address, entry and level of every leaf in the
+/// table, lowest address first.
+pub fn for_each_leaf<F>(root: &mut Table, mut f: F)
+	where F: FnMut(usize, &mut Entry, usize)
+{
+	for lv2 in 0..Table::len() {
+		let entry_lv2 = &mut root.entries[lv2];
+		if entry_lv2.is_invalid() {
+			continue;
+		}
+		if entry_lv2.is_leaf() {
+			f(lv2 << 30, entry_lv2, 2);
+			continue;
+		}
+		let table_lv1 = unsafe { &mut *(((entry_lv2.get_entry() & !0x3ff) << 2) as *mut Table) };
+		for lv1 in 0..Table::len() {
+			let entry_lv1 = &mut table_lv1.entries[lv1];
+			if entry_lv1.is_invalid() {
+				continue;
+			}
+			if entry_lv1.is_leaf() {
+				f(lv2 << 30 | lv1 << 21, entry_lv1, 1);
+				continue;
+			}
+			let table_lv0 = unsafe { &mut *(((entry_lv1.get_entry() & !0x3ff) << 2) as *mut Table) };
+			for lv0 in 0..Table::len() {
+				let entry_lv0 = &mut table_lv0.entries[lv0];
+				if entry_lv0.is_valid() {
+					f(lv2 << 30 | lv1 << 21 | lv0 << 12, entry_lv0, 0);
+				}
+			}
+		}
+	}
+}
+
+/// The permission bits (EntryBits) of the leaf that maps vaddr, or None
+/// if it isn't mapped.
+pub fn leaf_bits(root: &Table, vaddr: usize) -> Option<usize> {
+	walk(root, vaddr).map(|(v, _)| v.get_entry() & 0x3ff)
+}
+
+/// virt_to_phys for an address the user handed us. access is the
+/// EntryBits the kernel is about to use the page with (Read or Write), and
+/// we only give back a page that the user could use that way itself. A
+/// page without the user bit belongs to the kernel, and one without write
+/// may be the program's shared text or a page shared with a fork().
+pub fn user_to_phys(root: &Table, vaddr: usize, access: usize) -> Option<usize> {
+	let need = access | EntryBits::User.val();
+	match leaf_bits(root, vaddr) {
+		Some(bits) if bits & need == need => virt_to_phys(root, vaddr),
+		_ => None,
+	}
+}
+
+/// Walk a user buffer starting at vaddr for len bytes and hand each
+/// physically contiguous run to f as (paddr, run_len). We only consult the
+/// page table once per page instead of once per byte, and neighboring
+/// pages that happen to be physically contiguous are merged into a single
+/// run. access is what the kernel does with the buffer, as in
+/// user_to_phys().
+/// This returns the number of bytes covered. If a page isn't mapped, or
+/// not for access, we stop there, so the return value can be less than
+/// len.
+pub fn user_runs<F>(root: &Table, vaddr: usize, len: usize, access: usize, mut f: F) -> usize
+	where F: FnMut(usize, usize)
+{
+	let mut done = 0;
+	// The current run we're building, which we haven't given to f yet.
+	let mut run_paddr = 0;
+	let mut run_len = 0;
+	while done < len {
+		let va = vaddr + done;
+		// How many bytes are left in this page?
+		let in_page = PAGE_SIZE - (va & (PAGE_SIZE - 1));
+		let this_many = if in_page > len - done { len - done } else { in_page };
+		let paddr = match user_to_phys(root, va, access) {
+			Some(p) => p,
+			None => break,
+		};
+		if run_len > 0 && run_paddr + run_len == paddr {
+			run_len += this_many;
+		}
+		else {
+			if run_len > 0 {
+				f(run_paddr, run_len);
+			}
+			run_paddr = paddr;
+			run_len = this_many;
+		}
+		done += this_many;
+	}
+	if run_len > 0 {
+		f(run_paddr, run_len);
+	}
+	done
+}
+
+/// Copy len bytes from the user's virtual address src into the kernel
+/// (physical) address dst. Returns the number of bytes copied.
+pub fn copy_from_user(root: &Table, dst: *mut u8, src: usize, len: usize) -> usize {
+	let mut copied = 0;
+	user_runs(root, src, len, EntryBits::Read.val(), |paddr, run| {
+		unsafe {
+			memcpy(dst.add(copied), paddr as *const u8, run);
+		}
+		copied += run;
+	});
+	copied
+}
+
+/// Copy len bytes from the kernel (physical) address src into the user's
+/// virtual address dst. Returns the number of bytes copied.
+pub fn copy_to_user(root: &Table, dst: usize, src: *const u8, len: usize) -> usize {
+	let mut copied = 0;
+	user_runs(root, dst, len, EntryBits::Write.val(), |paddr, run| {
+		unsafe {
+			memcpy(paddr as *mut u8, src.add(copied), run);
+		}
+		copied += run;
+	});
+	copied
+}
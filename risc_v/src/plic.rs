@@ -3,6 +3,7 @@
 // Stephen Marz
 // 1 Nov 2019
 
+use crate::trace;
 use crate::uart;
 use crate::virtio;
 
@@ -118,6 +119,7 @@ pub fn handle_interrupt() {
         // If we get here, we've got an interrupt from the claim register. The PLIC will
         // automatically prioritize the next interrupt, so when we get it from claim, it
         // will be the next in priority order.
+        trace::record(trace::EV_INTERRUPT, 0, interrupt);
         match interrupt {
             1..=8 => {
                 virtio::handle_interrupt(interrupt);
@@ -3,19 +3,45 @@
 // Stephen Marz
 // 27 Nov 2019
 
-use crate::{cpu::{get_mtime,
+use crate::{cpu::{build_satp,
+                  get_mtime,
+                  satp_fence_asid,
+                  send_ipi,
+                  without_interrupts,
                   CpuMode,
+                  SatpMode,
 				  TrapFrame,
 				  Registers},
-			fs::Inode,
-            page::{dealloc,
+			fs::OpenFile,
+			profile::Profile,
+            elf,
+            futex,
+            input::{self, EVENT_RING_VADDR},
+            ioring::{self, IORING_PAGES, IORING_VADDR},
+            page::{copy_to_user,
+                   dealloc,
+                   fill_zero_megapages,
+                   fill_zero_pool,
+                   for_each_leaf,
+                   leaf_bits,
+                   leaf_mut,
+                   map,
+                   megapage_free,
+                   share,
+                   split,
                    unmap,
+                   unshare,
+				   take_zeroed_megapage,
 				   zalloc,
-				   Table},
+				   EntryBits,
+				   Table,
+				   MEGAPAGE_ORDER,
+				   PAGE_SIZE},
+            rng,
+            sched,
             syscall::{syscall_exit, syscall_yield}};
-use alloc::{string::String, collections::{vec_deque::VecDeque, BTreeMap}};
+use alloc::{boxed::Box, string::String, vec::Vec, collections::{vec_deque::VecDeque, BTreeMap, BTreeSet}};
 use core::ptr::null_mut;
-use crate::lock::Mutex;
 
 // How many pages are we going to give a process for their
 // stack?
@@ -26,6 +52,19 @@ pub const STACK_ADDR: usize = 0x1_0000_0000;
 // All processes will have a defined starting point in virtual memory.
 // We will use this later when we load processes from disk.
 pub const PROCESS_STARTING_ADDR: usize = 0x2000_0000;
+// The heap has to stay below everything we map at a fixed address: the
+// framebuffer and its damage ring at 0x3000_0000, then the event ring, the
+// time page, the I/O ring and the swapchain one window up each, and the
+// stack with a guard page under it. Otherwise, a heap fault could map a
+// page, or a whole megapage, right over one of them.
+pub const HEAP_LIMIT: usize = 0x3000_0000;
+// Heap pages are handed out when they're first touched. If a whole
+// 2 MiB aligned region sits inside of the heap, we map it with one
+// megapage instead of 512 separate pages, as long as one is zeroed and
+// ready (see take_zeroed_megapage()). Turn this off to always fault in
+// one page at a time.
+pub const USE_MEGAPAGES: bool = true;
+const MEGAPAGE_SIZE: usize = 1 << MEGAPAGE_ORDER;
 
 // Here, we store a process list. It uses the global allocator
 // that we made before and its job is to store all processes.
@@ -36,11 +75,40 @@ pub const PROCESS_STARTING_ADDR: usize = 0x2000_0000;
 // initializations must be at compile-time. We cannot allocate
 // a VecDeque at compile time, so we are somewhat forced to
 // do this.
-pub static mut PROCESS_LIST: Option<VecDeque<Process>> = None;
-pub static mut PROCESS_LIST_MUTEX: Mutex = Mutex::new();
-// We can search through the process list to get a new PID, but
-// it's probably easier and faster just to increase the pid:
-pub static mut NEXT_PID: u16 = 1;
+// Every hart adds and removes processes, so only touch it with the kernel
+// lock held (with_process_list() does that for you). Nobody holds it for
+// long, so it doesn't need a lock of its own.
+pub static mut PROCESS_LIST: Option<VecDeque<Box<Process>>> = None;
+// We hand PIDs out in order, and once they wrap around, we skip the ones
+// that the scheduler still has.
+static mut NEXT_PID: u16 = 1;
+
+/// Hand out a PID. This is safe to call from any hart. This returns None
+/// if every PID belongs to a live process.
+pub fn next_pid() -> Option<u16> {
+	without_interrupts(|| unsafe {
+		// 0 means "no process" to the callers of add_kernel_process(), so
+		// there are u16::MAX PIDs to try.
+		for _ in 0..u16::MAX {
+			let pid = NEXT_PID;
+			NEXT_PID = NEXT_PID.wrapping_add(1).max(1);
+			if sched::lookup(pid).is_null() {
+				return Some(pid);
+			}
+		}
+		None
+	})
+}
+
+/// Run f on the process list with the kernel lock held.
+pub fn with_process_list<R, F: FnOnce(&mut VecDeque<Box<Process>>) -> R>(default: R, f: F) -> R {
+	without_interrupts(|| unsafe {
+		match PROCESS_LIST.as_mut() {
+			Some(pl) => f(pl),
+			None => default,
+		}
+	})
+}
 
 // The following set_* and get_by_pid functions are C-style functions
 // They probably need to be re-written in a more Rusty style, but for
@@ -50,112 +118,152 @@ pub static mut NEXT_PID: u16 = 1;
 /// If this PID is not found, this returns false. Otherwise, it
 /// returns true.
 pub fn set_running(pid: u16) -> bool {
-	// Yes, this is O(n). A better idea here would be a static list
-	// of process pointers.
-	let mut retval = false;
 	unsafe {
-		if let Some(mut pl) = PROCESS_LIST.take() {
-			for proc in pl.iter_mut() {
-				if proc.pid == pid {
-					proc.state = ProcessState::Running;
-					retval = true;
-					break;
-				}
+		if let Some(proc) = get_by_pid(pid).as_mut() {
+			// A process that is waiting to be torn down (see
+			// delete_process()) stays dead.
+			if let ProcessState::Dead = proc.state {
+				return false;
 			}
-			// Now, we no longer need the owned Deque, so we hand it
-			// back by replacing the PROCESS_LIST's None with the
-			// Some(pl).
-			PROCESS_LIST.replace(pl);
+			proc.state = ProcessState::Running;
+			// The scheduler only looks at its run queues, so tell it
+			// this process can be picked again.
+			sched::wake(pid);
+			true
+		}
+		else {
+			false
 		}
 	}
-	retval
 }
 
 /// Set a process' state to waiting. This doesn't do any checks.
 /// If this PID is not found, this returns false. Otherwise, it
 /// returns true.
 pub fn set_waiting(pid: u16) -> bool {
-	// Yes, this is O(n). A better idea here would be a static list
-	// of process pointers.
-	let mut retval = false;
 	unsafe {
-		if let Some(mut pl) = PROCESS_LIST.take() {
-			for proc in pl.iter_mut() {
-				if proc.pid == pid {
-					proc.state = ProcessState::Waiting;
-					retval = true;
-					break;
-				}
-			}
-			// Now, we no longer need the owned Deque, so we hand it
-			// back by replacing the PROCESS_LIST's None with the
-			// Some(pl).
-			PROCESS_LIST.replace(pl);
+		if let Some(proc) = get_by_pid(pid).as_mut() {
+			// The scheduler drops this process from its run queue the
+			// next time it comes up.
+			proc.state = ProcessState::Waiting;
+			true
+		}
+		else {
+			false
 		}
 	}
-	retval
 }
 
 /// Sleep a process
 pub fn set_sleeping(pid: u16, duration: usize) -> bool {
-	// Yes, this is O(n). A better idea here would be a static list
-	// of process pointers.
-	let mut retval = false;
 	unsafe {
-		if let Some(mut pl) = PROCESS_LIST.take() {
-			for proc in pl.iter_mut() {
-				if proc.pid == pid {
-					proc.state = ProcessState::Sleeping;
-					proc.sleep_until = get_mtime() + duration;
-					retval = true;
-					break;
-				}
-			}
-			// Now, we no longer need the owned Deque, so we hand it
-			// back by replacing the PROCESS_LIST's None with the
-			// Some(pl).
-			PROCESS_LIST.replace(pl);
+		if let Some(proc) = get_by_pid(pid).as_mut() {
+			proc.state = ProcessState::Sleeping;
+			proc.sleep_until = get_mtime() + duration;
+			sched::sleep(pid, proc.sleep_until);
+			true
+		}
+		else {
+			false
 		}
 	}
-	retval
 }
 
 /// Delete a process given by pid. If this process doesn't exist,
-/// this function does nothing.
+/// this function does nothing. Deleting a process that has threads deletes
+/// them too, since they live in its address space. A thread goes by
+/// itself, unless its leader is already on its way out.
+/// Some of them may be running user code on another hart, so we can't free
+/// anything out from under them yet. Instead, we mark everyone dead and
+/// send those harts an IPI. The scheduler calls us again for each dead
+/// process it stops running, and whoever comes last does the deleting.
 pub fn delete_process(pid: u16) {
-	unsafe {
-		if let Some(mut pl) = PROCESS_LIST.take() {
-			for i in 0..pl.len() {
-				let p = pl.get_mut(i).unwrap();
-				if (*(*p).frame).pid as u16 == pid {
-					// When the structure gets dropped, all
-					// of the allocations get deallocated.
-					pl.remove(i);
-					break;
+	let unfinished = with_process_list(Vec::new(), |pl| {
+		let mut unfinished = Vec::new();
+		let mut victim = match pl.iter_mut().find(|p| p.pid == pid) {
+			Some(p) => &mut **p as *mut Process,
+			None => return unfinished,
+		};
+		unsafe {
+			let leader = (*victim).leader;
+			if !leader.is_null() {
+				if let ProcessState::Dead = (*leader).state {
+					victim = leader;
 				}
 			}
-			// Now, we no longer need the owned Deque, so we hand it
-			// back by replacing the PROCESS_LIST's None with the
-			// Some(pl).
-			PROCESS_LIST.replace(pl);
 		}
+		let victim_pid = unsafe { (*victim).pid };
+		let is_thread = unsafe { !(*victim).leader.is_null() };
+		let goes = |p: &Process| p.pid == victim_pid || (!is_thread && p.leader == victim);
+		let mut busy = false;
+		for p in pl.iter_mut().filter(|p| goes(p)) {
+			p.state = ProcessState::Dead;
+			if let Some(hart) = sched::running_elsewhere(p.pid) {
+				send_ipi(hart);
+				busy = true;
+			}
+		}
+		if busy {
+			return unfinished;
+		}
+		// An I/O ring may have a device writing into this memory. The last
+		// request to complete calls us again (see ioring::complete).
+		let mut io_busy = false;
+		for p in pl.iter().filter(|p| goes(p)) {
+			io_busy |= unsafe { ioring::cancel(p.pid) };
+		}
+		if io_busy {
+			return unfinished;
+		}
+		// A fork() that never got back to its caller shouldn't leave a
+		// child behind. It never ran, so it goes like any other process.
+		for p in pl.iter_mut().filter(|p| goes(p) && p.data.forking != 0) {
+			unfinished.push(p.data.forking);
+			p.data.forking = 0;
+			p.owner().data.forks_pending -= 1;
+		}
+		unsafe {
+			if is_thread && (*victim).clear_tid != 0 {
+				// Let whoever is joining this thread know. The page may be
+				// copy-on-write since a fork(), so it has to be faulted in
+				// for a store first.
+				let zero = 0u32;
+				if let Fault::Mapped = (*victim).fault_in((*victim).clear_tid, EntryBits::Write.val()) {
+					let table = &*(*victim).mmu_table;
+					copy_to_user(table, (*victim).clear_tid, &zero as *const u32 as *const u8, 4);
+				}
+				futex::wake((*victim).mmu_table as usize, (*victim).clear_tid, usize::MAX);
+			}
+		}
+		// When the structures get dropped, all of the allocations get
+		// deallocated.
+		pl.retain(|p| {
+			if goes(p) {
+				sched::remove(p.pid);
+				unsafe {
+					ioring::remove(p.pid);
+					input::detach(p.pid);
+					rng::forget(p.pid);
+				}
+				false
+			}
+			else {
+				true
+			}
+		});
+		unfinished
+	});
+	for child in unfinished {
+		delete_process(child);
 	}
 }
 
 /// Get a process by PID. Since we leak the process list, this is
 /// unsafe since the process can be deleted and we'll still have a pointer.
 pub unsafe fn get_by_pid(pid: u16) -> *mut Process {
-	let mut ret = null_mut();
-	if let Some(mut pl) = PROCESS_LIST.take() {
-		for i in pl.iter_mut() {
-			if (*(i.frame)).pid as u16 == pid {
-				ret = i as *mut Process;
-				break;
-			}
-		}
-		PROCESS_LIST.replace(pl);
-	}
-	ret
+	// The scheduler keeps a PID map, so this isn't a walk of the
+	// process list anymore.
+	sched::lookup(pid)
 }
 
 /// We will eventually move this function out of here, but its
@@ -165,6 +273,12 @@ fn init_process() {
 	// we're running in User space.
 	println!("Init process started...");
 	loop {
+		// We only run when it's our turn anyway, so get some pages ready
+		// for zalloc() while we're here.
+		fill_zero_pool(4);
+		if USE_MEGAPAGES {
+			fill_zero_megapages();
+		}
 		// Alright, I forgot. We cannot put init to sleep since the
 		// scheduler will loop until it finds a process to run. Since
 		// the scheduler is called in an interrupt context, nothing else
@@ -173,25 +287,18 @@ fn init_process() {
 	}
 }
 
-/// Add a kernel process.
+/// Add a kernel process. This returns its PID, or 0 if there's no PID left.
 pub fn add_kernel_process(func: fn()) -> u16 {
-	// This is the Rust-ism that really trips up C++ programmers.
-	// PROCESS_LIST is wrapped in an Option<> enumeration, which
-	// means that the Option owns the Deque. We can only borrow from
-	// it or move ownership to us. In this case, we choose the
-	// latter, where we move ownership to us, add a process, and
-	// then move ownership back to the PROCESS_LIST.
-	// This allows mutual exclusion as anyone else trying to grab
-	// the process list will get None rather than the Deque.
-	// .take() will replace PROCESS_LIST with None and give
-	// us the only copy of the Deque.
+	// We build the process first and only take the process list (and the
+	// kernel lock with it) to push it on. Another hart may be adding a
+	// process at the same time.
 	let func_addr = func as usize;
 	let func_vaddr = func_addr; //- 0x6000_0000;
 			// println!("func_addr = {:x} -> {:x}", func_addr, func_vaddr);
-			// We will convert NEXT_PID below into an atomic increment when
-			// we start getting into multi-hart processing. For now, we want
-			// a process. Get it to work, then improve it!
-	let my_pid = unsafe { NEXT_PID };
+	let my_pid = match next_pid() {
+		Some(pid) => pid,
+		None => return 0,
+	};
 	let mut ret_proc =
 		Process { frame:       zalloc(1) as *mut TrapFrame,
 					stack:       zalloc(STACK_PAGES),
@@ -202,10 +309,11 @@ pub fn add_kernel_process(func: fn()) -> u16 {
 					sleep_until: 0,
 					program:     null_mut(),
 					brk:         0,
+					heap_start:  0,
+					image:       null_mut(),
+					leader:      null_mut(),
+					clear_tid:   0,
 					};
-	unsafe {
-		NEXT_PID += 1;
-	}
 	// Now we move the stack pointer to the bottom of the
 	// allocation. The spec shows that register x2 (2) is the stack
 	// pointer.
@@ -226,24 +334,10 @@ pub fn add_kernel_process(func: fn()) -> u16 {
 		(*ret_proc.frame).pid = ret_proc.pid as usize;
 	}
 
-	if let Some(mut pl) = unsafe { PROCESS_LIST.take() } {
-		pl.push_back(ret_proc);
-		// Now, we no longer need the owned Deque, so we hand it
-		// back by replacing the PROCESS_LIST's None with the
-		// Some(pl).
-		unsafe {
-			PROCESS_LIST.replace(pl);
-		}
+	with_process_list(0, move |pl| {
+		push_process(pl, ret_proc);
 		my_pid
-	}
-	else {
-		unsafe { PROCESS_LIST_MUTEX.unlock(); }
-		// TODO: When we get to multi-hart processing, we need to keep
-		// trying to grab the process list. We can do this with an
-		// atomic instruction. but right now, we're a single-processor
-		// computer.
-		0
-	}
+	})
 }
 
 /// A kernel process is just a function inside of the kernel. Each
@@ -257,108 +351,288 @@ fn ra_delete_proc() {
 
 /// This is the same as the add_kernel_process function, except you can pass
 /// arguments. Typically, this will be a memory address on the heap where
-/// arguments can be found.
+/// arguments can be found. If this returns 0, func never runs, so the caller
+/// still owns the arguments.
 pub fn add_kernel_process_args(func: fn(args_ptr: usize), args: usize) -> u16 {
-	// This is the Rust-ism that really trips up C++ programmers.
-	// PROCESS_LIST is wrapped in an Option<> enumeration, which
-	// means that the Option owns the Deque. We can only borrow from
-	// it or move ownership to us. In this case, we choose the
-	// latter, where we move ownership to us, add a process, and
-	// then move ownership back to the PROCESS_LIST.
-	// This allows mutual exclusion as anyone else trying to grab
-	// the process list will get None rather than the Deque.
-	unsafe {PROCESS_LIST_MUTEX.spin_lock(); }
-	if let Some(mut pl) = unsafe { PROCESS_LIST.take() } {
-		// .take() will replace PROCESS_LIST with None and give
-		// us the only copy of the Deque.
-		let func_addr = func as usize;
-		let func_vaddr = func_addr; //- 0x6000_0000;
-			    // println!("func_addr = {:x} -> {:x}", func_addr, func_vaddr);
-			    // We will convert NEXT_PID below into an atomic increment when
-			    // we start getting into multi-hart processing. For now, we want
-			    // a process. Get it to work, then improve it!
-		let my_pid = unsafe { NEXT_PID };
-		let mut ret_proc =
-			Process { frame:       zalloc(1) as *mut TrapFrame,
-			          stack:       zalloc(STACK_PAGES),
-			          pid:         my_pid,
-			          mmu_table:        zalloc(1) as *mut Table,
-			          state:       ProcessState::Running,
-			          data:        ProcessData::new(),
-					  sleep_until: 0, 
-					  program:		null_mut(),
-					  brk:         0,
-					};
-		unsafe {
-			NEXT_PID += 1;
-		}
-		// Now we move the stack pointer to the bottom of the
-		// allocation. The spec shows that register x2 (2) is the stack
-		// pointer.
-		// We could use ret_proc.stack.add, but that's an unsafe
-		// function which would require an unsafe block. So, convert it
-		// to usize first and then add PAGE_SIZE is better.
-		// We also need to set the stack adjustment so that it is at the
-		// bottom of the memory and far away from heap allocations.
-		unsafe {
-			(*ret_proc.frame).pc = func_vaddr;
-			(*ret_proc.frame).regs[Registers::A0 as usize] = args;
-			// 1 is the return address register. This makes it so we
-			// don't have to do syscall_exit() when a kernel process
-			// finishes.
-			(*ret_proc.frame).regs[Registers::Ra as usize] = ra_delete_proc as usize;
-			(*ret_proc.frame).regs[Registers::Sp as usize] =
-				ret_proc.stack as usize + STACK_PAGES * 4096;
-			(*ret_proc.frame).mode = CpuMode::Machine as usize;
-			(*ret_proc.frame).pid = ret_proc.pid as usize;
-		}
-		pl.push_back(ret_proc);
-		// Now, we no longer need the owned Deque, so we hand it
-		// back by replacing the PROCESS_LIST's None with the
-		// Some(pl).
-		unsafe {
-			PROCESS_LIST.replace(pl);
-			PROCESS_LIST_MUTEX.unlock();
-		}
+	// As in add_kernel_process(), the process list is only held for the
+	// push.
+	let func_addr = func as usize;
+	let func_vaddr = func_addr; //- 0x6000_0000;
+		    // println!("func_addr = {:x} -> {:x}", func_addr, func_vaddr);
+	let my_pid = match next_pid() {
+		Some(pid) => pid,
+		None => return 0,
+	};
+	let mut ret_proc =
+		Process { frame:       zalloc(1) as *mut TrapFrame,
+		          stack:       zalloc(STACK_PAGES),
+		          pid:         my_pid,
+		          mmu_table:        zalloc(1) as *mut Table,
+		          state:       ProcessState::Running,
+		          data:        ProcessData::new(),
+				  sleep_until: 0, 
+				  program:		null_mut(),
+				  brk:         0,
+				  heap_start:  0,
+				  image:       null_mut(),
+				  leader:      null_mut(),
+				  clear_tid:   0,
+				};
+	// Now we move the stack pointer to the bottom of the
+	// allocation. The spec shows that register x2 (2) is the stack
+	// pointer.
+	// We could use ret_proc.stack.add, but that's an unsafe
+	// function which would require an unsafe block. So, convert it
+	// to usize first and then add PAGE_SIZE is better.
+	// We also need to set the stack adjustment so that it is at the
+	// bottom of the memory and far away from heap allocations.
+	unsafe {
+		(*ret_proc.frame).pc = func_vaddr;
+		(*ret_proc.frame).regs[Registers::A0 as usize] = args;
+		// 1 is the return address register. This makes it so we
+		// don't have to do syscall_exit() when a kernel process
+		// finishes.
+		(*ret_proc.frame).regs[Registers::Ra as usize] = ra_delete_proc as usize;
+		(*ret_proc.frame).regs[Registers::Sp as usize] =
+			ret_proc.stack as usize + STACK_PAGES * 4096;
+		(*ret_proc.frame).mode = CpuMode::Machine as usize;
+		(*ret_proc.frame).pid = ret_proc.pid as usize;
+	}
+	with_process_list(0, move |pl| {
+		push_process(pl, ret_proc);
 		my_pid
+	})
+}
+
+/// Start a thread in parent's address space at entry, with its stack
+/// pointer at stack and arg in A0. If tid_addr isn't 0, the thread's id goes
+/// there before it can run, and it's cleared when the thread goes away.
+/// The caller makes sure that tid_addr is mapped. This returns the thread's
+/// id (a PID), or 0 if parent doesn't exist or there's no PID left.
+pub fn add_thread(parent: u16, entry: usize, stack: usize, arg: usize, tid_addr: usize) -> u16 {
+	let parent = match unsafe { get_by_pid(parent).as_mut() } {
+		Some(p) => p,
+		None => return 0,
+	};
+	let parent_frame = parent.frame;
+	let leader = parent.owner();
+	let tid = match next_pid() {
+		Some(pid) => pid,
+		None => return 0,
+	};
+	let thread = Process { frame:       zalloc(1) as *mut TrapFrame,
+	                       stack:       null_mut(),
+	                       pid:         tid,
+	                       mmu_table:   leader.mmu_table,
+	                       state:       ProcessState::Running,
+	                       data:        ProcessData::new(),
+	                       sleep_until: 0,
+	                       program:     null_mut(),
+	                       brk:         0,
+	                       heap_start:  0,
+	                       image:       null_mut(),
+	                       leader:      leader as *mut Process,
+	                       clear_tid:   tid_addr, };
+	unsafe {
+		let frame = &mut *thread.frame;
+		frame.pc = entry;
+		frame.regs[Registers::Sp as usize] = stack;
+		frame.regs[Registers::A0 as usize] = arg;
+		frame.mode = (*parent_frame).mode;
+		frame.pid = tid as usize;
+		// Same page table, same address space ID, so the TLB entries
+		// the leader's threads build up are good for all of them.
+		frame.satp = (*parent_frame).satp;
+		if tid_addr != 0 && frame.satp >> 60 != 0 {
+			let tid32 = tid as u32;
+			copy_to_user(&*thread.mmu_table, tid_addr, &tid32 as *const u32 as *const u8, 4);
+		}
 	}
-	else {
-		unsafe {
-			PROCESS_LIST_MUTEX.unlock();
+	with_process_list(0, move |pl| {
+		push_process(pl, thread);
+		tid
+	})
+}
+
+/// Pages the kernel writes into behind the process' back: it keeps the
+/// physical address of its rings, so a copy would never see anything. A
+/// fork()ed child starts without them and can ask for its own.
+fn kernel_shared(vaddr: usize) -> bool {
+	(vaddr >= IORING_VADDR && vaddr < IORING_VADDR + IORING_PAGES * PAGE_SIZE)
+	|| (vaddr >= EVENT_RING_VADDR && vaddr < EVENT_RING_VADDR + PAGE_SIZE)
+}
+
+/// Make a copy of the user process that pid belongs to. The child gets
+/// the process' descriptors, working directory, environment and break,
+/// and one thread, which picks up where pid's frame left off with 0 in
+/// A0. Its memory isn't copied: every page the process owns is mapped into
+/// the child as well, and the writable ones are made read-only and marked
+/// Cow on both sides. Whichever side stores to one first gets its own copy
+/// (see fault_in_cow()), so a fork costs a page table, not the process'
+/// memory. Pages that aren't the process' own, like the program's
+/// read-only pages, the clock and the framebuffer, are mapped as they are.
+///
+/// Other harts running our threads may still remember that the pages were
+/// writable, so the child starts out waiting, and nobody in our address
+/// space gets a copy of a page, until they've all forgotten. See
+/// fork_finish(), which the caller uses to wait for that.
+///
+/// This returns the child's PID, or the errno: EINVAL if pid isn't a user
+/// process, EBUSY if a device may be writing into our memory, and EAGAIN
+/// if there's no PID left for the child.
+pub fn fork(pid: u16) -> Result<u16, isize> {
+	let caller = match unsafe { get_by_pid(pid).as_mut() } {
+		Some(p) => p,
+		None => return Err(EINVAL),
+	};
+	let caller_frame = caller.frame;
+	if unsafe { (*caller_frame).satp >> 60 == 0 } {
+		return Err(EINVAL);
+	}
+	let parent = caller.owner();
+	let parent_pid = parent.pid;
+	let parent_ptr = parent as *mut Process;
+	// A block request writes into pages by their physical address, so it
+	// would write into the page the child shares with us, whoever copies it
+	// first. I/O rings are the only way a request can still be going
+	// while one of our threads runs.
+	let io_busy = with_process_list(false, |pl| {
+		pl.iter()
+		  .filter(|p| p.pid == parent_pid || p.leader == parent_ptr)
+		  .any(|p| unsafe { ioring::in_flight(p.pid) })
+	});
+	if io_busy {
+		return Err(EBUSY);
+	}
+	let child_pid = match next_pid() {
+		Some(pid) => pid,
+		None => return Err(EAGAIN),
+	};
+	// The stack is one allocation, but each page can stop being shared at
+	// a different time, so from now on it's STACK_PAGES allocations in
+	// our pages.
+	if !parent.stack.is_null() {
+		split(parent.stack);
+		for i in 0..STACK_PAGES {
+			parent.data.pages.push_back(parent.stack as usize + i * PAGE_SIZE);
+		}
+		parent.stack = null_mut();
+	}
+	let mut child = Process { frame:       zalloc(1) as *mut TrapFrame,
+	                          stack:       null_mut(),
+	                          pid:         child_pid,
+	                          mmu_table:   zalloc(1) as *mut Table,
+	                          state:       ProcessState::Waiting,
+	                          data:        ProcessData::new(),
+	                          sleep_until: 0,
+	                          program:     null_mut(),
+	                          brk:         parent.brk,
+	                          heap_start:  parent.heap_start,
+	                          image:       parent.image,
+	                          leader:      null_mut(),
+	                          clear_tid:   0, };
+	if !child.image.is_null() {
+		elf::acquire(child.image);
+	}
+	child.data.environ = parent.data.environ.clone();
+	child.data.fdesc = parent.data.fdesc.clone();
+	child.data.fd_bits = parent.data.fd_bits.clone();
+	child.data.cwd = parent.data.cwd.clone();
+	let owned: BTreeSet<usize> = parent.data.pages.iter().cloned().collect();
+	let child_table = unsafe { &mut *child.mmu_table };
+	let child_pages = &mut child.data.pages;
+	for_each_leaf(unsafe { &mut *parent.mmu_table }, |vaddr, entry, level| {
+		if kernel_shared(vaddr) {
+			return;
+		}
+		let paddr = (entry.get_entry() & !0x3ff) << 2;
+		let mut bits = entry.get_entry() & 0x3ff;
+		if owned.contains(&paddr) {
+			share(paddr as *mut u8);
+			child_pages.push_back(paddr);
+			if bits & EntryBits::Write.val() != 0 {
+				bits = (bits & !EntryBits::Write.val()) | EntryBits::Cow.val();
+				entry.set_entry((entry.get_entry() & !0x3ff) | bits);
+			}
+		}
+		map(child_table, vaddr, paddr, bits & !EntryBits::Valid.val(), level);
+	});
+	// Our pages just lost their write permission, and every hart that has
+	// run us may remember that they had it.
+	parent.data.forks_pending += 1;
+	caller.data.forking = child_pid;
+	satp_fence_asid(parent_pid as usize);
+	with_process_list((), |pl| {
+		for p in pl.iter().filter(|p| p.pid == parent_pid || p.leader == parent_ptr) {
+			sched::fence_elsewhere(p.pid);
 		}
-		// TODO: When we get to multi-hart processing, we need to keep
-		// trying to grab the process list. We can do this with an
-		// atomic instruction. but right now, we're a single-processor
-		// computer.
-		0
+	});
+	unsafe {
+		let frame = &mut *child.frame;
+		*frame = *caller_frame;
+		frame.regs[Registers::A0 as usize] = 0;
+		frame.pid = child_pid as usize;
+		frame.satp = build_satp(SatpMode::Sv39, child_pid as usize, child.mmu_table as usize);
+	}
+	// As in load_proc(), the hart may remember this ASID from before.
+	satp_fence_asid(child_pid as usize);
+	with_process_list((), move |pl| push_process(pl, child));
+	Ok(child_pid)
+}
+
+/// Whether pid is in the middle of a fork(), waiting on other harts.
+pub fn forking(pid: u16) -> bool {
+	match unsafe { get_by_pid(pid).as_ref() } {
+		Some(p) => p.data.forking != 0,
+		None => false,
 	}
 }
 
+/// Finish the fork() pid is making, if no other hart could still be
+/// writing through our old page permissions. Every hart that was running
+/// one of our threads got an IPI from fork(), and it fences when it goes
+/// through the scheduler. Until then, this returns None and the caller
+/// has to try again. Otherwise, the child can run, and we get its PID.
+pub fn fork_finish(pid: u16) -> Option<u16> {
+	let caller = unsafe { get_by_pid(pid).as_mut()? };
+	let child = caller.data.forking;
+	if caller.owner().threads_fence_pending() {
+		return None;
+	}
+	release_fork(caller);
+	Some(child)
+}
+
+/// Let the child of the fork() that caller is making run.
+fn release_fork(caller: &mut Process) {
+	let child = caller.data.forking;
+	caller.data.forking = 0;
+	caller.owner().data.forks_pending -= 1;
+	set_running(child);
+}
+
+/// Move a process into the process list and hand it to the scheduler. The
+/// process is boxed so that the scheduler's pointer to it doesn't move when
+/// the list does.
+pub fn push_process(pl: &mut VecDeque<Box<Process>>, process: Process) {
+	let mut process = Box::new(process);
+	sched::add(&mut *process as *mut Process);
+	pl.push_back(process);
+}
+
 /// This should only be called once, and its job is to create
 /// the init process. Right now, this process is in the kernel,
 /// but later, it should call the shell.
 pub fn init() -> usize {
 	unsafe {
-		PROCESS_LIST_MUTEX.spin_lock();
 		PROCESS_LIST = Some(VecDeque::with_capacity(15));
-		// add_process_default(init_process);
-		add_kernel_process(init_process);
-		// Ugh....Rust is giving me fits over here!
-		// I just want a memory address to the trap frame, but
-		// due to the borrow rules of Rust, I'm fighting here. So,
-		// instead, let's move the value out of PROCESS_LIST, get
-		// the address, and then move it right back in.
-		let pl = PROCESS_LIST.take().unwrap();
-		let p = pl.front().unwrap().frame;
-		// let frame = p as *const TrapFrame as usize;
-		// println!("Init's frame is at 0x{:08x}", frame);
-		// Put the process list back in the global.
-		PROCESS_LIST.replace(pl);
-		PROCESS_LIST_MUTEX.unlock();
-		// Return the first instruction's address to execute.
-		// Since we use the MMU, all start here.
-		(*p).pc
+		sched::init();
 	}
+	// add_process_default(init_process);
+	add_kernel_process(init_process);
+	// Return the first instruction's address to execute.
+	// Since we use the MMU, all start here.
+	with_process_list(0, |pl| unsafe { (*pl.front().unwrap().frame).pc })
 }
 
 // Our process must be able to sleep, wait, or run.
@@ -367,6 +641,190 @@ pub fn init() -> usize {
 // Waiting - means that the process is waiting on I/O
 // Dead - We should never get here, but we can flag a process as Dead and clean
 //        it out of the list later.
+/// What happened when we tried to resolve a page fault.
+pub enum Fault {
+	/// The page is mapped now, so run the instruction again.
+	Mapped,
+	/// The page is part of the program, but this page of the file hasn't
+	/// been read yet. Reading it means going to the block device, so the
+	/// process has to wait (see elf::page_in).
+	Load(usize),
+	/// Nothing should be here, or we're out of memory.
+	Bad,
+	/// The page can't be made writable until a fork() finishes (see
+	/// fork_finish()), or until the other harts forget the page it
+	/// replaced (see fault_in_cow()). Try again a little later.
+	Busy,
+}
+
+// How long something waiting on a fork() sleeps before it looks again, in
+// mtime ticks (100 us)
+pub const FORK_RETRY: usize = 1_000;
+
+// What fork() gives back when it can't
+pub const EAGAIN: isize = -11;
+pub const EBUSY: isize = -16;
+pub const EINVAL: isize = -22;
+
+impl Process {
+	/// The process whose address space, descriptors and working directory
+	/// this one uses. That's the leader for a thread and itself otherwise.
+	pub fn owner(&mut self) -> &mut Process {
+		if self.leader.is_null() {
+			self
+		}
+		else {
+			unsafe { &mut *self.leader }
+		}
+	}
+
+	/// Resolve a fault at vaddr. access is the EntryBits the access needs
+	/// (read, write or execute). Heap pages that brk() handed out are
+	/// zeroed and mapped here, and program pages come from the program's
+	/// elf::Image.
+	pub fn fault_in(&mut self, vaddr: usize, access: usize) -> Fault {
+		if !self.leader.is_null() {
+			return unsafe { (*self.leader).fault_in(vaddr, access) };
+		}
+		if self.mmu_table.is_null() {
+			return Fault::Bad;
+		}
+		let table = unsafe { self.mmu_table.as_mut().unwrap() };
+		if let Some(bits) = leaf_bits(table, vaddr) {
+			// A store to a page we share with a fork() gets a copy of
+			// its own.
+			if bits & EntryBits::Cow.val() != 0 && access & EntryBits::Write.val() != 0 {
+				return self.fault_in_cow(table, vaddr);
+			}
+			// Somebody else got here first, such as a syscall that
+			// faulted the range in before us. If the page is there and
+			// we still don't have permission, this is a bad access, such
+			// as a store into .text.
+			return if bits & access == access { Fault::Mapped } else { Fault::Bad };
+		}
+		if vaddr >= self.heap_start && vaddr < self.brk {
+			return self.fault_in_heap(table, vaddr);
+		}
+		if !self.image.is_null() {
+			// The page gets the segment's permissions, which may not be
+			// the ones that were asked for.
+			return match unsafe { elf::fault_in(&*self.image, table, &mut self.data.pages, vaddr) } {
+				Fault::Mapped => match leaf_bits(table, vaddr) {
+					Some(bits) if bits & access == access => Fault::Mapped,
+					_ => Fault::Bad,
+				},
+				other => other,
+			};
+		}
+		Fault::Bad
+	}
+
+	fn fault_in_heap(&mut self, table: &mut Table, vaddr: usize) -> Fault {
+		if USE_MEGAPAGES {
+			let mega = vaddr & !(MEGAPAGE_SIZE - 1);
+			if mega >= self.heap_start
+			   && mega + MEGAPAGE_SIZE <= self.brk
+			   && megapage_free(table, mega)
+			{
+				// We're in the trap handler, so we don't zero 2 MiB here.
+				// If there isn't one ready, fall back to a normal page.
+				let paddr = take_zeroed_megapage() as usize;
+				if paddr != 0 {
+					self.data.pages.push_back(paddr);
+					map(table, mega, paddr, EntryBits::UserReadWrite.val(), 1);
+					return Fault::Mapped;
+				}
+			}
+		}
+		let paddr = zalloc(1) as usize;
+		if paddr == 0 {
+			return Fault::Bad;
+		}
+		self.data.pages.push_back(paddr);
+		map(table, vaddr & !(PAGE_SIZE - 1), paddr, EntryBits::UserReadWrite.val(), 0);
+		Fault::Mapped
+	}
+
+	/// Make the copy-on-write page (or megapage) at vaddr writable. If the
+	/// other side of the fork() still has it, it's copied first. Our other
+	/// threads may remember the old page, which is the other side's now,
+	/// and would keep reading it instead of what we write into the copy.
+	/// So the copy stays read-only, and we come back with Fault::Busy,
+	/// until every hart has forgotten.
+	fn fault_in_cow(&mut self, table: &mut Table, vaddr: usize) -> Fault {
+		// Another hart may still be writing into the page we'd copy
+		// through what it remembers from before the fork(), and the copy
+		// wouldn't see it.
+		if self.data.forks_pending > 0 {
+			return Fault::Busy;
+		}
+		let (entry, level) = match leaf_mut(table, vaddr) {
+			Some(e) => e,
+			None => return Fault::Bad,
+		};
+		let old = (entry.get_entry() & !0x3ff) << 2;
+		let new = unshare(old as *mut u8, 1 << (9 * level), 12 + 9 * level) as usize;
+		if new == 0 {
+			return Fault::Bad;
+		}
+		if new != old {
+			// The copy replaces our share of the old page.
+			if let Some(slot) = self.data.pages.iter_mut().find(|p| **p == old) {
+				*slot = new;
+			}
+			// Still Cow, so the next fault finds the copy is ours alone
+			// and only has to make it writable.
+			entry.set_entry((new >> 2) | (entry.get_entry() & 0x3ff));
+			satp_fence_asid(self.pid as usize);
+			let me = self as *mut Process;
+			let pid = self.pid;
+			with_process_list((), |pl| {
+				for p in pl.iter().filter(|p| p.pid == pid || p.leader == me) {
+					sched::fence_elsewhere(p.pid);
+				}
+			});
+		}
+		if self.threads_fence_pending() {
+			return Fault::Busy;
+		}
+		let bits = (entry.get_entry() & 0x3ff & !EntryBits::Cow.val()) | EntryBits::Write.val();
+		entry.set_entry((new >> 2) | bits);
+		Fault::Mapped
+	}
+
+	/// Whether a hart is running one of our threads (or us) and may still
+	/// remember our page table from before a fence_elsewhere().
+	fn threads_fence_pending(&mut self) -> bool {
+		let me = self as *mut Process;
+		let pid = self.pid;
+		with_process_list(false, |pl| {
+			pl.iter()
+			  .filter(|p| p.pid == pid || p.leader == me)
+			  .any(|p| sched::fence_pending(p.pid))
+		})
+	}
+
+	/// Fault in every page in [vaddr, vaddr + len). The kernel walks the
+	/// page table itself when it copies to or from a process, so it never
+	/// takes the page fault that would normally do this. We stop at the
+	/// first page that needs the block device or can't be mapped at all.
+	pub fn fault_in_range(&mut self, vaddr: usize, len: usize, access: usize) -> Fault {
+		if len == 0 {
+			return Fault::Mapped;
+		}
+		let mut page = vaddr & !(PAGE_SIZE - 1);
+		let end = vaddr.saturating_add(len);
+		while page < end {
+			match self.fault_in(page, access) {
+				Fault::Mapped => {},
+				other => return other,
+			}
+			page += PAGE_SIZE;
+		}
+		Fault::Mapped
+	}
+}
+
 pub enum ProcessState {
 	Running,
 	Sleeping,
@@ -384,14 +842,36 @@ pub struct Process {
 	pub sleep_until: usize,
 	pub program:	 *mut u8,
 	pub brk:         usize,
+	// brk() only records the new break. Pages in [heap_start, brk) are
+	// mapped by fault_in() the first time they're touched.
+	pub heap_start:  usize,
+	// The program this process is running, which is shared with every
+	// other process running it. Kernel processes don't have one.
+	pub image:       *mut elf::Image,
+	// If this is a thread, the process that made it with clone(). The two
+	// share a page table, and the thread uses the leader's descriptors,
+	// break and pages (see owner()). This is null for a normal process.
+	pub leader:      *mut Process,
+	// Where clone() put this thread's id. When the thread goes away, we
+	// store 0 there and wake the futex on it, which is how join() works.
+	pub clear_tid:   usize,
 }
 
 impl Drop for Process {
 	/// Since we're storing ownership of a Process in the linked list,
 	/// we can cause it to deallocate automatically when it is removed.
 	fn drop(&mut self) {
-		// We allocate the stack as a page.
-		dealloc(self.stack);
+		// Everything but the trap frame belongs to the leader, and the
+		// leader outlives its threads.
+		if !self.leader.is_null() {
+			dealloc(self.frame as *mut u8);
+			return;
+		}
+		// We allocate the stack as a page. fork() splits it up and
+		// moves it into our pages.
+		if !self.stack.is_null() {
+			dealloc(self.stack);
+		}
 		// This is unsafe, but it's at the drop stage, so we won't
 		// be using this again.
 		unsafe {
@@ -410,13 +890,20 @@ impl Drop for Process {
 		if !self.program.is_null() {
 			dealloc(self.program);
 		}
+		// Pages we shared with other users of the image are only freed
+		// once nobody is using it anymore.
+		if !self.image.is_null() {
+			elf::release(self.image);
+		}
 	}
 }
 
+#[derive(Clone)]
 pub enum Descriptor {
-	File(Inode),
+	File(OpenFile),
 	Device(usize),
-	Framebuffer,
+	// The offset write() is at
+	Framebuffer(usize),
 	ButtonEvents,
 	AbsoluteEvents,
 	Console,
@@ -424,6 +911,45 @@ pub enum Descriptor {
 	Unknown,
 }
 
+// How many descriptors a process can have open, counting stdin, stdout,
+// and stderr.
+pub const MAX_FDS: usize = 256;
+
+/// Which descriptor numbers are taken, one bit each. This gives us the
+/// lowest free number, like POSIX wants, by looking at a few words instead
+/// of every open descriptor.
+#[derive(Clone)]
+pub struct FdBitmap {
+	words: [u64; MAX_FDS / 64],
+}
+
+impl FdBitmap {
+	pub fn new() -> Self {
+		// 0, 1, and 2 are stdin, stdout, and stderr.
+		let mut words = [0; MAX_FDS / 64];
+		words[0] = 0b111;
+		Self { words }
+	}
+
+	pub fn alloc(&mut self) -> Option<u16> {
+		for (i, w) in self.words.iter_mut().enumerate() {
+			if *w != !0 {
+				let bit = (!*w).trailing_zeros();
+				*w |= 1 << bit;
+				return Some((i * 64) as u16 + bit as u16);
+			}
+		}
+		None
+	}
+
+	pub fn free(&mut self, fd: u16) {
+		let fd = fd as usize;
+		if fd > 2 && fd < MAX_FDS {
+			self.words[fd / 64] &= !(1 << (fd % 64));
+		}
+	}
+}
+
 // The private data in a process contains information
 // that is relevant to where we are, including the path
 // and open file descriptors.
@@ -433,8 +959,17 @@ pub enum Descriptor {
 pub struct ProcessData {
 	pub environ: BTreeMap<String, String>,
 	pub fdesc: BTreeMap<u16, Descriptor>,
+	pub fd_bits: FdBitmap,
 	pub cwd: String,
 	pub pages: VecDeque<usize>,
+	// Samples of where we've been, once we've asked for them. See
+	// profile.rs.
+	pub profile: Option<Box<Profile>>,
+	// The child of the fork() this process is in the middle of, or 0
+	pub forking: u16,
+	// How many fork()s are in the middle of being made in this address
+	// space. This is kept by the leader.
+	pub forks_pending: usize,
 }
 
 // This is private data that we can query with system calls.
@@ -445,8 +980,25 @@ impl ProcessData {
 		ProcessData { 
 			environ: BTreeMap::new(),
 			fdesc: BTreeMap::new(),
+			fd_bits: FdBitmap::new(),
 			cwd: String::from("/"),
 			pages: VecDeque::new(),
+			profile: None,
+			forking: 0,
+			forks_pending: 0,
 		 }
 	}
+
+	/// Give desc the lowest free descriptor number, or None if we're out.
+	pub fn add_fd(&mut self, desc: Descriptor) -> Option<u16> {
+		let fd = self.fd_bits.alloc()?;
+		self.fdesc.insert(fd, desc);
+		Some(fd)
+	}
+
+	pub fn remove_fd(&mut self, fd: u16) -> Option<Descriptor> {
+		let desc = self.fdesc.remove(&fd)?;
+		self.fd_bits.free(fd);
+		Some(desc)
+	}
 }
@@ -0,0 +1,151 @@
+// profile.rs
+// Sampling profiler
+// A process that asks to be profiled gets the timer on its hart set to go
+// off more often than the scheduler needs it to. Each time it goes off,
+// we write down the PC and PID it interrupted, and unless the quantum is
+// up, we go straight back. The samples pile up in the process (threads
+// share their leader's) until it reads them out with the profile system
+// call (1040). Nothing changes for processes that aren't being profiled.
+
+use crate::{cpu::{memcpy, FREQ, CONTEXT_SWITCH_TIME},
+            page::{copy_to_user, Table},
+            sched};
+use alloc::{boxed::Box, vec::Vec};
+use core::{cmp::min, mem::size_of};
+
+// The operations the profile system call takes in A0.
+pub const PROFILE_START: usize = 0;
+pub const PROFILE_STOP: usize = 1;
+pub const PROFILE_READ: usize = 2;
+
+// How many samples a process holds before we start dropping them. This is
+// a little over 8 seconds at 1000 Hz, and 128 KiB.
+pub const PROFILE_MAX_SAMPLES: usize = 8192;
+// The fastest we sample, in Hz. Much faster and we'd be spending more time
+// in the trap than in the program.
+pub const PROFILE_MAX_RATE: usize = 20_000;
+
+// This must match startlib/profile.h.
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct Sample {
+	pub pc:  usize,
+	pub pid: usize,
+}
+
+pub struct Profile {
+	// mtime ticks between samples
+	interval: u64,
+	// Stopping keeps the samples around until they're read.
+	running:  bool,
+	samples:  Vec<Sample>,
+	dropped:  usize,
+}
+
+// How many processes are being profiled. The timer doesn't look any
+// further while this is 0. Profiles start and stop under the kernel lock.
+static mut PROFILING: usize = 0;
+
+impl Profile {
+	pub fn new() -> Box<Profile> {
+		// Make room for every sample now, so that the timer never
+		// allocates.
+		Box::new(Profile { interval: CONTEXT_SWITCH_TIME,
+		                   running:  false,
+		                   samples:  Vec::with_capacity(PROFILE_MAX_SAMPLES),
+		                   dropped:  0, })
+	}
+
+	/// Sample at rate samples a second. We never sample slower than once a
+	/// quantum, since that's how often the timer goes off anyway.
+	pub fn start(&mut self, rate: usize) {
+		let rate = min(rate, PROFILE_MAX_RATE);
+		self.interval = if rate == 0 { CONTEXT_SWITCH_TIME } else { min(FREQ / rate as u64, CONTEXT_SWITCH_TIME) };
+		if !self.running {
+			self.running = true;
+			unsafe {
+				PROFILING += 1;
+			}
+		}
+	}
+
+	pub fn stop(&mut self) {
+		if self.running {
+			self.running = false;
+			unsafe {
+				PROFILING -= 1;
+			}
+		}
+	}
+
+	/// Copy the oldest samples we have into len bytes at buf and forget
+	/// them. table is None for a kernel process, whose buf is a physical
+	/// address. Returns how many we copied.
+	pub unsafe fn read(&mut self, table: Option<&Table>, buf: usize, len: usize) -> usize {
+		let count = min(len / size_of::<Sample>(), self.samples.len());
+		let bytes = count * size_of::<Sample>();
+		let copied = match table {
+			Some(t) => copy_to_user(t, buf, self.samples.as_ptr() as *const u8, bytes),
+			None => {
+				memcpy(buf as *mut u8, self.samples.as_ptr() as *const u8, bytes);
+				bytes
+			}
+		} / size_of::<Sample>();
+		self.samples.drain(..copied);
+		copied
+	}
+
+	pub fn dropped(&self) -> usize {
+		self.dropped
+	}
+}
+
+impl Drop for Profile {
+	fn drop(&mut self) {
+		self.stop();
+	}
+}
+
+/// The timer went off while this hart was running whatever it's running
+/// now. If that's being profiled, write down where it was.
+pub fn sample(pc: usize) {
+	unsafe {
+		if PROFILING == 0 {
+			return;
+		}
+		let process = sched::current();
+		if process.is_null() {
+			return;
+		}
+		let pid = (*process).pid as usize;
+		match (*process).owner().data.profile.as_mut() {
+			Some(p) if p.running => {
+				if p.samples.len() < PROFILE_MAX_SAMPLES {
+					p.samples.push(Sample { pc, pid });
+				}
+				else {
+					p.dropped += 1;
+				}
+			},
+			_ => {},
+		}
+	}
+}
+
+/// When the timer should go off next, given that it's now and this
+/// hart's quantum is up at end.
+pub fn next_timer(now: u64, end: u64) -> u64 {
+	unsafe {
+		if PROFILING == 0 {
+			return end;
+		}
+		let process = sched::current();
+		if process.is_null() {
+			return end;
+		}
+		match (*process).owner().data.profile.as_ref() {
+			Some(p) if p.running => min(now.wrapping_add(p.interval), end),
+			_ => end,
+		}
+	}
+}
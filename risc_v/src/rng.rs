@@ -2,29 +2,87 @@
 // Random number generator using VirtIO
 // Stephen Marz
 // 16 March 2020
+//
+// The entropy device is slow, and a request costs a trap and an interrupt
+// however little it asks for, so we never go to it for what somebody
+// wants right now. Each device owns a page-sized pool that it fills in one
+// request, in the background, whenever the pool runs dry. What programs
+// get comes out of a ChaCha20 generator, which takes a fresh key from the
+// pool when it first starts and every RESEED_BYTES after that. The
+// generator throws its key away and makes a new one out of its own output
+// every time it's used, so a key that leaks later can't give back
+// anything that came out before it.
+//
+// User space gets at it with getrandom (278), as on Linux.
 
 #![allow(dead_code)]
-use crate::{kmem::{kfree, kmalloc},
-            page::{zalloc, PAGE_SIZE},
+use crate::{cpu::{get_mtime, memcpy},
+            page::{copy_to_user, zalloc, Table, PAGE_SIZE},
+            process::set_running,
             virtio,
             virtio::{Descriptor, MmioOffsets, Queue, StatusField, VIRTIO_RING_SIZE}};
-use core::{mem::size_of, ptr::null_mut};
+use alloc::vec::Vec;
+use core::{cmp::min, mem::size_of, ptr::null_mut};
+
+// How many bytes of entropy one request asks the device for.
+pub const POOL_SIZE: usize = PAGE_SIZE;
+// How much the generator gives out before it takes a new key from a pool.
+pub const RESEED_BYTES: usize = 1 << 20;
+// The most one getrandom call gives back. Like Linux, asking for more
+// gets a short count, and the caller goes around again.
+pub const GETRANDOM_MAX: usize = 1 << 16;
+
+// Without an entropy device, getrandom fails with EAGAIN instead of
+// handing out bytes that anyone who can guess the boot time can
+// reproduce. Turn this on to seed from the clock anyway, for a machine
+// that only needs the numbers to look random.
+pub const CLOCK_SEED: bool = false;
+
+// getrandom's flags. These are Linux's.
+pub const GRND_NONBLOCK: usize = 1;
+pub const GRND_RANDOM: usize = 2;
 
 pub struct EntropyDevice {
 	queue:        *mut Queue,
 	dev:          *mut u32,
 	idx:          u16,
 	ack_used_idx: u16,
+	// The device writes pool[..POOL_SIZE] while busy is set. Otherwise,
+	// pool[..avail] is entropy that nobody has taken yet. We take it from
+	// the top down and zero it as we go.
+	pool:         *mut u8,
+	avail:        usize,
+	busy:         bool,
 }
 impl EntropyDevice {
 	pub const fn new() -> Self {
 		EntropyDevice { queue:        null_mut(),
 		                dev:          null_mut(),
 		                idx:          0,
-		                ack_used_idx: 0, }
+		                ack_used_idx: 0,
+		                pool:         null_mut(),
+		                avail:        0,
+		                busy:         false, }
 	}
 }
 
+struct ChaCha {
+	key:    [u32; 8],
+	// Whether the key has come from a device yet
+	seeded: bool,
+	// Bytes given out since the last reseed
+	used:   usize,
+}
+
+// Everything here only runs under the kernel lock, so, like the other
+// drivers, none of it needs a lock of its own.
+static mut CHACHA: ChaCha = ChaCha { key: [0; 8], seeded: false, used: 0 };
+// PIDs waiting in getrandom for the first seed
+static mut RNG_WAITERS: Vec<u16> = Vec::new();
+// Set if there's no entropy device and CLOCK_SEED let us fall back on the
+// clock.
+static mut WEAK_SEED: bool = false;
+
 static mut ENTROPY_DEVICES: [Option<EntropyDevice>; 8] = [
 	None,
 	None,
@@ -118,34 +176,298 @@ pub fn setup_entropy_device(ptr: *mut u32) -> bool {
 		status_bits |= StatusField::DriverOk.val32();
 		ptr.add(MmioOffsets::Status.scale32()).write_volatile(status_bits);
 
-		let rngdev = EntropyDevice {
-			queue: queue_ptr,
-			dev: ptr,
-			idx: 0,
-			ack_used_idx: 0,
-		};
+		let rngdev = EntropyDevice { queue: queue_ptr,
+		                             dev: ptr,
+		                             idx: 0,
+		                             ack_used_idx: 0,
+		                             pool: zalloc(POOL_SIZE / PAGE_SIZE),
+		                             avail: 0,
+		                             busy: false, };
 
 		ENTROPY_DEVICES[idx] = Some(rngdev);
+		// Get the first pool going now, so we're seeded by the time
+		// anybody asks.
+		refill(ENTROPY_DEVICES[idx].as_mut().unwrap());
 
 		true
 	}
 }
 
-pub fn get_random() -> u64 {
+/// Ask the device to fill its pool, unless it's already at it or there's
+/// still something in it.
+fn refill(edev: &mut EntropyDevice) {
+	if edev.busy || edev.avail > 0 {
+		return;
+	}
+	unsafe {
+		// There's only ever one request out, so it always has the
+		// same descriptor.
+		let head = edev.idx;
+		(*edev.queue).desc[head as usize] = Descriptor { addr:  edev.pool as u64,
+		                                                 len:   POOL_SIZE as u32,
+		                                                 flags: virtio::VIRTIO_DESC_F_WRITE,
+		                                                 next:  0, };
+		edev.idx = (edev.idx + 1) % VIRTIO_RING_SIZE as u16;
+		(*edev.queue).avail.ring[(*edev.queue).avail.idx as usize % VIRTIO_RING_SIZE] = head;
+		// The descriptor has to be written before the device can see the
+		// new avail index.
+		core::sync::atomic::fence(core::sync::atomic::Ordering::SeqCst);
+		(*edev.queue).avail.idx = (*edev.queue).avail.idx.wrapping_add(1);
+		edev.busy = true;
+		// The only queue an entropy device has is 0, the request queue.
+		edev.dev.add(MmioOffsets::QueueNotify.scale32()).write_volatile(0);
+	}
+}
+
+fn pending(edev: &mut EntropyDevice) {
 	unsafe {
-		for i in ENTROPY_DEVICES.iter() {
-			if let Some(_edev) = i {
-				let ptr = kmalloc(8);
-				let _desc = Descriptor { addr:  ptr as u64,
-										len:   8,
-										flags: virtio::VIRTIO_DESC_F_WRITE,
-										next:  0, };
-				let _val = *ptr as u64;
-				kfree(ptr);
-				break;
+		let ref queue = *edev.queue;
+		while edev.ack_used_idx != queue.used.idx {
+			let ref elem = queue.used.ring[edev.ack_used_idx as usize % VIRTIO_RING_SIZE];
+			edev.ack_used_idx = edev.ack_used_idx.wrapping_add(1);
+			// The device is allowed to give us less than we asked for.
+			edev.avail = min(elem.len as usize, POOL_SIZE);
+			edev.busy = false;
+		}
+		if edev.avail == 0 {
+			// It gave us nothing, so ask again.
+			refill(edev);
+			return;
+		}
+		if !CHACHA.seeded {
+			reseed();
+			for pid in RNG_WAITERS.drain(..) {
+				set_running(pid);
 			}
 		}
 	}
+}
+
+pub fn handle_interrupt(idx: usize) {
+	unsafe {
+		if let Some(edev) = ENTROPY_DEVICES[idx].as_mut() {
+			pending(edev);
+		}
+		else {
+			println!("Invalid entropy device for interrupt {}", idx + 1);
+		}
+	}
+}
+
+/// Take len bytes out of whichever pool has them into out, and start a
+/// refill of any pool that's empty. Returns false if none had enough.
+fn take(out: &mut [u8]) -> bool {
+	let mut got = false;
+	unsafe {
+		for e in ENTROPY_DEVICES.iter_mut() {
+			if let Some(edev) = e {
+				if !got && !edev.busy && edev.avail >= out.len() {
+					edev.avail -= out.len();
+					let src = edev.pool.add(edev.avail);
+					memcpy(out.as_mut_ptr(), src, out.len());
+					src.write_bytes(0, out.len());
+					got = true;
+				}
+				refill(edev);
+			}
+		}
+	}
+	got
+}
+
+fn is_present() -> bool {
+	unsafe { ENTROPY_DEVICES.iter().any(|e| e.is_some()) }
+}
+
+// ChaCha20, as in RFC 8439.
+fn quarter_round(s: &mut [u32; 16], a: usize, b: usize, c: usize, d: usize) {
+	s[a] = s[a].wrapping_add(s[b]);
+	s[d] = (s[d] ^ s[a]).rotate_left(16);
+	s[c] = s[c].wrapping_add(s[d]);
+	s[b] = (s[b] ^ s[c]).rotate_left(12);
+	s[a] = s[a].wrapping_add(s[b]);
+	s[d] = (s[d] ^ s[a]).rotate_left(8);
+	s[c] = s[c].wrapping_add(s[d]);
+	s[b] = (s[b] ^ s[c]).rotate_left(7);
+}
+
+/// Write block counter of key's keystream into out. The nonce is always 0,
+/// since no key is ever used for more than one run of blocks.
+fn chacha_block(key: &[u32; 8], counter: u32, out: &mut [u8]) {
+	let mut init = [0u32; 16];
+	// "expand 32-byte k"
+	init[0] = 0x6170_7865;
+	init[1] = 0x3320_646e;
+	init[2] = 0x7962_2d32;
+	init[3] = 0x6b20_6574;
+	init[4..12].copy_from_slice(key);
+	init[12] = counter;
+	let mut s = init;
+	for _ in 0..10 {
+		quarter_round(&mut s, 0, 4, 8, 12);
+		quarter_round(&mut s, 1, 5, 9, 13);
+		quarter_round(&mut s, 2, 6, 10, 14);
+		quarter_round(&mut s, 3, 7, 11, 15);
+		quarter_round(&mut s, 0, 5, 10, 15);
+		quarter_round(&mut s, 1, 6, 11, 12);
+		quarter_round(&mut s, 2, 7, 8, 13);
+		quarter_round(&mut s, 3, 4, 9, 14);
+	}
+	for i in 0..16 {
+		out[i * 4..i * 4 + 4].copy_from_slice(&s[i].wrapping_add(init[i]).to_le_bytes());
+	}
+}
+
+// How much generate() makes at a time, on the stack
+const CHUNK: usize = 512;
+
+/// Fill out (at most CHUNK bytes) from the generator. Block 0 becomes the
+/// next key before any of the rest leaves here.
+fn generate(out: &mut [u8]) {
+	let mut block = [0u8; 64];
+	unsafe {
+		chacha_block(&CHACHA.key, 0, &mut block);
+		let key = CHACHA.key;
+		for i in 0..8 {
+			CHACHA.key[i] = u32::from_le_bytes([block[i * 4], block[i * 4 + 1], block[i * 4 + 2], block[i * 4 + 3]]);
+		}
+		for (i, part) in out.chunks_mut(64).enumerate() {
+			chacha_block(&key, i as u32 + 1, &mut block);
+			part.copy_from_slice(&block[..part.len()]);
+		}
+		CHACHA.used += out.len();
+	}
+	wipe(&mut block);
+}
 
-	0u64.wrapping_sub(1)
+/// Zero something that held key material. The volatile writes keep the
+/// compiler from deciding nobody will read it again.
+fn wipe(buf: &mut [u8]) {
+	for b in buf.iter_mut() {
+		unsafe {
+			(b as *mut u8).write_volatile(0);
+		}
+	}
+}
+
+/// Mix 32 bytes from a pool into the key. If there aren't any, we keep
+/// the key we have and try again after the next chunk.
+fn reseed() {
+	let mut fresh = [0u8; 32];
+	if !take(&mut fresh) {
+		return;
+	}
+	let mut block = [0u8; 64];
+	unsafe {
+		chacha_block(&CHACHA.key, 0, &mut block);
+		for i in 0..8 {
+			CHACHA.key[i] = u32::from_le_bytes([block[i * 4] ^ fresh[i * 4],
+			                                    block[i * 4 + 1] ^ fresh[i * 4 + 1],
+			                                    block[i * 4 + 2] ^ fresh[i * 4 + 2],
+			                                    block[i * 4 + 3] ^ fresh[i * 4 + 3]]);
+		}
+		CHACHA.seeded = true;
+		CHACHA.used = 0;
+	}
+	wipe(&mut block);
+	wipe(&mut fresh);
+}
+
+fn mix_clock() {
+	unsafe {
+		let now = get_mtime() as u64;
+		CHACHA.key[0] ^= now as u32;
+		CHACHA.key[1] ^= (now >> 32) as u32;
+	}
+}
+
+/// Without an entropy device, the best we've got is how long it's been
+/// since we booted. That's enough for hash seeds, but nothing that needs
+/// to be secret, so we only do this if CLOCK_SEED says so.
+fn weak_seed() {
+	unsafe {
+		if !WEAK_SEED {
+			println!("rng: no entropy device, seeding from the clock");
+			WEAK_SEED = true;
+		}
+		mix_clock();
+		CHACHA.seeded = true;
+		CHACHA.used = 0;
+	}
+}
+
+/// Whether getrandom will ever be able to go ahead. It won't if there's
+/// no entropy device and we aren't allowed to use the clock instead.
+pub fn available() -> bool {
+	unsafe { CHACHA.seeded || is_present() || CLOCK_SEED }
+}
+
+/// Whether getrandom can go ahead now. If not, pid goes on the list to
+/// be woken by the first pool to come in. Without a device, nothing ever
+/// comes in, so check available() first.
+pub fn ready(pid: u16) -> bool {
+	unsafe {
+		if CHACHA.seeded {
+			return true;
+		}
+		if !is_present() {
+			if CLOCK_SEED {
+				weak_seed();
+			}
+			return CHACHA.seeded;
+		}
+		reseed();
+		if !CHACHA.seeded && pid != 0 {
+			RNG_WAITERS.push(pid);
+		}
+		CHACHA.seeded
+	}
+}
+
+/// pid is exiting, so the first pool mustn't wake it, or whoever gets
+/// its PID next.
+pub fn forget(pid: u16) {
+	unsafe {
+		RNG_WAITERS.retain(|&p| p != pid);
+	}
+}
+
+/// The getrandom system call, once ready() says we can. The buffer is
+/// already faulted in. table is None for a kernel process, whose buf is
+/// a physical address. Returns how many bytes we wrote.
+pub unsafe fn getrandom(table: Option<&Table>, buf: usize, len: usize) -> usize {
+	let len = min(len, GETRANDOM_MAX);
+	let mut chunk = [0u8; CHUNK];
+	let mut done = 0;
+	while done < len {
+		if CHACHA.used >= RESEED_BYTES {
+			reseed();
+		}
+		let n = min(CHUNK, len - done);
+		generate(&mut chunk[..n]);
+		let copied = match table {
+			Some(t) => copy_to_user(t, buf + done, chunk.as_ptr(), n),
+			None => {
+				memcpy((buf + done) as *mut u8, chunk.as_ptr(), n);
+				n
+			}
+		};
+		done += copied;
+		if copied < n {
+			break;
+		}
+	}
+	wipe(&mut chunk);
+	done
+}
+
+/// 64 random bits for the kernel. Until the first pool comes in, these
+/// are only as good as the clock.
+pub fn get_random() -> u64 {
+	if !ready(0) {
+		mix_clock();
+	}
+	let mut out = [0u8; 8];
+	generate(&mut out);
+	u64::from_le_bytes(out)
 }
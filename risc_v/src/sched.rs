@@ -3,48 +3,403 @@
 // Stephen Marz
 // 27 Dec 2019
 
-use crate::process::{ProcessState, PROCESS_LIST, PROCESS_LIST_MUTEX};
-use crate::cpu::get_mtime;
+use crate::process::{delete_process, Process, ProcessState};
+use crate::trace;
+use crate::cpu::{get_mtime, mhartid_read, satp_fence_asid, send_ipi, without_interrupts, CpuMode, TrapFrame, MAX_HARTS};
+use alloc::{collections::{BTreeMap, BinaryHeap, VecDeque}, vec::Vec};
+use core::cmp::Reverse;
+use core::ptr::null_mut;
 
-pub fn schedule() -> usize {
-	let mut frame_addr: usize = 0x1111;
+// The process list still owns the processes, but we don't walk it to
+// schedule anymore. Instead, we keep our own bookkeeping:
+//   1. A PID -> process map, so we never have to search for a process.
+//   2. For each hart, one run queue per priority, holding the PIDs that
+//      can run there. A process stays on the hart it last ran on, where
+//      its data is probably still in the cache. A hart that runs out of
+//      work steals from the others.
+//   3. A min-heap of sleepers ordered by when they wake up, so each
+//      tick is one look at the earliest deadline, not one per sleeper.
+// The run queues are lazy: when a process stops running, we leave its PID
+// where it is and throw it away when it gets to the front.
+// All of this is shared by every hart, so we only touch it with the kernel
+// lock held (see without_interrupts).
+
+/// Priority 0 is the highest. Kernel processes start there since they are
+/// usually finishing I/O for somebody else. User processes start at
+/// DEFAULT_PRIORITY and can nice themselves down to the lowest.
+pub const NUM_PRIORITIES: usize = 4;
+pub const KERNEL_PRIORITY: usize = 0;
+pub const DEFAULT_PRIORITY: usize = 1;
+
+// Higher priorities get more turns, but every non-empty queue gets
+// some, so a busy process at priority 1 (like init) can't starve a
+// niced one forever.
+const PRIORITY_WEIGHTS: [usize; NUM_PRIORITIES] = [8, 4, 2, 1];
+
+struct Task {
+	process:  *mut Process,
+	priority: usize,
+	// Set when this PID is sitting in a run queue, so we don't add it
+	// twice.
+	queued:   bool,
+	// Set while a hart is running it. It goes back on a queue when that
+	// hart schedules again.
+	running:  bool,
+	// Whose run queue it goes in
+	hart:     usize,
+	// One bit per hart that has to fence this address space before it
+	// runs this again (see fence_elsewhere()).
+	stale:    usize,
+}
+
+struct Hart {
+	queues:  [VecDeque<u16>; NUM_PRIORITIES],
+	credits: [usize; NUM_PRIORITIES],
+	// What this hart is running. None means it's idle.
+	current: Option<u16>,
+	online:  bool,
+}
+
+struct Scheduler {
+	tasks:    BTreeMap<u16, Task>,
+	harts:    Vec<Hart>,
+	sleepers: BinaryHeap<Reverse<(usize, u16)>>,
+}
+
+static mut SCHEDULER: Option<Scheduler> = None;
+
+// What a hart runs when there's nothing else: a wfi loop in machine mode
+// (hart_idle in trap.S). It has a frame like a process so that traps
+// taken while idle have somewhere to go.
+static mut IDLE_FRAMES: [TrapFrame; MAX_HARTS] = [TrapFrame::new(); MAX_HARTS];
+
+extern "C" {
+	fn hart_idle();
+}
+
+pub fn init() {
 	unsafe {
-		// If we can't get the lock, then usually this means a kernel
-		// process has the lock. So, we return 0. This has a special
-		// meaning to whomever calls the scheduler to say "nobody else got scheduled"
-		if PROCESS_LIST_MUTEX.try_lock() == false {
-			return 0;
-		}
-		if let Some(mut pl) = PROCESS_LIST.take() {
-			// Rust allows us to label loops so that break statements can be
-			// targeted.
-			'procfindloop: loop {
-				pl.rotate_left(1);
-				if let Some(prc) = pl.front_mut() {
-					match prc.state {
-						ProcessState::Running => {
-							frame_addr = prc.frame as usize;
-							break 'procfindloop;
-						},
-						ProcessState::Sleeping => {
-							// Awaken sleeping processes whose sleep until is in
-							// the past.
-							if prc.sleep_until <= get_mtime() {
-								prc.state = ProcessState::Running;
-								frame_addr = prc.frame as usize;
-								break 'procfindloop;
-							}
-						},
-						_ => {},
+		let mut harts = Vec::with_capacity(MAX_HARTS);
+		for h in 0..MAX_HARTS {
+			harts.push(Hart { queues:  [VecDeque::new(), VecDeque::new(), VecDeque::new(), VecDeque::new()],
+			                  credits: PRIORITY_WEIGHTS,
+			                  current: None,
+			                  online:  false, });
+			let frame = &mut IDLE_FRAMES[h];
+			frame.pc = hart_idle as usize;
+			frame.mode = CpuMode::Machine as usize;
+			frame.hartid = h;
+		}
+		SCHEDULER = Some(Scheduler { tasks: BTreeMap::new(),
+		                             harts,
+		                             sleepers: BinaryHeap::new() });
+	}
+}
+
+/// Run f on the scheduler with the kernel lock held.
+fn with_scheduler<R, F: FnOnce(&mut Scheduler) -> R>(default: R, f: F) -> R {
+	without_interrupts(|| unsafe {
+		match SCHEDULER.as_mut() {
+			Some(s) => f(s),
+			None => default,
+		}
+	})
+}
+
+/// A hart is up and can be given work.
+pub fn start_hart(hart: usize) {
+	with_scheduler((), |s| s.harts[hart].online = true);
+}
+
+impl Scheduler {
+	/// Put the PID on the back of its hart's run queue for its priority,
+	/// unless it's already in one or running. If its hart is busy and
+	/// another one is idle, poke the idle one so that it comes and takes it.
+	fn enqueue(&mut self, pid: u16) {
+		let (hart, priority) = match self.tasks.get_mut(&pid) {
+			Some(task) if !task.queued && !task.running => {
+				task.queued = true;
+				(task.hart, task.priority)
+			},
+			_ => return,
+		};
+		self.harts[hart].queues[priority].push_back(pid);
+		let target = if self.harts[hart].current.is_none() {
+			Some(hart)
+		}
+		else {
+			self.harts.iter().position(|h| h.online && h.current.is_none())
+		};
+		if let Some(t) = target {
+			// We're about to schedule anyway if it's us.
+			if t != mhartid_read() {
+				send_ipi(t);
+			}
+		}
+	}
+
+	/// Pop PIDs off of this hart's queue for this priority until we find
+	/// one that can run.
+	fn take(&mut self, hart: usize, priority: usize) -> Option<u16> {
+		while let Some(pid) = self.harts[hart].queues[priority].pop_front() {
+			if let Some(task) = self.tasks.get_mut(&pid) {
+				if task.priority != priority || task.hart != hart || task.running || !task.queued {
+					// Stale entry from before a priority change, or one the
+					// task has already been taken from.
+					continue;
+				}
+				task.queued = false;
+				if let ProcessState::Running = unsafe { &(*task.process).state } {
+					return Some(pid);
+				}
+			}
+		}
+		None
+	}
+
+	/// Each priority spends one credit per turn. Once every queue that has
+	/// something in it is out of credits, everyone gets their weight back.
+	/// We go around at most twice: once with the credits we have, and once
+	/// after a refill.
+	fn pick(&mut self, hart: usize) -> Option<u16> {
+		for _ in 0..2 {
+			for priority in 0..NUM_PRIORITIES {
+				if self.harts[hart].credits[priority] == 0 {
+					continue;
+				}
+				if let Some(pid) = self.take(hart, priority) {
+					self.harts[hart].credits[priority] -= 1;
+					return Some(pid);
+				}
+			}
+			self.harts[hart].credits = PRIORITY_WEIGHTS;
+		}
+		None
+	}
+
+	/// We have nothing to run, so take the most important thing waiting on
+	/// the hart with the most waiting.
+	fn steal(&mut self, me: usize) -> Option<u16> {
+		let mut tried = [false; MAX_HARTS];
+		tried[me] = true;
+		loop {
+			let mut victim = None;
+			let mut most = 0;
+			for (h, hart) in self.harts.iter().enumerate() {
+				let waiting: usize = hart.queues.iter().map(|q| q.len()).sum();
+				if !tried[h] && hart.online && waiting > most {
+					most = waiting;
+					victim = Some(h);
+				}
+			}
+			let victim = victim?;
+			tried[victim] = true;
+			for priority in 0..NUM_PRIORITIES {
+				if let Some(pid) = self.take(victim, priority) {
+					self.tasks.get_mut(&pid).unwrap().hart = me;
+					return Some(pid);
+				}
+			}
+		}
+	}
+
+	/// Move every sleeper whose time has come onto its run queue. The heap
+	/// may have stale entries (the process died or went back to sleep for
+	/// longer), so we check the process before waking it.
+	fn wake_sleepers(&mut self) {
+		let now = get_mtime();
+		while let Some(&Reverse((until, pid))) = self.sleepers.peek() {
+			if until > now {
+				break;
+			}
+			self.sleepers.pop();
+			if let Some(task) = self.tasks.get_mut(&pid) {
+				let prc = unsafe { &mut *task.process };
+				if let ProcessState::Sleeping = prc.state {
+					if prc.sleep_until <= now {
+						prc.state = ProcessState::Running;
+						self.enqueue(pid);
 					}
 				}
 			}
-			PROCESS_LIST.replace(pl);
+		}
+	}
+}
+
+/// Start tracking a process. It has to already be boxed in the process
+/// list so that this pointer stays good until remove().
+pub fn add(process: *mut Process) {
+	unsafe {
+		let pid = (*(*process).frame).pid as u16;
+		let priority = if (*(*process).frame).mode == CpuMode::Machine as usize {
+			KERNEL_PRIORITY
 		}
 		else {
-			println!("could not take process list");
+			DEFAULT_PRIORITY
+		};
+		with_scheduler((), |s| {
+			s.tasks.insert(pid, Task { process, priority, queued: false, running: false, hart: mhartid_read(), stale: 0 });
+			if let ProcessState::Running = (*process).state {
+				s.enqueue(pid);
+			}
+		});
+	}
+}
+
+/// Stop tracking a process. Any PIDs left in the run queues or the sleep
+/// heap are dropped when they're found.
+pub fn remove(pid: u16) {
+	with_scheduler((), |s| {
+		s.tasks.remove(&pid);
+	});
+}
+
+/// Look up a process by PID. This returns null if it doesn't exist.
+pub fn lookup(pid: u16) -> *mut Process {
+	with_scheduler(null_mut(), |s| match s.tasks.get(&pid) {
+		Some(task) => task.process,
+		None => null_mut(),
+	})
+}
+
+/// The process this hart is running, or null in the idle loop.
+pub fn current() -> *mut Process {
+	let me = mhartid_read();
+	with_scheduler(null_mut(), |s| match s.harts[me].current {
+		Some(pid) => s.tasks.get(&pid).map_or(null_mut(), |task| task.process),
+		None => null_mut(),
+	})
+}
+
+/// Called by set_running(): the process can be picked again.
+pub fn wake(pid: u16) {
+	with_scheduler((), |s| s.enqueue(pid));
+}
+
+/// Called by set_sleeping(): remember when to wake this process up.
+pub fn sleep(pid: u16, until: usize) {
+	with_scheduler((), |s| s.sleepers.push(Reverse((until, pid))));
+}
+
+/// Change a process' priority. This returns the priority it ended up
+/// with, or None if there is no such process.
+pub fn set_priority(pid: u16, priority: usize) -> Option<usize> {
+	let priority = if priority >= NUM_PRIORITIES {
+		NUM_PRIORITIES - 1
+	}
+	else {
+		priority
+	};
+	with_scheduler(None, |s| {
+		let task = s.tasks.get_mut(&pid)?;
+		if task.priority != priority {
+			// If it's queued at its old priority, that entry will be
+			// dropped as stale, so queue it again at the new one.
+			let was_queued = task.queued;
+			task.priority = priority;
+			task.queued = false;
+			if was_queued {
+				s.enqueue(pid);
+			}
+		}
+		Some(priority)
+	})
+}
+
+pub fn get_priority(pid: u16) -> Option<usize> {
+	with_scheduler(None, |s| s.tasks.get(&pid).map(|t| t.priority))
+}
+
+/// If pid is in the middle of running on a hart other than ours, which
+/// one. delete_process() has to wait for those.
+pub fn running_elsewhere(pid: u16) -> Option<usize> {
+	let me = mhartid_read();
+	with_scheduler(None, |s| match s.tasks.get(&pid) {
+		Some(task) if task.running && task.hart != me => Some(task.hart),
+		_ => None,
+	})
+}
+
+/// pid's page table changed in a way that the other harts' TLBs won't
+/// notice, like a page losing write permission. The caller fences this
+/// hart. Every other one fences before it runs pid again, and if one is
+/// running it right now, we send it an IPI so that it stops. Until the IPI
+/// lands, that hart can still use what it remembers, so a caller that
+/// can't have that waits until fence_pending() says it's done.
+pub fn fence_elsewhere(pid: u16) {
+	let me = mhartid_read();
+	with_scheduler((), |s| {
+		if let Some(task) = s.tasks.get_mut(&pid) {
+			task.stale = !(1 << me);
+			if task.running && task.hart != me {
+				send_ipi(task.hart);
+			}
 		}
-		PROCESS_LIST_MUTEX.unlock();
+	});
+}
+
+/// Whether a hart is running pid and hasn't fenced since fence_elsewhere().
+/// It does that the next time it goes through schedule().
+pub fn fence_pending(pid: u16) -> bool {
+	with_scheduler(false, |s| match s.tasks.get(&pid) {
+		Some(task) => task.running && task.stale & (1 << task.hart) != 0,
+		None => false,
+	})
+}
+
+/// Pick what this hart runs next and return its trap frame. Whatever it
+/// was running goes to the back of its queue if it can still run, and if
+/// it died while it was running, we finish deleting it. If there's nothing
+/// to run here or anywhere else, we get the hart's idle frame.
+pub fn schedule() -> usize {
+	let me = mhartid_read();
+	let idle = unsafe { &mut IDLE_FRAMES[me] as *mut TrapFrame as usize };
+	let mut dead = None;
+	let mut prev = 0;
+	let mut next = 0;
+	let frame = with_scheduler(idle, |s| {
+		s.wake_sleepers();
+		if let Some(pid) = s.harts[me].current.take() {
+			prev = pid;
+			if let Some(task) = s.tasks.get_mut(&pid) {
+				task.running = false;
+				match unsafe { &(*task.process).state } {
+					ProcessState::Running => s.enqueue(pid),
+					ProcessState::Dead => dead = Some(pid),
+					_ => {},
+				}
+			}
+		}
+		let (pid, stolen) = match s.pick(me) {
+			Some(pid) => (pid, false),
+			None => match s.steal(me) {
+				Some(pid) => (pid, true),
+				None => return idle,
+			},
+		};
+		let task = s.tasks.get_mut(&pid).unwrap();
+		task.running = true;
+		s.harts[me].current = Some(pid);
+		next = pid;
+		unsafe {
+			let frame = (*task.process).frame;
+			(*frame).hartid = me;
+			if stolen || task.stale & (1 << me) != 0 {
+				// This hart may remember translations for this address
+				// space from the last time it ran here, which could be
+				// stale. Threads use their leader's address space ID.
+				task.stale &= !(1 << me);
+				satp_fence_asid(((*frame).satp >> 44) & 0xffff);
+			}
+			frame as usize
+		}
+	});
+	// Going back to the same process isn't a switch.
+	if prev != next {
+		trace::record(trace::EV_SWITCH, next, prev as u32);
+	}
+	if let Some(pid) = dead {
+		delete_process(pid);
 	}
-	frame_addr
+	frame
 }
@@ -4,16 +4,169 @@
 // 3 Jan 2020
 
 use crate::{block::block_op,
-            buffer::Buffer,
-            cpu::{dump_registers, Registers, TrapFrame, gp},
+            cpu::{dump_registers, memcpy, CpuMode, Registers, TrapFrame, gp},
             elf,
             fs,
+            futex,
             gpu,
-            input::{Event, ABS_EVENTS, KEY_EVENTS},
-            page::{map, virt_to_phys, EntryBits, Table, PAGE_SIZE, zalloc},
-			process::{add_kernel_process_args, delete_process, get_by_pid, set_sleeping, set_waiting, PROCESS_LIST, PROCESS_LIST_MUTEX, Descriptor}};
+            input::{self, Event, ABS_EVENTS, KEY_EVENTS},
+            ioring,
+            profile::{self, Profile},
+            page::{self, copy_to_user, map, user_runs, user_to_phys, EntryBits, Table, PAGE_SIZE},
+			process::{self, add_kernel_process_args, delete_process, Fault, get_by_pid, push_process, set_running, set_sleeping, set_waiting, with_process_list, Descriptor, HEAP_LIMIT, STACK_ADDR},
+            rng,
+            sched,
+            trace};
 use crate::console::{IN_LOCK, IN_BUFFER, push_queue};
-use alloc::{boxed::Box, string::String};
+use crate::uart;
+use alloc::{boxed::Box, string::String, vec::Vec};
+use core::mem::size_of;
+
+// The longest path open() and execv() take, counting the terminator.
+const PATH_MAX: usize = 256;
+
+/// Copy a NUL-terminated string out of the caller. We translate once per
+/// page, not once per byte, and a string can run across pages that aren't
+/// next to each other in physical memory. Returns None if it isn't
+/// terminated within max bytes (or runs into an unmapped page first) or
+/// isn't UTF-8.
+unsafe fn user_string(frame: *const TrapFrame, vaddr: usize, max: usize) -> Option<String> {
+	let mut bytes = Vec::new();
+	let mut terminated = false;
+	let mut copy = |paddr: usize, run: usize| {
+		if terminated {
+			return;
+		}
+		let s = core::slice::from_raw_parts(paddr as *const u8, run);
+		match s.iter().position(|&c| c == 0) {
+			Some(n) => {
+				bytes.extend_from_slice(&s[..n]);
+				terminated = true;
+			}
+			None => bytes.extend_from_slice(s),
+		}
+	};
+	if (*frame).satp >> 60 != 0 {
+		let process = get_by_pid((*frame).pid as u16);
+		let table = ((*process).mmu_table).as_ref().unwrap();
+		user_runs(table, vaddr, max, EntryBits::Read.val(), copy);
+	}
+	else {
+		copy(vaddr, max);
+	}
+	if !terminated {
+		return None;
+	}
+	String::from_utf8(bytes).ok()
+}
+
+// /dev/fb is this GPU, the same one the user programs draw into.
+const FB_DEV: usize = 6;
+
+/// write() and pwrite() to an open descriptor other than the console. The
+/// buffer is already faulted in. offset is None for write(), which starts
+/// at the descriptor's offset and moves it along.
+unsafe fn write_descriptor(frame: *mut TrapFrame, fd: u16, buf: usize, size: usize, offset: Option<usize>) {
+	let pid = (*frame).pid as u16;
+	let process = get_by_pid(pid).as_mut().unwrap().owner();
+	match process.data.fdesc.get_mut(&fd) {
+		Some(Descriptor::Framebuffer(fb_offset)) => {
+			// This is a copy into memory and a queued transfer, so we can do
+			// it right here.
+			let at = offset.unwrap_or(*fb_offset);
+			let table = process.mmu_table.as_ref();
+			let written = gpu::write_framebuffer(FB_DEV, at, |dst, room| {
+				let len = if size > room { room } else { size };
+				if (*frame).satp >> 60 != 0 {
+					let mut done = 0;
+					user_runs(table.unwrap(), buf, len, EntryBits::Read.val(), |paddr, run| {
+						memcpy(dst.add(done), paddr as *const u8, run);
+						done += run;
+					})
+				}
+				else {
+					memcpy(dst, buf as *const u8, len);
+					len
+				}
+			});
+			if offset.is_none() {
+				*fb_offset = at + written;
+			}
+			(*frame).regs[gp(Registers::A0)] = written;
+		}
+		Some(Descriptor::File(_)) => {
+			// This might wait on the block device, so a kernel process does
+			// it and sets our return value.
+			fs::process_write(pid, fd, buf, size as u32, offset.map(|o| o as u32));
+		}
+		_ => {
+			// unsupported
+			(*frame).regs[gp(Registers::A0)] = 0;
+		}
+	}
+}
+
+/// What fault_in_user() found.
+enum UserBuffer {
+	/// All of it is mapped, and the process could use it the way we're
+	/// about to.
+	Ready,
+	/// Part of it still has to come off of the block device, or can't be
+	/// copied until a fork() is done. We've backed the process up so that
+	/// it makes this system call again once it can, so the call should
+	/// return without doing anything.
+	Paging,
+	/// Part of it isn't the process's to use that way. It isn't mapped, or
+	/// it's read-only (such as .text) and we'd write to it, or we ran out
+	/// of memory for it.
+	Bad,
+}
+
+// The address the process gave us is no good.
+const EFAULT: usize = -14isize as usize;
+
+/// Make sure a user buffer is mapped for access before we copy to or from
+/// it.
+unsafe fn fault_in_user(mepc: usize, frame: *mut TrapFrame, vaddr: usize, len: usize, access: usize) -> UserBuffer {
+	if (*frame).satp >> 60 == 0 {
+		return UserBuffer::Ready;
+	}
+	let pid = (*frame).pid as u16;
+	if let Some(process) = get_by_pid(pid).as_mut() {
+		// Pages without the user bit are the kernel's, even if they're
+		// in the process's table.
+		match process.fault_in_range(vaddr, len, access | EntryBits::User.val()) {
+			Fault::Mapped => UserBuffer::Ready,
+			Fault::Load(page) => {
+				(*frame).pc = mepc;
+				elf::page_in(pid, process.owner().image, page);
+				UserBuffer::Paging
+			},
+			Fault::Busy => {
+				(*frame).pc = mepc;
+				set_sleeping(pid, process::FORK_RETRY);
+				UserBuffer::Paging
+			},
+			Fault::Bad => UserBuffer::Bad,
+		}
+	}
+	else {
+		UserBuffer::Bad
+	}
+}
+
+/// fault_in_user() for the usual system call, which fails with EFAULT if
+/// the buffer is bad. Returns false if the call should return now.
+unsafe fn user_buffer(mepc: usize, frame: *mut TrapFrame, vaddr: usize, len: usize, access: usize) -> bool {
+	match fault_in_user(mepc, frame, vaddr, len, access) {
+		UserBuffer::Ready => true,
+		UserBuffer::Paging => false,
+		UserBuffer::Bad => {
+			(*frame).regs[gp(Registers::A0)] = EFAULT;
+			false
+		},
+	}
+}
 
 /// do_syscall is called from trap.rs to invoke a system call. No discernment is
 /// made here whether this is a U-mode, S-mode, or M-mode system call.
@@ -30,10 +183,18 @@ pub unsafe fn do_syscall(mepc: usize, frame: *mut TrapFrame) {
 	// skip the ecall
 	(*frame).pc = mepc + 4;
 	match syscall_number {
-		93 | 94 => {
-			// exit and exit_group
+		93 => {
+			// exit
+			// From a thread, this only ends the thread. From anything else,
+			// it takes its threads with it.
 			delete_process((*frame).pid as u16);
 		}
+		94 => {
+			// exit_group
+			if let Some(process) = get_by_pid((*frame).pid as u16).as_mut() {
+				delete_process(process.owner().pid);
+			}
+		}
 		1 => {
 			//yield
 			// We don't do anything, but we don't want to print "unknown system call"
@@ -53,32 +214,30 @@ pub unsafe fn do_syscall(mepc: usize, frame: *mut TrapFrame) {
 			// execv
 			// A0 = path
 			// A1 = argv
-			let mut path_addr = (*frame).regs[Registers::A0 as usize];
-			// If the MMU is turned on, translate.
-			if (*frame).satp >> 60 != 0 {
-				let p = get_by_pid((*frame).pid as u16);
-				let table = ((*p).mmu_table).as_ref().unwrap();
-				path_addr = virt_to_phys(table, path_addr).unwrap();
-			}
-			// Our path address here is now a physical address. If it came in virtual,
-			// it is now physical.
-			let path_bytes = path_addr as *const u8;
-			let mut path = String::new();
-			let mut iterator: usize = 0;
-			// I really have to figure out how to change an array of bytes
-			// to a string. For now, this is very C-style and mimics strcpy.
-			loop {
-				let ch = *path_bytes.add(iterator);
-				if ch == 0 {
-					break;
-				}
-				iterator += 1;
-				path.push(ch as char);
+			let path_addr = (*frame).regs[Registers::A0 as usize];
+			if !user_buffer(mepc, frame, path_addr, 1, EntryBits::Read.val()) {
+				return;
 			}
+			let path = match user_string(frame, path_addr, PATH_MAX) {
+				Some(p) => p,
+				None => {
+					(*frame).regs[Registers::A0 as usize] = -1isize as usize;
+					return;
+				}
+			};
 			// See if we can find the path.
-			if let Ok(inode) = fs::MinixFileSystem::open(8, &path) {
-				let inode_heap = Box::new(inode);
-				// The Box above moves the Inode to a new memory location on the heap.
+			let res = match fs::MinixFileSystem::open_cached(8, &path) {
+				Some(res) => res,
+				None => {
+					// We don't know yet. Look it up and then try again.
+					(*frame).pc = mepc;
+					fs::process_lookup((*frame).pid as u16, 8, path);
+					return;
+				}
+			};
+			if let Ok(inode) = res {
+				let exec_args = Box::new(ExecArgs { path, inode });
+				// The Box above moves the path and Inode to a new memory location on the heap.
 				// This needs to be on the heap since we are about to hand over control
 				// to a kernel process.
 				// THERE is an issue here. If we fail somewhere inside the kernel process,
@@ -86,7 +245,7 @@ pub unsafe fn do_syscall(mepc: usize, frame: *mut TrapFrame) {
 				// our process will still get deleted and the error won't be reported.
 				// We have to make sure we relinquish Box control here by using into_raw.
 				// Otherwise, the Box will free the memory associated with this inode.
-				add_kernel_process_args(exec_func, Box::into_raw(inode_heap) as usize);
+				add_kernel_process_args(exec_func, Box::into_raw(exec_args) as usize);
 				// This deletes us, which is what we want.
 				delete_process((*frame).pid as u16);
 			}
@@ -100,11 +259,14 @@ pub unsafe fn do_syscall(mepc: usize, frame: *mut TrapFrame) {
 		17 => { //getcwd
 			let mut buf = (*frame).regs[gp(Registers::A0)] as *mut u8;
 			let size = (*frame).regs[gp(Registers::A1)];
-			let process = get_by_pid((*frame).pid as u16).as_ref().unwrap();
+			if !user_buffer(mepc, frame, buf as usize, size, EntryBits::Write.val()) {
+				return;
+			}
+			let process = get_by_pid((*frame).pid as u16).as_mut().unwrap().owner();
 			let mut iter = 0usize;
 			if (*frame).satp >> 60 != 0 {
 				let table = ((*process).mmu_table).as_mut().unwrap();
-				let paddr = virt_to_phys(table, buf as usize);
+				let paddr = user_to_phys(table, buf as usize, EntryBits::Write.val());
 				if let Some(bufaddr) = paddr {
 					buf = bufaddr as *mut u8;
 				}
@@ -128,20 +290,26 @@ pub unsafe fn do_syscall(mepc: usize, frame: *mut TrapFrame) {
 		57 => {
 			// #define SYS_close 57
 			let fd = (*frame).regs[gp(Registers::A0)] as u16;
-			let process = get_by_pid((*frame).pid as u16).as_mut().unwrap();
-			if process.data.fdesc.contains_key(&fd) {
-				process.data.fdesc.remove(&fd);
+			let process = get_by_pid((*frame).pid as u16).as_mut().unwrap().owner();
+			if let Some(desc) = process.data.remove_fd(fd) {
+				// Start writing back what's dirty, but don't make the
+				// caller wait for it. fsync does that.
+				if let Descriptor::File(f) = desc {
+					fs::process_sync(None, f.dev);
+				}
 				(*frame).regs[gp(Registers::A0)] = 0;
 			}
 			else {
 				(*frame).regs[gp(Registers::A0)] = -1isize as usize;
 			}
-			// Flush?
 		}
 		63 => { // sys_read
 			let fd = (*frame).regs[gp(Registers::A0)] as u16;
-			let mut buf = (*frame).regs[gp(Registers::A1)] as *mut u8;
+			let buf = (*frame).regs[gp(Registers::A1)] as *mut u8;
 			let size = (*frame).regs[gp(Registers::A2)];
+			if !user_buffer(mepc, frame, buf as usize, size, EntryBits::Write.val()) {
+				return;
+			}
 			let process = get_by_pid((*frame).pid as u16).as_mut().unwrap();
 			let mut ret = 0usize;
 			// If we return 0, the trap handler will schedule
@@ -150,27 +318,27 @@ pub unsafe fn do_syscall(mepc: usize, frame: *mut TrapFrame) {
 				IN_LOCK.spin_lock();
 				if let Some(mut inb) = IN_BUFFER.take() {
 					let num_elements = if inb.len() >= size { size } else { inb.len() };
-					let mut buf_ptr = buf as *mut u8;
 					if num_elements == 0 {
 						push_queue((*frame).pid as u16);
 						set_waiting((*frame).pid as u16);
 					}
-					else {
-						for i in inb.drain(0..num_elements) {
-							if (*frame).satp >> 60 != 0 {
-								let table = ((*process).mmu_table).as_mut().unwrap();
-								let buf_addr = virt_to_phys(table, buf as usize);
-								if buf_addr.is_none() {
-									break;
-								}
-								buf_ptr = buf_addr.unwrap() as *mut u8;
-								buf_ptr.write(i);
-								ret += 1;
-								println!("R: {}", ret);
+					else if (*frame).satp >> 60 != 0 {
+						// We translate once per page, not once per byte. If the user's
+						// buffer runs into an unmapped page, whatever we didn't copy stays
+						// in the input buffer for the next read.
+						let table = ((*process).mmu_table).as_ref().unwrap();
+						ret = user_runs(table, buf as usize, num_elements, EntryBits::Write.val(), |paddr, run| {
+							let dst = paddr as *mut u8;
+							for i in 0..run {
+								dst.add(i).write(inb.pop_front().unwrap());
 							}
-							buf = buf.add(1);
-							buf_ptr = buf_ptr.add(1);
+						});
+					}
+					else {
+						for i in 0..num_elements {
+							buf.add(i).write(inb.pop_front().unwrap());
 						}
+						ret = num_elements;
 					}
 					IN_BUFFER.replace(inb);
 				}
@@ -182,95 +350,244 @@ pub unsafe fn do_syscall(mepc: usize, frame: *mut TrapFrame) {
 			let fd = (*frame).regs[gp(Registers::A0)] as u16;
 			let buf = (*frame).regs[gp(Registers::A1)] as *const u8;
 			let size = (*frame).regs[gp(Registers::A2)];
+			if !user_buffer(mepc, frame, buf as usize, size, EntryBits::Read.val()) {
+				return;
+			}
 			let process = get_by_pid((*frame).pid as u16).as_ref().unwrap();
 			if fd == 1 || fd == 2 {
 				// stdout / stderr
 				// println!("WRITE {}, 0x{:08x}, {}", fd, bu/f as usize, size);
-				let mut iter = 0;
-				for i in 0..size {
-					iter += 1;
-					if (*frame).satp >> 60 != 0 {
-						let table = ((*process).mmu_table).as_mut().unwrap();
-						// We don't need to do the following until we reach a page boundary,
-						// however that code isn't written, yet.
-						let paddr = virt_to_phys(table, buf.add(i) as usize);
-						if let Some(bufaddr) = paddr {
-							print!("{}", *(bufaddr as *const u8) as char);
-						}
-						else {
-							break;
+				// This only copies into the UART's transmit ring. If the ring
+				// fills up, we give back how much we took, like a pipe.
+				let mut written = 0;
+				if (*frame).satp >> 60 != 0 {
+					// Walk the page table once per page and copy each physically
+					// contiguous run.
+					let table = ((*process).mmu_table).as_ref().unwrap();
+					let mut full = false;
+					user_runs(table, buf as usize, size, EntryBits::Read.val(), |paddr, run| {
+						if !full {
+							let n = uart::tx_write(core::slice::from_raw_parts(paddr as *const u8, run));
+							written += n;
+							full = n < run;
 						}
-					}
-				}
-				(*frame).regs[gp(Registers::A0)] = iter as usize;
-			}
-			else {
-				let descriptor = process.data.fdesc.get(&fd);
-				if descriptor.is_none() {
-					(*frame).regs[gp(Registers::A0)] = 0;
-					return;
+					});
 				}
 				else {
-					let descriptor = descriptor.unwrap();
-					match descriptor {
-						Descriptor::Framebuffer => {
-
-						}
-						Descriptor::File(inode) => {
-
-						
-						}
-						_ => {
-							// unsupported
-							(*frame).regs[gp(Registers::A0)] = 0;
-						}
+					written = uart::tx_write(core::slice::from_raw_parts(buf, size));
+				}
+				if written == 0 && size != 0 {
+					// Nothing fit. Make this system call again, once the ring
+					// is half empty if it's still full.
+					(*frame).pc = mepc;
+					if uart::tx_wait((*frame).pid as u16) {
+						set_waiting((*frame).pid as u16);
 					}
+					return;
 				}
+				(*frame).regs[gp(Registers::A0)] = written;
+			}
+			else {
+				write_descriptor(frame, fd, buf as usize, size, None);
 			}
 		}
+		68 => { // sys_pwrite
+			// ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+			// Like write, but at offset, and the descriptor's offset stays put.
+			let fd = (*frame).regs[gp(Registers::A0)] as u16;
+			let buf = (*frame).regs[gp(Registers::A1)];
+			let size = (*frame).regs[gp(Registers::A2)];
+			let offset = (*frame).regs[gp(Registers::A3)];
+			if !user_buffer(mepc, frame, buf, size, EntryBits::Read.val()) {
+				return;
+			}
+			write_descriptor(frame, fd, buf, size, Some(offset));
+		}
 		66 => {
 			(*frame).regs[gp(Registers::A0)] = -1isize as usize;
 		}
+		82 => {
+			// int fsync(int fd)
+			// Everything on the disk goes out together, so this syncs all of it.
+			let fd = (*frame).regs[gp(Registers::A0)] as u16;
+			let process = get_by_pid((*frame).pid as u16).as_mut().unwrap().owner();
+			match process.data.fdesc.get(&fd) {
+				Some(Descriptor::File(f)) => fs::process_sync(Some((*frame).pid as u16), f.dev),
+				Some(_) => (*frame).regs[gp(Registers::A0)] = 0,
+				None => (*frame).regs[gp(Registers::A0)] = -1isize as usize,
+			}
+		}
 		// #define SYS_fstat 80
 		80 => {
 			// int fstat(int filedes, struct stat *buf)
 			(*frame).regs[gp(Registers::A0)] = 0;
 		}
+		98 => {
+			// futex(addr, op, val)
+			// FUTEX_WAIT sleeps if the word at addr still holds val, so that
+			// nobody sleeps through the wake that was meant for them.
+			// FUTEX_WAKE wakes up to val waiters and returns how many it woke.
+			let uaddr = (*frame).regs[gp(Registers::A0)];
+			let op = (*frame).regs[gp(Registers::A1)];
+			let val = (*frame).regs[gp(Registers::A2)];
+			if uaddr & 3 != 0 {
+				(*frame).regs[gp(Registers::A0)] = -22isize as usize;
+				return;
+			}
+			if !user_buffer(mepc, frame, uaddr, 4, EntryBits::Read.val()) {
+				return;
+			}
+			let pid = (*frame).pid as u16;
+			let table = (*get_by_pid(pid)).mmu_table;
+			let paddr = if (*frame).satp >> 60 != 0 { user_to_phys(&*table, uaddr, EntryBits::Read.val()) } else { Some(uaddr) };
+			(*frame).regs[gp(Registers::A0)] = match (op, paddr) {
+				(futex::FUTEX_WAIT, Some(paddr)) => {
+					if (paddr as *const u32).read_volatile() != val as u32 {
+						// EAGAIN
+						-11isize as usize
+					}
+					else {
+						futex::wait(table as usize, uaddr, pid);
+						set_waiting(pid);
+						0
+					}
+				},
+				(futex::FUTEX_WAKE, Some(_)) => futex::wake(table as usize, uaddr, val),
+				_ => -22isize as usize,
+			};
+		}
 		172 => {
 			// A0 = pid
 			(*frame).regs[Registers::A0 as usize] = (*frame).pid;
 		}
-		180 => {
-			set_waiting((*frame).pid as u16);
-			let _ = block_op(
-			                 (*frame).regs[Registers::A0 as usize],
-			                 (*frame).regs[Registers::A1 as usize] as *mut u8,
-			                 (*frame).regs[Registers::A2 as usize] as u32,
-			                 (*frame).regs[Registers::A3 as usize] as u64,
-			                 false,
-			                 (*frame).pid as u16
-			);
+		180 | 181 => {
+			// block_read(dev, paddr, size, offset) and block_write(...).
+			// The buffer is a physical address that goes straight to the
+			// device, so only kernel processes, like the block cache, get
+			// to use these. 181 is how the block cache writes back dirty
+			// blocks.
+			if (*frame).satp >> 60 != 0 {
+				(*frame).regs[gp(Registers::A0)] = -1isize as usize;
+				return;
+			}
+			let pid = (*frame).pid as u16;
+			set_waiting(pid);
+			let res = block_op((*frame).regs[gp(Registers::A0)],
+			                   (*frame).regs[gp(Registers::A1)] as *mut u8,
+			                   (*frame).regs[gp(Registers::A2)] as u32,
+			                   (*frame).regs[gp(Registers::A3)] as u64,
+			                   syscall_number == 181,
+			                   pid);
+			if res.is_err() {
+				// Nothing is going to wake us, so fail the call now. The
+				// caller sees a status that isn't OK.
+				(*frame).regs[gp(Registers::A0)] = -1isize as usize;
+				set_running(pid);
+			}
+		}
+		220 => {
+			// clone(entry, stack, arg, tid_addr)
+			// This only makes threads: the new process starts at entry in our
+			// address space, with its stack pointer at stack and arg in A0.
+			// We store its id at tid_addr (if it isn't 0), and when it exits,
+			// we store 0 there and wake the futex on it.
+			let tid_addr = (*frame).regs[gp(Registers::A3)];
+			if tid_addr & 3 != 0 {
+				(*frame).regs[gp(Registers::A0)] = -22isize as usize;
+				return;
+			}
+			if tid_addr != 0 && !user_buffer(mepc, frame, tid_addr, 4, EntryBits::Write.val()) {
+				return;
+			}
+			let tid = process::add_thread((*frame).pid as u16,
+			                              (*frame).regs[gp(Registers::A0)],
+			                              (*frame).regs[gp(Registers::A1)],
+			                              (*frame).regs[gp(Registers::A2)],
+			                              tid_addr);
+			(*frame).regs[gp(Registers::A0)] = if tid == 0 { -1isize as usize } else { tid as usize };
+		}
+		1079 => {
+			// fork()
+			// This was fork's number before Linux dropped it for clone(),
+			// which we only use for threads. The child starts with 0 in
+			// A0, and we get its PID. See process::fork.
+			// The child can't run until the other harts running our
+			// threads have forgotten that our pages were writable, so we
+			// look again every so often until they have.
+			let pid = (*frame).pid as u16;
+			if !process::forking(pid) {
+				if let Err(e) = process::fork(pid) {
+					(*frame).regs[gp(Registers::A0)] = e as usize;
+					return;
+				}
+			}
+			match process::fork_finish(pid) {
+				Some(child) => (*frame).regs[gp(Registers::A0)] = child as usize,
+				None => {
+					(*frame).pc = mepc;
+					set_sleeping(pid, process::FORK_RETRY);
+				},
+			}
 		}
 		214 => { // brk
 			// #define SYS_brk 214
 			// void *brk(void *addr);
 			let addr = (*frame).regs[gp(Registers::A0)];
-			let process = get_by_pid((*frame).pid as u16).as_mut().unwrap();
+			let process = get_by_pid((*frame).pid as u16).as_mut().unwrap().owner();
 			// println!("Break move from 0x{:08x} to 0x{:08x}", process.brk, addr);
-			if addr > process.brk {
-				if (*frame).satp >> 60 != 0 {
-					let table = ((*process).mmu_table).as_mut().unwrap();
-					let diff = (addr + PAGE_SIZE - process.brk) / PAGE_SIZE;
-					for i in 0..diff {
-						let new_addr = zalloc(1) as usize;
-						process.data.pages.push_back(new_addr);
-						map(table, process.brk + (i << 12), new_addr, EntryBits::UserReadWrite.val(), 0);
-					}
-				}
+			// We don't map anything here. A program that asks for a lot of
+			// memory at once doesn't pay for pages it never uses, and the ones
+			// it does use get mapped when they fault (see Process::fault_in).
+			// Like Linux, a break we can't give out gets the current one
+			// back, and the program can tell it failed.
+			if addr > process.brk && addr <= HEAP_LIMIT && addr <= STACK_ADDR - PAGE_SIZE {
 				process.brk = addr;
 			}
 			(*frame).regs[gp(Registers::A0)] = process.brk;
 		}
+		278 => {
+			// getrandom(buf, len, flags)
+			// #define SYS_getrandom 278
+			// Fill buf from the kernel's generator. See rng.rs. Like Linux,
+			// this only ever blocks before the first pool of entropy comes
+			// in, and GRND_RANDOM gets the same bytes as everything else.
+			// Without an entropy device, there's nothing to wait for, so
+			// it fails with EAGAIN (see rng::CLOCK_SEED).
+			let buf = (*frame).regs[gp(Registers::A0)];
+			let len = (*frame).regs[gp(Registers::A1)];
+			let flags = (*frame).regs[gp(Registers::A2)];
+			if flags & !(rng::GRND_NONBLOCK | rng::GRND_RANDOM) != 0 {
+				(*frame).regs[gp(Registers::A0)] = -22isize as usize;
+				return;
+			}
+			if !rng::available() {
+				(*frame).regs[gp(Registers::A0)] = -11isize as usize;
+				return;
+			}
+			if !rng::ready(if flags & rng::GRND_NONBLOCK != 0 { 0 } else { (*frame).pid as u16 }) {
+				if flags & rng::GRND_NONBLOCK != 0 {
+					// EAGAIN
+					(*frame).regs[gp(Registers::A0)] = -11isize as usize;
+				}
+				else {
+					// We'll come back through here when the pool wakes us.
+					(*frame).pc = mepc;
+					set_waiting((*frame).pid as u16);
+				}
+				return;
+			}
+			let len = if len > rng::GETRANDOM_MAX { rng::GETRANDOM_MAX } else { len };
+			if !user_buffer(mepc, frame, buf, len, EntryBits::Write.val()) {
+				return;
+			}
+			let table = if (*frame).satp >> 60 != 0 {
+				get_by_pid((*frame).pid as u16).as_ref().unwrap().mmu_table.as_ref()
+			}
+			else {
+				None
+			};
+			(*frame).regs[gp(Registers::A0)] = rng::getrandom(table, buf, len);
+		}
 		// System calls 1000 and above are "special" system calls for our OS. I'll
 		// try to mimic the normal system calls below 1000 so that this OS is compatible
 		// with libraries.
@@ -306,11 +623,122 @@ pub unsafe fn do_syscall(mepc: usize, frame: *mut TrapFrame) {
 			let height = (*frame).regs[Registers::A4 as usize] as u32;
 			gpu::transfer(dev, x, y, width, height);
 		}
+		1005 => {
+			// get the damage ring
+			// syscall_get_damage(device)
+			// The damage ring is mapped right after the framebuffer. The user
+			// pushes dirty rectangles onto it and calls present (1006).
+			let dev = (*frame).regs[Registers::A0 as usize];
+			(*frame).regs[Registers::A0 as usize] = 0;
+			if dev > 0 && dev <= 8 {
+				if let Some(p) = gpu::GPU_DEVICES[dev - 1].take() {
+					let fb_bytes = (p.get_width() * p.get_height() * 4) as usize;
+					let vaddr = 0x3000_0000 + (fb_bytes + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+					if (*frame).satp >> 60 != 0 {
+						let process = get_by_pid((*frame).pid as u16);
+						let table = ((*process).mmu_table).as_mut().unwrap();
+						map(table, vaddr, p.get_damage() as usize, EntryBits::UserReadWrite as usize, 0);
+						(*frame).regs[Registers::A0 as usize] = vaddr;
+					}
+					else {
+						(*frame).regs[Registers::A0 as usize] = p.get_damage() as usize;
+					}
+					gpu::GPU_DEVICES[dev - 1].replace(p);
+				}
+			}
+		}
+		1006 => {
+			// present
+			// syscall_present(device)
+			// Merge everything in the damage ring and transfer it in one batch.
+			let dev = (*frame).regs[Registers::A0 as usize];
+			if dev > 0 && dev <= 8 {
+				gpu::present(dev);
+			}
+		}
+		1007 => {
+			// get framebuffer size
+			// syscall_get_fb_size(device)
+			// We pack the width into the upper 32 bits and the height into
+			// the lower 32 bits.
+			let dev = (*frame).regs[Registers::A0 as usize];
+			(*frame).regs[Registers::A0 as usize] = 0;
+			if dev > 0 && dev <= 8 {
+				if let Some(p) = gpu::GPU_DEVICES[dev - 1].as_ref() {
+					(*frame).regs[Registers::A0 as usize] = (p.get_width() as usize) << 32 | p.get_height() as usize;
+				}
+			}
+		}
+		1011 => {
+			// swapchain(device, count)
+			// Make (or find) the device's swapchain and map its buffers one
+			// after another at gpu::SWAP_VADDR. This gives back how many
+			// buffers there are, or 0.
+			let dev = (*frame).regs[Registers::A0 as usize];
+			let count = (*frame).regs[Registers::A1 as usize];
+			(*frame).regs[Registers::A0 as usize] = 0;
+			if dev > 0 && dev <= 8 && (*frame).satp >> 60 != 0 {
+				if let Some((ptr, count, stride)) = gpu::swapchain(dev, count) {
+					let process = get_by_pid((*frame).pid as u16);
+					let table = ((*process).mmu_table).as_mut().unwrap();
+					for i in 0..count * stride / PAGE_SIZE {
+						let vaddr = gpu::SWAP_VADDR + (i << 12);
+						let paddr = ptr as usize + (i << 12);
+						map(table, vaddr, paddr, EntryBits::UserReadWrite as usize, 0);
+					}
+					(*frame).regs[Registers::A0 as usize] = count;
+				}
+			}
+		}
+		1012 => {
+			// present_buffer(device, index)
+			// Show swapchain buffer index. This gives back the fence to wait
+			// on before drawing into it again, or -1. We only let one present
+			// out a frame, so if we're early, we sleep until it's time and
+			// then make the call again.
+			let dev = (*frame).regs[Registers::A0 as usize];
+			let index = (*frame).regs[Registers::A1 as usize];
+			(*frame).regs[Registers::A0 as usize] = -1isize as usize;
+			if dev > 0 && dev <= 8 {
+				let delay = gpu::frame_delay(dev);
+				if delay > 0 {
+					(*frame).pc = mepc;
+					set_sleeping((*frame).pid as u16, delay);
+					return;
+				}
+				if let Some(fence) = gpu::present_buffer(dev, index) {
+					(*frame).regs[Registers::A0 as usize] = fence as usize;
+				}
+			}
+		}
+		1013 => {
+			// fence_wait(device, fence)
+			// Wait until the device is done with everything up to fence.
+			let dev = (*frame).regs[Registers::A0 as usize];
+			let fence = (*frame).regs[Registers::A1 as usize] as u64;
+			(*frame).regs[Registers::A0 as usize] = 0;
+			if dev > 0 && dev <= 8 && !gpu::fence_wait(dev, fence, (*frame).pid as u16) {
+				// We'll look again when it wakes us.
+				(*frame).pc = mepc;
+				set_waiting((*frame).pid as u16);
+			}
+		}
 		1002 => {
 			// wait for keyboard events
-			let mut ev = KEY_EVENTS.take().unwrap();
 			let max_events = (*frame).regs[Registers::A1 as usize];
 			let vaddr = (*frame).regs[Registers::A0 as usize] as *const Event;
+			// A big enough count would wrap around to a small buffer.
+			let len = match max_events.checked_mul(size_of::<Event>()) {
+				Some(len) => len,
+				None => {
+					(*frame).regs[gp(Registers::A0)] = -22isize as usize;
+					return;
+				},
+			};
+			if !user_buffer(mepc, frame, vaddr as usize, len, EntryBits::Write.val()) {
+				return;
+			}
+			let mut ev = KEY_EVENTS.take().unwrap();
 			if (*frame).satp >> 60 != 0 {
 				let process = get_by_pid((*frame).pid as u16);
 				let table = (*process).mmu_table.as_mut().unwrap();
@@ -322,7 +750,7 @@ pub unsafe fn do_syscall(mepc: usize, frame: *mut TrapFrame) {
 					ev.len()
 				};
 				for i in 0..num_events {
-					let paddr = virt_to_phys(table, vaddr.add(i) as usize);
+					let paddr = user_to_phys(table, vaddr.add(i) as usize, EntryBits::Write.val());
 					if paddr.is_none() {
 						break;
 					}
@@ -335,9 +763,20 @@ pub unsafe fn do_syscall(mepc: usize, frame: *mut TrapFrame) {
 		}
 		1004 => {
 			// wait for abs events
-			let mut ev = ABS_EVENTS.take().unwrap();
 			let max_events = (*frame).regs[Registers::A1 as usize];
 			let vaddr = (*frame).regs[Registers::A0 as usize] as *const Event;
+			// A big enough count would wrap around to a small buffer.
+			let len = match max_events.checked_mul(size_of::<Event>()) {
+				Some(len) => len,
+				None => {
+					(*frame).regs[gp(Registers::A0)] = -22isize as usize;
+					return;
+				},
+			};
+			if !user_buffer(mepc, frame, vaddr as usize, len, EntryBits::Write.val()) {
+				return;
+			}
+			let mut ev = ABS_EVENTS.take().unwrap();
 			if (*frame).satp >> 60 != 0 {
 				let process = get_by_pid((*frame).pid as u16);
 				let table = ((*process).mmu_table as *mut Table).as_mut().unwrap();
@@ -348,7 +787,7 @@ pub unsafe fn do_syscall(mepc: usize, frame: *mut TrapFrame) {
 				else {
 					ev.len()
 				} {
-					let paddr = virt_to_phys(table, vaddr.add(i) as usize);
+					let paddr = user_to_phys(table, vaddr.add(i) as usize, EntryBits::Write.val());
 					if paddr.is_none() {
 						break;
 					}
@@ -359,61 +798,201 @@ pub unsafe fn do_syscall(mepc: usize, frame: *mut TrapFrame) {
 			}
 			ABS_EVENTS.replace(ev);
 		}
+		1008 => {
+			// get the event ring
+			// syscall_get_events()
+			// Key and abs events are written into this page as they come
+			// in, so there's no need to poll 1002 or 1004.
+			let pid = (*frame).pid as u16;
+			let ring = input::attach(pid);
+			if ring.is_null() {
+				(*frame).regs[Registers::A0 as usize] = 0;
+			}
+			else if (*frame).satp >> 60 != 0 {
+				let process = get_by_pid(pid);
+				let table = ((*process).mmu_table).as_mut().unwrap();
+				map(table, input::EVENT_RING_VADDR, ring as usize, EntryBits::UserReadWrite as usize, 0);
+				(*frame).regs[Registers::A0 as usize] = input::EVENT_RING_VADDR;
+			}
+			else {
+				(*frame).regs[Registers::A0 as usize] = ring as usize;
+			}
+		}
+		1009 => {
+			// wait for events
+			// syscall_wait_events()
+			// Returns the number of events in the ring, sleeping until
+			// there is at least one.
+			(*frame).regs[Registers::A0 as usize] = input::wait_events((*frame).pid as u16) as usize;
+		}
+		1010 => {
+			// nice
+			// syscall_nice(increment)
+			// Move the caller down (positive) or back up (negative) by this
+			// many priority levels and return the level it ends up at. Only
+			// kernel processes get the top level.
+			let pid = (*frame).pid as u16;
+			let inc = (*frame).regs[Registers::A0 as usize] as isize;
+			let cur = sched::get_priority(pid).unwrap_or(sched::DEFAULT_PRIORITY) as isize;
+			let want = cur + inc;
+			let lowest = if (*frame).mode == CpuMode::Machine as usize {
+				sched::KERNEL_PRIORITY as isize
+			}
+			else {
+				sched::DEFAULT_PRIORITY as isize
+			};
+			let want = if want < lowest {
+				lowest
+			}
+			else {
+				want
+			};
+			(*frame).regs[Registers::A0 as usize] = match sched::set_priority(pid, want as usize) {
+				Some(p) => p,
+				None => -1isize as usize,
+			};
+		}
+		1020 => {
+			// set up an I/O ring
+			// syscall_io_setup()
+			// Returns where the submission and completion queues are
+			// mapped, or 0.
+			(*frame).regs[gp(Registers::A0)] = ioring::setup((*frame).pid as u16);
+		}
+		1021 => {
+			// start submissions and maybe wait for completions
+			// syscall_io_enter(min_complete)
+			let pid = (*frame).pid as u16;
+			// Everything the ring points to has to be in memory before we
+			// hand it to a device. If a page has to be read in first, we
+			// come back here once it is, and nothing has been started yet.
+			for (addr, len, written) in ioring::pending_buffers(pid) {
+				let access = if written { EntryBits::Write.val() } else { EntryBits::Read.val() };
+				// A bad buffer fails its own op with EFAULT when enter()
+				// gets to it.
+				if let UserBuffer::Paging = fault_in_user(mepc, frame, addr, len, access) {
+					return;
+				}
+			}
+			(*frame).regs[gp(Registers::A0)] = ioring::enter(pid, (*frame).regs[gp(Registers::A0)]) as usize;
+		}
 		1024 => {
 			// #define SYS_open 1024
-			let mut path = (*frame).regs[gp(Registers::A0)];
+			let path = (*frame).regs[gp(Registers::A0)];
 			let _perm = (*frame).regs[gp(Registers::A1)];
-			let process = get_by_pid((*frame).pid as u16).as_mut().unwrap();
-			if (*frame).satp >> 60 != 0 {
-				let table = process.mmu_table.as_mut().unwrap();
-				let paddr = virt_to_phys(table, path);
-				if paddr.is_none() {
+			if !user_buffer(mepc, frame, path, 1, EntryBits::Read.val()) {
+				return;
+			}
+			let str_path = match user_string(frame, path, PATH_MAX) {
+				Some(p) => p,
+				None => {
 					(*frame).regs[gp(Registers::A0)] = -1isize as usize;
 					return;
 				}
-				path = paddr.unwrap();
-			}
-			let path_ptr = path as *const u8;
-			let mut str_path = String::new();
-			for i in 0..256 {
-				let c = path_ptr.add(i).read();
-				if c == 0 {
-					break;
-				}
-				str_path.push(c as char);
-			}
-			// Allocate a blank file descriptor
-			let mut max_fd = 2;
-			for k in process.data.fdesc.keys() {
-				if *k > max_fd {
-					max_fd = *k;
-				}
-			}
-			max_fd += 1;
-			match str_path.as_str() {
+			};
+			let desc = match str_path.as_str() {
 				"/dev/fb" => {
 					// framebuffer
-					process.data.fdesc.insert(max_fd, Descriptor::Framebuffer);
-				}
-				"/dev/butev" => {
-					process.data.fdesc.insert(max_fd, Descriptor::ButtonEvents);
-				}
-				"/dev/absev" => {
-					process.data.fdesc.insert(max_fd, Descriptor::AbsoluteEvents);
+					Descriptor::Framebuffer(0)
 				}
+				"/dev/butev" => Descriptor::ButtonEvents,
+				"/dev/absev" => Descriptor::AbsoluteEvents,
 				_ => {
-					let res = fs::MinixFileSystem::open(8, &str_path);
-					if res.is_err() {
-						(*frame).regs[gp(Registers::A0)] = -1isize as usize;
-						return;
-					}
-					else {
-						let inode = res.ok().unwrap();
-						process.data.fdesc.insert(max_fd, Descriptor::File(inode));
+					match fs::MinixFileSystem::lookup_cached(8, &str_path) {
+						Some(Ok(inode)) => Descriptor::File(fs::OpenFile { dev: 8, inode, offset: 0 }),
+						Some(Err(_)) => {
+							(*frame).regs[gp(Registers::A0)] = -1isize as usize;
+							return;
+						}
+						None => {
+							// Part of the path has to come off of the disk. Once a
+							// kernel process has looked it up, we run open again.
+							(*frame).pc = mepc;
+							fs::process_lookup((*frame).pid as u16, 8, str_path);
+							return;
+						}
 					}
 				}
+			};
+			let process = get_by_pid((*frame).pid as u16).as_mut().unwrap().owner();
+			(*frame).regs[gp(Registers::A0)] = match process.data.add_fd(desc) {
+				Some(fd) => fd as usize,
+				None => -1isize as usize,
+			};
+		}
+		1030 => {
+			// trace(op, buf, len)
+			// Copy the trace rings or the system call counts out. See trace.rs.
+			let op = (*frame).regs[gp(Registers::A0)];
+			let buf = (*frame).regs[gp(Registers::A1)];
+			let len = (*frame).regs[gp(Registers::A2)];
+			let copies = op == trace::TRACE_EVENTS || op == trace::TRACE_STATS;
+			if copies && !user_buffer(mepc, frame, buf, len, EntryBits::Write.val()) {
+				return;
+			}
+			let table = if (*frame).satp >> 60 != 0 {
+				get_by_pid((*frame).pid as u16).as_ref().unwrap().mmu_table.as_ref()
+			}
+			else {
+				None
+			};
+			(*frame).regs[gp(Registers::A0)] = trace::syscall(table, op, buf, len);
+		}
+		1031 => {
+			// memstats(buf, len)
+			// Copy the page allocator's statistics out. See page::PageStats.
+			let buf = (*frame).regs[gp(Registers::A0)];
+			let len = (*frame).regs[gp(Registers::A1)];
+			if !user_buffer(mepc, frame, buf, len, EntryBits::Write.val()) {
+				return;
+			}
+			let mut stats = page::stats();
+			stats.slab_pages = crate::kmem::get_num_slab_pages() as u64;
+			let size = if len < size_of::<page::PageStats>() { len } else { size_of::<page::PageStats>() };
+			let src = &stats as *const page::PageStats as *const u8;
+			(*frame).regs[gp(Registers::A0)] = if (*frame).satp >> 60 != 0 {
+				let process = get_by_pid((*frame).pid as u16).as_ref().unwrap();
+				copy_to_user((*process).mmu_table.as_ref().unwrap(), buf, src, size)
 			}
-			(*frame).regs[gp(Registers::A0)] = max_fd as usize;
+			else {
+				memcpy(buf as *mut u8, src, size);
+				size
+			};
+		}
+		1040 => {
+			// profile(op, a1, a2)
+			// PROFILE_START: a1 = samples a second
+			// PROFILE_STOP: gives back how many samples were dropped
+			// PROFILE_READ: a1 = buffer, a2 = its size in bytes, and gives back
+			// how many samples we copied there
+			let op = (*frame).regs[gp(Registers::A0)];
+			let a1 = (*frame).regs[gp(Registers::A1)];
+			let a2 = (*frame).regs[gp(Registers::A2)];
+			if op == profile::PROFILE_READ && !user_buffer(mepc, frame, a1, a2, EntryBits::Write.val()) {
+				return;
+			}
+			let user = (*frame).satp >> 60 != 0;
+			let process = get_by_pid((*frame).pid as u16).as_mut().unwrap().owner();
+			let table = if user { process.mmu_table.as_ref() } else { None };
+			(*frame).regs[gp(Registers::A0)] = match (op, process.data.profile.as_mut()) {
+				(profile::PROFILE_START, Some(p)) => {
+					p.start(a1);
+					0
+				}
+				(profile::PROFILE_START, None) => {
+					let mut p = Profile::new();
+					p.start(a1);
+					process.data.profile = Some(p);
+					0
+				}
+				(profile::PROFILE_STOP, Some(p)) => {
+					p.stop();
+					p.dropped()
+				}
+				(profile::PROFILE_READ, Some(p)) => p.read(table, a1, a2),
+				(profile::PROFILE_STOP, None) | (profile::PROFILE_READ, None) => 0,
+				_ => -1isize as usize,
+			};
 		}
 		1062 => {
 			// gettime
@@ -453,6 +1032,10 @@ pub fn syscall_block_read(dev: usize, buffer: *mut u8, size: u32, offset: u32) -
 	do_make_syscall(180, dev, buffer as usize, size as usize, offset as usize, 0, 0) as u8
 }
 
+pub fn syscall_block_write(dev: usize, buffer: *mut u8, size: u32, offset: u32) -> u8 {
+	do_make_syscall(181, dev, buffer as usize, size as usize, offset as usize, 0, 0) as u8
+}
+
 pub fn syscall_sleep(duration: usize) {
 	let _ = do_make_syscall(10, duration, 0, 0, 0, 0, 0);
 }
@@ -463,31 +1046,35 @@ pub fn syscall_get_pid() -> u16 {
 
 /// This is a helper function ran as a process in kernel space
 /// to finish loading and executing a process.
+struct ExecArgs {
+	path:  String,
+	inode: fs::Inode,
+}
+
 fn exec_func(args: usize) {
 	unsafe {
 		// We got the inode from the syscall. Its Box rid itself of control, so
 		// we take control back here. The Box now owns the Inode and will complete
 		// freeing the heap memory allocated for it.
-		let inode = Box::from_raw(args as *mut fs::Inode);
-		let mut buffer = Buffer::new(inode.size as usize);
-		// This is why we need to be in a process context. The read() call may sleep as it
-		// waits for the block driver to return.
-		fs::MinixFileSystem::read(8, &inode, buffer.get_mut(), inode.size, 0);
-		// Now we have the data, so the following will load the ELF file and give us a process.
-		let proc = elf::File::load_proc(&buffer);
-		if proc.is_err() {
+		let args = Box::from_raw(args as *mut ExecArgs);
+		// This is why we need to be in a process context. Opening the image reads the
+		// ELF headers, which may sleep as it waits for the block driver to return. The
+		// rest of the program is read as the new process touches it.
+		let image = elf::Image::open(8, &args.path, &args.inode);
+		if image.is_err() {
 			println!("Failed to launch process.");
 		}
 		else {
-			let process = proc.ok().unwrap();
-			// If we hold this lock, we can still be preempted, but the scheduler will
-			// return control to us. This required us to use try_lock in the scheduler.
-			PROCESS_LIST_MUTEX.sleep_lock();
-			if let Some(mut proc_list) = PROCESS_LIST.take() {
-				proc_list.push_back(process);
-				PROCESS_LIST.replace(proc_list);
-			}
-			PROCESS_LIST_MUTEX.unlock();
+			let image = image.ok().unwrap();
+			match elf::load_proc(image) {
+				// This takes the kernel lock, so we can't be preempted while we
+				// hold the list, and the trap handler on another hart has to wait.
+				Some(process) => with_process_list((), move |pl| push_process(pl, process)),
+				None => {
+					println!("Failed to launch process: no PIDs left.");
+					elf::release(image);
+				},
+			}
 		}
 	}
 }
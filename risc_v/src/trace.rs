@@ -0,0 +1,219 @@
+// trace.rs
+// Kernel tracing
+// Each hart writes what it does into its own ring of events, stamped with
+// mtime: system calls going in and coming out, context switches, PLIC
+// interrupts and virtio requests finishing. A hart only ever writes its
+// own ring and never waits to do it, so tracing costs a few stores. On
+// top of that, we count every system call by number, with how long the
+// kernel spent on it in a log2 histogram.
+//
+// User space gets at all of it with the trace system call (1030), which
+// copies a snapshot out. See userspace/trace.cpp.
+
+use crate::{cpu::{get_mtime, memcpy, mhartid_read, MAX_HARTS},
+            page::{copy_to_user, Table}};
+use alloc::vec::Vec;
+use core::mem::size_of;
+
+// How many events each hart keeps. The oldest go first. This must be a
+// power of two.
+pub const TRACE_RING_SIZE: usize = 256;
+// How many different system call numbers we keep counts for.
+pub const SYSCALL_SLOTS: usize = 64;
+// Bucket i of the histogram counts calls that took less than 2^i ticks
+// (and at least 2^(i-1)). The last bucket takes everything slower.
+pub const HIST_BUCKETS: usize = 16;
+
+// What an event is. These must match startlib/trace.h.
+pub const EV_SYSCALL_ENTER: u8 = 1; // arg = system call number
+pub const EV_SYSCALL_EXIT: u8 = 2; // arg = ticks it took
+pub const EV_SWITCH: u8 = 3; // arg = PID we switched away from
+pub const EV_INTERRUPT: u8 = 4; // arg = PLIC source
+pub const EV_BLOCK_DONE: u8 = 5; // arg = virtio status
+pub const EV_GPU_DONE: u8 = 6; // arg = descriptor
+
+// The operations the trace system call takes in A0.
+pub const TRACE_EVENTS: usize = 0;
+pub const TRACE_STATS: usize = 1;
+pub const TRACE_RESET: usize = 2;
+pub const TRACE_ENABLE: usize = 3;
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct TraceEvent {
+	pub time: u64,
+	pub arg:  u32,
+	// 0 for the idle loop or when there's no process
+	pub pid:  u16,
+	pub kind: u8,
+	pub hart: u8,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+pub struct SyscallStat {
+	pub number: u64,
+	pub count:  u64,
+	// In mtime ticks
+	pub total:  u64,
+	pub max:    u64,
+	pub hist:   [u32; HIST_BUCKETS],
+}
+
+const NO_EVENT: TraceEvent = TraceEvent { time: 0, arg: 0, pid: 0, kind: 0, hart: 0 };
+const NO_STAT: SyscallStat = SyscallStat { number: 0, count: 0, total: 0, max: 0, hist: [0; HIST_BUCKETS] };
+
+// Tracing is on from boot. The trace system call can turn it off.
+static mut ENABLED: bool = true;
+// Hart h writes only EVENTS[h] and HEADS[h], and always from a trap, so
+// writers never share anything. HEADS[h] counts every event the hart has
+// ever written, so it also says how many have been written over.
+static mut EVENTS: [[TraceEvent; TRACE_RING_SIZE]; MAX_HARTS] = [[NO_EVENT; TRACE_RING_SIZE]; MAX_HARTS];
+static mut HEADS: [usize; MAX_HARTS] = [0; MAX_HARTS];
+// The counts are only touched under the kernel lock, which every trap
+// holds, so they don't need atomics.
+static mut STATS: [SyscallStat; SYSCALL_SLOTS] = [NO_STAT; SYSCALL_SLOTS];
+// Calls to numbers we had no room for
+static mut STATS_DROPPED: u64 = 0;
+
+/// Add an event to this hart's ring.
+pub fn record(kind: u8, pid: u16, arg: u32) {
+	unsafe {
+		if !ENABLED {
+			return;
+		}
+		let hart = mhartid_read();
+		let head = HEADS[hart];
+		EVENTS[hart][head & (TRACE_RING_SIZE - 1)] = TraceEvent { time: get_mtime() as u64,
+		                                                          arg,
+		                                                          pid,
+		                                                          kind,
+		                                                          hart: hart as u8 };
+		HEADS[hart] = head.wrapping_add(1);
+	}
+}
+
+/// Note that pid is starting system call number. This gives back the time
+/// to hand to syscall_exit(), or 0 if we aren't tracing.
+pub fn syscall_enter(pid: u16, number: usize) -> usize {
+	unsafe {
+		if !ENABLED {
+			return 0;
+		}
+	}
+	record(EV_SYSCALL_ENTER, pid, number as u32);
+	get_mtime()
+}
+
+/// Note that system call number is done, and count it.
+pub fn syscall_exit(pid: u16, number: usize, start: usize) {
+	unsafe {
+		// Tracing was off when the call came in.
+		if !ENABLED || start == 0 {
+			return;
+		}
+		let ticks = get_mtime().wrapping_sub(start) as u64;
+		record(EV_SYSCALL_EXIT, pid, ticks as u32);
+		// There aren't many system call numbers, but they're spread out, so
+		// they're hashed into the table.
+		let mut slot = number % SYSCALL_SLOTS;
+		for _ in 0..SYSCALL_SLOTS {
+			let stat = &mut STATS[slot];
+			if stat.count == 0 || stat.number == number as u64 {
+				stat.number = number as u64;
+				stat.count += 1;
+				stat.total += ticks;
+				if ticks > stat.max {
+					stat.max = ticks;
+				}
+				let bucket = (64 - ticks.leading_zeros()) as usize;
+				stat.hist[if bucket >= HIST_BUCKETS { HIST_BUCKETS - 1 } else { bucket }] += 1;
+				return;
+			}
+			slot = (slot + 1) % SYSCALL_SLOTS;
+		}
+		STATS_DROPPED += 1;
+	}
+}
+
+/// Everything still in the rings, hart by hart and oldest first.
+fn events() -> Vec<TraceEvent> {
+	let mut out = Vec::new();
+	unsafe {
+		for hart in 0..MAX_HARTS {
+			let head = HEADS[hart];
+			let count = if head > TRACE_RING_SIZE { TRACE_RING_SIZE } else { head };
+			for i in head - count..head {
+				out.push(EVENTS[hart][i & (TRACE_RING_SIZE - 1)]);
+			}
+		}
+	}
+	out
+}
+
+/// The system calls we've seen, with the overflow count as number 0 if
+/// there was any.
+fn stats() -> Vec<SyscallStat> {
+	let mut out = Vec::new();
+	unsafe {
+		for stat in STATS.iter() {
+			if stat.count != 0 {
+				out.push(*stat);
+			}
+		}
+		if STATS_DROPPED != 0 {
+			let mut dropped = NO_STAT;
+			dropped.count = STATS_DROPPED;
+			out.push(dropped);
+		}
+	}
+	out
+}
+
+fn reset() {
+	unsafe {
+		for hart in 0..MAX_HARTS {
+			HEADS[hart] = 0;
+		}
+		for stat in STATS.iter_mut() {
+			*stat = NO_STAT;
+		}
+		STATS_DROPPED = 0;
+	}
+}
+
+/// Copy as much of items as fits into len bytes at buf. table is None for a
+/// kernel process, whose buf is a physical address. Returns how many items
+/// we copied.
+unsafe fn copy_out<T>(table: Option<&Table>, buf: usize, len: usize, items: &[T]) -> usize {
+	let count = core::cmp::min(len / size_of::<T>(), items.len());
+	let bytes = count * size_of::<T>();
+	let copied = match table {
+		Some(t) => copy_to_user(t, buf, items.as_ptr() as *const u8, bytes),
+		None => {
+			memcpy(buf as *mut u8, items.as_ptr() as *const u8, bytes);
+			bytes
+		}
+	};
+	copied / size_of::<T>()
+}
+
+/// The trace system call. The buffer is already faulted in. For
+/// TRACE_ENABLE, buf is 0 to turn tracing off and anything else to turn it
+/// on, and we give back whether it was on.
+pub unsafe fn syscall(table: Option<&Table>, op: usize, buf: usize, len: usize) -> usize {
+	match op {
+		TRACE_EVENTS => copy_out(table, buf, len, &events()),
+		TRACE_STATS => copy_out(table, buf, len, &stats()),
+		TRACE_RESET => {
+			reset();
+			0
+		}
+		TRACE_ENABLE => {
+			let was = ENABLED;
+			ENABLED = buf != 0;
+			was as usize
+		}
+		_ => -1isize as usize,
+	}
+}
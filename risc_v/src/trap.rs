@@ -3,25 +3,51 @@
 // Stephen Marz
 // 10 October 2019
 
-use crate::{cpu::{TrapFrame, CONTEXT_SWITCH_TIME},
+use crate::{cpu::{clear_ipi, gp, mhartid_read, satp_fence_asid, Registers, TrapFrame, CONTEXT_SWITCH_TIME, MAX_HARTS},
+            elf,
+            lock::KERNEL_LOCK,
+            page::EntryBits,
             plic,
-            process::delete_process,
+            process::{delete_process, get_by_pid, set_sleeping, Fault, FORK_RETRY},
+            profile,
             rust_switch_to_user,
             sched::schedule,
-            syscall::do_syscall};
+            syscall::do_syscall,
+            trace};
 
 #[no_mangle]
 /// The m_trap stands for "machine trap". Right now, we are handling
 /// all traps at machine mode. In this mode, we can figure out what's
 /// going on and send a trap where it needs to be. Remember, in machine
 /// mode and in this trap, interrupts are disabled and the MMU is off.
+/// Every hart comes through here, so we take the kernel lock first. If we
+/// switch to another process, rust_switch_to_user() lets it go. Otherwise,
+/// we do when we return to the one that trapped.
 extern "C" fn m_trap(epc: usize,
                      tval: usize,
                      cause: usize,
                      hart: usize,
-                     _status: usize,
+                     status: usize,
                      frame: *mut TrapFrame)
                      -> usize
+{
+	unsafe {
+		KERNEL_LOCK.lock();
+	}
+	let pc = handle_trap(epc, tval, cause, hart, status, frame);
+	unsafe {
+		KERNEL_LOCK.release();
+	}
+	pc
+}
+
+fn handle_trap(epc: usize,
+               tval: usize,
+               cause: usize,
+               hart: usize,
+               _status: usize,
+               frame: *mut TrapFrame)
+               -> usize
 {
 	// We're going to handle all traps in machine mode. RISC-V lets
 	// us delegate to supervisor mode, but switching out SATP (virtual memory)
@@ -42,20 +68,35 @@ extern "C" fn m_trap(epc: usize,
 		// Asynchronous trap
 		match cause_num {
 			3 => {
-				// We will use this to awaken our other CPUs so they can process
-				// processes.
-				println!("Machine software interrupt CPU #{}", hart);
+				// Another hart put something on our run queue, or saw that
+				// we're idle while it has more than it can run.
+				clear_ipi(hart);
+				let new_frame = schedule();
+				schedule_next_context_switch(1);
+				rust_switch_to_user(new_frame);
 			}
 			7 => {
 				// This is the context-switch timer.
 				// We would typically invoke the scheduler here to pick another
 				// process to run.
 				// Machine timer
+				// If this process is being profiled, the timer goes off
+				// more often than once a quantum. Write down where it was,
+				// and if its quantum isn't up, let it carry on.
+				profile::sample(epc);
+				let now = unsafe { MMIO_MTIME.read_volatile() };
+				let end = unsafe { QUANTUM_END[hart] };
+				if now < end {
+					unsafe {
+						MMIO_MTIMECMP.add(hart).write_volatile(profile::next_timer(now, end));
+					}
+					return epc;
+				}
+				// schedule() always gives us something, even if it's just
+				// this hart's idle loop.
 				let new_frame = schedule();
 				schedule_next_context_switch(1);
-				if new_frame != 0 {
-					rust_switch_to_user(new_frame);
-				}
+				rust_switch_to_user(new_frame);
 			}
 			11 => {
 				// Machine external (interrupt from Platform Interrupt Controller (PLIC))
@@ -101,7 +142,12 @@ extern "C" fn m_trap(epc: usize,
 			8 | 9 | 11 => unsafe {
 				// Environment (system) call from User, Supervisor, and Machine modes
 				// println!("E-call from User mode! CPU#{} -> 0x{:08x}", hart, epc);
+				// Take these now. The process may not be here afterward.
+				let pid = (*frame).pid as u16;
+				let number = (*frame).regs[gp(Registers::A7)];
+				let start = trace::syscall_enter(pid, number);
 				do_syscall(return_pc, frame);
+				trace::syscall_exit(pid, number, start);
 				let frame = schedule();
 				schedule_next_context_switch(1);
 				rust_switch_to_user(frame);
@@ -109,6 +155,10 @@ extern "C" fn m_trap(epc: usize,
 			// Page faults
 			12 => unsafe {
 				// Instruction page fault
+				// Program pages are read in the first time they run.
+				if resolve_page_fault(epc, tval, frame, EntryBits::Execute.val()) {
+					return epc;
+				}
 				println!("Instruction page fault CPU#{} -> 0x{:08x}: 0x{:08x}", hart, epc, tval);
 				delete_process((*frame).pid as u16);
 				let frame = schedule();
@@ -117,6 +167,12 @@ extern "C" fn m_trap(epc: usize,
 			}
 			13 => unsafe {
 				// Load page fault
+				// If this is a heap page that brk() handed out, or part of the
+				// program, that nobody has touched yet, map it and run the same
+				// instruction again.
+				if resolve_page_fault(epc, tval, frame, EntryBits::Read.val()) {
+					return epc;
+				}
 				println!("Load page fault CPU#{} -> 0x{:08x}: 0x{:08x}", hart, epc, tval);
 				delete_process((*frame).pid as u16);
 				let frame = schedule();
@@ -125,6 +181,12 @@ extern "C" fn m_trap(epc: usize,
 			}
 			15 => unsafe {
 				// Store page fault
+				// If this is a heap page that brk() handed out, or part of the
+				// program, that nobody has touched yet, map it and run the same
+				// instruction again.
+				if resolve_page_fault(epc, tval, frame, EntryBits::Write.val()) {
+					return epc;
+				}
 				println!("Store page fault CPU#{} -> 0x{:08x}: 0x{:08x}", hart, epc, tval);
 				delete_process((*frame).pid as u16);
 				let frame = schedule();
@@ -143,11 +205,60 @@ extern "C" fn m_trap(epc: usize,
 	return_pc
 }
 
+/// Try to make the page at tval available to the faulting process.
+/// access is the EntryBits the access needed. This returns true if the
+/// page is mapped now, so the instruction can run again. If the page has
+/// to come off of the block device, the process waits for it and we never
+/// return. Otherwise, this returns false: it's a real fault.
+unsafe fn resolve_page_fault(epc: usize, tval: usize, frame: *mut TrapFrame, access: usize) -> bool {
+	let pid = (*frame).pid as u16;
+	if let Some(process) = get_by_pid(pid).as_mut() {
+		match process.fault_in(tval, access) {
+			Fault::Mapped => {
+				// The hart may have remembered that this page wasn't there.
+				// A thread runs in its leader's address space, so this is
+				// the leader's ASID, not necessarily pid.
+				satp_fence_asid(((*frame).satp >> 44) & 0xffff);
+				return true;
+			},
+			Fault::Load(page) => {
+				// Run this instruction again once the page is in.
+				(*frame).pc = epc;
+				elf::page_in(pid, process.owner().image, page);
+				let frame = schedule();
+				schedule_next_context_switch(1);
+				rust_switch_to_user(frame);
+			},
+			Fault::Busy => {
+				// Try this instruction again once the fork() is done.
+				(*frame).pc = epc;
+				set_sleeping(pid, FORK_RETRY);
+				let frame = schedule();
+				schedule_next_context_switch(1);
+				rust_switch_to_user(frame);
+			},
+			Fault::Bad => {},
+		}
+	}
+	false
+}
+
+// Each hart has its own mtimecmp, one after another starting here.
 pub const MMIO_MTIMECMP: *mut u64 = 0x0200_4000usize as *mut u64;
 pub const MMIO_MTIME: *const u64 = 0x0200_BFF8 as *const u64;
 
+// When each hart's current quantum is up. The timer can go off before
+// then to take a profiling sample.
+static mut QUANTUM_END: [u64; MAX_HARTS] = [0; MAX_HARTS];
+
+/// Set the timer for the hart we're on. Call this after schedule(), so
+/// that we know whether what's about to run is being profiled.
 pub fn schedule_next_context_switch(qm: u16) {
 	unsafe {
-		MMIO_MTIMECMP.write_volatile(MMIO_MTIME.read_volatile().wrapping_add(CONTEXT_SWITCH_TIME * qm as u64));
+		let hart = mhartid_read();
+		let now = MMIO_MTIME.read_volatile();
+		let end = now.wrapping_add(CONTEXT_SWITCH_TIME * qm as u64);
+		QUANTUM_END[hart] = end;
+		MMIO_MTIMECMP.add(hart).write_volatile(profile::next_timer(now, end));
 	}
 }
@@ -3,7 +3,27 @@
 
 use core::{convert::TryInto,
 		   fmt::{Error, Write}};
-use crate::console::push_stdin;
+use crate::{console::push_stdin,
+            cpu::without_local_interrupts,
+            lock::Mutex,
+            process::set_running};
+use alloc::collections::VecDeque;
+
+pub const UART_BASE: usize = 0x1000_0000;
+
+// Registers, as offsets from the base address
+const THR: usize = 0; // Transmit holding (write)
+const IER: usize = 1; // Interrupt enable
+const LSR: usize = 5; // Line status
+
+const IER_RX: u8 = 1 << 0; // Received data is ready
+const IER_THRE: u8 = 1 << 1; // The transmit FIFO is empty
+const LSR_DR: u8 = 1 << 0; // There's received data
+const LSR_THRE: u8 = 1 << 5; // The transmit FIFO is empty
+
+// The 16550's transmit FIFO, which we can fill all at once whenever it's
+// empty.
+const TX_FIFO_SIZE: usize = 16;
 
 pub struct Uart {
 	base_address: usize,
@@ -11,8 +31,15 @@ pub struct Uart {
 
 impl Write for Uart {
 	fn write_str(&mut self, out: &str) -> Result<(), Error> {
-		for c in out.bytes() {
-			self.put(c);
+		// The kernel's own output can't be dropped, and it can't wait for
+		// an interrupt, so if the ring is full we send some ourselves.
+		let bytes = out.as_bytes();
+		let mut done = 0;
+		while done < bytes.len() {
+			done += tx_write(&bytes[done..]);
+			if done < bytes.len() {
+				tx_poll();
+			}
 		}
 		Ok(())
 	}
@@ -122,14 +149,142 @@ impl Uart {
 	}
 }
 
+// ///////////////////////////////////
+// / TRANSMIT RING
+// ///////////////////////////////////
+
+// Everything written to the console goes into this ring instead of
+// straight to the UART. Whenever the UART's FIFO is empty, it interrupts
+// us, and we move the next 16 bytes over, so nobody sits waiting for
+// bytes to go out one at a time. A process whose write finds the ring full
+// waits until it's half empty.
+
+pub const TX_RING_SIZE: usize = 16384;
+
+static mut TX_RING: [u8; TX_RING_SIZE] = [0; TX_RING_SIZE];
+// These count every byte that has gone in and out, so the ring has
+// TX_TAIL - TX_HEAD bytes in it.
+static mut TX_HEAD: usize = 0;
+static mut TX_TAIL: usize = 0;
+// Anybody on any hart can print, so the ring has its own lock. We never
+// take the kernel lock while holding it.
+static mut TX_LOCK: Mutex = Mutex::new();
+static mut TX_WAITERS: Option<VecDeque<u16>> = None;
+
+fn reg(offset: usize) -> *mut u8 {
+	(UART_BASE + offset) as *mut u8
+}
+
+fn with_tx<R, F: FnOnce() -> R>(f: F) -> R {
+	without_local_interrupts(|| unsafe {
+		TX_LOCK.spin_lock();
+		let ret = f();
+		TX_LOCK.unlock();
+		ret
+	})
+}
+
+/// If the UART can take more, give it as much of the ring as fits in its
+/// FIFO. Then, have it interrupt us when it's empty, if there's more to
+/// send. The TX lock must be held.
+unsafe fn tx_start() {
+	if reg(LSR).read_volatile() & LSR_THRE != 0 {
+		let mut n = 0;
+		while n < TX_FIFO_SIZE && TX_HEAD != TX_TAIL {
+			reg(THR).write_volatile(TX_RING[TX_HEAD % TX_RING_SIZE]);
+			TX_HEAD = TX_HEAD.wrapping_add(1);
+			n += 1;
+		}
+	}
+	let ier = if TX_HEAD != TX_TAIL { IER_RX | IER_THRE } else { IER_RX };
+	reg(IER).write_volatile(ier);
+}
+
+/// The processes to wake, if the ring has room for them now. The TX lock
+/// must be held, and they have to be woken after it's let go.
+unsafe fn tx_ready_waiters() -> Option<VecDeque<u16>> {
+	if TX_TAIL.wrapping_sub(TX_HEAD) <= TX_RING_SIZE / 2 {
+		if let Some(w) = TX_WAITERS.as_mut() {
+			if !w.is_empty() {
+				return Some(core::mem::replace(w, VecDeque::new()));
+			}
+		}
+	}
+	None
+}
+
+fn wake(waiters: Option<VecDeque<u16>>) {
+	if let Some(w) = waiters {
+		for pid in w {
+			set_running(pid);
+		}
+	}
+}
+
+/// Put as much of bytes in the ring as fits and get it moving. Returns how
+/// many bytes we took.
+pub fn tx_write(bytes: &[u8]) -> usize {
+	with_tx(|| unsafe {
+		let room = TX_RING_SIZE - TX_TAIL.wrapping_sub(TX_HEAD);
+		let n = if bytes.len() < room { bytes.len() } else { room };
+		for &b in &bytes[..n] {
+			TX_RING[TX_TAIL % TX_RING_SIZE] = b;
+			TX_TAIL = TX_TAIL.wrapping_add(1);
+		}
+		tx_start();
+		n
+	})
+}
+
+/// Wait for the UART's FIFO to empty and refill it, without an interrupt.
+/// This is for when we can't wait for one.
+pub fn tx_poll() {
+	let waiters = with_tx(|| unsafe {
+		while reg(LSR).read_volatile() & LSR_THRE == 0 {}
+		tx_start();
+		tx_ready_waiters()
+	});
+	wake(waiters);
+}
+
+/// pid found the ring full. Returns false if there's room now, so it
+/// should try again right away. Otherwise, the caller puts it to sleep, and
+/// we wake it when the ring is half empty. Call this with the kernel lock
+/// held, so that the wake can't come before the sleep.
+pub fn tx_wait(pid: u16) -> bool {
+	with_tx(|| unsafe {
+		if TX_TAIL.wrapping_sub(TX_HEAD) < TX_RING_SIZE {
+			return false;
+		}
+		TX_WAITERS.get_or_insert_with(VecDeque::new).push_back(pid);
+		true
+	})
+}
+
+/// Send everything in the ring, however long it takes. This doesn't take
+/// the lock, since we only use it when we're going down anyway.
+pub fn tx_flush() {
+	unsafe {
+		while TX_HEAD != TX_TAIL {
+			while reg(LSR).read_volatile() & LSR_THRE == 0 {}
+			tx_start();
+		}
+	}
+}
+
 pub fn handle_interrupt() {
 	// We would typically set this to be handled out of the interrupt context,
 	// but we're testing here! C'mon!
 	// We haven't yet used the singleton pattern for my_uart, but remember, this
 	// just simply wraps 0x1000_0000 (UART).
-	let mut my_uart = Uart::new(0x1000_0000);
-	// If we get here, the UART better have something! If not, what happened??
-	if let Some(c) = my_uart.get() {
+	let mut my_uart = Uart::new(UART_BASE);
+	// This is the transmit FIFO going empty, or there's input, or both.
+	let waiters = with_tx(|| unsafe {
+		tx_start();
+		tx_ready_waiters()
+	});
+	wake(waiters);
+	while let Some(c) = my_uart.get() {
 		// If you recognize this code, it used to be in the lib.rs under kmain(). That
 		// was because we needed to poll for UART data. Now that we have interrupts,
 		// here it goes!
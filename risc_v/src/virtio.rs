@@ -4,7 +4,7 @@
 // 10 March 2020
 
 use crate::{block, block::setup_block_device, page::PAGE_SIZE};
-use crate::rng::setup_entropy_device;
+use crate::{rng, rng::setup_entropy_device};
 use crate::{gpu, gpu::setup_gpu_device};
 use crate::{input, input::setup_input_device};
 use core::mem::size_of;
@@ -299,6 +299,11 @@ pub fn probe() {
 						println!("setup failed.");
 					}
 					else {
+						let idx = (addr - MMIO_VIRTIO_START) >> 12;
+						unsafe {
+							VIRTIO_DEVICES[idx] =
+								Some(VirtioDevice::new_with(DeviceTypes::Entropy));
+						}
 						println!("setup succeeded!");
 					}
 				},
@@ -360,6 +365,9 @@ pub fn handle_interrupt(interrupt: u32) {
 				DeviceTypes::Input => {
 					input::handle_interrupt(idx);
 				},
+				DeviceTypes::Entropy => {
+					rng::handle_interrupt(idx);
+				},
 				_ => {
 					println!("Invalid device generated interrupt!");
 				},
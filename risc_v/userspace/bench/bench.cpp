@@ -0,0 +1,60 @@
+// bench.cpp
+// Run every benchmark and report the results
+
+#include <cstdio>
+#include "bench.h"
+
+static void sort(unsigned long *v, unsigned int n) {
+	// Shell sort: a few hundred samples don't need anything fancier, and
+	// this doesn't recurse or allocate.
+	for (unsigned int gap = n / 2; gap > 0; gap /= 2) {
+		for (unsigned int i = gap; i < n; i++) {
+			unsigned long x = v[i];
+			unsigned int j = i;
+			for (; j >= gap && v[j - gap] > x; j -= gap) {
+				v[j] = v[j - gap];
+			}
+			v[j] = x;
+		}
+	}
+}
+
+// Nearest rank, so every percentile is a sample we actually saw.
+static unsigned long percentile(const Samples &s, unsigned int pct) {
+	unsigned int rank = (s.n * pct + 99) / 100;
+	return s.v[rank == 0 ? 0 : rank - 1];
+}
+
+void bench_report(const char *name, const char *unit, Samples &s) {
+	if (s.n == 0) {
+		bench_skip(name, "no-samples");
+		return;
+	}
+	sort(s.v, s.n);
+	unsigned long sum = 0;
+	for (unsigned int i = 0; i < s.n; i++) {
+		sum += s.v[i];
+	}
+	printf("bench %s unit=%s n=%u min=%lu p50=%lu p90=%lu p99=%lu max=%lu mean=%lu\n",
+	       name, unit, s.n, s.v[0], percentile(s, 50), percentile(s, 90), percentile(s, 99),
+	       s.v[s.n - 1], sum / s.n);
+}
+
+void bench_skip(const char *name, const char *why) {
+	printf("skip %s %s\n", name, why);
+}
+
+int main()
+{
+	// The version goes up whenever a benchmark changes what it measures,
+	// so that results from different versions aren't compared.
+	printf("# sos-bench 1\n");
+	bench_syscalls();
+	bench_switches();
+	bench_memory();
+	bench_files();
+	bench_framebuffer();
+	bench_input();
+	printf("# done\n");
+	return 0;
+}
@@ -0,0 +1,56 @@
+#pragma once
+// bench.h
+// Microbenchmark harness
+// Each benchmark takes a number of samples, and we print one line for it
+// with the percentiles of those samples:
+//
+//     bench syscall_getpid unit=ns n=200 min=900 p50=1000 p90=1100 p99=1500 max=2300 mean=1024
+//
+// Every line starts with "bench" and is key=value after the name, so the
+// results from two kernels can be diffed or pulled apart with awk. A
+// benchmark that can't run here prints "skip <name> <why>" instead.
+//
+// Time comes from the mtime page (clock.h), which ticks at 10 MHz, so
+// anything faster than a few microseconds is timed in batches and divided.
+
+#include <startlib/clock.h>
+
+#define BENCH_MAX_SAMPLES 1000
+
+struct Samples {
+	unsigned long v[BENCH_MAX_SAMPLES];
+	unsigned int n;
+
+	Samples() : n(0) {}
+
+	void add(unsigned long x) {
+		if (n < BENCH_MAX_SAMPLES) {
+			v[n++] = x;
+		}
+	}
+};
+
+// Sorts the samples, then prints the line for them.
+void bench_report(const char *name, const char *unit, Samples &s);
+void bench_skip(const char *name, const char *why);
+
+// ns per operation for count operations that took ticks.
+static inline unsigned long per_op_ns(unsigned long ticks, unsigned long count) {
+	return ticks_to_ns(ticks) / (count == 0 ? 1 : count);
+}
+
+// KiB per second for bytes that took ticks.
+static inline unsigned long kib_per_sec(unsigned long bytes, unsigned long ticks) {
+	if (ticks == 0) {
+		ticks = 1;
+	}
+	return bytes * TIMEBASE_FREQ / ticks / 1024;
+}
+
+// The benchmarks, by what they measure.
+void bench_syscalls();
+void bench_switches();
+void bench_memory();
+void bench_files();
+void bench_framebuffer();
+void bench_input();
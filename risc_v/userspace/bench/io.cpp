@@ -0,0 +1,189 @@
+// io.cpp
+// Files, the framebuffer and input
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <startlib/syscall.h>
+#include <startlib/ioring.h>
+#include <startlib/events.h>
+#include <startlib/thread.h>
+#include "bench.h"
+
+#define SAMPLES 100
+
+// Put a file of at least 1 MiB here to run the file benchmarks:
+//
+//     dd if=/dev/urandom of=bench.dat bs=1k count=1024
+//     ./upload.sh bench.dat
+#define BENCH_FILE "/bench.dat"
+#define READ_SIZE  4096
+
+// Where to read from. Minix 3 has 7 direct zones of 1 KiB, then an indirect
+// zone of 256 and then a double indirect one, so each of these takes a
+// different way through the inode.
+static const struct {
+	const char *name;
+	unsigned long offset;
+} READS[] = {
+	{ "file_read_direct", 0 },
+	{ "file_read_indirect", 128 * 1024 },
+	{ "file_read_dindirect", 512 * 1024 },
+};
+
+void bench_files() {
+	int fd = open(BENCH_FILE, O_RDONLY);
+	if (fd < 0) {
+		for (unsigned int r = 0; r < sizeof(READS) / sizeof(READS[0]); r++) {
+			bench_skip(READS[r].name, "no-file");
+		}
+		return;
+	}
+	char *buf = (char *)malloc(READ_SIZE);
+	IoRing io;
+	Samples s;
+	for (unsigned int r = 0; r < sizeof(READS) / sizeof(READS[0]); r++) {
+		// The first read brings the blocks into the block cache. The
+		// samples are the cost of getting them out again, which is what
+		// we can compare from one build to the next.
+		if (io.read_file(fd, buf, READ_SIZE, READS[r].offset).get() != READ_SIZE) {
+			bench_skip(READS[r].name, "short-file");
+			continue;
+		}
+		s.n = 0;
+		for (int i = 0; i < SAMPLES; i++) {
+			unsigned long t0 = now_ticks();
+			long got = io.read_file(fd, buf, READ_SIZE, READS[r].offset).get();
+			unsigned long t1 = now_ticks();
+			if (got == READ_SIZE) {
+				s.add(kib_per_sec(READ_SIZE, t1 - t0));
+			}
+		}
+		bench_report(READS[r].name, "KiB/s", s);
+	}
+	// How long the ring takes with nothing to do, for comparison.
+	s.n = 0;
+	for (int i = 0; i < SAMPLES; i++) {
+		unsigned long t0 = now_ticks();
+		io.nop().get();
+		s.add(ticks_to_ns(now_ticks() - t0));
+	}
+	bench_report("ioring_nop", "ns", s);
+	free(buf);
+	close(fd);
+}
+
+// The GPU device, like in fb.cpp.
+#define GPU_DEV 6
+
+void bench_framebuffer() {
+	unsigned int *fb = (unsigned int *)syscall_get_fb(GPU_DEV);
+	unsigned long size = syscall_get_fb_size(GPU_DEV);
+	if (fb == nullptr || size == 0) {
+		bench_skip("fb_fill", "no-framebuffer");
+		bench_skip("fb_transfer", "no-framebuffer");
+		return;
+	}
+	unsigned int width = size >> 32;
+	unsigned int height = size & 0xffffffff;
+	unsigned long pixels = (unsigned long)width * height;
+	Samples s;
+	// Filling the screen is all stores to memory that the GPU reads.
+	for (int i = 0; i < SAMPLES; i++) {
+		unsigned int color = 0xff000000 | (i * 0x00010101);
+		unsigned long t0 = now_ticks();
+		for (unsigned long p = 0; p < pixels; p++) {
+			fb[p] = color;
+		}
+		s.add(kib_per_sec(pixels * 4, now_ticks() - t0));
+	}
+	bench_report("fb_fill", "KiB/s", s);
+
+	// Handing the whole screen to the GPU, from the system call until it
+	// comes back.
+	s.n = 0;
+	for (int i = 0; i < SAMPLES; i++) {
+		unsigned long t0 = now_ticks();
+		syscall_inv_rect(GPU_DEV, 0, 0, width, height);
+		s.add(kib_per_sec(pixels * 4, now_ticks() - t0));
+	}
+	bench_report("fb_transfer", "KiB/s", s);
+}
+
+// How long to wait for somebody to press keys or move the mouse, in
+// seconds.
+#define INPUT_WINDOW 5
+
+struct InputWatch {
+	EventRing *volatile ring;
+	volatile bool stop;
+	// How many times the waiter has woken up to events, and when it last
+	// did.
+	volatile unsigned int wakes;
+	volatile unsigned long woke;
+};
+
+// Sleep on the event ring like a program would, and note when we wake.
+// The ring belongs to whoever asks for it, so this thread gets the ring.
+static void input_waiter(InputWatch *w) {
+	EventRing *ring = events_get();
+	w->ring = ring;
+	while (!w->stop) {
+		while (ring->head == ring->tail && !w->stop) {
+			syscall_wait_events();
+		}
+		w->woke = now_ticks();
+		__sync_synchronize();
+		w->wakes = w->wakes + 1;
+		InputEvent ev;
+		while (events_next(ring, ev)) {
+		}
+	}
+}
+
+void bench_input() {
+	// We share the address space with the waiter, so we can watch its
+	// ring's head. When it moves, the event is in, and the time until the
+	// waiter is running again is the latency.
+	InputWatch w;
+	w.ring = nullptr;
+	w.stop = false;
+	w.wakes = 0;
+	w.woke = 0;
+	sos::thread t(input_waiter, &w);
+	if (!t.joinable()) {
+		bench_skip("input_latency", "no-thread");
+		return;
+	}
+	while (w.ring == nullptr) {
+	}
+	printf("# press keys or move the mouse for %d seconds\n", INPUT_WINDOW);
+	Samples s;
+	unsigned long end = now_ticks() + INPUT_WINDOW * TIMEBASE_FREQ;
+	while (now_ticks() < end && s.n < BENCH_MAX_SAMPLES) {
+		unsigned int wakes = w.wakes;
+		unsigned int head = w.ring->head;
+		while (w.ring->head == head && now_ticks() < end) {
+		}
+		unsigned long t0 = now_ticks();
+		while (w.wakes == wakes && now_ticks() < end) {
+		}
+		__sync_synchronize();
+		// If the waiter was already up when the event came in, it didn't
+		// have to be woken, so there's nothing to measure.
+		if (w.wakes != wakes && w.woke >= t0) {
+			s.add(ticks_to_ns(w.woke - t0));
+		}
+	}
+	// Wake the waiter so it sees stop. Any event does that, and if there
+	// aren't any, it's left asleep and goes when we exit.
+	w.stop = true;
+	if (s.n == 0) {
+		bench_skip("input_latency", "no-events");
+	}
+	else {
+		bench_report("input_latency", "ns", s);
+	}
+	t.detach();
+}
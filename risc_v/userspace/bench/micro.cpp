@@ -0,0 +1,199 @@
+// micro.cpp
+// System calls, context switches and page faults
+
+#include <cstdlib>
+#include <startlib/syscall.h>
+#include <startlib/futex.h>
+#include <startlib/random.h>
+#include <startlib/thread.h>
+#include "bench.h"
+
+#define SAMPLES 200
+// The clock ticks every 100ns, so the fast things are timed this many at a
+// time.
+#define BATCH   64
+
+void bench_syscalls() {
+	Samples s;
+	// 1 is yield, which the kernel doesn't do anything for, so this is
+	// just the trap in and out.
+	for (int i = 0; i < SAMPLES; i++) {
+		unsigned long t0 = now_ticks();
+		for (int j = 0; j < BATCH; j++) {
+			make_syscall(1);
+		}
+		s.add(per_op_ns(now_ticks() - t0, BATCH));
+	}
+	bench_report("syscall_null", "ns", s);
+
+	// getpid looks the process up, like most system calls do.
+	s.n = 0;
+	for (int i = 0; i < SAMPLES; i++) {
+		unsigned long t0 = now_ticks();
+		for (int j = 0; j < BATCH; j++) {
+			make_syscall(172);
+		}
+		s.add(per_op_ns(now_ticks() - t0, BATCH));
+	}
+	bench_report("syscall_getpid", "ns", s);
+
+	// The same load that now_ticks() does, through the kernel.
+	s.n = 0;
+	for (int i = 0; i < SAMPLES; i++) {
+		unsigned long t0 = now_ticks();
+		for (int j = 0; j < BATCH; j++) {
+			syscall_get_time();
+		}
+		s.add(per_op_ns(now_ticks() - t0, BATCH));
+	}
+	bench_report("syscall_gettime", "ns", s);
+
+	// 64 bytes from the generator. The entropy device is only ever asked
+	// for more in the background, so it shouldn't show up here.
+	unsigned char bytes[64];
+	if (syscall_getrandom(bytes, sizeof(bytes), GRND_NONBLOCK) < 0) {
+		bench_skip("syscall_getrandom", "unseeded");
+		return;
+	}
+	s.n = 0;
+	for (int i = 0; i < SAMPLES; i++) {
+		unsigned long t0 = now_ticks();
+		for (int j = 0; j < BATCH; j++) {
+			syscall_getrandom(bytes, sizeof(bytes), 0);
+		}
+		s.add(per_op_ns(now_ticks() - t0, BATCH));
+	}
+	bench_report("syscall_getrandom", "ns", s);
+}
+
+struct PingPong {
+	volatile int turn;
+	int rounds;
+};
+
+// The other half of the ping-pong: wait for our turn, then give it back.
+static void pong(PingPong *p) {
+	for (int i = 0; i < p->rounds; i++) {
+		while (__atomic_load_n(&p->turn, __ATOMIC_ACQUIRE) == 0) {
+			futex_wait(&p->turn, 0);
+		}
+		__atomic_store_n(&p->turn, 0, __ATOMIC_RELEASE);
+		futex_wake(&p->turn, 1);
+	}
+}
+
+void bench_switches() {
+	// Two threads hand a futex back and forth, so each round is two
+	// wakes and, when they share a hart, two context switches. On
+	// separate harts it's the cost of a cross-hart wake.
+	PingPong p;
+	p.turn = 0;
+	p.rounds = SAMPLES * 8;
+	sos::thread t(pong, &p);
+	if (!t.joinable()) {
+		bench_skip("switch_futex_pingpong", "no-thread");
+		return;
+	}
+	Samples s;
+	for (int i = 0; i < SAMPLES; i++) {
+		unsigned long t0 = now_ticks();
+		for (int j = 0; j < 8; j++) {
+			__atomic_store_n(&p.turn, 1, __ATOMIC_RELEASE);
+			futex_wake(&p.turn, 1);
+			while (__atomic_load_n(&p.turn, __ATOMIC_ACQUIRE) == 1) {
+				futex_wait(&p.turn, 1);
+			}
+		}
+		s.add(per_op_ns(now_ticks() - t0, 8));
+	}
+	t.join();
+	bench_report("switch_futex_pingpong", "ns", s);
+}
+
+// How much memory to fault in. This is well past what malloc() keeps
+// around, so it comes fresh from brk and none of it is mapped yet.
+#define FAULT_PAGES 2048
+#define PAGE_SIZE   4096
+
+void bench_memory() {
+	Samples s;
+	// brk(0) only reads the break. Moving it ourselves would pull the
+	// heap out from under malloc().
+	for (int i = 0; i < SAMPLES; i++) {
+		unsigned long t0 = now_ticks();
+		for (int j = 0; j < BATCH; j++) {
+			syscall_brk(0);
+		}
+		s.add(per_op_ns(now_ticks() - t0, BATCH));
+	}
+	bench_report("brk_query", "ns", s);
+
+	// The kernel maps the heap as it's touched, so the first write to
+	// each page is a page fault.
+	volatile char *mem = (volatile char *)malloc(FAULT_PAGES * PAGE_SIZE);
+	if (mem == nullptr) {
+		bench_skip("page_fault", "no-memory");
+		return;
+	}
+	s.n = 0;
+	// Start one page in, past the page malloc() wrote its header to.
+	for (int page = 1; page + 8 <= FAULT_PAGES; page += 8) {
+		unsigned long t0 = now_ticks();
+		for (int j = 0; j < 8; j++) {
+			mem[(page + j) * PAGE_SIZE] = 1;
+		}
+		s.add(per_op_ns(now_ticks() - t0, 8));
+	}
+	bench_report("page_fault", "ns", s);
+
+	// The same pages again, now that they're mapped, so that the fault
+	// can be told apart from the store.
+	s.n = 0;
+	for (int page = 1; page + 8 <= FAULT_PAGES; page += 8) {
+		unsigned long t0 = now_ticks();
+		for (int j = 0; j < 8; j++) {
+			mem[(page + j) * PAGE_SIZE] = 2;
+		}
+		s.add(per_op_ns(now_ticks() - t0, 8));
+	}
+	bench_report("page_touch", "ns", s);
+
+	// fork() maps our pages into the child instead of copying them, so
+	// this is the cost of a page table for the FAULT_PAGES we just touched.
+	// The child leaves right away, without going through exit() and the
+	// stdio buffers it shares with us.
+	s.n = 0;
+	for (int i = 0; i < SAMPLES / 10; i++) {
+		unsigned long t0 = now_ticks();
+		long pid = syscall_fork();
+		if (pid == 0) {
+			syscall_exit();
+		}
+		if (pid < 0) {
+			bench_skip("fork", "no-fork");
+			free((void *)mem);
+			return;
+		}
+		s.add(ticks_to_ns(now_ticks() - t0));
+	}
+	bench_report("fork", "ns", s);
+
+	// Now keep the child around, so that our first store to each page
+	// has to copy it. The heap is mapped with megapages where it can be,
+	// and those copy 2 MiB at a time.
+	long pid = syscall_fork();
+	if (pid == 0) {
+		syscall_sleep(TIMEBASE_FREQ);
+		syscall_exit();
+	}
+	s.n = 0;
+	for (int page = 1; pid > 0 && page + 8 <= FAULT_PAGES; page += 8) {
+		unsigned long t0 = now_ticks();
+		for (int j = 0; j < 8; j++) {
+			mem[(page + j) * PAGE_SIZE] = 3;
+		}
+		s.add(per_op_ns(now_ticks() - t0, 8));
+	}
+	bench_report("cow_fault", "ns", s);
+	free((void *)mem);
+}
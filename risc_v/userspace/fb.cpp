@@ -4,48 +4,23 @@
 #include <cmath>
 #include <cstdio>
 #include <input-event-codes.h>
+#include <raster.h>
+#include <startlib/syscall.h>
+#include <startlib/events.h>
+#include <startlib/swapchain.h>
+#include <startlib/thread.h>
 
 
-#define MAX_EVENTS 100
 #define min(x, y) ((x < y) ? x : y)
 #define max(x, y) ((x > y) ? x : y)
 
-using u8 = unsigned char;
-using i8 = signed char;
-using u16 = unsigned short;
-using i16 = signed short;
-using u32 = unsigned int;
-using i32 = signed int;
-using u64 = unsigned long;
-using i64 = signed long;
-using f64 = double;
-using f32 = float;
-
-struct Pixel {
-	u8 r;
-	u8 g;
-	u8 b;
-	u8 a;
-};
-
-struct Event {
-	u16 event_type;
-	u16 code;
-	u32 value;
-};
-
-void fill_rect(Pixel *fb, u32 x, u32 y, u32 width, u32 height, Pixel &color);
-void stroke_rect(Pixel *fb, u32 x, u32 y, u32 width, u32 height, Pixel &color, u32 size);
-void set_pixel(Pixel *fb, u32 x, u32 y, Pixel &color);
-void draw_cosine(Pixel *fb, u32 x, u32 y, u32 width, u32 height, Pixel &color);
-void draw_circle(Pixel *fb, u32 x, u32 y, f64 r, Pixel &color);
-
-const u64 noevt_slptm = 10000;
-const u64 evt_slptm   = 10000;
+void draw_cosine(const Surface &s, i32 x, i32 y, i32 width, i32 height, const Pixel &color);
+void show(Swapchain &sc, const Surface &canvas);
 
 #define FB_DEV "/dev/fb"
 #define BUT_DEV "/dev/butev"
 #define ABS_DEV "/dev/absev"
+#define GPU_DEVICE 6
 
 struct Rect {
 	u32 x;
@@ -54,15 +29,88 @@ struct Rect {
 	u32 height;
 };
 
+// The tablet reports 0..TABLET_MAX on both axes, whatever the screen size.
+const u32 TABLET_MAX = 32767;
+
 constexpr u32 lerp(u32 val, u32 mx1, u32 mx2) {
 	f64 r = val / static_cast<f64>(mx1);
 	return r * mx2;
 }
 
-int main()
+// Where to paint, from the input thread to the main thread.
+struct Dab {
+	u32 x;
+	u32 y;
+};
+
+#define MAX_DABS 256
+
+struct Canvas {
+	sos::mutex lock;
+	sos::condition_variable changed;
+	Dab dabs[MAX_DABS];
+	u32 count = 0;
+	bool quit = false;
+};
+
+void read_input(Canvas *canvas, i32 w, i32 h)
 {
-	Event *events = new Event[100];
+	// Events land in the ring of whoever asks for it, and only that
+	// thread can wait on it, so this is ours and not main()'s.
+	EventRing *ring = events_get();
+	if (ring == nullptr) {
+		printf("Unable to get the input event ring.\n");
+		sos::lock_guard<sos::mutex> guard(canvas->lock);
+		canvas->quit = true;
+		canvas->changed.notify_one();
+		return;
+	}
 	bool pressed = false;
+	u32 cx = 0;
+	u32 cy = 0;
+	while (true) {
+		events_wait(ring);
+		InputEvent ev;
+		bool added = false;
+		bool quit = false;
+		sos::lock_guard<sos::mutex> guard(canvas->lock);
+		while (events_next(ring, ev)) {
+			if (ev.event_type == EV_ABS) {
+				if (ev.code == ABS_X) {
+					cx = lerp(ev.value & 0x7fff, TABLET_MAX, w);
+				}
+				else if (ev.code == ABS_Y) {
+					cy = lerp(ev.value & 0x7fff, TABLET_MAX, h);
+				}
+				// If the painter is this far behind, drop the dab.
+				if (pressed && canvas->count < MAX_DABS) {
+					canvas->dabs[canvas->count++] = { cx, cy };
+					added = true;
+				}
+			}
+			else if (ev.event_type == EV_KEY) {
+				if (ev.code == BTN_LEFT) {
+					pressed = ev.value != 0;
+				}
+				else if (ev.code == KEY_Q && ev.value != 0) {
+					quit = true;
+				}
+			}
+		}
+		if (quit) {
+			canvas->quit = true;
+		}
+		if (added || quit) {
+			canvas->changed.notify_one();
+		}
+		if (quit) {
+			return;
+		}
+	}
+}
+
+int main()
+{
 	int fb = open(FB_DEV, O_RDWR);
 	int but = open(BUT_DEV, O_RDONLY);
 	int abs = open(ABS_DEV, O_RDONLY);
@@ -79,52 +127,109 @@ int main()
 		return -1;
 
 	}
-	close(fb);
-	close(but);
-	close(abs);
-	delete [] events;
-	return 0;
-}
-
-void set_pixel(Pixel *fb, u32 x, u32 y, Pixel &color) {
-	if (x < 640 && y < 480) {
-		fb[y * 640 + x] = color;
+	// The kernel tells us how big the framebuffer is, so nothing below
+	// assumes 640x480.
+	u64 size = syscall_get_fb_size(GPU_DEVICE);
+	Pixel *pixels = (Pixel *)syscall_get_fb(GPU_DEVICE);
+	if (pixels == nullptr || size == 0) {
+		printf("Unable to map the framebuffer.\n");
+		return -1;
+	}
+	Surface screen = surface(pixels, size >> 32, size & 0xffffffff);
+	i32 w = screen.width;
+	i32 h = screen.height;
+
+	Pixel white  = { 255, 255, 255, 255 };
+	Pixel blue   = { 0, 0, 255, 255 };
+	Pixel red    = { 255, 0, 0, 255 };
+	Pixel shadow = { 0, 0, 0, 96 };
+	clear(screen, white);
+	stroke_rect(screen, 10, 10, w - 20, h - 20, blue, 5);
+	draw_cosine(screen, 15, h / 2, w - 30, h / 4, red);
+	fill_circle(screen, w / 2, h / 2, h / 8, blue);
+	draw_circle(screen, w / 2, h / 2, h / 6, red);
+	draw_line(screen, 15, 15, w - 15, h - 15, blue);
+	draw_line(screen, 15, h - 15, w - 15, 15, blue);
+
+	// A translucent drop shadow, blended over whatever is already there.
+	Pixel *shade = new Pixel[64 * 64];
+	Surface shade_surface = surface(shade, 64, 64);
+	clear(shade_surface, shadow);
+	blit(screen, w / 4, h / 4, shade_surface, true);
+	delete [] shade;
+
+	// We paint on the framebuffer, but if we can have a swapchain, that's
+	// what goes on the screen: a whole frame at a time, so it never tears,
+	// and we can paint the next one while the last one is on its way.
+	Swapchain sc;
+	bool swapping = swapchain_open(sc, GPU_DEVICE, 2);
+	if (swapping) {
+		show(sc, screen);
+	}
+	else {
+		syscall_inv_rect(GPU_DEVICE, 0, 0, w, h);
 	}
-}
 
-void fill_rect(Pixel *fb, u32 x, u32 y, u32 width, u32 height, Pixel &color) {
-	for (u32 row = y; row < (y+height);row++) {
-		for (u32 col = x; col < (x+width);col++) {
-			set_pixel(fb, col, row, color);
+	// Paint with the mouse until Q is pressed. A second thread reads the
+	// events and hands us the spots to paint. Both of us sleep in the
+	// kernel when there's nothing to do.
+	Canvas canvas;
+	sos::thread input(read_input, &canvas, w, h);
+	Dab dabs[MAX_DABS];
+	while (true) {
+		u32 n;
+		bool quit;
+		{
+			sos::unique_lock<sos::mutex> lock(canvas.lock);
+			canvas.changed.wait(lock, [&] { return canvas.count > 0 || canvas.quit; });
+			n = canvas.count;
+			quit = canvas.quit;
+			for (u32 i = 0; i < n; i++) {
+				dabs[i] = canvas.dabs[i];
+			}
+			canvas.count = 0;
+		}
+		// Paint without the lock, so the input thread can keep going.
+		for (u32 i = 0; i < n; i++) {
+			fill_circle(screen, dabs[i].x, dabs[i].y, 3, red);
+			if (!swapping) {
+				syscall_inv_rect(GPU_DEVICE, max((i32)dabs[i].x - 3, 0), max((i32)dabs[i].y - 3, 0), 7, 7);
+			}
+		}
+		// Everything we got since the last frame goes out in one.
+		if (swapping && n > 0) {
+			show(sc, screen);
+		}
+		if (quit) {
+			break;
 		}
 	}
+	input.join();
+	close(fb);
+	close(but);
+	close(abs);
+	return 0;
 }
 
-void stroke_rect(Pixel *fb, u32 x, u32 y, u32 width, u32 height, Pixel &color, u32 size) {
-   // Essentially fill the four sides.
-   // Top
-   fill_rect(fb, x, y, width, size, color);
-   // Bottom
-   fill_rect(fb, x, y + height, width, size, color);
-   // Left
-   fill_rect(fb, x, y, size, height, color);
-   // Right
-   fill_rect(fb, x + width, y, size, height + size, color);
-}
-
-void draw_cosine(Pixel *fb, u32 x, u32 y, u32 width, u32 height, Pixel &color) {
-	for (u32 i = 1; i <= width;i++) {
+void draw_cosine(const Surface &s, i32 x, i32 y, i32 width, i32 height, const Pixel &color) {
+	i32 lastx = x;
+	i32 lasty = y - height / 2;
+	for (i32 i = 1; i <= width;i++) {
 		f64 fy = -cos(i % 360);
 		f64 yy = fy / 2.0 * height;
-		u32 nx = x + i;
-		u32 ny = yy + y;
-		// printf("Cos %u = %lf, x: %u, y: %u\n", (i % 360), fy, nx, ny);
-		fill_rect(fb, nx, ny, 2, 2, color);
+		i32 nx = x + i;
+		i32 ny = yy + y;
+		// Connect the samples instead of plotting blocks so the curve has
+		// no gaps when it is steep.
+		draw_line(s, lastx, lasty, nx, ny, color);
+		lastx = nx;
+		lasty = ny;
 	}
 }
 
-void draw_circle(Pixel *fb, u32 x, u32 y, f64 r, Pixel &color)
-{
-
+// Copy the canvas into the next buffer and present it.
+void show(Swapchain &sc, const Surface &canvas) {
+	Surface back = surface((Pixel *)swapchain_acquire(sc), canvas.width, canvas.height);
+	blit(back, 0, 0, canvas, false);
+	swapchain_present(sc);
 }
-
@@ -0,0 +1,28 @@
+// memstat.cpp
+// Print the page allocator's statistics on one line, so they can be
+// compared from one run to the next.
+
+#include <cstdio>
+#include <startlib/memstats.h>
+
+int main()
+{
+	MemStats s;
+	if (!memstats_get(s)) {
+		printf("memstat: no statistics\n");
+		return 1;
+	}
+	printf("mem total=%lu free=%lu allocs=%lu frees=%lu zero_pool=%lu zero_hits=%lu zero_misses=%lu slab=%lu shared=%lu cow_copies=%lu blocks=",
+	       s.total_pages, s.free_pages, s.allocs, s.frees, s.zero_pool, s.zero_hits, s.zero_misses, s.slab_pages,
+	       s.shared_pages, s.cow_copies);
+	// The biggest free block says how big an allocation can still work.
+	int largest = -1;
+	for (int k = 0; k <= MEM_MAX_ORDER; k++) {
+		printf(k == 0 ? "%lu" : ",%lu", s.free_blocks[k]);
+		if (s.free_blocks[k] != 0) {
+			largest = k;
+		}
+	}
+	printf(" largest=%lu\n", largest < 0 ? 0UL : 1UL << largest);
+	return 0;
+}
@@ -0,0 +1,272 @@
+#pragma once
+// raster.h
+// Span-based 2D drawing into a framebuffer
+// Everything here clips once per primitive and then writes whole
+// spans, instead of bounds checking and recomputing y * width + x for
+// every pixel. Spans are stored 64 bits (two pixels) at a time.
+
+#include <string.h>
+
+using u8 = unsigned char;
+using i8 = signed char;
+using u16 = unsigned short;
+using i16 = signed short;
+using u32 = unsigned int;
+using i32 = signed int;
+using u64 = unsigned long;
+using i64 = signed long;
+using f64 = double;
+using f32 = float;
+
+struct Pixel {
+	u8 r;
+	u8 g;
+	u8 b;
+	u8 a;
+};
+
+// The GPU resource is R8G8B8A8, so a pixel is also one little-endian word.
+static inline u32 pixel_word(const Pixel &p) {
+	return (u32)p.r | ((u32)p.g << 8) | ((u32)p.b << 16) | ((u32)p.a << 24);
+}
+
+// A surface is any block of pixels we can draw into. The stride is in
+// pixels, which lets a surface describe part of a bigger one.
+struct Surface {
+	Pixel *pixels;
+	u32 width;
+	u32 height;
+	u32 stride;
+};
+
+static inline Surface surface(Pixel *pixels, u32 width, u32 height) {
+	return Surface { pixels, width, height, width };
+}
+
+static inline Pixel *surface_row(const Surface &s, u32 y) {
+	return s.pixels + (u64)y * s.stride;
+}
+
+// Fill count pixels starting at dst. This is the workhorse, so it is the
+// only place we care about store width.
+static inline void fill_span(Pixel *dst, u32 count, const Pixel &color) {
+	u32 word = pixel_word(color);
+	u32 *p = (u32 *)dst;
+	// Get to an 8-byte boundary so that the doubleword stores are aligned.
+	if (count > 0 && ((u64)p & 7) != 0) {
+		*p++ = word;
+		count--;
+	}
+	u64 dword = (u64)word | ((u64)word << 32);
+	u64 *p8 = (u64 *)p;
+	while (count >= 8) {
+		p8[0] = dword;
+		p8[1] = dword;
+		p8[2] = dword;
+		p8[3] = dword;
+		p8 += 4;
+		count -= 8;
+	}
+	while (count >= 2) {
+		*p8++ = dword;
+		count -= 2;
+	}
+	p = (u32 *)p8;
+	if (count) {
+		*p = word;
+	}
+}
+
+// Clip [x, x + w) against [0, limit). Returns false if nothing is left.
+static inline bool clip_range(i32 &x, i32 &w, u32 limit) {
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (x + w > (i32)limit) {
+		w = (i32)limit - x;
+	}
+	return w > 0;
+}
+
+static inline void set_pixel(const Surface &s, i32 x, i32 y, const Pixel &color) {
+	if (x >= 0 && y >= 0 && (u32)x < s.width && (u32)y < s.height) {
+		surface_row(s, y)[x] = color;
+	}
+}
+
+static inline void hline(const Surface &s, i32 x, i32 y, i32 w, const Pixel &color) {
+	if (y < 0 || (u32)y >= s.height || !clip_range(x, w, s.width)) {
+		return;
+	}
+	fill_span(surface_row(s, y) + x, w, color);
+}
+
+static inline void fill_rect(const Surface &s, i32 x, i32 y, i32 w, i32 h, const Pixel &color) {
+	if (!clip_range(x, w, s.width) || !clip_range(y, h, s.height)) {
+		return;
+	}
+	Pixel *row = surface_row(s, y) + x;
+	for (i32 i = 0; i < h; i++) {
+		fill_span(row, w, color);
+		row += s.stride;
+	}
+}
+
+static inline void clear(const Surface &s, const Pixel &color) {
+	if (s.stride == s.width) {
+		// One contiguous span for the whole screen.
+		fill_span(s.pixels, s.width * s.height, color);
+	}
+	else {
+		fill_rect(s, 0, 0, s.width, s.height, color);
+	}
+}
+
+static inline void stroke_rect(const Surface &s, i32 x, i32 y, i32 w, i32 h, const Pixel &color, i32 size) {
+	// Top
+	fill_rect(s, x, y, w, size, color);
+	// Bottom
+	fill_rect(s, x, y + h, w, size, color);
+	// Left
+	fill_rect(s, x, y, size, h, color);
+	// Right
+	fill_rect(s, x + w, y, size, h + size, color);
+}
+
+// Bresenham's line. Horizontal and vertical lines are common enough in
+// UIs that they get their own spans.
+static inline void draw_line(const Surface &s, i32 x0, i32 y0, i32 x1, i32 y1, const Pixel &color) {
+	if (y0 == y1) {
+		if (x1 < x0) {
+			i32 t = x0; x0 = x1; x1 = t;
+		}
+		hline(s, x0, y0, x1 - x0 + 1, color);
+		return;
+	}
+	if (x0 == x1) {
+		if (y1 < y0) {
+			i32 t = y0; y0 = y1; y1 = t;
+		}
+		fill_rect(s, x0, y0, 1, y1 - y0 + 1, color);
+		return;
+	}
+	i32 dx = x1 > x0 ? x1 - x0 : x0 - x1;
+	i32 dy = y1 > y0 ? y0 - y1 : y1 - y0;
+	i32 sx = x0 < x1 ? 1 : -1;
+	i32 sy = y0 < y1 ? 1 : -1;
+	i32 err = dx + dy;
+	while (true) {
+		set_pixel(s, x0, y0, color);
+		if (x0 == x1 && y0 == y1) {
+			break;
+		}
+		i32 e2 = 2 * err;
+		if (e2 >= dy) {
+			err += dy;
+			x0 += sx;
+		}
+		if (e2 <= dx) {
+			err += dx;
+			y0 += sy;
+		}
+	}
+}
+
+// Midpoint circle. We walk one octant and mirror it to the other seven.
+static inline void draw_circle(const Surface &s, i32 cx, i32 cy, i32 r, const Pixel &color) {
+	i32 x = r;
+	i32 y = 0;
+	i32 err = 1 - r;
+	while (x >= y) {
+		set_pixel(s, cx + x, cy + y, color);
+		set_pixel(s, cx + y, cy + x, color);
+		set_pixel(s, cx - y, cy + x, color);
+		set_pixel(s, cx - x, cy + y, color);
+		set_pixel(s, cx - x, cy - y, color);
+		set_pixel(s, cx - y, cy - x, color);
+		set_pixel(s, cx + y, cy - x, color);
+		set_pixel(s, cx + x, cy - y, color);
+		y++;
+		if (err < 0) {
+			err += 2 * y + 1;
+		}
+		else {
+			x--;
+			err += 2 * (y - x) + 1;
+		}
+	}
+}
+
+// Same walk as draw_circle, but each step fills the spans between the
+// mirrored points.
+static inline void fill_circle(const Surface &s, i32 cx, i32 cy, i32 r, const Pixel &color) {
+	i32 x = r;
+	i32 y = 0;
+	i32 err = 1 - r;
+	while (x >= y) {
+		hline(s, cx - x, cy + y, 2 * x + 1, color);
+		hline(s, cx - x, cy - y, 2 * x + 1, color);
+		hline(s, cx - y, cy + x, 2 * y + 1, color);
+		hline(s, cx - y, cy - x, 2 * y + 1, color);
+		y++;
+		if (err < 0) {
+			err += 2 * y + 1;
+		}
+		else {
+			x--;
+			err += 2 * (y - x) + 1;
+		}
+	}
+}
+
+// (a * b) / 255 without the divide.
+static inline u32 mul255(u32 a, u32 b) {
+	u32 v = a * b + 128;
+	return (v + (v >> 8)) >> 8;
+}
+
+static inline Pixel blend(const Pixel &src, const Pixel &dst) {
+	u32 a = src.a;
+	u32 ia = 255 - a;
+	return Pixel {
+		(u8)(mul255(src.r, a) + mul255(dst.r, ia)),
+		(u8)(mul255(src.g, a) + mul255(dst.g, ia)),
+		(u8)(mul255(src.b, a) + mul255(dst.b, ia)),
+		(u8)(a + mul255(dst.a, ia)),
+	};
+}
+
+// Copy src onto dst at (x, y). With alpha set, src is blended using its
+// own alpha channel, otherwise the rows are copied as they are.
+static inline void blit(const Surface &dst, i32 x, i32 y, const Surface &src, bool alpha) {
+	i32 sx = 0;
+	i32 sy = 0;
+	i32 w = src.width;
+	i32 h = src.height;
+	i32 ox = x;
+	i32 oy = y;
+	if (!clip_range(x, w, dst.width) || !clip_range(y, h, dst.height)) {
+		return;
+	}
+	sx = x - ox;
+	sy = y - oy;
+	for (i32 row = 0; row < h; row++) {
+		Pixel *d = surface_row(dst, y + row) + x;
+		const Pixel *s = surface_row(src, sy + row) + sx;
+		if (alpha) {
+			for (i32 col = 0; col < w; col++) {
+				u8 a = s[col].a;
+				if (a == 255) {
+					d[col] = s[col];
+				}
+				else if (a != 0) {
+					d[col] = blend(s[col], d[col]);
+				}
+			}
+		}
+		else {
+			memcpy(d, s, w * sizeof(Pixel));
+		}
+	}
+}
@@ -0,0 +1,38 @@
+# build.mk
+# Build profiles, for startlib/Makefile and userspace/Makefile
+#
+#     make PROFILE=debug     -O0 with debug information
+#     make PROFILE=release   -O3 with link-time optimization (the default)
+#     make PROFILE=size      -Os with link-time optimization
+#
+# The optimized profiles put every function and variable in its own
+# section, so the linker can throw out whatever nothing uses. Smaller
+# programs are quicker to read off the disk and load.
+#
+# ARCH picks the instruction set. The default adds compressed
+# instructions to rv64g, which makes most programs a good deal smaller.
+PROFILE?=release
+ARCH?=rv64gc
+ABI?=lp64d
+
+ifeq ($(PROFILE),debug)
+PROFILE_FLAGS=-O0 -g
+PROFILE_LDFLAGS=
+else ifeq ($(PROFILE),release)
+PROFILE_FLAGS=-O3 -flto -ffunction-sections -fdata-sections
+PROFILE_LDFLAGS=-flto -Wl,--gc-sections
+else ifeq ($(PROFILE),size)
+PROFILE_FLAGS=-Os -flto -ffunction-sections -fdata-sections
+PROFILE_LDFLAGS=-flto -Wl,--gc-sections
+else
+$(error Unknown PROFILE $(PROFILE), use debug, release or size)
+endif
+
+# The kernel leaves the vector unit off (mstatus.VS) and doesn't save the
+# vector registers when it switches processes, so the first vector
+# instruction would be an illegal instruction trap.
+ifneq ($(findstring v,$(patsubst rv64%,%,$(firstword $(subst _, ,$(ARCH))))),)
+$(error ARCH $(ARCH) has the vector extension, which the kernel doesn't support yet)
+endif
+
+ARCH_FLAGS=-march=$(ARCH) -mabi=$(ABI)
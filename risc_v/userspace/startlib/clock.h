@@ -0,0 +1,37 @@
+#pragma once
+// clock.h
+// Reading the clock without a system call
+// The kernel maps the CLINT page that holds mtime, read-only, into every
+// user process. now_ticks() is a single load, where syscall_get_time()
+// (1062) traps into the kernel to do the same load for us.
+
+// These must match TIME_PAGE_VADDR and FREQ in cpu.rs.
+#define TIME_PAGE_VADDR 0x32000000UL
+#define TIMEBASE_FREQ   10000000UL
+
+#define NS_PER_SEC 1000000000UL
+
+// Raw timebase ticks since boot, which never go backwards.
+static inline unsigned long now_ticks() {
+	return *(volatile unsigned long *)(TIME_PAGE_VADDR + 0xff8);
+}
+
+// Split into seconds and the rest so that ticks * NS_PER_SEC can't
+// overflow. The divides are by constants, so they're multiplies.
+static inline unsigned long ticks_to_ns(unsigned long ticks) {
+	return (ticks / TIMEBASE_FREQ) * NS_PER_SEC + (ticks % TIMEBASE_FREQ) * NS_PER_SEC / TIMEBASE_FREQ;
+}
+
+// Monotonic nanoseconds since boot.
+static inline unsigned long now_ns() {
+	return ticks_to_ns(now_ticks());
+}
+
+// Monotonic time as seconds and nanoseconds, like clock_gettime() with
+// CLOCK_MONOTONIC. It has its own name so that it doesn't collide with
+// newlib's clock_gettime().
+static inline void clock_monotonic(unsigned long *sec, unsigned long *nsec) {
+	const unsigned long ticks = now_ticks();
+	*sec = ticks / TIMEBASE_FREQ;
+	*nsec = (ticks % TIMEBASE_FREQ) * NS_PER_SEC / TIMEBASE_FREQ;
+}
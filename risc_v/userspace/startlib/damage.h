@@ -0,0 +1,87 @@
+#pragma once
+// damage.h
+// Dirty rectangle tracking for the shared framebuffer
+// Draw straight into the framebuffer from syscall_get_fb(), record what
+// you touched with damage_add(), and call damage_present() once per frame.
+// The kernel merges the rectangles and sends them to the GPU in one batch,
+// rather than one transfer, flush, and notify per syscall_inv_rect().
+
+#include "syscall.h"
+
+// This must match DAMAGE_RING_SIZE in gpu.rs: one page minus the header.
+#define DAMAGE_RING_SIZE ((4096 - 16) / 16)
+
+struct DamageRect {
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+};
+
+struct DamageRing {
+	volatile unsigned int head;     // We write this
+	volatile unsigned int tail;     // The kernel writes this
+	volatile unsigned int overflow; // Set when we run out of room
+	unsigned int staged;            // rects[head] is ours and not published yet
+	DamageRect rects[DAMAGE_RING_SIZE];
+};
+
+static inline DamageRing *damage_get(unsigned long dev) {
+	return (DamageRing *)syscall_get_damage(dev);
+}
+
+static inline bool damage_touches(const DamageRect &a, unsigned int x, unsigned int y, unsigned int w, unsigned int h) {
+	return a.x <= x + w && x <= a.x + a.width && a.y <= y + h && y <= a.y + a.height;
+}
+
+// Hand the rectangle we've been growing to the kernel.
+static inline void damage_flush(DamageRing *ring) {
+	if (ring->staged) {
+		// The rectangle has to be in place before the kernel can see head move.
+		__sync_synchronize();
+		ring->head = (ring->head + 1) % DAMAGE_RING_SIZE;
+		ring->staged = 0;
+	}
+}
+
+// Record a dirty rectangle. Widgets tend to redraw next to what was just
+// drawn, so we keep growing the newest rectangle until something lands
+// that doesn't touch it. It stays at head, where the kernel can't see it,
+// until then, since the kernel may be reading anything before head. The
+// kernel does the full merge when we present.
+static inline void damage_add(DamageRing *ring, unsigned int x, unsigned int y, unsigned int w, unsigned int h) {
+	if (w == 0 || h == 0) {
+		return;
+	}
+	if (ring->staged) {
+		DamageRect &r = ring->rects[ring->head];
+		if (damage_touches(r, x, y, w, h)) {
+			unsigned int x2 = (r.x + r.width > x + w) ? r.x + r.width : x + w;
+			unsigned int y2 = (r.y + r.height > y + h) ? r.y + r.height : y + h;
+			r.x = r.x < x ? r.x : x;
+			r.y = r.y < y ? r.y : y;
+			r.width = x2 - r.x;
+			r.height = y2 - r.y;
+			return;
+		}
+		damage_flush(ring);
+	}
+	unsigned int head = ring->head;
+	// We only stage into a slot we know we can publish later.
+	if ((head + 1) % DAMAGE_RING_SIZE == ring->tail) {
+		// Full. The kernel will redraw the whole screen at present.
+		ring->overflow = 1;
+		return;
+	}
+	ring->rects[head].x = x;
+	ring->rects[head].y = y;
+	ring->rects[head].width = w;
+	ring->rects[head].height = h;
+	ring->staged = 1;
+}
+
+// Publish what we've recorded and send it to the GPU.
+static inline long damage_present(DamageRing *ring, unsigned long dev) {
+	damage_flush(ring);
+	return syscall_present(dev);
+}
@@ -0,0 +1,53 @@
+#pragma once
+// events.h
+// Input events through a shared ring
+// syscall_get_events() maps a page that the kernel writes key and abs
+// events into as they arrive. Read them with events_next(), and when the
+// ring is empty, syscall_wait_events() sleeps until there are more. There
+// is no polling and no system call per event.
+
+#include "syscall.h"
+
+// This must match EVENT_RING_SIZE in input.rs. It's a power of two so that
+// tail % EVENT_RING_SIZE stays right when the counters wrap.
+#define EVENT_RING_SIZE 256
+
+struct InputEvent {
+	unsigned short event_type;
+	unsigned short code;
+	unsigned int value;
+};
+
+struct EventRing {
+	volatile unsigned int head;    // The kernel writes this
+	volatile unsigned int tail;    // We write this
+	volatile unsigned int dropped; // Events lost because we fell behind
+	unsigned int padding;
+	InputEvent events[EVENT_RING_SIZE];
+};
+
+static inline EventRing *events_get() {
+	return (EventRing *)syscall_get_events();
+}
+
+// Take the next event off of the ring. Returns false if it's empty.
+static inline bool events_next(EventRing *ring, InputEvent &ev) {
+	unsigned int tail = ring->tail;
+	if (ring->head == tail) {
+		return false;
+	}
+	// Don't read the event until we've seen head move past it.
+	__sync_synchronize();
+	ev = ring->events[tail % EVENT_RING_SIZE];
+	__sync_synchronize();
+	ring->tail = tail + 1;
+	return true;
+}
+
+// Block until there's at least one event. Returns how many are ready.
+static inline unsigned int events_wait(EventRing *ring) {
+	while (ring->head == ring->tail) {
+		syscall_wait_events();
+	}
+	return ring->head - ring->tail;
+}
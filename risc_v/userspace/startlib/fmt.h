@@ -0,0 +1,594 @@
+#pragma once
+// fmt.h
+// Compile-time format strings for startlib
+// printf() parses its format string every time it's called, even though
+// the string almost never changes. Here, the format string is parsed by the
+// compiler instead, so each call site gets its own formatter that only
+// converts its arguments and copies its literal text.
+//
+//     fmt::print(FMT("frame {} took {:.3f} ms\n"), frame, ms);
+//
+// Fields are {} or {:spec} where spec is [align][sign][#][0][width][.prec][type]
+//     align  < (left), > (right) or ^ (center)
+//     sign   + or space, for numbers
+//     #      0x, 0b or 0 in front of hex, binary and octal
+//     0      pad numbers with zeros instead of spaces
+//     type   d x X o b c for integers, f F e E g G for doubles, s, p
+// {{ and }} are a literal { and }. With no type, integers are decimal,
+// doubles are the shortest text that reads back as the same value, and
+// strings are strings. A format string that doesn't parse, or whose fields
+// don't match the arguments, is a compile error.
+//
+// Output goes straight into the stdout buffer (stdout.h), and doubles are
+// converted by dtoa() and dtoa_format() from printf.cpp, so link libstart.
+// The C printf() is still there for everything else.
+
+#include <stddef.h>
+#include <type_traits>
+#include "printf.h"
+#include "stdout.h"
+
+// Wrap a string literal so that it can be parsed at compile time. Every
+// FMT() is its own type, which is what gives each call site its own code.
+#define FMT(s)                                                     \
+	([] {                                                          \
+		struct FmtString {                                         \
+			static constexpr const char *get() { return s; }       \
+		};                                                         \
+		return FmtString{};                                        \
+	}())
+
+namespace fmt {
+namespace detail {
+
+enum : unsigned int {
+	FLAG_PLUS  = 1U << 0U,
+	FLAG_SPACE = 1U << 1U,
+	FLAG_HASH  = 1U << 2U,
+	FLAG_ZERO  = 1U << 3U,
+	FLAG_PREC  = 1U << 4U,
+};
+
+struct Spec {
+	unsigned int flags = 0;
+	unsigned int width = 0;
+	unsigned int prec = 0;
+	char align = 0; // 0 means the default for the argument
+	char type = 0;  // 0 means the default for the argument
+};
+
+// A format string is a list of pieces: literal text or a field.
+struct Piece {
+	bool field = false;
+	bool error = false;
+	unsigned int begin = 0; // The literal text is [begin, end)
+	unsigned int end = 0;
+	unsigned int next = 0;  // Where the next piece starts
+	Spec spec;
+};
+
+constexpr bool is_digit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+// Parse the piece that starts at i.
+constexpr Piece parse_piece(const char *s, unsigned int i) {
+	Piece p;
+	p.begin = i;
+	if ((s[i] == '{' && s[i + 1] == '{') || (s[i] == '}' && s[i + 1] == '}')) {
+		p.end = i + 1;
+		p.next = i + 2;
+		return p;
+	}
+	if (s[i] == '}') {
+		p.error = true;
+		return p;
+	}
+	if (s[i] != '{') {
+		while (s[i] && s[i] != '{' && s[i] != '}') {
+			i++;
+		}
+		p.end = i;
+		p.next = i;
+		return p;
+	}
+	p.field = true;
+	i++;
+	if (s[i] == ':') {
+		i++;
+		if (s[i] == '<' || s[i] == '>' || s[i] == '^') {
+			p.spec.align = s[i++];
+		}
+		if (s[i] == '+') {
+			p.spec.flags |= FLAG_PLUS;
+			i++;
+		}
+		else if (s[i] == ' ') {
+			p.spec.flags |= FLAG_SPACE;
+			i++;
+		}
+		if (s[i] == '#') {
+			p.spec.flags |= FLAG_HASH;
+			i++;
+		}
+		if (s[i] == '0') {
+			p.spec.flags |= FLAG_ZERO;
+			i++;
+		}
+		while (is_digit(s[i])) {
+			p.spec.width = p.spec.width * 10 + (s[i++] - '0');
+		}
+		if (s[i] == '.') {
+			i++;
+			if (!is_digit(s[i])) {
+				p.error = true;
+				return p;
+			}
+			p.spec.flags |= FLAG_PREC;
+			while (is_digit(s[i])) {
+				p.spec.prec = p.spec.prec * 10 + (s[i++] - '0');
+			}
+		}
+		if (s[i] && s[i] != '}') {
+			p.spec.type = s[i++];
+		}
+	}
+	if (s[i] != '}') {
+		p.error = true;
+		return p;
+	}
+	p.next = i + 1;
+	return p;
+}
+
+// These walk the string from the start every time. That's quadratic, but
+// it only ever runs in the compiler.
+constexpr Piece piece_at(const char *s, unsigned int k) {
+	Piece p = parse_piece(s, 0);
+	while (k-- && !p.error) {
+		p = parse_piece(s, p.next);
+	}
+	return p;
+}
+
+constexpr unsigned int piece_count(const char *s) {
+	unsigned int n = 0;
+	unsigned int i = 0;
+	while (s[i]) {
+		const Piece p = parse_piece(s, i);
+		if (p.error) {
+			return n;
+		}
+		i = p.next;
+		n++;
+	}
+	return n;
+}
+
+constexpr bool parse_error(const char *s) {
+	unsigned int i = 0;
+	while (s[i]) {
+		const Piece p = parse_piece(s, i);
+		if (p.error) {
+			return true;
+		}
+		i = p.next;
+	}
+	return false;
+}
+
+constexpr unsigned int field_count(const char *s) {
+	unsigned int n = 0;
+	const unsigned int pieces = piece_count(s);
+	for (unsigned int k = 0; k < pieces; k++) {
+		if (piece_at(s, k).field) {
+			n++;
+		}
+	}
+	return n;
+}
+
+// Which argument piece k formats
+constexpr unsigned int field_index(const char *s, unsigned int k) {
+	unsigned int n = 0;
+	for (unsigned int j = 0; j < k; j++) {
+		if (piece_at(s, j).field) {
+			n++;
+		}
+	}
+	return n;
+}
+
+// What an argument is, which decides the types it may be formatted with.
+enum class Kind { Int, Char, Float, String, Pointer, Other };
+
+template <typename T>
+struct kind_of {
+	typedef typename std::decay<T>::type D;
+	static constexpr Kind value =
+		std::is_same<D, char>::value                         ? Kind::Char :
+		std::is_integral<D>::value                           ? Kind::Int :
+		std::is_floating_point<D>::value                     ? Kind::Float :
+		std::is_same<D, const char *>::value ||
+		std::is_same<D, char *>::value                       ? Kind::String :
+		std::is_pointer<D>::value                            ? Kind::Pointer :
+		                                                       Kind::Other;
+};
+
+constexpr bool type_ok(Kind kind, char type) {
+	switch (kind) {
+		case Kind::Int:
+		case Kind::Char:
+			return type == 0 || type == 'd' || type == 'x' || type == 'X' || type == 'o' ||
+			       type == 'b' || type == 'c';
+		case Kind::Float:
+			return type == 0 || type == 'f' || type == 'F' || type == 'e' || type == 'E' ||
+			       type == 'g' || type == 'G';
+		case Kind::String:
+			return type == 0 || type == 's' || type == 'p';
+		case Kind::Pointer:
+			return type == 0 || type == 'p';
+		default:
+			return false;
+	}
+}
+
+// Where the characters go
+struct StdoutSink {
+	size_t count = 0;
+	void put(char c) {
+		stdout_putchar(c);
+		count++;
+	}
+	void write(const char *s, size_t n) {
+		stdout_write(s, n);
+		count += n;
+	}
+};
+
+// Like snprintf(), this counts everything but keeps only what fits.
+struct BufferSink {
+	char *buffer;
+	size_t size;
+	size_t count = 0;
+	BufferSink(char *b, size_t n) : buffer(b), size(n) {}
+	void put(char c) {
+		if (count < size) {
+			buffer[count] = c;
+		}
+		count++;
+	}
+	void write(const char *s, size_t n) {
+		for (size_t i = 0; i < n && count + i < size; i++) {
+			buffer[count + i] = s[i];
+		}
+		count += n;
+	}
+};
+
+template <typename Sink>
+inline void pad(Sink &sink, char c, size_t n) {
+	char run[16];
+	for (size_t i = 0; i < sizeof(run); i++) {
+		run[i] = c;
+	}
+	while (n) {
+		const size_t k = n < sizeof(run) ? n : sizeof(run);
+		sink.write(run, k);
+		n -= k;
+	}
+}
+
+// Write prefix (sign, 0x) and body with the width and alignment applied.
+template <typename Sink>
+inline void write_padded(Sink &sink, const Spec &spec, bool numeric, const char *prefix, size_t prefix_len,
+                         const char *body, size_t body_len) {
+	const size_t len = prefix_len + body_len;
+	const size_t fill = spec.width > len ? spec.width - len : 0;
+	char align = spec.align ? spec.align : (numeric ? '>' : '<');
+	if (fill && numeric && (spec.flags & FLAG_ZERO) && !spec.align) {
+		sink.write(prefix, prefix_len);
+		pad(sink, '0', fill);
+		sink.write(body, body_len);
+		return;
+	}
+	const size_t before = align == '>' ? fill : align == '^' ? fill / 2 : 0;
+	pad(sink, ' ', before);
+	sink.write(prefix, prefix_len);
+	sink.write(body, body_len);
+	pad(sink, ' ', fill - before);
+}
+
+// The digits of value, ending right before end. Returns the first digit.
+inline char *utoa10(char *end, unsigned long long value) {
+	static const char lut[] = "00010203040506070809101112131415161718192021222324"
+	                          "25262728293031323334353637383940414243444546474849"
+	                          "50515253545556575859606162636465666768697071727374"
+	                          "75767778798081828384858687888990919293949596979899";
+	char *p = end;
+	while (value >= 100) {
+		const unsigned int r = (unsigned int)(value % 100) * 2;
+		value /= 100;
+		p -= 2;
+		p[0] = lut[r];
+		p[1] = lut[r + 1];
+	}
+	if (value >= 10) {
+		p -= 2;
+		p[0] = lut[value * 2];
+		p[1] = lut[value * 2 + 1];
+	}
+	else {
+		*--p = (char)('0' + value);
+	}
+	return p;
+}
+
+inline char *utoa_pow2(char *end, unsigned long long value, unsigned int shift, bool upper) {
+	const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	const unsigned long long mask = (1ULL << shift) - 1;
+	char *p = end;
+	do {
+		*--p = digits[value & mask];
+		value >>= shift;
+	} while (value);
+	return p;
+}
+
+template <typename Sink>
+inline void write_int(Sink &sink, const Spec &spec, unsigned long long value, bool negative) {
+	if (spec.type == 'c') {
+		const char c = (char)value;
+		write_padded(sink, spec, false, nullptr, 0, &c, 1);
+		return;
+	}
+	char buf[64];
+	char *const end = buf + sizeof(buf);
+	char *digits;
+	char prefix[3];
+	size_t prefix_len = 0;
+	if (negative) {
+		prefix[prefix_len++] = '-';
+	}
+	else if (spec.flags & FLAG_PLUS) {
+		prefix[prefix_len++] = '+';
+	}
+	else if (spec.flags & FLAG_SPACE) {
+		prefix[prefix_len++] = ' ';
+	}
+	const bool hash = spec.flags & FLAG_HASH;
+	switch (spec.type) {
+		case 'x':
+		case 'X':
+			digits = utoa_pow2(end, value, 4, spec.type == 'X');
+			if (hash) {
+				prefix[prefix_len++] = '0';
+				prefix[prefix_len++] = spec.type;
+			}
+			break;
+		case 'b':
+			digits = utoa_pow2(end, value, 1, false);
+			if (hash) {
+				prefix[prefix_len++] = '0';
+				prefix[prefix_len++] = 'b';
+			}
+			break;
+		case 'o':
+			digits = utoa_pow2(end, value, 3, false);
+			if (hash && value) {
+				prefix[prefix_len++] = '0';
+			}
+			break;
+		default:
+			digits = utoa10(end, value);
+			break;
+	}
+	write_padded(sink, spec, true, prefix, prefix_len, digits, (size_t)(end - digits));
+}
+
+template <typename Sink>
+inline void write_float_text(Sink &sink, const Spec &spec, const char *text, int len) {
+	// The sign counts as a prefix, so that zeros go after it. nan and inf
+	// are never zero padded.
+	const bool finite = len && (text[len - 1] != 'n' && text[len - 1] != 'N' && text[len - 1] != 'f' &&
+	                            text[len - 1] != 'F');
+	Spec s = spec;
+	if (!finite) {
+		s.flags &= ~FLAG_ZERO;
+	}
+	if (text[0] == '-') {
+		write_padded(sink, s, true, text, 1, text + 1, len - 1);
+	}
+	else if (spec.flags & (FLAG_PLUS | FLAG_SPACE)) {
+		const char sign = (spec.flags & FLAG_PLUS) ? '+' : ' ';
+		write_padded(sink, s, true, &sign, 1, text, len);
+	}
+	else {
+		write_padded(sink, s, true, nullptr, 0, text, len);
+	}
+}
+
+template <typename Sink>
+inline void write_float(Sink &sink, const Spec &spec, double value) {
+	char buf[64];
+	int len;
+	if (spec.type || (spec.flags & FLAG_PREC)) {
+		const char type = spec.type ? spec.type : 'g';
+		const unsigned int prec = (spec.flags & FLAG_PREC) ? spec.prec : 6;
+		len = dtoa_format(buf, sizeof(buf), value, type, prec, (spec.flags & FLAG_HASH) != 0);
+		if (len >= (int)sizeof(buf)) {
+			// Something like {:f} of 1e300. Take the slow way.
+			char *big = new char[len + 1];
+			dtoa_format(big, len + 1, value, type, prec, (spec.flags & FLAG_HASH) != 0);
+			write_float_text(sink, spec, big, len);
+			delete[] big;
+			return;
+		}
+	}
+	else {
+		len = dtoa(buf, value);
+	}
+	write_float_text(sink, spec, buf, len);
+}
+
+template <typename Sink>
+inline void write_string(Sink &sink, const Spec &spec, const char *s) {
+	if (!s) {
+		s = "(null)";
+	}
+	size_t len = 0;
+	const size_t limit = (spec.flags & FLAG_PREC) ? spec.prec : (size_t)-1;
+	while (len < limit && s[len]) {
+		len++;
+	}
+	write_padded(sink, spec, false, nullptr, 0, s, len);
+}
+
+template <typename Sink>
+inline void write_pointer(Sink &sink, const Spec &spec, const void *p) {
+	char buf[16];
+	char *const end = buf + sizeof(buf);
+	char *digits = utoa_pow2(end, (unsigned long long)(size_t)p, 4, false);
+	write_padded(sink, spec, true, "0x", 2, digits, (size_t)(end - digits));
+}
+
+// One overload per kind of argument
+template <typename T>
+constexpr bool is_negative(T value, std::true_type) {
+	return value < 0;
+}
+
+template <typename T>
+constexpr bool is_negative(T, std::false_type) {
+	return false;
+}
+
+template <typename Sink, typename T>
+inline void write_arg(Sink &sink, const Spec &spec, T value, std::integral_constant<Kind, Kind::Int>) {
+	if (is_negative(value, std::is_signed<T>())) {
+		write_int(sink, spec, 0ULL - (unsigned long long)value, true);
+	}
+	else {
+		write_int(sink, spec, (unsigned long long)value, false);
+	}
+}
+
+template <typename Sink, typename T>
+inline void write_arg(Sink &sink, const Spec &spec, T value, std::integral_constant<Kind, Kind::Char>) {
+	if (spec.type == 0 || spec.type == 'c') {
+		write_padded(sink, spec, false, nullptr, 0, &value, 1);
+	}
+	else {
+		write_int(sink, spec, (unsigned char)value, false);
+	}
+}
+
+template <typename Sink, typename T>
+inline void write_arg(Sink &sink, const Spec &spec, T value, std::integral_constant<Kind, Kind::Float>) {
+	write_float(sink, spec, (double)value);
+}
+
+template <typename Sink, typename T>
+inline void write_arg(Sink &sink, const Spec &spec, T value, std::integral_constant<Kind, Kind::String>) {
+	if (spec.type == 'p') {
+		write_pointer(sink, spec, value);
+	}
+	else {
+		write_string(sink, spec, value);
+	}
+}
+
+template <typename Sink, typename T>
+inline void write_arg(Sink &sink, const Spec &spec, T value, std::integral_constant<Kind, Kind::Pointer>) {
+	write_pointer(sink, spec, (const void *)value);
+}
+
+// The nth of a pack of arguments
+template <unsigned int N>
+struct nth {
+	template <typename T, typename... Rest>
+	static const auto &get(const T &, const Rest &... rest) {
+		return nth<N - 1>::get(rest...);
+	}
+};
+
+template <>
+struct nth<0> {
+	template <typename T, typename... Rest>
+	static const T &get(const T &first, const Rest &...) {
+		return first;
+	}
+};
+
+// Emit piece K of format string S. The piece is worked out at compile
+// time, so this is either a copy of constant text or a single conversion.
+template <typename S, unsigned int K, bool Field = piece_at(S::get(), K).field>
+struct Emit {
+	template <typename Sink, typename... Args>
+	static void run(Sink &sink, const Args &...) {
+		constexpr Piece p = piece_at(S::get(), K);
+		if (p.end - p.begin == 1) {
+			sink.put(S::get()[p.begin]);
+		}
+		else {
+			sink.write(S::get() + p.begin, p.end - p.begin);
+		}
+	}
+};
+
+template <typename S, unsigned int K>
+struct Emit<S, K, true> {
+	template <typename Sink, typename... Args>
+	static void run(Sink &sink, const Args &... args) {
+		constexpr Piece p = piece_at(S::get(), K);
+		constexpr unsigned int n = field_index(S::get(), K);
+		const auto &arg = nth<n>::get(args...);
+		typedef kind_of<decltype(arg)> kind;
+		static_assert(kind::value != Kind::Other, "fmt: this type can't be formatted");
+		static_assert(type_ok(kind::value, p.spec.type), "fmt: format type doesn't match the argument");
+		write_arg(sink, p.spec, arg, std::integral_constant<Kind, kind::value>());
+	}
+};
+
+template <unsigned int... I>
+struct seq {};
+
+template <unsigned int N, unsigned int... I>
+struct make_seq : make_seq<N - 1, N - 1, I...> {};
+
+template <unsigned int... I>
+struct make_seq<0, I...> {
+	typedef seq<I...> type;
+};
+
+template <typename S, typename Sink, unsigned int... I, typename... Args>
+inline void emit_all(Sink &sink, seq<I...>, const Args &... args) {
+	static_assert(!parse_error(S::get()), "fmt: bad format string");
+	static_assert(field_count(S::get()) == sizeof...(Args), "fmt: wrong number of arguments");
+	const int expand[] = {0, (Emit<S, I>::run(sink, args...), 0)...};
+	(void)expand;
+}
+
+} // namespace detail
+
+// printf() with a FMT() string. Returns the number of characters written.
+template <typename S, typename... Args>
+inline int print(S, const Args &... args) {
+	detail::StdoutSink sink;
+	detail::emit_all<S>(sink, typename detail::make_seq<detail::piece_count(S::get())>::type(), args...);
+	return (int)sink.count;
+}
+
+// snprintf() with a FMT() string. At most count - 1 characters and a 0 are
+// stored, and the return value is how many there would have been.
+template <typename S, typename... Args>
+inline int format_to(char *buffer, size_t count, S, const Args &... args) {
+	detail::BufferSink sink(buffer, count);
+	detail::emit_all<S>(sink, typename detail::make_seq<detail::piece_count(S::get())>::type(), args...);
+	if (count) {
+		buffer[sink.count < count ? sink.count : count - 1] = 0;
+	}
+	return (int)sink.count;
+}
+
+} // namespace fmt
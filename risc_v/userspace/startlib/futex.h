@@ -0,0 +1,57 @@
+#pragma once
+// futex.h
+// Waiting on a word of memory
+// syscall_futex() (98) puts us to sleep on an int until somebody wakes us,
+// but only if the int still holds what we think it does. FutexLock is a
+// lock built on that: taking and giving back a free lock is a single
+// atomic, and we only go to the kernel when somebody has to wait.
+
+#include "syscall.h"
+
+// These must match futex.rs.
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+// Sleep while *addr == val. This can come back early, so check again.
+static inline long futex_wait(volatile int *addr, int val) {
+	return syscall_futex(addr, FUTEX_WAIT, val);
+}
+
+// Wake up to n threads waiting on addr. Returns how many there were.
+static inline long futex_wake(volatile int *addr, int n) {
+	return syscall_futex(addr, FUTEX_WAKE, n);
+}
+
+// How many times to try a held lock before we sleep on it. Whoever holds
+// it may be running on another hart and about to let go.
+#define FUTEX_SPINS 100
+
+// state is 0 when the lock is free, 1 when it's held, and 2 when it's
+// held and somebody might be sleeping on it. Only unlock() from 2 makes a
+// system call.
+struct FutexLock {
+	volatile int state;
+
+	bool try_lock() {
+		int expected = 0;
+		return __atomic_compare_exchange_n(&state, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+	}
+
+	void lock() {
+		for (int i = 0; i < FUTEX_SPINS; i++) {
+			if (state == 0 && try_lock()) {
+				return;
+			}
+		}
+		// From here on we say there's a waiter, since we might become one.
+		while (__atomic_exchange_n(&state, 2, __ATOMIC_ACQUIRE) != 0) {
+			futex_wait(&state, 2);
+		}
+	}
+
+	void unlock() {
+		if (__atomic_exchange_n(&state, 0, __ATOMIC_RELEASE) == 2) {
+			futex_wake(&state, 1);
+		}
+	}
+};
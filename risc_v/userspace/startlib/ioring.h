@@ -0,0 +1,198 @@
+#pragma once
+// ioring.h
+// Asynchronous file and block I/O through shared rings
+// syscall_io_setup() maps a submission queue and a completion queue into
+// the process. Fill in as many submissions as you like, then one
+// syscall_io_enter() starts all of them, so a program can keep the block
+// device busy without a system call (or a kernel process) per request.
+//
+//     IoRing io;
+//     io.init();
+//     IoFuture a = io.read_block(8, buf, 4096, 0);
+//     IoFuture b = io.read_file(fd, other, 1000, 0);
+//     io.submit();
+//     long got = a.get() + b.get();
+
+#include "syscall.h"
+
+// These must match ioring.rs.
+#define IORING_SQ_ENTRIES 64
+#define IORING_CQ_ENTRIES 128
+
+#define IORING_OP_NOP         0
+#define IORING_OP_BLOCK_READ  1
+#define IORING_OP_BLOCK_WRITE 2
+#define IORING_OP_FILE_READ   3
+#define IORING_OP_FILE_WRITE  4
+
+// Block ops need a buffer and length that are multiples of 512, and
+// offset is in bytes. File ops take a descriptor from open().
+struct IoSqe {
+	unsigned char op;
+	unsigned char pad[3];
+	unsigned int fd;
+	unsigned long addr;
+	unsigned int len;
+	unsigned int pad1;
+	unsigned long offset;
+	unsigned long user_data;
+};
+
+// res is the number of bytes, or a negative errno.
+struct IoCqe {
+	unsigned long user_data;
+	long res;
+};
+
+struct IoRingPages {
+	volatile unsigned int sq_head;     // The kernel writes this
+	volatile unsigned int sq_tail;     // We write this
+	volatile unsigned int cq_head;     // We write this
+	volatile unsigned int cq_tail;     // The kernel writes this
+	volatile unsigned int cq_overflow; // Completions lost because we fell behind
+	unsigned int pad[3];
+	IoSqe sqes[IORING_SQ_ENTRIES];
+	IoCqe cqes[IORING_CQ_ENTRIES];
+};
+
+class IoRing;
+
+// The result of one submission, which may not be in yet.
+class IoFuture {
+public:
+	IoFuture() : ring(nullptr), slot(0) {}
+	IoFuture(IoRing *r, unsigned int s) : ring(r), slot(s) {}
+	// Has it completed? This doesn't block.
+	bool ready();
+	// Wait for it, and give back its result.
+	long get();
+	bool valid() const { return ring != nullptr; }
+
+private:
+	IoRing *ring;
+	unsigned int slot;
+};
+
+class IoRing {
+public:
+	// Returns false if the kernel wouldn't give us a ring.
+	bool init() {
+		pages = (IoRingPages *)syscall_io_setup();
+		for (unsigned int i = 0; i < IORING_CQ_ENTRIES; i++) {
+			slots[i].state = SLOT_FREE;
+		}
+		return pages != nullptr;
+	}
+
+	IoFuture read_block(unsigned int dev, void *buf, unsigned int len, unsigned long offset) {
+		return queue(IORING_OP_BLOCK_READ, dev, buf, len, offset);
+	}
+	IoFuture write_block(unsigned int dev, const void *buf, unsigned int len, unsigned long offset) {
+		return queue(IORING_OP_BLOCK_WRITE, dev, buf, len, offset);
+	}
+	IoFuture read_file(int fd, void *buf, unsigned int len, unsigned long offset) {
+		return queue(IORING_OP_FILE_READ, fd, buf, len, offset);
+	}
+	IoFuture write_file(int fd, const void *buf, unsigned int len, unsigned long offset) {
+		return queue(IORING_OP_FILE_WRITE, fd, buf, len, offset);
+	}
+	IoFuture nop() {
+		return queue(IORING_OP_NOP, 0, nullptr, 0, 0);
+	}
+
+	// Start everything queued so far without waiting.
+	void submit() {
+		syscall_io_enter(0);
+		reap();
+	}
+
+	// Start everything queued so far and wait until at least n more
+	// results are in.
+	void wait(unsigned int n) {
+		syscall_io_enter(n);
+		reap();
+	}
+
+	// Move results from the completion queue to their futures.
+	void reap() {
+		unsigned int head = pages->cq_head;
+		while (head != pages->cq_tail) {
+			// Don't read the entry until we've seen the tail move past it.
+			__sync_synchronize();
+			const IoCqe &cqe = pages->cqes[head % IORING_CQ_ENTRIES];
+			Slot &s = slots[cqe.user_data % IORING_CQ_ENTRIES];
+			s.res = cqe.res;
+			s.state = SLOT_DONE;
+			head++;
+		}
+		__sync_synchronize();
+		pages->cq_head = head;
+	}
+
+private:
+	friend class IoFuture;
+	enum SlotState { SLOT_FREE, SLOT_PENDING, SLOT_DONE };
+	struct Slot {
+		SlotState state;
+		long res;
+	};
+
+	IoFuture queue(unsigned char op, unsigned int fd, const void *buf, unsigned int len, unsigned long offset) {
+		// There are as many slots as completion entries, so a full set of
+		// slots means the completion queue is full too. Make room by
+		// waiting for something to finish.
+		unsigned int slot = find_slot();
+		while (slot == IORING_CQ_ENTRIES) {
+			wait(1);
+			slot = find_slot();
+		}
+		while (pages->sq_tail - pages->sq_head >= IORING_SQ_ENTRIES) {
+			submit();
+		}
+		const unsigned int tail = pages->sq_tail;
+		IoSqe &sqe = pages->sqes[tail % IORING_SQ_ENTRIES];
+		sqe.op = op;
+		sqe.fd = fd;
+		sqe.addr = (unsigned long)buf;
+		sqe.len = len;
+		sqe.offset = offset;
+		sqe.user_data = slot;
+		slots[slot].state = SLOT_PENDING;
+		// The entry has to be filled in before the kernel can see it.
+		__sync_synchronize();
+		pages->sq_tail = tail + 1;
+		return IoFuture(this, slot);
+	}
+
+	unsigned int find_slot() {
+		for (unsigned int i = 0; i < IORING_CQ_ENTRIES; i++) {
+			const unsigned int s = (next_slot + i) % IORING_CQ_ENTRIES;
+			if (slots[s].state == SLOT_FREE) {
+				next_slot = s + 1;
+				return s;
+			}
+		}
+		return IORING_CQ_ENTRIES;
+	}
+
+	IoRingPages *pages = nullptr;
+	Slot slots[IORING_CQ_ENTRIES];
+	unsigned int next_slot = 0;
+};
+
+inline bool IoFuture::ready() {
+	ring->reap();
+	return ring->slots[slot].state == IoRing::SLOT_DONE;
+}
+
+inline long IoFuture::get() {
+	IoRing::Slot &s = ring->slots[slot];
+	while (s.state != IoRing::SLOT_DONE) {
+		// Anything not yet started goes with this, so get() alone is
+		// enough to make progress.
+		ring->wait(1);
+	}
+	// The result is ours now, so the slot can be used again.
+	s.state = IoRing::SLOT_FREE;
+	return s.res;
+}
@@ -0,0 +1,493 @@
+// malloc.cpp
+// Heap allocator for startlib
+
+#include "malloc.h"
+#include "futex.h"
+#include "string.h"
+#include "syscall.h"
+#include <new>
+
+// Everything we get from brk is cut into page-sized chunks. A chunk is
+// either part of a slab for one size class or part of a large allocation.
+// chunk_kind[] records which, so free() can find out what a pointer is
+// without a header in front of every small object. Large allocations are
+// a whole number of chunks, so they waste less than a page each.
+#define CHUNK_SIZE      4096
+#define SLAB_CHUNKS     4
+#define SLAB_SIZE       (SLAB_CHUNKS * CHUNK_SIZE)
+#define MAX_HEAP        (256 * 1024 * 1024)
+#define MAX_CHUNKS      (MAX_HEAP / CHUNK_SIZE)
+#define KIND_NONE       0
+#define KIND_LARGE      0xfe
+#define KIND_LARGE_TAIL 0xff
+// Grow the heap by at least this much, and otherwise by as much as we
+// already have, up to MAX_GROWTH at a time.
+#define MIN_GROWTH      (64 * 1024)
+#define MAX_GROWTH      (4 * 1024 * 1024)
+#define ALIGN           16
+// What posix_memalign() returns. These match newlib's errno.h.
+#define EINVAL          22
+#define ENOMEM          12
+
+// Size classes. Each step is at most 50% bigger than the last so we waste
+// no more than a third of an object. Anything bigger than the last class
+// is a large allocation.
+static const unsigned short class_sizes[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072
+};
+#define NUM_CLASSES (sizeof(class_sizes) / sizeof(class_sizes[0]))
+#define MAX_SMALL   3072
+
+struct FreeObject {
+	FreeObject *next;
+};
+
+// A free run of chunks that used to be a large allocation.
+struct FreeRun {
+	FreeRun *next;
+	size_t chunks;
+};
+
+// The header right in front of a large allocation. It's ALIGN bytes so
+// the pointer we hand out stays aligned. Normally the pointer is just past
+// it at the start of the first chunk, but memalign() can push it further
+// in, so we record how far.
+struct LargeHeader {
+	size_t chunks;
+	size_t offset;
+};
+
+// All of the per-thread state lives here. Right now every thread shares
+// one, under heap_lock, but each could get its own Heap for the size
+// classes and only go to the shared chunk allocator when a slab runs dry.
+struct Heap {
+	FreeObject *free_lists[NUM_CLASSES];
+};
+
+static Heap main_heap;
+
+// Threads (thread.h) share the heap. The lock is free almost all of the
+// time, so this costs an atomic or two per call.
+static FutexLock heap_lock;
+
+struct HeapGuard {
+	HeapGuard() { heap_lock.lock(); }
+	~HeapGuard() { heap_lock.unlock(); }
+};
+
+static inline Heap *current_heap() {
+	return &main_heap;
+}
+
+// The chunk allocator, which sits on top of brk.
+static unsigned long heap_base = 0;  // First chunk (aligned)
+static unsigned long heap_top = 0;   // Next chunk we haven't used
+static unsigned long heap_end = 0;   // End of what brk gave us
+static FreeRun *free_runs = nullptr;
+static unsigned char chunk_kind[MAX_CHUNKS];
+static HeapStats stats;
+
+static inline unsigned long align_up(unsigned long val, unsigned long align) {
+	return (val + align - 1) & ~(align - 1);
+}
+
+static inline unsigned long chunk_index(const void *ptr) {
+	return ((unsigned long)ptr - heap_base) / CHUNK_SIZE;
+}
+
+// Make sure [heap_top, heap_top + bytes) is backed by brk.
+static bool grow(unsigned long bytes) {
+	if (heap_end == 0) {
+		heap_end = syscall_brk(0);
+		heap_base = align_up(heap_end, CHUNK_SIZE);
+		heap_top = heap_base;
+	}
+	unsigned long need = heap_top + bytes;
+	if (need <= heap_end) {
+		return true;
+	}
+	if (need - heap_base > MAX_HEAP) {
+		return false;
+	}
+	// Geometric growth: ask for at least as much as we already have, so N
+	// bytes of heap costs O(log N) system calls.
+	unsigned long have = heap_end - heap_base;
+	unsigned long step = have < MIN_GROWTH ? MIN_GROWTH : (have > MAX_GROWTH ? MAX_GROWTH : have);
+	unsigned long want = align_up(need, CHUNK_SIZE);
+	if (want - heap_end < step) {
+		want = heap_end + step;
+	}
+	if (want - heap_base > MAX_HEAP) {
+		want = heap_base + MAX_HEAP;
+	}
+	unsigned long got = syscall_brk(want);
+	stats.brk_calls++;
+	if (got < need) {
+		// The kernel gave us less than we need. Keep what it did give.
+		if (got > heap_end) {
+			heap_end = got;
+		}
+		return false;
+	}
+	heap_end = got;
+	stats.heap_bytes = heap_end - heap_base;
+	return true;
+}
+
+// Get a run of chunks, either from a freed large allocation or fresh
+// from the top of the heap.
+static void *alloc_chunks(size_t chunks) {
+	FreeRun **prev = &free_runs;
+	for (FreeRun *run = free_runs; run != nullptr; prev = &run->next, run = run->next) {
+		if (run->chunks >= chunks) {
+			if (run->chunks == chunks) {
+				*prev = run->next;
+			}
+			else {
+				// Take the back of the run so the front stays on the list.
+				run->chunks -= chunks;
+				return (char *)run + run->chunks * CHUNK_SIZE;
+			}
+			return run;
+		}
+	}
+	if (!grow(chunks * CHUNK_SIZE)) {
+		return nullptr;
+	}
+	void *ret = (void *)heap_top;
+	heap_top += chunks * CHUNK_SIZE;
+	return ret;
+}
+
+static void free_chunks(void *ptr, size_t chunks) {
+	unsigned long idx = chunk_index(ptr);
+	for (size_t i = 0; i < chunks; i++) {
+		chunk_kind[idx + i] = KIND_NONE;
+	}
+	// Keep the free runs sorted by address so that we can join a run with
+	// its neighbors. Otherwise the heap would only ever get more broken up.
+	FreeRun *run = (FreeRun *)ptr;
+	run->chunks = chunks;
+	FreeRun **prev = &free_runs;
+	FreeRun *before = nullptr;
+	while (*prev != nullptr && *prev < run) {
+		before = *prev;
+		prev = &(*prev)->next;
+	}
+	run->next = *prev;
+	*prev = run;
+	if (run->next != nullptr && (char *)run + run->chunks * CHUNK_SIZE == (char *)run->next) {
+		run->chunks += run->next->chunks;
+		run->next = run->next->next;
+	}
+	if (before != nullptr && (char *)before + before->chunks * CHUNK_SIZE == (char *)run) {
+		before->chunks += run->chunks;
+		before->next = run->next;
+		run = before;
+	}
+	// If this run is at the top of the heap, move the top back down
+	// instead. It's the last run on the list since the list is sorted.
+	if ((unsigned long)run + run->chunks * CHUNK_SIZE == heap_top) {
+		heap_top = (unsigned long)run;
+		if (before == run) {
+			// We joined with before, so find whoever points at it.
+			prev = &free_runs;
+			while (*prev != run) {
+				prev = &(*prev)->next;
+			}
+		}
+		*prev = nullptr;
+	}
+}
+
+static inline int size_class(size_t size) {
+	// The classes are small enough that a scan beats anything clever.
+	for (unsigned int i = 0; i < NUM_CLASSES; i++) {
+		if (size <= class_sizes[i]) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Carve a new slab into objects for this class and put them all on the
+// free list.
+static bool refill(Heap *heap, int cls) {
+	char *slab = (char *)alloc_chunks(SLAB_CHUNKS);
+	if (slab == nullptr) {
+		return false;
+	}
+	unsigned long idx = chunk_index(slab);
+	for (int i = 0; i < SLAB_CHUNKS; i++) {
+		chunk_kind[idx + i] = cls + 1;
+	}
+	stats.slab_bytes += SLAB_SIZE;
+	size_t sz = class_sizes[cls];
+	size_t count = SLAB_SIZE / sz;
+	FreeObject *head = heap->free_lists[cls];
+	// Link them back to front so that we hand them out in address order.
+	for (size_t i = count; i > 0; i--) {
+		FreeObject *obj = (FreeObject *)(slab + (i - 1) * sz);
+		obj->next = head;
+		head = obj;
+	}
+	heap->free_lists[cls] = head;
+	return true;
+}
+
+// align is a power of two, at least ALIGN.
+static void *large_alloc(size_t size, size_t align) {
+	// Nothing bigger than the heap can fit, and rounding it up to chunks
+	// could wrap around to a small count.
+	if (size > MAX_HEAP || align > MAX_HEAP) {
+		return nullptr;
+	}
+	// The header goes in front of the pointer, and we move the pointer up
+	// to the alignment, which is never more than align bytes in.
+	size_t chunks = (size + align + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	char *start = (char *)alloc_chunks(chunks);
+	if (start == nullptr) {
+		return nullptr;
+	}
+	unsigned long idx = chunk_index(start);
+	chunk_kind[idx] = KIND_LARGE;
+	for (size_t i = 1; i < chunks; i++) {
+		chunk_kind[idx + i] = KIND_LARGE_TAIL;
+	}
+	char *ptr = (char *)align_up((unsigned long)start + sizeof(LargeHeader), align);
+	LargeHeader *hdr = (LargeHeader *)ptr - 1;
+	hdr->chunks = chunks;
+	hdr->offset = ptr - start;
+	stats.large_bytes += chunks * CHUNK_SIZE;
+	return ptr;
+}
+
+static inline bool is_large(unsigned char kind) {
+	return kind == KIND_LARGE || kind == KIND_LARGE_TAIL;
+}
+
+// How many bytes can the user actually use at ptr?
+static size_t usable_size(void *ptr) {
+	unsigned char kind = chunk_kind[chunk_index(ptr)];
+	if (is_large(kind)) {
+		LargeHeader *hdr = (LargeHeader *)ptr - 1;
+		return hdr->chunks * CHUNK_SIZE - hdr->offset;
+	}
+	return class_sizes[kind - 1];
+}
+
+static void *small_alloc(int cls) {
+	Heap *heap = current_heap();
+	if (heap->free_lists[cls] == nullptr && !refill(heap, cls)) {
+		return nullptr;
+	}
+	FreeObject *obj = heap->free_lists[cls];
+	heap->free_lists[cls] = obj->next;
+	return obj;
+}
+
+void *malloc(size_t size) {
+	if (size == 0) {
+		size = 1;
+	}
+	HeapGuard guard;
+	if (size > MAX_SMALL) {
+		return large_alloc(size, ALIGN);
+	}
+	return small_alloc(size_class(size));
+}
+
+void *memalign(size_t align, size_t size) {
+	if (align == 0 || (align & (align - 1)) != 0) {
+		return nullptr;
+	}
+	if (align <= ALIGN) {
+		return malloc(size);
+	}
+	if (size == 0) {
+		size = 1;
+	}
+	HeapGuard guard;
+	// Slabs start on a chunk, so every object in a class whose size is a
+	// multiple of align is aligned.
+	if (size <= MAX_SMALL && align <= CHUNK_SIZE) {
+		for (int cls = size_class(size); cls < (int)NUM_CLASSES; cls++) {
+			if (class_sizes[cls] % align == 0) {
+				return small_alloc(cls);
+			}
+		}
+	}
+	return large_alloc(size, align);
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+	return memalign(align, size);
+}
+
+int posix_memalign(void **out, size_t align, size_t size) {
+	if (align < sizeof(void *) || (align & (align - 1)) != 0) {
+		return EINVAL;
+	}
+	void *ptr = memalign(align, size);
+	if (ptr == nullptr) {
+		return ENOMEM;
+	}
+	*out = ptr;
+	return 0;
+}
+
+void free(void *ptr) {
+	if (ptr == nullptr || (unsigned long)ptr < heap_base || (unsigned long)ptr >= heap_top) {
+		return;
+	}
+	HeapGuard guard;
+	unsigned long idx = chunk_index(ptr);
+	unsigned char kind = chunk_kind[idx];
+	if (is_large(kind)) {
+		LargeHeader *hdr = (LargeHeader *)ptr - 1;
+		stats.large_bytes -= hdr->chunks * CHUNK_SIZE;
+		free_chunks((char *)ptr - hdr->offset, hdr->chunks);
+	}
+	else if (kind != KIND_NONE) {
+		// Slabs are never given back to the chunk allocator. Objects
+		// just go back onto the free list for their class.
+		Heap *heap = current_heap();
+		FreeObject *obj = (FreeObject *)ptr;
+		obj->next = heap->free_lists[kind - 1];
+		heap->free_lists[kind - 1] = obj;
+	}
+}
+
+void *calloc(size_t num, size_t size) {
+	size_t total = num * size;
+	if (size != 0 && total / size != num) {
+		return nullptr;
+	}
+	char *ret = (char *)malloc(total);
+	if (ret != nullptr) {
+		// Fresh memory from brk is already zero (the kernel zallocs it),
+		// but recycled memory isn't, so we always clear.
+		memset(ret, 0, total);
+	}
+	return ret;
+}
+
+void *realloc(void *ptr, size_t size) {
+	if (ptr == nullptr) {
+		return malloc(size);
+	}
+	if (size == 0) {
+		free(ptr);
+		return nullptr;
+	}
+	size_t have = usable_size(ptr);
+	if (size <= have && (have <= MAX_SMALL || size > have / 2)) {
+		// Still fits, and we wouldn't get much back by moving it.
+		return ptr;
+	}
+	char *ret = (char *)malloc(size);
+	if (ret != nullptr) {
+		memcpy(ret, ptr, size < have ? size : have);
+		free(ptr);
+	}
+	return ret;
+}
+
+void heap_stats(HeapStats *out) {
+	HeapGuard guard;
+	*out = stats;
+}
+
+// ///////////////////////////////////
+// // ARENAS
+// ///////////////////////////////////
+struct ArenaBlock {
+	ArenaBlock *next;
+	size_t size;
+	size_t used;
+	size_t padding;
+};
+
+void arena_init(Arena *arena, size_t block_size) {
+	arena->head = nullptr;
+	arena->block_size = block_size < SLAB_SIZE ? SLAB_SIZE : block_size;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+	size = align_up(size == 0 ? 1 : size, ALIGN);
+	ArenaBlock *blk = arena->head;
+	if (blk == nullptr || blk->used + size > blk->size) {
+		size_t want = size + sizeof(ArenaBlock);
+		if (want < arena->block_size) {
+			want = arena->block_size;
+		}
+		// Arena blocks are large allocations, so this is a whole number
+		// of chunks and we might as well use all of it.
+		ArenaBlock *nblk;
+		{
+			HeapGuard guard;
+			nblk = (ArenaBlock *)large_alloc(want, ALIGN);
+		}
+		if (nblk == nullptr) {
+			return nullptr;
+		}
+		nblk->size = usable_size(nblk) - sizeof(ArenaBlock);
+		nblk->used = 0;
+		nblk->next = blk;
+		arena->head = nblk;
+		blk = nblk;
+	}
+	void *ret = (char *)(blk + 1) + blk->used;
+	blk->used += size;
+	return ret;
+}
+
+void arena_reset(Arena *arena) {
+	ArenaBlock *blk = arena->head;
+	if (blk == nullptr) {
+		return;
+	}
+	// Keep the newest block, which is usually the biggest.
+	ArenaBlock *rest = blk->next;
+	blk->next = nullptr;
+	blk->used = 0;
+	while (rest != nullptr) {
+		ArenaBlock *next = rest->next;
+		free(rest);
+		rest = next;
+	}
+}
+
+void arena_release(Arena *arena) {
+	arena_reset(arena);
+	free(arena->head);
+	arena->head = nullptr;
+}
+
+// ///////////////////////////////////
+// // NEWLIB AND C++
+// ///////////////////////////////////
+// newlib's own functions allocate through the reentrant _r versions. If we
+// didn't provide them, the linker would pull in newlib's malloc along with
+// ours.
+struct _reent;
+extern "C" {
+void *_malloc_r(_reent *, size_t size) { return malloc(size); }
+void _free_r(_reent *, void *ptr) { free(ptr); }
+void *_calloc_r(_reent *, size_t num, size_t size) { return calloc(num, size); }
+void *_realloc_r(_reent *, void *ptr, size_t size) { return realloc(ptr, size); }
+void *_memalign_r(_reent *, size_t align, size_t size) { return memalign(align, size); }
+}
+
+void *operator new(size_t size) { return malloc(size); }
+void *operator new[](size_t size) { return malloc(size); }
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+void *operator new(size_t size, std::align_val_t align) { return memalign((size_t)align, size); }
+void *operator new[](size_t size, std::align_val_t align) { return memalign((size_t)align, size); }
+void operator delete(void *ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept { free(ptr); }
@@ -0,0 +1,51 @@
+#pragma once
+// malloc.h
+// Heap allocator for startlib
+// Small allocations come out of size-class slabs, big ones get whole
+// chunks, and an arena gives out memory that is all thrown away at once.
+// The heap grows through brk (214), but geometrically, so a program that
+// allocates a lot makes a handful of system calls instead of one per page.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void *malloc(size_t size);
+void free(void *ptr);
+void *calloc(size_t num, size_t size);
+void *realloc(void *ptr, size_t size);
+// align has to be a power of two (and, for posix_memalign(), a multiple
+// of sizeof(void *)). These come out of the same slabs and chunks.
+void *memalign(size_t align, size_t size);
+void *aligned_alloc(size_t align, size_t size);
+int posix_memalign(void **out, size_t align, size_t size);
+
+// An arena is a bump allocator for short-lived memory, like everything a
+// frame or a request needs. There is no arena_free(). Instead,
+// arena_reset() hands everything back at once and keeps the first block
+// for next time, and arena_release() returns all of it to the heap.
+struct Arena {
+	struct ArenaBlock *head;
+	size_t block_size;
+};
+
+void arena_init(struct Arena *arena, size_t block_size);
+void *arena_alloc(struct Arena *arena, size_t size);
+void arena_reset(struct Arena *arena);
+void arena_release(struct Arena *arena);
+
+// Heap statistics, mostly for tuning the size classes.
+struct HeapStats {
+	size_t brk_calls;     // How many times we went to the kernel
+	size_t heap_bytes;    // How much the kernel has given us
+	size_t slab_bytes;    // How much of that is in slabs
+	size_t large_bytes;   // How much is in large allocations (in use or free)
+};
+
+void heap_stats(struct HeapStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
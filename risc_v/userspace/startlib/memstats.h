@@ -0,0 +1,29 @@
+#pragma once
+// memstats.h
+// How the kernel's page allocator is doing
+// Free memory is kept in blocks of 2^k pages. free_blocks[k] is how many
+// there are of each size, so lots of free pages in small blocks means
+// memory is fragmented.
+
+#include "syscall.h"
+
+// These must match page.rs.
+#define MEM_MAX_ORDER 15
+
+struct MemStats {
+	unsigned long total_pages;
+	unsigned long free_pages;
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long zero_pool;   // Pages zeroed ahead of time, ready to go
+	unsigned long zero_hits;   // Single page zallocs that got one of those
+	unsigned long zero_misses; // and the ones that had to zero their own
+	unsigned long slab_pages;  // Pages holding kmalloc's small objects
+	unsigned long shared_pages; // Extra owners of pages fork() didn't copy
+	unsigned long cow_copies;  // Copies made since, by writes to them
+	unsigned long free_blocks[MEM_MAX_ORDER + 1];
+};
+
+static inline bool memstats_get(MemStats &stats) {
+	return syscall_memstats(&stats, sizeof(stats)) == sizeof(stats);
+}
@@ -34,21 +34,17 @@
 #include <stdint.h>
 #include <printf.h>
 #include <syscall.h>
+#include <stdout.h>
+#include <string.h>
 
 // #define USE_DIRECT_UART
 // 
-// 'ntoa' conversion buffer size, this must be big enough to hold one converted
-// numeric number including padded zeros (dynamically created on stack)
-// default: 32 byte
+// 'ntoa' conversion buffer size, this must be big enough to hold the digits of
+// one 64-bit number in binary (dynamically created on stack). Padding is sent
+// straight to the output, so it doesn't need room here.
+// default: 64 byte
 #ifndef PRINTF_NTOA_BUFFER_SIZE
-#define PRINTF_NTOA_BUFFER_SIZE 32U
-#endif
-
-// 'ftoa' conversion buffer size, this must be big enough to hold one converted
-// float number including padded zeros (dynamically created on stack)
-// default: 32 byte
-#ifndef PRINTF_FTOA_BUFFER_SIZE
-#define PRINTF_FTOA_BUFFER_SIZE 32U
+#define PRINTF_NTOA_BUFFER_SIZE 64U
 #endif
 
 // support for the floating point type (%f)
@@ -69,12 +65,6 @@
 #define PRINTF_DEFAULT_FLOAT_PRECISION 6U
 #endif
 
-// define the largest float suitable to print with %f
-// default: 1e9
-#ifndef PRINTF_MAX_FLOAT
-#define PRINTF_MAX_FLOAT 1e9
-#endif
-
 // support for the long long types (%llu or %p)
 // default: activated
 // #ifndef PRINTF_DISABLE_SUPPORT_LONG_LONG
@@ -132,7 +122,9 @@ static inline void _out_buffer(char character, void *buffer, size_t idx, size_t
 
 void _putchar(char c)
 {
-	syscall_put_char(c);
+	// Goes through the stdout buffer, which drains with write (64)
+	// instead of one putchar (2) system call per character.
+	stdout_putchar(c);
 }
 
 // internal null output
@@ -168,14 +160,55 @@ static inline void _out_fct(char character, void *buffer, size_t idx, size_t max
 	}
 }
 
+// output a run of characters
+// Going through out() costs an indirect call per character, so the two
+// outputs we know about (a buffer and stdout) get the whole run at once.
+// Everything else still sees one character at a time.
+static size_t _out_str(out_fct_type out, char *buffer, size_t idx, size_t maxlen, const char *str, size_t len)
+{
+	if (out == _out_buffer)
+	{
+		if (idx < maxlen)
+		{
+			memcpy(buffer + idx, str, (maxlen - idx < len) ? maxlen - idx : len);
+		}
+	}
+	else if (out == _out_char)
+	{
+		stdout_write(str, len);
+	}
+	else if (out != _out_null)
+	{
+		for (size_t i = 0U; i < len; i++)
+		{
+			out(str[i], buffer, idx + i, maxlen);
+		}
+	}
+	return idx + len;
+}
+
+// output count copies of character, 16 at a time
+static size_t _out_pad(out_fct_type out, char *buffer, size_t idx, size_t maxlen, char character, size_t count)
+{
+	char pad[16];
+	for (size_t i = 0U; i < sizeof(pad); i++)
+	{
+		pad[i] = character;
+	}
+	while (count)
+	{
+		const size_t n = count < sizeof(pad) ? count : sizeof(pad);
+		idx = _out_str(out, buffer, idx, maxlen, pad, n);
+		count -= n;
+	}
+	return idx;
+}
+
 // internal secure strlen
 // \return The length of the string (excluding the terminating 0) limited by 'maxsize'
 static inline unsigned int _strnlen_s(const char *str, size_t maxsize)
 {
-	const char *s;
-	for (s = str; *s && maxsize--; ++s)
-		;
-	return (unsigned int)(s - str);
+	return (unsigned int)strnlen(str, maxsize);
 }
 
 // internal test if char is a digit (0-9)
@@ -196,441 +229,895 @@ static unsigned int _atoi(const char **str)
 	return i;
 }
 
-// output the specified string in reverse, taking care of any zero-padding
-static size_t _out_rev(out_fct_type out, char *buffer, size_t idx, size_t maxlen, const char *buf, size_t len, unsigned int width, unsigned int flags)
+// "00" through "99", so we get two decimal digits per division
+static const char _digits_lut[200] = {
+	'0', '0', '0', '1', '0', '2', '0', '3', '0', '4', '0', '5', '0', '6', '0', '7', '0', '8', '0', '9',
+	'1', '0', '1', '1', '1', '2', '1', '3', '1', '4', '1', '5', '1', '6', '1', '7', '1', '8', '1', '9',
+	'2', '0', '2', '1', '2', '2', '2', '3', '2', '4', '2', '5', '2', '6', '2', '7', '2', '8', '2', '9',
+	'3', '0', '3', '1', '3', '2', '3', '3', '3', '4', '3', '5', '3', '6', '3', '7', '3', '8', '3', '9',
+	'4', '0', '4', '1', '4', '2', '4', '3', '4', '4', '4', '5', '4', '6', '4', '7', '4', '8', '4', '9',
+	'5', '0', '5', '1', '5', '2', '5', '3', '5', '4', '5', '5', '5', '6', '5', '7', '5', '8', '5', '9',
+	'6', '0', '6', '1', '6', '2', '6', '3', '6', '4', '6', '5', '6', '6', '6', '7', '6', '8', '6', '9',
+	'7', '0', '7', '1', '7', '2', '7', '3', '7', '4', '7', '5', '7', '6', '7', '7', '7', '8', '7', '9',
+	'8', '0', '8', '1', '8', '2', '8', '3', '8', '4', '8', '5', '8', '6', '8', '7', '8', '8', '8', '9',
+	'9', '0', '9', '1', '9', '2', '9', '3', '9', '4', '9', '5', '9', '6', '9', '7', '9', '8', '9', '9'};
+
+// write the decimal digits of value so that they end right before end
+// \return The first digit
+static char *_utoa10(char *end, unsigned long long value)
 {
-	const size_t start_idx = idx;
+	char *p = end;
+	// the compiler turns these into a multiply, not a divide
+	while (value >= 100U)
+	{
+		const unsigned int r = (unsigned int)(value % 100U);
+		value /= 100U;
+		p -= 2;
+		p[0] = _digits_lut[2U * r];
+		p[1] = _digits_lut[2U * r + 1U];
+	}
+	if (value >= 10U)
+	{
+		p -= 2;
+		p[0] = _digits_lut[2U * value];
+		p[1] = _digits_lut[2U * value + 1U];
+	}
+	else
+	{
+		*--p = (char)('0' + value);
+	}
+	return p;
+}
 
-	// pad spaces up to given width
-	if (!(flags & FLAGS_LEFT) && !(flags & FLAGS_ZEROPAD))
+// write the digits of value in base 2^shift (binary, octal or hex) so
+// that they end right before end
+// \return The first digit
+static char *_utoa_pow2(char *end, unsigned long long value, unsigned int shift, bool uppercase)
+{
+	const char *digits = uppercase ? "0123456789ABCDEF" : "0123456789abcdef";
+	const unsigned int mask = (1U << shift) - 1U;
+	char *p = end;
+	do
 	{
-		for (size_t i = len; i < width; i++)
+		*--p = digits[value & mask];
+		value >>= shift;
+	} while (value);
+	return p;
+}
+
+// internal itoa
+// The digits are written into buf from the back, and everything around
+// them (sign, prefix, zeros, spaces) is sent straight to the output.
+static size_t _ntoa(out_fct_type out, char *buffer, size_t idx, size_t maxlen, unsigned long long value, bool negative, unsigned int base, unsigned int prec, unsigned int width, unsigned int flags)
+{
+	char buf[PRINTF_NTOA_BUFFER_SIZE];
+	char *const end = buf + PRINTF_NTOA_BUFFER_SIZE;
+	char *digits = end;
+
+	// no 0x or 0b for 0 values, octal '#' still prints its 0
+	if (!value && (base != 8U))
+	{
+		flags &= ~FLAGS_HASH;
+	}
+
+	// write if precision != 0 and value is != 0
+	if (!(flags & FLAGS_PRECISION) || value)
+	{
+		switch (base)
 		{
-			out(' ', buffer, idx++, maxlen);
+		case 16U:
+			digits = _utoa_pow2(end, value, 4U, flags & FLAGS_UPPERCASE);
+			break;
+		case 8U:
+			digits = _utoa_pow2(end, value, 3U, false);
+			break;
+		case 2U:
+			digits = _utoa_pow2(end, value, 1U, false);
+			break;
+		default:
+			digits = _utoa10(end, value);
+			break;
 		}
 	}
+	const size_t len = (size_t)(end - digits);
 
-	// reverse string
-	while (len)
+	// sign and base prefix
+	char prefix[3];
+	size_t prefix_len = 0U;
+	if (negative)
+	{
+		prefix[prefix_len++] = '-';
+	}
+	else if (flags & FLAGS_PLUS)
 	{
-		out(buf[--len], buffer, idx++, maxlen);
+		prefix[prefix_len++] = '+'; // ignore the space if the '+' exists
+	}
+	else if (flags & FLAGS_SPACE)
+	{
+		prefix[prefix_len++] = ' ';
+	}
+	if ((flags & FLAGS_HASH) && (base == 16U || base == 2U))
+	{
+		prefix[prefix_len++] = '0';
+		prefix[prefix_len++] = (base == 2U) ? 'b' : (flags & FLAGS_UPPERCASE) ? 'X' : 'x';
 	}
 
-	// append pad spaces up to given width
-	if (flags & FLAGS_LEFT)
+	// zeros between the prefix and the digits, for the precision, the '0'
+	// flag, or '#' on octal (which always starts with a 0)
+	size_t zeros = (prec > len) ? prec - len : 0U;
+	if ((flags & FLAGS_HASH) && (base == 8U) && !zeros && (!len || *digits != '0'))
 	{
-		while (idx - start_idx < width)
-		{
-			out(' ', buffer, idx++, maxlen);
-		}
+		zeros = 1U;
+	}
+	if ((flags & FLAGS_ZEROPAD) && !(flags & FLAGS_LEFT) && (width > prefix_len + zeros + len))
+	{
+		zeros = width - prefix_len - len;
 	}
+	const size_t total = prefix_len + zeros + len;
 
+	// pad spaces up to given width
+	if (!(flags & FLAGS_LEFT) && (width > total))
+	{
+		idx = _out_pad(out, buffer, idx, maxlen, ' ', width - total);
+	}
+	idx = _out_str(out, buffer, idx, maxlen, prefix, prefix_len);
+	idx = _out_pad(out, buffer, idx, maxlen, '0', zeros);
+	idx = _out_str(out, buffer, idx, maxlen, digits, len);
+	// append pad spaces up to given width
+	if ((flags & FLAGS_LEFT) && (width > total))
+	{
+		idx = _out_pad(out, buffer, idx, maxlen, ' ', width - total);
+	}
 	return idx;
 }
 
-// internal itoa format
-static size_t _ntoa_format(out_fct_type out, char *buffer, size_t idx, size_t maxlen, char *buf, size_t len, bool negative, unsigned int base, unsigned int prec, unsigned int width, unsigned int flags)
+#if defined(PRINTF_SUPPORT_FLOAT)
+
+#include <dtoa_table.h>
+
+// Floating point numbers are converted in two steps. First, Ryu (Ulf
+// Adams, "Ryu: fast float-to-string conversion", PLDI 2018) gives us the
+// shortest decimal number that reads back as exactly the same double.
+// That takes a handful of 64x128-bit multiplies instead of one multiply or
+// divide per digit. Then, we round that number to whatever precision was
+// asked for and print it. Rounding the shortest digits gives the same
+// answer as rounding the exact value as long as we keep 15 digits or less
+// and don't land on a tie. Otherwise (%.17g, %f of a big number, ...), we
+// fall back to the exact expansion, which is slow but always right.
+
+// 'dtoa' digit buffer size, this must be big enough to hold every significant
+// digit of a double (767 for the worst subnormal)
+#ifndef PRINTF_DTOA_BUFFER_SIZE
+#define PRINTF_DTOA_BUFFER_SIZE 776U
+#endif
+
+// limbs for the exact conversion, enough for 2^1024 and 2^1074 * 10^9
+#define PRINTF_BIGNUM_LIMBS 40U
+
+// A decimal number 0.d1 d2 d3 ... dlen x 10^point. Zero has no digits.
+typedef struct
 {
-	// pad leading zeros
-	if (!(flags & FLAGS_LEFT))
+	char digits[PRINTF_DTOA_BUFFER_SIZE];
+	int len;
+	int point;
+	bool negative;
+} decimal_type;
+
+static inline uint32_t _pow5bits(const int32_t e)
+{
+	// ceil(log2(5^e)) for e > 0
+	return (uint32_t)(((e * 1217359) >> 19) + 1);
+}
+
+static inline uint32_t _log10_pow2(const int32_t e)
+{
+	// floor(log10(2^e))
+	return (uint32_t)((e * 78913) >> 18);
+}
+
+static inline uint32_t _log10_pow5(const int32_t e)
+{
+	// floor(log10(5^e))
+	return (uint32_t)((e * 732923) >> 20);
+}
+
+static inline bool _multiple_of_pow5(uint64_t value, const uint32_t p)
+{
+	uint32_t count = 0U;
+	while (value % 5U == 0U)
 	{
-		if (width && (flags & FLAGS_ZEROPAD) && (negative || (flags & (FLAGS_PLUS | FLAGS_SPACE))))
+		value /= 5U;
+		count++;
+	}
+	return count >= p;
+}
+
+static inline bool _multiple_of_pow2(const uint64_t value, const uint32_t p)
+{
+	return (value & ((1ULL << p) - 1U)) == 0U;
+}
+
+// (m * mul) >> j, where mul is a 128-bit number and j >= 64
+static inline uint64_t _mul_shift64(const uint64_t m, const uint64_t *const mul, const int32_t j)
+{
+	const unsigned __int128 b0 = (unsigned __int128)m * mul[0];
+	const unsigned __int128 b2 = (unsigned __int128)m * mul[1];
+	return (uint64_t)(((b0 >> 64) + b2) >> (j - 64));
+}
+
+// Ryu's d2d(): the shortest decimal output * 10^exponent that rounds to the
+// double with these bits. This works for any finite, non-zero double.
+static uint64_t _ryu(const uint64_t ieee_mantissa, const uint32_t ieee_exponent, int32_t *exponent)
+{
+	int32_t e2;
+	uint64_t m2;
+	if (ieee_exponent == 0U)
+	{
+		// subnormal
+		e2 = 1 - 1023 - 52 - 2;
+		m2 = ieee_mantissa;
+	}
+	else
+	{
+		e2 = (int32_t)ieee_exponent - 1023 - 52 - 2;
+		m2 = (1ULL << 52U) | ieee_mantissa;
+	}
+	const bool accept_bounds = (m2 & 1U) == 0U;
+
+	// Step 2: the interval of decimals that round to this double is
+	// (mv - mm, mv + mp), scaled by 4 so that the bounds are integers.
+	const uint64_t mv = 4U * m2;
+	const uint32_t mm_shift = (ieee_mantissa != 0U || ieee_exponent <= 1U) ? 1U : 0U;
+
+	// Step 3: convert the interval to decimal, vm < vr < vp
+	uint64_t vr, vp, vm;
+	int32_t e10;
+	bool vm_trailing_zeros = false;
+	bool vr_trailing_zeros = false;
+	if (e2 >= 0)
+	{
+		const uint32_t q = _log10_pow2(e2) - (e2 > 3);
+		e10 = (int32_t)q;
+		const int32_t k = DOUBLE_POW5_INV_BITCOUNT + (int32_t)_pow5bits((int32_t)q) - 1;
+		const int32_t i = -e2 + (int32_t)q + k;
+		vr = _mul_shift64(4U * m2, DOUBLE_POW5_INV_SPLIT[q], i);
+		vp = _mul_shift64(4U * m2 + 2U, DOUBLE_POW5_INV_SPLIT[q], i);
+		vm = _mul_shift64(4U * m2 - 1U - mm_shift, DOUBLE_POW5_INV_SPLIT[q], i);
+		if (q <= 21U)
 		{
-			width--;
+			// Only one of mp, mv, and mm can be a multiple of 5, if any.
+			if (mv % 5U == 0U)
+			{
+				vr_trailing_zeros = _multiple_of_pow5(mv, q);
+			}
+			else if (accept_bounds)
+			{
+				vm_trailing_zeros = _multiple_of_pow5(mv - 1U - mm_shift, q);
+			}
+			else
+			{
+				vp -= _multiple_of_pow5(mv + 2U, q);
+			}
 		}
-		while ((len < prec) && (len < PRINTF_NTOA_BUFFER_SIZE))
+	}
+	else
+	{
+		const uint32_t q = _log10_pow5(-e2) - (-e2 > 1);
+		e10 = (int32_t)q + e2;
+		const int32_t i = -e2 - (int32_t)q;
+		const int32_t k = (int32_t)_pow5bits(i) - DOUBLE_POW5_BITCOUNT;
+		const int32_t j = (int32_t)q - k;
+		vr = _mul_shift64(4U * m2, DOUBLE_POW5_SPLIT[i], j);
+		vp = _mul_shift64(4U * m2 + 2U, DOUBLE_POW5_SPLIT[i], j);
+		vm = _mul_shift64(4U * m2 - 1U - mm_shift, DOUBLE_POW5_SPLIT[i], j);
+		if (q <= 1U)
 		{
-			buf[len++] = '0';
+			// {vr,vp,vm} is trailing zeros if {mv,mp,mm} has at least q
+			// trailing 0 bits. mv = 4 * m2, so it always has at least two.
+			vr_trailing_zeros = true;
+			if (accept_bounds)
+			{
+				// mm = mv - 1 - mm_shift, so it has 1 trailing 0 bit iff
+				// mm_shift == 1.
+				vm_trailing_zeros = mm_shift == 1U;
+			}
+			else
+			{
+				// mp = mv + 2, so it always has at least one trailing 0 bit.
+				--vp;
+			}
 		}
-		while ((flags & FLAGS_ZEROPAD) && (len < width) && (len < PRINTF_NTOA_BUFFER_SIZE))
+		else if (q < 63U)
 		{
-			buf[len++] = '0';
+			vr_trailing_zeros = _multiple_of_pow2(mv, q);
 		}
 	}
 
-	// handle hash
-	if (flags & FLAGS_HASH)
+	// Step 4: find the shortest decimal in the interval
+	int32_t removed = 0;
+	uint8_t last_removed_digit = 0U;
+	uint64_t output;
+	if (vm_trailing_zeros || vr_trailing_zeros)
 	{
-		if (!(flags & FLAGS_PRECISION) && len && ((len == prec) || (len == width)))
+		// the general case, which happens rarely (~0.7%)
+		for (;;)
 		{
-			len--;
-			if (len && (base == 16U))
+			const uint64_t vp_div10 = vp / 10U;
+			const uint64_t vm_div10 = vm / 10U;
+			if (vp_div10 <= vm_div10)
 			{
-				len--;
+				break;
 			}
+			const uint32_t vm_mod10 = (uint32_t)(vm - 10U * vm_div10);
+			const uint64_t vr_div10 = vr / 10U;
+			const uint32_t vr_mod10 = (uint32_t)(vr - 10U * vr_div10);
+			vm_trailing_zeros &= vm_mod10 == 0U;
+			vr_trailing_zeros &= last_removed_digit == 0U;
+			last_removed_digit = (uint8_t)vr_mod10;
+			vr = vr_div10;
+			vp = vp_div10;
+			vm = vm_div10;
+			++removed;
 		}
-		if ((base == 16U) && !(flags & FLAGS_UPPERCASE) && (len < PRINTF_NTOA_BUFFER_SIZE))
+		if (vm_trailing_zeros)
 		{
-			buf[len++] = 'x';
+			for (;;)
+			{
+				const uint64_t vm_div10 = vm / 10U;
+				const uint32_t vm_mod10 = (uint32_t)(vm - 10U * vm_div10);
+				if (vm_mod10 != 0U)
+				{
+					break;
+				}
+				const uint64_t vp_div10 = vp / 10U;
+				const uint64_t vr_div10 = vr / 10U;
+				const uint32_t vr_mod10 = (uint32_t)(vr - 10U * vr_div10);
+				vr_trailing_zeros &= last_removed_digit == 0U;
+				last_removed_digit = (uint8_t)vr_mod10;
+				vr = vr_div10;
+				vp = vp_div10;
+				vm = vm_div10;
+				++removed;
+			}
 		}
-		else if ((base == 16U) && (flags & FLAGS_UPPERCASE) && (len < PRINTF_NTOA_BUFFER_SIZE))
+		if (vr_trailing_zeros && last_removed_digit == 5U && vr % 2U == 0U)
 		{
-			buf[len++] = 'X';
+			// round even if the exact number is .....50..0
+			last_removed_digit = 4U;
 		}
-		else if ((base == 2U) && (len < PRINTF_NTOA_BUFFER_SIZE))
+		// we need to take vr + 1 if vr is outside bounds or we need to round up
+		output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last_removed_digit >= 5U);
+	}
+	else
+	{
+		// the common case (~99.3%)
+		bool round_up = false;
+		const uint64_t vp_div100 = vp / 100U;
+		const uint64_t vm_div100 = vm / 100U;
+		if (vp_div100 > vm_div100)
 		{
-			buf[len++] = 'b';
+			// remove two digits at a time (~86.2%)
+			const uint64_t vr_div100 = vr / 100U;
+			const uint32_t vr_mod100 = (uint32_t)(vr - 100U * vr_div100);
+			round_up = vr_mod100 >= 50U;
+			vr = vr_div100;
+			vp = vp_div100;
+			vm = vm_div100;
+			removed += 2;
 		}
-		if (len < PRINTF_NTOA_BUFFER_SIZE)
+		for (;;)
 		{
-			buf[len++] = '0';
+			const uint64_t vp_div10 = vp / 10U;
+			const uint64_t vm_div10 = vm / 10U;
+			if (vp_div10 <= vm_div10)
+			{
+				break;
+			}
+			const uint64_t vr_div10 = vr / 10U;
+			const uint32_t vr_mod10 = (uint32_t)(vr - 10U * vr_div10);
+			round_up = vr_mod10 >= 5U;
+			vr = vr_div10;
+			vp = vp_div10;
+			vm = vm_div10;
+			++removed;
 		}
+		// we need to take vr + 1 if vr is outside bounds or we need to round up
+		output = vr + (vr == vm || round_up);
 	}
+	*exponent = e10 + removed;
+	return output;
+}
 
-	if (len < PRINTF_NTOA_BUFFER_SIZE)
+// convert a finite double to its shortest decimal
+static void _dtod(double value, decimal_type *dec)
+{
+	union {
+		uint64_t U;
+		double F;
+	} conv;
+	conv.F = value;
+	dec->negative = (conv.U >> 63U) != 0U;
+	const uint64_t mantissa = conv.U & ((1ULL << 52U) - 1U);
+	const uint32_t exponent = (uint32_t)((conv.U >> 52U) & 0x07FFU);
+	if (!mantissa && !exponent)
+	{
+		dec->len = 0;
+		dec->point = 1;
+		return;
+	}
+	int32_t e10;
+	const uint64_t output = _ryu(mantissa, exponent, &e10);
+	char *const end = dec->digits + sizeof(dec->digits);
+	const char *p = _utoa10(end, output);
+	dec->len = (int)(end - p);
+	for (int i = 0; i < dec->len; i++)
+	{
+		dec->digits[i] = p[i];
+	}
+	dec->point = e10 + dec->len;
+	while (dec->digits[dec->len - 1] == '0')
+	{
+		dec->len--;
+	}
+}
+
+// the exact decimal expansion of a finite, non-zero double
+// Every double is an integer times a power of two, so this always ends.
+static void _dtod_exact(double value, decimal_type *dec)
+{
+	union {
+		uint64_t U;
+		double F;
+	} conv;
+	conv.F = value;
+	dec->negative = (conv.U >> 63U) != 0U;
+	const uint32_t exponent = (uint32_t)((conv.U >> 52U) & 0x07FFU);
+	uint64_t m = conv.U & ((1ULL << 52U) - 1U);
+	int e;
+	if (exponent == 0U)
+	{
+		e = -1074;
+	}
+	else
 	{
-		if (negative)
+		m |= 1ULL << 52U;
+		e = (int)exponent - 1075;
+	}
+
+	// value = m * 2^e, with m in little endian 32-bit limbs
+	uint32_t big[PRINTF_BIGNUM_LIMBS];
+	for (unsigned int i = 0U; i < PRINTF_BIGNUM_LIMBS; i++)
+	{
+		big[i] = 0U;
+	}
+	dec->len = 0;
+	if (e >= 0)
+	{
+		// an integer, m << e
+		const unsigned int limb = (unsigned int)e / 32U;
+		const unsigned int shift = (unsigned int)e % 32U;
+		const uint64_t low = m << shift;
+		big[limb] = (uint32_t)low;
+		big[limb + 1U] = (uint32_t)(low >> 32U);
+		big[limb + 2U] = shift ? (uint32_t)(m >> (64U - shift)) : 0U;
+		unsigned int n = limb + 3U;
+		// peel off 9 digits at a time, from the back
+		char *const end = dec->digits + sizeof(dec->digits);
+		char *p = end;
+		while (n)
 		{
-			buf[len++] = '-';
+			uint64_t rem = 0U;
+			for (unsigned int i = n; i-- > 0U;)
+			{
+				const uint64_t cur = (rem << 32U) | big[i];
+				big[i] = (uint32_t)(cur / 1000000000U);
+				rem = cur % 1000000000U;
+			}
+			while (n && !big[n - 1U])
+			{
+				n--;
+			}
+			char *const chunk_end = p;
+			p = _utoa10(p, rem);
+			if (n)
+			{
+				// this isn't the first chunk, so it has leading zeros
+				while (chunk_end - p < 9)
+				{
+					*--p = '0';
+				}
+			}
 		}
-		else if (flags & FLAGS_PLUS)
+		dec->len = (int)(end - p);
+		for (int i = 0; i < dec->len; i++)
 		{
-			buf[len++] = '+'; // ignore the space if the '+' exists
+			dec->digits[i] = p[i];
 		}
-		else if (flags & FLAGS_SPACE)
+		dec->point = dec->len;
+	}
+	else
+	{
+		const unsigned int s = (unsigned int)-e;
+		uint64_t whole = 0U;
+		uint64_t frac = m;
+		if (s < 53U)
+		{
+			whole = m >> s;
+			frac = m & ((1ULL << s) - 1U);
+		}
+		if (whole)
+		{
+			char *const end = dec->digits + sizeof(dec->digits);
+			const char *p = _utoa10(end, whole);
+			dec->len = (int)(end - p);
+			for (int i = 0; i < dec->len; i++)
+			{
+				dec->digits[i] = p[i];
+			}
+		}
+		dec->point = dec->len;
+		// the fraction is frac / 2^s, so multiplying it by 10^9 moves the
+		// next 9 digits above bit s
+		big[0] = (uint32_t)frac;
+		big[1] = (uint32_t)(frac >> 32U);
+		unsigned int n = 2U;
+		const unsigned int top = s / 32U;
+		const unsigned int shift = s % 32U;
+		while (frac)
 		{
-			buf[len++] = ' ';
+			uint64_t carry = 0U;
+			for (unsigned int i = 0U; i < n; i++)
+			{
+				const uint64_t cur = (uint64_t)big[i] * 1000000000U + carry;
+				big[i] = (uint32_t)cur;
+				carry = cur >> 32U;
+			}
+			if (carry)
+			{
+				big[n++] = (uint32_t)carry;
+			}
+			const uint64_t pair = ((uint64_t)big[top + 1U] << 32U) | big[top];
+			const uint32_t chunk = (uint32_t)(pair >> shift);
+			big[top] &= (uint32_t)((1ULL << shift) - 1U);
+			frac = big[top];
+			for (unsigned int i = top + 1U; i < n; i++)
+			{
+				big[i] = 0U;
+			}
+			n = top + 1U;
+			for (unsigned int i = 0U; i < top; i++)
+			{
+				frac |= big[i];
+			}
+			char chunk_digits[9];
+			char *const chunk_end = chunk_digits + 9;
+			char *p = _utoa10(chunk_end, chunk);
+			while (p > chunk_digits)
+			{
+				*--p = '0';
+			}
+			for (int i = 0; i < 9; i++)
+			{
+				if (!dec->len && chunk_digits[i] == '0')
+				{
+					// not significant
+					dec->point--;
+				}
+				else if (dec->len < (int)sizeof(dec->digits))
+				{
+					dec->digits[dec->len++] = chunk_digits[i];
+				}
+			}
 		}
 	}
-
-	return _out_rev(out, buffer, idx, maxlen, buf, len, width, flags);
+	while (dec->len && dec->digits[dec->len - 1] == '0')
+	{
+		dec->len--;
+	}
 }
 
-// internal itoa for 'long' type
-static size_t _ntoa_long(out_fct_type out, char *buffer, size_t idx, size_t maxlen, unsigned long value, bool negative, unsigned long base, unsigned int prec, unsigned int width, unsigned int flags)
+// round to the first keep digits, half to even
+static void _round_decimal(decimal_type *dec, int keep)
 {
-	char buf[PRINTF_NTOA_BUFFER_SIZE];
-	size_t len = 0U;
-
-	// no hash for 0 values
-	if (!value)
+	if (keep >= dec->len)
 	{
-		flags &= ~FLAGS_HASH;
+		return;
 	}
-
-	// write if precision != 0 and value is != 0
-	if (!(flags & FLAGS_PRECISION) || value)
+	if (keep < 0)
 	{
-		do
+		dec->len = 0;
+		return;
+	}
+	bool round_up = dec->digits[keep] > '5';
+	if (dec->digits[keep] == '5')
+	{
+		// a 5 with anything after it is more than half
+		round_up = (keep + 1 < dec->len) || (keep > 0 && ((dec->digits[keep - 1] - '0') & 1));
+	}
+	else if (dec->digits[keep] < '5')
+	{
+		round_up = false;
+	}
+	dec->len = keep;
+	if (!round_up)
+	{
+		// drop trailing zeros, they print the same either way
+		while (dec->len > 0 && dec->digits[dec->len - 1] == '0')
 		{
-			const char digit = (char)(value % base);
-			buf[len++] = digit < 10 ? '0' + digit : (flags & FLAGS_UPPERCASE ? 'A' : 'a') + digit - 10;
-			value /= base;
-		} while (value && (len < PRINTF_NTOA_BUFFER_SIZE));
+			dec->len--;
+		}
+		return;
+	}
+	while (dec->len > 0 && dec->digits[dec->len - 1] == '9')
+	{
+		dec->len--;
+	}
+	if (dec->len == 0)
+	{
+		// 9.99 -> 10.0
+		dec->digits[0] = '1';
+		dec->len = 1;
+		dec->point++;
+	}
+	else
+	{
+		dec->digits[dec->len - 1]++;
 	}
-
-	return _ntoa_format(out, buffer, idx, maxlen, buf, len, negative, (unsigned int)base, prec, width, flags);
 }
 
-// internal itoa for 'long long' type
-#if defined(PRINTF_SUPPORT_LONG_LONG)
-static size_t _ntoa_long_long(out_fct_type out, char *buffer, size_t idx, size_t maxlen, unsigned long long value, bool negative, unsigned long long base, unsigned int prec, unsigned int width, unsigned int flags)
+// convert a finite double, rounded to prec significant digits (or for
+// fixed, prec digits after the point)
+static void _dtod_rounded(double value, decimal_type *dec, int prec, bool fixed)
 {
-	char buf[PRINTF_NTOA_BUFFER_SIZE];
-	size_t len = 0U;
-
-	// no hash for 0 values
-	if (!value)
+	_dtod(value, dec);
+	if (!dec->len)
 	{
-		flags &= ~FLAGS_HASH;
+		return;
 	}
-
-	// write if precision != 0 and value is != 0
-	if (!(flags & FLAGS_PRECISION) || value)
+	const int keep = fixed ? dec->point + prec : prec;
+	union {
+		uint64_t U;
+		double F;
+	} conv;
+	conv.F = value;
+	const bool subnormal = ((conv.U >> 52U) & 0x07FFU) == 0U;
+	const bool tie = (keep + 1 == dec->len) && (dec->digits[keep] == '5');
+	if ((keep > 15) || subnormal || tie)
 	{
-		do
-		{
-			const char digit = (char)(value % base);
-			buf[len++] = digit < 10 ? '0' + digit : (flags & FLAGS_UPPERCASE ? 'A' : 'a') + digit - 10;
-			value /= base;
-		} while (value && (len < PRINTF_NTOA_BUFFER_SIZE));
+		_dtod_exact(value, dec);
+		_round_decimal(dec, fixed ? dec->point + prec : prec);
+		return;
 	}
-
-	return _ntoa_format(out, buffer, idx, maxlen, buf, len, negative, (unsigned int)base, prec, width, flags);
+	_round_decimal(dec, keep);
 }
-#endif // PRINTF_SUPPORT_LONG_LONG
 
-#if defined(PRINTF_SUPPORT_FLOAT)
-
-#if defined(PRINTF_SUPPORT_EXPONENTIAL)
-// forward declaration so that _ftoa can switch to exp notation for values > PRINTF_MAX_FLOAT
-static size_t _etoa(out_fct_type out, char *buffer, size_t idx, size_t maxlen, double value, unsigned int prec, unsigned int width, unsigned int flags);
-#endif
+// the sign (if any) for a float
+static inline char _float_sign(bool negative, unsigned int flags)
+{
+	return negative ? '-' : (flags & FLAGS_PLUS) ? '+' : (flags & FLAGS_SPACE) ? ' ' : 0;
+}
 
-// internal ftoa for fixed decimal floating point
-static size_t _ftoa(out_fct_type out, char *buffer, size_t idx, size_t maxlen, double value, unsigned int prec, unsigned int width, unsigned int flags)
+// nan and inf
+static size_t _out_special(out_fct_type out, char *buffer, size_t idx, size_t maxlen, double value, unsigned int width, unsigned int flags)
 {
-	char buf[PRINTF_FTOA_BUFFER_SIZE];
+	char str[4];
 	size_t len = 0U;
-	double diff = 0.0;
-
-	// powers of 10
-	static const double pow10[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
-
-	// test for special values
-	if (value != value)
-		return _out_rev(out, buffer, idx, maxlen, "nan", 3, width, flags);
-	if (value < -DBL_MAX)
-		return _out_rev(out, buffer, idx, maxlen, "fni-", 4, width, flags);
-	if (value > DBL_MAX)
-		return _out_rev(out, buffer, idx, maxlen, (flags & FLAGS_PLUS) ? "fni+" : "fni", (flags & FLAGS_PLUS) ? 4U : 3U, width, flags);
-
-	// test for very large values
-	// standard printf behavior is to print EVERY whole number digit -- which could be 100s of characters overflowing your buffers == bad
-	if ((value > PRINTF_MAX_FLOAT) || (value < -PRINTF_MAX_FLOAT))
+	const bool is_nan = value != value;
+	// Like glibc, a nan gets its sign bit, a + or a space too.
+	const char sign = _float_sign(__builtin_signbit(value) != 0, flags);
+	if (sign)
 	{
-#if defined(PRINTF_SUPPORT_EXPONENTIAL)
-		return _etoa(out, buffer, idx, maxlen, value, prec, width, flags);
-#else
-		return 0U;
-#endif
+		str[len++] = sign;
 	}
-
-	// test for negative
-	bool negative = false;
-	if (value < 0)
+	const char *name = ((flags & FLAGS_UPPERCASE) ? (is_nan ? "NAN" : "INF") : (is_nan ? "nan" : "inf"));
+	for (int i = 0; i < 3; i++)
 	{
-		negative = true;
-		value = 0 - value;
+		str[len++] = name[i];
 	}
-
-	// set default precision, if not set explicitly
-	if (!(flags & FLAGS_PRECISION))
+	if (!(flags & FLAGS_LEFT) && (width > len))
 	{
-		prec = PRINTF_DEFAULT_FLOAT_PRECISION;
+		idx = _out_pad(out, buffer, idx, maxlen, ' ', width - len);
 	}
-	// limit precision to 9, cause a prec >= 10 can lead to overflow errors
-	while ((len < PRINTF_FTOA_BUFFER_SIZE) && (prec > 9U))
+	idx = _out_str(out, buffer, idx, maxlen, str, len);
+	if ((flags & FLAGS_LEFT) && (width > len))
 	{
-		buf[len++] = '0';
-		prec--;
+		idx = _out_pad(out, buffer, idx, maxlen, ' ', width - len);
 	}
+	return idx;
+}
 
-	int whole = (int)value;
-	double tmp = (value - whole) * pow10[prec];
-	unsigned long frac = (unsigned long)tmp;
-	diff = tmp - frac;
+// print a decimal as ddd.ddd with prec digits after the point
+static size_t _out_fixed(out_fct_type out, char *buffer, size_t idx, size_t maxlen, const decimal_type *dec, unsigned int prec, unsigned int width, unsigned int flags)
+{
+	const char sign = _float_sign(dec->negative, flags);
+	const size_t int_len = dec->point > 0 ? (size_t)dec->point : 1U;
+	const bool dot = prec || (flags & FLAGS_HASH);
+	const size_t total = (sign ? 1U : 0U) + int_len + (dot ? 1U : 0U) + prec;
 
-	if (diff > 0.5)
+	size_t zeros = 0U;
+	if (!(flags & FLAGS_LEFT) && (width > total))
 	{
-		++frac;
-		// handle rollover, e.g. case 0.99 with prec 1 is 1.0
-		if (frac >= pow10[prec])
+		if (flags & FLAGS_ZEROPAD)
+		{
+			zeros = width - total;
+		}
+		else
 		{
-			frac = 0;
-			++whole;
+			idx = _out_pad(out, buffer, idx, maxlen, ' ', width - total);
 		}
 	}
-	else if (diff < 0.5)
+	if (sign)
 	{
+		out(sign, buffer, idx++, maxlen);
 	}
-	else if ((frac == 0U) || (frac & 1U))
+	idx = _out_pad(out, buffer, idx, maxlen, '0', zeros);
+
+	// whole part
+	if (dec->point > 0)
 	{
-		// if halfway, round up if odd OR if last digit is 0
-		++frac;
+		const int n = dec->len < dec->point ? dec->len : dec->point;
+		idx = _out_str(out, buffer, idx, maxlen, dec->digits, (size_t)n);
+		idx = _out_pad(out, buffer, idx, maxlen, '0', (size_t)(dec->point - n));
+	}
+	else
+	{
+		out('0', buffer, idx++, maxlen);
 	}
 
-	if (prec == 0U)
+	// fractional part
+	if (dot)
 	{
-		diff = value - (double)whole;
-		if ((!(diff < 0.5) || (diff > 0.5)) && (whole & 1))
-		{
-			// exactly 0.5 and ODD, then round up
-			// 1.5 -> 2, but 2.5 -> 2
-			++whole;
-		}
+		out('.', buffer, idx++, maxlen);
 	}
-	else
+	size_t left = prec;
+	if (dec->point < 0)
 	{
-		unsigned int count = prec;
-		// now do fractional part, as an unsigned number
-		while (len < PRINTF_FTOA_BUFFER_SIZE)
-		{
-			--count;
-			buf[len++] = (char)(48U + (frac % 10U));
-			if (!(frac /= 10U))
-			{
-				break;
-			}
-		}
-		// add extra 0s
-		while ((len < PRINTF_FTOA_BUFFER_SIZE) && (count-- > 0U))
-		{
-			buf[len++] = '0';
-		}
-		if (len < PRINTF_FTOA_BUFFER_SIZE)
-		{
-			// add decimal
-			buf[len++] = '.';
-		}
+		const size_t lead = ((size_t)-dec->point < left) ? (size_t)-dec->point : left;
+		idx = _out_pad(out, buffer, idx, maxlen, '0', lead);
+		left -= lead;
+	}
+	const int first = dec->point > 0 ? dec->point : 0;
+	if (dec->len > first)
+	{
+		const size_t n = ((size_t)(dec->len - first) < left) ? (size_t)(dec->len - first) : left;
+		idx = _out_str(out, buffer, idx, maxlen, dec->digits + first, n);
+		left -= n;
 	}
+	idx = _out_pad(out, buffer, idx, maxlen, '0', left);
 
-	// do whole part, number is reversed
-	while (len < PRINTF_FTOA_BUFFER_SIZE)
+	// append pad spaces up to given width
+	if ((flags & FLAGS_LEFT) && (width > total))
 	{
-		buf[len++] = (char)(48 + (whole % 10));
-		if (!(whole /= 10))
-		{
-			break;
-		}
+		idx = _out_pad(out, buffer, idx, maxlen, ' ', width - total);
 	}
+	return idx;
+}
 
-	// pad leading zeros
-	if (!(flags & FLAGS_LEFT) && (flags & FLAGS_ZEROPAD))
+#if defined(PRINTF_SUPPORT_EXPONENTIAL)
+// print a decimal as d.ddde+dd with prec digits after the point
+static size_t _out_exp(out_fct_type out, char *buffer, size_t idx, size_t maxlen, const decimal_type *dec, unsigned int prec, unsigned int width, unsigned int flags)
+{
+	const char sign = _float_sign(dec->negative, flags);
+	const bool dot = prec || (flags & FLAGS_HASH);
+	const int expval = dec->len ? dec->point - 1 : 0;
+
+	// the exponent format is "%+03d" and largest value is "324"
+	char exp_buf[8];
+	char *const exp_end = exp_buf + sizeof(exp_buf);
+	char *exp_str = _utoa10(exp_end, (unsigned long long)(expval < 0 ? -expval : expval));
+	if (exp_end - exp_str < 2)
 	{
-		if (width && (negative || (flags & (FLAGS_PLUS | FLAGS_SPACE))))
-		{
-			width--;
-		}
-		while ((len < width) && (len < PRINTF_FTOA_BUFFER_SIZE))
-		{
-			buf[len++] = '0';
-		}
+		*--exp_str = '0';
 	}
+	*--exp_str = expval < 0 ? '-' : '+';
+	*--exp_str = (flags & FLAGS_UPPERCASE) ? 'E' : 'e';
+	const size_t exp_len = (size_t)(exp_end - exp_str);
 
-	if (len < PRINTF_FTOA_BUFFER_SIZE)
+	const size_t total = (sign ? 1U : 0U) + 1U + (dot ? 1U : 0U) + prec + exp_len;
+	size_t zeros = 0U;
+	if (!(flags & FLAGS_LEFT) && (width > total))
 	{
-		if (negative)
-		{
-			buf[len++] = '-';
-		}
-		else if (flags & FLAGS_PLUS)
+		if (flags & FLAGS_ZEROPAD)
 		{
-			buf[len++] = '+'; // ignore the space if the '+' exists
+			zeros = width - total;
 		}
-		else if (flags & FLAGS_SPACE)
+		else
 		{
-			buf[len++] = ' ';
+			idx = _out_pad(out, buffer, idx, maxlen, ' ', width - total);
 		}
 	}
+	if (sign)
+	{
+		out(sign, buffer, idx++, maxlen);
+	}
+	idx = _out_pad(out, buffer, idx, maxlen, '0', zeros);
+	out(dec->len ? dec->digits[0] : '0', buffer, idx++, maxlen);
+	if (dot)
+	{
+		out('.', buffer, idx++, maxlen);
+	}
+	const size_t more = dec->len > 1 ? (size_t)(dec->len - 1) : 0U;
+	const size_t n = more < prec ? more : prec;
+	idx = _out_str(out, buffer, idx, maxlen, dec->digits + 1, n);
+	idx = _out_pad(out, buffer, idx, maxlen, '0', prec - n);
+	idx = _out_str(out, buffer, idx, maxlen, exp_str, exp_len);
 
-	return _out_rev(out, buffer, idx, maxlen, buf, len, width, flags);
-}
-
-#if defined(PRINTF_SUPPORT_EXPONENTIAL)
-// internal ftoa variant for exponential floating-point type, contributed by Martijn Jasperse <m.jasperse@gmail.com>
-static size_t _etoa(out_fct_type out, char *buffer, size_t idx, size_t maxlen, double value, unsigned int prec, unsigned int width, unsigned int flags)
-{
-	// check for NaN and special values
-	if ((value != value) || (value > DBL_MAX) || (value < -DBL_MAX))
+	// append pad spaces up to given width
+	if ((flags & FLAGS_LEFT) && (width > total))
 	{
-		return _ftoa(out, buffer, idx, maxlen, value, prec, width, flags);
+		idx = _out_pad(out, buffer, idx, maxlen, ' ', width - total);
 	}
+	return idx;
+}
+#endif // PRINTF_SUPPORT_EXPONENTIAL
 
-	// determine the sign
-	const bool negative = value < 0;
-	if (negative)
+// internal ftoa for fixed decimal floating point
+static size_t _ftoa(out_fct_type out, char *buffer, size_t idx, size_t maxlen, double value, unsigned int prec, unsigned int width, unsigned int flags)
+{
+	// test for special values
+	if ((value != value) || (value < -DBL_MAX) || (value > DBL_MAX))
 	{
-		value = -value;
+		return _out_special(out, buffer, idx, maxlen, value, width, flags);
 	}
 
-	// default precision
+	// set default precision, if not set explicitly
 	if (!(flags & FLAGS_PRECISION))
 	{
 		prec = PRINTF_DEFAULT_FLOAT_PRECISION;
 	}
 
-	// determine the decimal exponent
-	// based on the algorithm by David Gay (https://www.ampl.com/netlib/fp/dtoa.c)
-	union {
-		uint64_t U;
-		double F;
-	} conv;
-
-	conv.F = value;
-	int exp2 = (int)((conv.U >> 52U) & 0x07FFU) - 1023;	  // effectively log2
-	conv.U = (conv.U & ((1ULL << 52U) - 1U)) | (1023ULL << 52U); // drop the exponent so conv.F is now in [1,2)
-	// now approximate log10 from the log2 integer part and an expansion of ln around 1.5
-	int expval = (int)(0.1760912590558 + exp2 * 0.301029995663981 + (conv.F - 1.5) * 0.289529654602168);
-	// now we want to compute 10^expval but we want to be sure it won't overflow
-	exp2 = (int)(expval * 3.321928094887362 + 0.5);
-	const double z = expval * 2.302585092994046 - exp2 * 0.6931471805599453;
-	const double z2 = z * z;
-	conv.U = (uint64_t)(exp2 + 1023) << 52U;
-	// compute exp(z) using continued fractions, see https://en.wikipedia.org/wiki/Exponential_function#Continued_fractions_for_ex
-	conv.F *= 1 + 2 * z / (2 - z + (z2 / (6 + (z2 / (10 + z2 / 14)))));
-	// correct for rounding errors
-	if (value < conv.F)
-	{
-		expval--;
-		conv.F /= 10;
-	}
-
-	// the exponent format is "%+03d" and largest value is "307", so set aside 4-5 characters
-	unsigned int minwidth = ((expval < 100) && (expval > -100)) ? 4U : 5U;
+	decimal_type dec;
+	_dtod_rounded(value, &dec, (int)prec, true);
+	return _out_fixed(out, buffer, idx, maxlen, &dec, prec, width, flags);
+}
 
-	// in "%g" mode, "prec" is the number of *significant figures* not decimals
-	if (flags & FLAGS_ADAPT_EXP)
+#if defined(PRINTF_SUPPORT_EXPONENTIAL)
+// internal ftoa variant for exponential floating-point type (%e and %g)
+static size_t _etoa(out_fct_type out, char *buffer, size_t idx, size_t maxlen, double value, unsigned int prec, unsigned int width, unsigned int flags)
+{
+	// check for NaN and special values
+	if ((value != value) || (value > DBL_MAX) || (value < -DBL_MAX))
 	{
-		// do we want to fall-back to "%f" mode?
-		if ((value >= 1e-4) && (value < 1e6))
-		{
-			if ((int)prec > expval)
-			{
-				prec = (unsigned)((int)prec - expval - 1);
-			}
-			else
-			{
-				prec = 0;
-			}
-			flags |= FLAGS_PRECISION; // make sure _ftoa respects precision
-			// no characters in exponent
-			minwidth = 0U;
-			expval = 0;
-		}
-		else
-		{
-			// we use one sigfig for the whole part
-			if ((prec > 0) && (flags & FLAGS_PRECISION))
-			{
-				--prec;
-			}
-		}
+		return _out_special(out, buffer, idx, maxlen, value, width, flags);
 	}
 
-	// will everything fit?
-	unsigned int fwidth = width;
-	if (width > minwidth)
-	{
-		// we didn't fall-back so subtract the characters required for the exponent
-		fwidth -= minwidth;
-	}
-	else
-	{
-		// not enough characters, so go back to default sizing
-		fwidth = 0U;
-	}
-	if ((flags & FLAGS_LEFT) && minwidth)
+	// default precision
+	if (!(flags & FLAGS_PRECISION))
 	{
-		// if we're padding on the right, DON'T pad the floating part
-		fwidth = 0U;
+		prec = PRINTF_DEFAULT_FLOAT_PRECISION;
 	}
 
-	// rescale the float value
-	if (expval)
+	decimal_type dec;
+	if (!(flags & FLAGS_ADAPT_EXP))
 	{
-		value /= conv.F;
+		_dtod_rounded(value, &dec, (int)prec + 1, false);
+		return _out_exp(out, buffer, idx, maxlen, &dec, prec, width, flags);
 	}
 
-	// output the floating part
-	const size_t start_idx = idx;
-	idx = _ftoa(out, buffer, idx, maxlen, negative ? -value : value, prec, fwidth, flags & ~FLAGS_ADAPT_EXP);
-
-	// output the exponent part
-	if (minwidth)
+	// in "%g" mode, "prec" is the number of *significant figures* not decimals
+	const int sig = prec ? (int)prec : 1;
+	_dtod_rounded(value, &dec, sig, false);
+	const int expval = dec.len ? dec.point - 1 : 0;
+	// _round_decimal() drops trailing zeros, which is what %g wants unless
+	// there is a '#'
+	const bool keep_zeros = flags & FLAGS_HASH;
+	if ((sig > expval) && (expval >= -4))
 	{
-		// output the exponential symbol
-		out((flags & FLAGS_UPPERCASE) ? 'E' : 'e', buffer, idx++, maxlen);
-		// output the exponent value
-		idx = _ntoa_long(out, buffer, idx, maxlen, (expval < 0) ? -expval : expval, expval < 0, 10, 0, minwidth - 1, FLAGS_ZEROPAD | FLAGS_PLUS);
-		// might need to right-pad spaces
-		if (flags & FLAGS_LEFT)
+		// fall back to "%f" mode
+		int fprec = sig - 1 - expval;
+		if (!keep_zeros)
 		{
-			while (idx - start_idx < width)
-				out(' ', buffer, idx++, maxlen);
+			const int needed = dec.len - dec.point;
+			fprec = needed < 0 ? 0 : (needed < fprec ? needed : fprec);
 		}
+		return _out_fixed(out, buffer, idx, maxlen, &dec, (unsigned int)fprec, width, flags);
 	}
-	return idx;
+	int eprec = sig - 1;
+	if (!keep_zeros)
+	{
+		eprec = dec.len > 1 ? dec.len - 1 : 0;
+	}
+	return _out_exp(out, buffer, idx, maxlen, &dec, (unsigned int)eprec, width, flags);
 }
 #endif // PRINTF_SUPPORT_EXPONENTIAL
 #endif // PRINTF_SUPPORT_FLOAT
@@ -652,9 +1139,13 @@ static int _vsnprintf(out_fct_type out, char *buffer, const size_t maxlen, const
 		// format specifier?  %[flags][width][.precision][length]
 		if (*format != '%')
 		{
-			// no
-			out(*format, buffer, idx++, maxlen);
-			format++;
+			// no, so send everything up to the next one in one go
+			const char *run = format;
+			while (*format && (*format != '%'))
+			{
+				format++;
+			}
+			idx = _out_str(out, buffer, idx, maxlen, run, (size_t)(format - run));
 			continue;
 		}
 		else
@@ -834,18 +1325,18 @@ static int _vsnprintf(out_fct_type out, char *buffer, const size_t maxlen, const
 				{
 #if defined(PRINTF_SUPPORT_LONG_LONG)
 					const long long value = va_arg(va, long long);
-					idx = _ntoa_long_long(out, buffer, idx, maxlen, (unsigned long long)(value > 0 ? value : 0 - value), value < 0, base, precision, width, flags);
+					idx = _ntoa(out, buffer, idx, maxlen, value > 0 ? (unsigned long long)value : 0ULL - (unsigned long long)value, value < 0, base, precision, width, flags);
 #endif
 				}
 				else if (flags & FLAGS_LONG)
 				{
 					const long value = va_arg(va, long);
-					idx = _ntoa_long(out, buffer, idx, maxlen, (unsigned long)(value > 0 ? value : 0 - value), value < 0, base, precision, width, flags);
+					idx = _ntoa(out, buffer, idx, maxlen, value > 0 ? (unsigned long)value : 0UL - (unsigned long)value, value < 0, base, precision, width, flags);
 				}
 				else
 				{
 					const int value = (flags & FLAGS_CHAR) ? (char)va_arg(va, int) : (flags & FLAGS_SHORT) ? (short int)va_arg(va, int) : va_arg(va, int);
-					idx = _ntoa_long(out, buffer, idx, maxlen, (unsigned int)(value > 0 ? value : 0 - value), value < 0, base, precision, width, flags);
+					idx = _ntoa(out, buffer, idx, maxlen, value > 0 ? (unsigned int)value : 0U - (unsigned int)value, value < 0, base, precision, width, flags);
 				}
 			}
 			else
@@ -854,17 +1345,17 @@ static int _vsnprintf(out_fct_type out, char *buffer, const size_t maxlen, const
 				if (flags & FLAGS_LONG_LONG)
 				{
 #if defined(PRINTF_SUPPORT_LONG_LONG)
-					idx = _ntoa_long_long(out, buffer, idx, maxlen, va_arg(va, unsigned long long), false, base, precision, width, flags);
+					idx = _ntoa(out, buffer, idx, maxlen, va_arg(va, unsigned long long), false, base, precision, width, flags);
 #endif
 				}
 				else if (flags & FLAGS_LONG)
 				{
-					idx = _ntoa_long(out, buffer, idx, maxlen, va_arg(va, unsigned long), false, base, precision, width, flags);
+					idx = _ntoa(out, buffer, idx, maxlen, va_arg(va, unsigned long), false, base, precision, width, flags);
 				}
 				else
 				{
 					const unsigned int value = (flags & FLAGS_CHAR) ? (unsigned char)va_arg(va, unsigned int) : (flags & FLAGS_SHORT) ? (unsigned short int)va_arg(va, unsigned int) : va_arg(va, unsigned int);
-					idx = _ntoa_long(out, buffer, idx, maxlen, value, false, base, precision, width, flags);
+					idx = _ntoa(out, buffer, idx, maxlen, value, false, base, precision, width, flags);
 				}
 			}
 			format++;
@@ -894,24 +1385,17 @@ static int _vsnprintf(out_fct_type out, char *buffer, const size_t maxlen, const
 #endif // PRINTF_SUPPORT_FLOAT
 		case 'c':
 		{
-			unsigned int l = 1U;
 			// pre padding
-			if (!(flags & FLAGS_LEFT))
+			if (!(flags & FLAGS_LEFT) && (width > 1U))
 			{
-				while (l++ < width)
-				{
-					out(' ', buffer, idx++, maxlen);
-				}
+				idx = _out_pad(out, buffer, idx, maxlen, ' ', width - 1U);
 			}
 			// char output
 			out((char)va_arg(va, int), buffer, idx++, maxlen);
 			// post padding
-			if (flags & FLAGS_LEFT)
+			if ((flags & FLAGS_LEFT) && (width > 1U))
 			{
-				while (l++ < width)
-				{
-					out(' ', buffer, idx++, maxlen);
-				}
+				idx = _out_pad(out, buffer, idx, maxlen, ' ', width - 1U);
 			}
 			format++;
 			break;
@@ -920,31 +1404,18 @@ static int _vsnprintf(out_fct_type out, char *buffer, const size_t maxlen, const
 		case 's':
 		{
 			const char *p = va_arg(va, char *);
-			unsigned int l = _strnlen_s(p, precision ? precision : (size_t)-1);
+			unsigned int l = _strnlen_s(p, (flags & FLAGS_PRECISION) ? precision : (size_t)-1);
 			// pre padding
-			if (flags & FLAGS_PRECISION)
+			if (!(flags & FLAGS_LEFT) && (width > l))
 			{
-				l = (l < precision ? l : precision);
-			}
-			if (!(flags & FLAGS_LEFT))
-			{
-				while (l++ < width)
-				{
-					out(' ', buffer, idx++, maxlen);
-				}
+				idx = _out_pad(out, buffer, idx, maxlen, ' ', width - l);
 			}
 			// string output
-			while ((*p != 0) && (!(flags & FLAGS_PRECISION) || precision--))
-			{
-				out(*(p++), buffer, idx++, maxlen);
-			}
+			idx = _out_str(out, buffer, idx, maxlen, p, l);
 			// post padding
-			if (flags & FLAGS_LEFT)
+			if ((flags & FLAGS_LEFT) && (width > l))
 			{
-				while (l++ < width)
-				{
-					out(' ', buffer, idx++, maxlen);
-				}
+				idx = _out_pad(out, buffer, idx, maxlen, ' ', width - l);
 			}
 			format++;
 			break;
@@ -954,19 +1425,7 @@ static int _vsnprintf(out_fct_type out, char *buffer, const size_t maxlen, const
 		{
 			width = sizeof(void *) * 2U;
 			flags |= FLAGS_ZEROPAD | FLAGS_UPPERCASE;
-#if defined(PRINTF_SUPPORT_LONG_LONG)
-			const bool is_ll = sizeof(uintptr_t) == sizeof(long long);
-			if (is_ll)
-			{
-				idx = _ntoa_long_long(out, buffer, idx, maxlen, (uintptr_t)va_arg(va, void *), false, 16U, precision, width, flags);
-			}
-			else
-			{
-#endif
-				idx = _ntoa_long(out, buffer, idx, maxlen, (unsigned long)((uintptr_t)va_arg(va, void *)), false, 16U, precision, width, flags);
-#if defined(PRINTF_SUPPORT_LONG_LONG)
-			}
-#endif
+			idx = _ntoa(out, buffer, idx, maxlen, (uintptr_t)va_arg(va, void *), false, 16U, precision, width, flags);
 			format++;
 			break;
 		}
@@ -1040,3 +1499,66 @@ int fctprintf(void (*out)(char character, void *arg), void *arg, const char *for
 	va_end(va);
 	return ret;
 }
+
+#if defined(PRINTF_SUPPORT_FLOAT) && defined(PRINTF_SUPPORT_EXPONENTIAL)
+int dtoa(char *buffer, double value)
+{
+	size_t idx;
+	if ((value != value) || (value < -DBL_MAX) || (value > DBL_MAX))
+	{
+		idx = _out_special(_out_buffer, buffer, 0U, (size_t)-1, value, 0U, 0U);
+	}
+	else
+	{
+		// the shortest digits, laid out like %.17g would
+		decimal_type dec;
+		_dtod(value, &dec);
+		const int expval = dec.len ? dec.point - 1 : 0;
+		if ((expval < 17) && (expval >= -4))
+		{
+			const int fprec = dec.len - dec.point;
+			idx = _out_fixed(_out_buffer, buffer, 0U, (size_t)-1, &dec, fprec < 0 ? 0U : (unsigned int)fprec, 0U, 0U);
+		}
+		else
+		{
+			idx = _out_exp(_out_buffer, buffer, 0U, (size_t)-1, &dec, dec.len > 1 ? (unsigned int)dec.len - 1U : 0U, 0U, 0U);
+		}
+	}
+	buffer[idx] = '\0';
+	return (int)idx;
+}
+
+int dtoa_format(char *buffer, size_t count, double value, char type, unsigned int prec, int alt)
+{
+	unsigned int flags = FLAGS_PRECISION;
+	if ((type == 'F') || (type == 'E') || (type == 'G'))
+	{
+		flags |= FLAGS_UPPERCASE;
+	}
+	if (alt)
+	{
+		flags |= FLAGS_HASH;
+	}
+	size_t idx;
+	switch (type)
+	{
+	case 'e':
+	case 'E':
+		idx = _etoa(_out_buffer, buffer, 0U, count, value, prec, 0U, flags);
+		break;
+	case 'g':
+	case 'G':
+		idx = _etoa(_out_buffer, buffer, 0U, count, value, prec, 0U, flags | FLAGS_ADAPT_EXP);
+		break;
+	default:
+		idx = _ftoa(_out_buffer, buffer, 0U, count, value, prec, 0U, flags);
+		break;
+	}
+	// termination, like vsnprintf()
+	if (count)
+	{
+		buffer[idx < count ? idx : count - 1U] = '\0';
+	}
+	return (int)idx;
+}
+#endif
@@ -105,6 +105,31 @@ int vprintf_(const char* format, va_list va);
 int fctprintf(void (*out)(char character, void* arg), void* arg, const char* format, ...);
 
 
+/**
+ * Shortest round trip conversion of a double
+ * Writes the fewest digits that still read back as exactly the same value, in the
+ * same layout as %.17g. This is much faster than %.17g, which has to print every digit.
+ * \param buffer A pointer to the buffer, which must hold at least DTOA_BUFFER_SIZE characters
+ * \param value The value to convert
+ * \return The number of characters written, not counting the terminating null character
+ */
+#define DTOA_BUFFER_SIZE 32
+int dtoa(char* buffer, double value);
+
+
+/**
+ * One double, formatted like %.*f, %.*e or %.*g without padding
+ * \param buffer A pointer to the buffer where to store the formatted string
+ * \param count The maximum number of characters to store in the buffer, including a terminating null character
+ * \param value The value to convert
+ * \param type One of 'f', 'e', 'g' or their uppercase versions
+ * \param prec The precision, as in %.*f
+ * \param alt Non-zero for the alternate form, as in %#f
+ * \return The number of characters that COULD have been written, like snprintf()
+ */
+int dtoa_format(char* buffer, size_t count, double value, char type, unsigned int prec, int alt);
+
+
 #ifdef __cplusplus
 }
 #endif
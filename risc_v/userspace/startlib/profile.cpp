@@ -0,0 +1,190 @@
+// profile.cpp
+// Turn profile samples into a flat profile
+// We read the symbol table out of the program's ELF file ourselves, the
+// same way elf.rs reads the program headers.
+
+#include "profile.h"
+#include "ioring.h"
+#include "malloc.h"
+#include "printf.h"
+
+#define ELF_MAGIC    0x464c457f
+#define SHT_SYMTAB   2
+#define STT_FUNC     2
+
+struct ElfHeader {
+	unsigned int magic;
+	unsigned char bitsize, endian, ident_abi_version, target_platform;
+	unsigned char abi_version, padding[7];
+	unsigned short obj_type, machine;
+	unsigned int version;
+	unsigned long entry_addr, phoff, shoff;
+	unsigned int flags;
+	unsigned short ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+};
+
+struct SectionHeader {
+	unsigned int name, type;
+	unsigned long flags, addr, offset, size;
+	unsigned int link, info;
+	unsigned long addralign, entsize;
+};
+
+struct ElfSymbol {
+	unsigned int name;
+	unsigned char info, other;
+	unsigned short shndx;
+	unsigned long value, size;
+};
+
+struct Function {
+	unsigned long start, end;
+	const char *name;
+	unsigned long hits;
+};
+
+// Read exactly len bytes at offset, or fail.
+static bool read_at(IoRing &io, int fd, void *buf, unsigned long len, unsigned long offset) {
+	char *p = (char *)buf;
+	while (len > 0) {
+		unsigned int chunk = len > 65536 ? 65536 : len;
+		if (io.read_file(fd, p, chunk, offset).get() != chunk) {
+			return false;
+		}
+		p += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+	return true;
+}
+
+// Every function in the symbol table, sorted by address. The names point
+// into *strings, for the caller to free.
+static Function *load_functions(const char *path, unsigned long &count, char *&strings) {
+	count = 0;
+	strings = nullptr;
+	int fd = (int)syscall_open(path, 0);
+	if (fd < 0) {
+		return nullptr;
+	}
+	IoRing io;
+	ElfHeader eh;
+	SectionHeader *sh = nullptr;
+	ElfSymbol *syms = nullptr;
+	Function *funcs = nullptr;
+	unsigned long nsyms = 0;
+	if (!read_at(io, fd, &eh, sizeof(eh), 0) || eh.magic != ELF_MAGIC || eh.shentsize != sizeof(SectionHeader)) {
+		goto out;
+	}
+	sh = (SectionHeader *)malloc(eh.shnum * sizeof(SectionHeader));
+	if (!read_at(io, fd, sh, eh.shnum * sizeof(SectionHeader), eh.shoff)) {
+		goto out;
+	}
+	for (unsigned int i = 0; i < eh.shnum; i++) {
+		if (sh[i].type != SHT_SYMTAB || sh[i].link >= eh.shnum) {
+			continue;
+		}
+		const SectionHeader &strtab = sh[sh[i].link];
+		nsyms = sh[i].size / sizeof(ElfSymbol);
+		syms = (ElfSymbol *)malloc(sh[i].size);
+		strings = (char *)malloc(strtab.size + 1);
+		if (!read_at(io, fd, syms, sh[i].size, sh[i].offset) ||
+		    !read_at(io, fd, strings, strtab.size, strtab.offset)) {
+			nsyms = 0;
+			break;
+		}
+		strings[strtab.size] = 0;
+		break;
+	}
+	funcs = (Function *)malloc((nsyms + 1) * sizeof(Function));
+	for (unsigned long i = 0; i < nsyms; i++) {
+		if ((syms[i].info & 0xf) != STT_FUNC || syms[i].value == 0) {
+			continue;
+		}
+		Function f = { syms[i].value, syms[i].value + (syms[i].size ? syms[i].size : 1), strings + syms[i].name, 0 };
+		// Insertion sort. Symbol tables are mostly in order already.
+		unsigned long j = count++;
+		for (; j > 0 && funcs[j - 1].start > f.start; j--) {
+			funcs[j] = funcs[j - 1];
+		}
+		funcs[j] = f;
+	}
+out:
+	free(syms);
+	free(sh);
+	syscall_close(fd);
+	return funcs;
+}
+
+static Function *find(Function *funcs, unsigned long count, unsigned long pc) {
+	unsigned long lo = 0, hi = count;
+	while (lo < hi) {
+		unsigned long mid = (lo + hi) / 2;
+		if (funcs[mid].start <= pc) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	if (lo == 0 || pc >= funcs[lo - 1].end) {
+		return nullptr;
+	}
+	return &funcs[lo - 1];
+}
+
+#define SAMPLE_BATCH 256
+
+long profile_report(const char *elf_path) {
+	unsigned long count;
+	char *strings;
+	Function *funcs = load_functions(elf_path, count, strings);
+	if (funcs == nullptr) {
+		printf("# profile: can't read symbols from %s\n", elf_path);
+	}
+	ProfileSample *batch = (ProfileSample *)malloc(SAMPLE_BATCH * sizeof(ProfileSample));
+	long total = 0;
+	unsigned long unknown = 0;
+	long got;
+	while ((got = profile_read(batch, SAMPLE_BATCH)) > 0) {
+		for (long i = 0; i < got; i++) {
+			Function *f = find(funcs, count, batch[i].pc);
+			if (f != nullptr) {
+				f->hits++;
+			}
+			else {
+				if (funcs == nullptr) {
+					printf("sample pc=0x%lx pid=%lu\n", batch[i].pc, batch[i].pid);
+				}
+				unknown++;
+			}
+		}
+		total += got;
+	}
+	free(batch);
+	if (funcs != nullptr) {
+		// Print the busiest first. Pull each one out in turn; there
+		// aren't many functions with hits.
+		printf("# profile %s samples=%ld\n", elf_path, total);
+		for (;;) {
+			Function *best = nullptr;
+			for (unsigned long i = 0; i < count; i++) {
+				if (funcs[i].hits != 0 && (best == nullptr || funcs[i].hits > best->hits)) {
+					best = &funcs[i];
+				}
+			}
+			if (best == nullptr) {
+				break;
+			}
+			printf("prof %lu %lu.%lu%% %s\n", best->hits, best->hits * 100 / total,
+			       best->hits * 1000 / total % 10, best->name);
+			best->hits = 0;
+		}
+		if (unknown != 0) {
+			printf("prof %lu %lu.%lu%% [unknown]\n", unknown, unknown * 100 / total, unknown * 1000 / total % 10);
+		}
+	}
+	free(funcs);
+	free(strings);
+	return total;
+}
@@ -0,0 +1,47 @@
+#pragma once
+// profile.h
+// Where is the time going?
+// profile_start() has the kernel sample our PC off of the timer, every
+// thread of us, rate times a second. profile_stop() stops it, and
+// profile_report() matches the samples up with the functions in our ELF
+// file and prints a flat profile:
+//
+//     profile_start(1000);
+//     do_the_work();
+//     profile_stop();
+//     profile_report("/helloworld");
+//
+// The program doesn't have to be built any differently, only linked with
+// profile.cpp, and it isn't slowed down at all when it isn't sampling.
+
+#include "syscall.h"
+
+// These must match profile.rs.
+#define PROFILE_START 0
+#define PROFILE_STOP  1
+#define PROFILE_READ  2
+
+struct ProfileSample {
+	unsigned long pc;
+	unsigned long pid; // Which thread it was
+};
+
+static inline void profile_start(unsigned int rate) {
+	syscall_profile(PROFILE_START, rate, 0);
+}
+
+// Returns how many samples didn't fit in the kernel.
+static inline unsigned long profile_stop() {
+	return syscall_profile(PROFILE_STOP, 0, 0);
+}
+
+// Move up to n of the oldest samples into samples. Returns how many.
+static inline long profile_read(ProfileSample *samples, unsigned long n) {
+	return syscall_profile(PROFILE_READ, samples, n * sizeof(ProfileSample));
+}
+
+// Read every sample and print how many landed in each function, most
+// first, using the symbol table in the ELF file at elf_path. Prints the
+// raw PCs if it can't read the symbols. This returns how many samples it
+// read.
+long profile_report(const char *elf_path);
@@ -0,0 +1,58 @@
+#pragma once
+// random.h
+// Random bytes from the kernel
+// getrandom (278) fills a buffer from the kernel's ChaCha20 generator,
+// which the entropy device reseeds in the background, so a call costs
+// about as much as any other trap. See rng.rs.
+//
+// Nothing is buffered out here. A buffer would be copied into the child
+// by fork(), and the two would hand out the same "random" numbers.
+
+#include "syscall.h"
+
+// These must match rng.rs.
+#define GRND_NONBLOCK 1
+#define GRND_RANDOM   2
+#define GETRANDOM_MAX 65536UL
+
+// Fill len bytes at buf. This only waits if the kernel hasn't had its
+// first pool of entropy yet. Returns false if the kernel couldn't write
+// to buf, or has no entropy device to get any from.
+static inline bool random_bytes(void *buf, unsigned long len) {
+	unsigned char *p = (unsigned char *)buf;
+	while (len > 0) {
+		const long got = syscall_getrandom(p, len, 0);
+		if (got <= 0) {
+			return false;
+		}
+		p += got;
+		len -= got;
+	}
+	return true;
+}
+
+// Put a random number in v. Like random_bytes(), this returns false,
+// leaving v alone, if there's no randomness to be had, so that a failure
+// can't pass for a number.
+static inline bool random_u64(unsigned long &v) {
+	return random_bytes(&v, sizeof(v));
+}
+
+// Put a number in [0, bound) in v, with every one of them as likely as
+// the rest. Ones from the short end of 2^64 that would favour the low
+// numbers are thrown back. Returns false if bound is 0 or there's no
+// randomness.
+static inline bool random_below(unsigned long bound, unsigned long &v) {
+	if (bound == 0) {
+		return false;
+	}
+	const unsigned long reject = -bound % bound;
+	unsigned long r;
+	do {
+		if (!random_bytes(&r, sizeof(r))) {
+			return false;
+		}
+	} while (r < reject);
+	v = r % bound;
+	return true;
+}
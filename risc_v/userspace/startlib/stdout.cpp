@@ -0,0 +1,104 @@
+// stdout.cpp
+// Buffered standard output for startlib
+
+#include <stdout.h>
+#include <string.h>
+#include <syscall.h>
+
+#define STDOUT_FD 1
+
+// Each process gets its own copy of these since they live in the
+// program's .bss.
+static char out_buffer[STDOUT_BUFFER_SIZE];
+static size_t out_len = 0;
+// The kernel's write (64) sends descriptor 1 to the UART console no
+// matter what is open, so standard output is always a terminal, which
+// wants to see each line as it's finished. A program that would rather
+// send the largest writes it can picks STDOUT_FULLBUF with
+// stdout_setmode().
+static int out_mode = STDOUT_LINEBUF;
+
+int isatty(int fd) {
+	// The kernel sends descriptors 0, 1, and 2 straight to the UART
+	// console. There is no redirection, yet, so anything else is a file
+	// or a device.
+	return (fd >= 0 && fd <= 2) ? 1 : 0;
+}
+
+int stdout_flush(void) {
+	size_t done = 0;
+	while (done < out_len) {
+		unsigned long written = syscall_write(STDOUT_FD, out_buffer + done, out_len - done);
+		// The kernel returns how many bytes it actually took. If it took
+		// nothing (or errored), don't spin here forever.
+		if (written == 0 || (long)written < 0) {
+			break;
+		}
+		done += written;
+	}
+	if (done < out_len) {
+		// Keep what the kernel didn't take at the front of the buffer so
+		// that the next flush tries again.
+		memmove(out_buffer, out_buffer + done, out_len - done);
+		out_len -= done;
+		return -1;
+	}
+	out_len = 0;
+	return 0;
+}
+
+// Make room for at least one more byte. If the buffer is full and the
+// kernel won't take any of it, it's never going out, so we drop it rather
+// than write past the end of the buffer or wait for room forever.
+static inline void make_room() {
+	if (out_len < STDOUT_BUFFER_SIZE) {
+		return;
+	}
+	stdout_flush();
+	if (out_len >= STDOUT_BUFFER_SIZE) {
+		out_len = 0;
+	}
+}
+
+void stdout_putchar(char c) {
+	make_room();
+	out_buffer[out_len++] = c;
+	int mode = out_mode;
+	if (mode == STDOUT_UNBUF || (mode == STDOUT_LINEBUF && c == '\n') || out_len >= STDOUT_BUFFER_SIZE) {
+		stdout_flush();
+	}
+}
+
+void stdout_write(const char *buf, size_t len) {
+	int mode = out_mode;
+	bool saw_newline = false;
+	while (len) {
+		make_room();
+		size_t n = STDOUT_BUFFER_SIZE - out_len;
+		if (n > len) {
+			n = len;
+		}
+		// Line buffering only needs to know if there was a newline at
+		// all, not where.
+		if (!saw_newline && mode == STDOUT_LINEBUF) {
+			for (size_t i = 0; i < n; i++) {
+				if (buf[i] == '\n') {
+					saw_newline = true;
+					break;
+				}
+			}
+		}
+		memcpy(out_buffer + out_len, buf, n);
+		out_len += n;
+		buf += n;
+		len -= n;
+	}
+	if (mode == STDOUT_UNBUF || (mode == STDOUT_LINEBUF && saw_newline) || out_len >= STDOUT_BUFFER_SIZE) {
+		stdout_flush();
+	}
+}
+
+void stdout_setmode(int mode) {
+	stdout_flush();
+	out_mode = mode;
+}
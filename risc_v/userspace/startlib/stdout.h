@@ -0,0 +1,39 @@
+#pragma once
+// stdout.h
+// Buffered standard output for startlib
+// Every character that printf() produces used to be its own putchar
+// system call (2). Instead, we collect output here and drain it through
+// write (64) a line or a block at a time.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Buffering modes, which mimic setvbuf()'s.
+#define STDOUT_FULLBUF   0 // Flush only when the buffer fills (or on stdout_flush)
+#define STDOUT_LINEBUF   1 // Flush after every newline
+#define STDOUT_UNBUF     2 // Flush after every stdout_write
+
+#ifndef STDOUT_BUFFER_SIZE
+#define STDOUT_BUFFER_SIZE 1024
+#endif
+
+// Returns 1 if the given file descriptor is the console, 0 otherwise.
+int isatty(int fd);
+
+// Queue a single character or a run of characters for standard output.
+void stdout_putchar(char c);
+void stdout_write(const char *buf, size_t len);
+
+// Push everything we've buffered out to the kernel. This is our fflush().
+// Returns 0 on success, -1 if the kernel refused part of the buffer.
+int stdout_flush(void);
+
+// Change the buffering mode. Anything already buffered is flushed first.
+void stdout_setmode(int mode);
+
+#ifdef __cplusplus
+}
+#endif
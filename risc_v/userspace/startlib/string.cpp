@@ -0,0 +1,237 @@
+// string.cpp
+// Memory and string routines for startlib
+
+#include "string.h"
+
+// RISC-V doesn't promise that misaligned loads and stores work, and where
+// they do, they may trap and be emulated, which is far slower than bytes.
+// So everything here lines the pointers up first and only then goes a
+// word at a time. may_alias lets us look at any buffer through a word.
+typedef unsigned long __attribute__((may_alias)) word;
+#define WORD_SIZE  sizeof(word)
+#define WORD_MASK  (WORD_SIZE - 1)
+// Unrolled loops move this many bytes per trip.
+#define BLOCK_SIZE (8 * WORD_SIZE)
+
+#define ONES  0x0101010101010101UL
+#define HIGHS 0x8080808080808080UL
+
+// Non-zero if any byte in w is zero. Reading a whole aligned word past the
+// end of a string is fine since it can't cross into another page.
+static inline word has_zero(word w) {
+	return (w - ONES) & ~w & HIGHS;
+}
+
+static inline bool aligned(const void *p) {
+	return ((unsigned long)p & WORD_MASK) == 0;
+}
+
+// Copy words from an aligned src to an aligned dest, 8 at a time.
+static inline void copy_words(word *d, const word *s, size_t words) {
+	while (words >= 8) {
+		word w0 = s[0], w1 = s[1], w2 = s[2], w3 = s[3];
+		word w4 = s[4], w5 = s[5], w6 = s[6], w7 = s[7];
+		d[0] = w0; d[1] = w1; d[2] = w2; d[3] = w3;
+		d[4] = w4; d[5] = w5; d[6] = w6; d[7] = w7;
+		d += 8;
+		s += 8;
+		words -= 8;
+	}
+	while (words--) {
+		*d++ = *s++;
+	}
+}
+
+void *memcpy(void *dest, const void *src, size_t n) {
+	unsigned char *d = (unsigned char *)dest;
+	const unsigned char *s = (const unsigned char *)src;
+	if (n >= BLOCK_SIZE) {
+		// Line dest up, then see where that leaves src.
+		while (!aligned(d)) {
+			*d++ = *s++;
+			n--;
+		}
+		const unsigned long offset = (unsigned long)s & WORD_MASK;
+		if (offset == 0) {
+			copy_words((word *)d, (const word *)s, n / WORD_SIZE);
+			d += n & ~WORD_MASK;
+			s += n & ~WORD_MASK;
+			n &= WORD_MASK;
+		}
+		else {
+			// src is off by offset bytes. Read aligned words anyway and
+			// stitch each pair together with shifts (little endian).
+			const unsigned int right = offset * 8;
+			const unsigned int left = WORD_SIZE * 8 - right;
+			const word *sw = (const word *)(s - offset);
+			word *dw = (word *)d;
+			word lo = *sw++;
+			// Stop a word early so that we never read the word after the
+			// last one we need.
+			size_t words = n / WORD_SIZE - 1;
+			for (size_t i = 0; i < words; i++) {
+				const word hi = *sw++;
+				*dw++ = (lo >> right) | (hi << left);
+				lo = hi;
+			}
+			d += words * WORD_SIZE;
+			s += words * WORD_SIZE;
+			n -= words * WORD_SIZE;
+		}
+	}
+	while (n--) {
+		*d++ = *s++;
+	}
+	return dest;
+}
+
+void *memmove(void *dest, const void *src, size_t n) {
+	unsigned char *d = (unsigned char *)dest;
+	const unsigned char *s = (const unsigned char *)src;
+	if (d <= s || d >= s + n) {
+		// A forward copy never reads anything it already wrote.
+		return memcpy(dest, src, n);
+	}
+	// dest overlaps the end of src, so go backwards.
+	d += n;
+	s += n;
+	if (((unsigned long)d & WORD_MASK) == ((unsigned long)s & WORD_MASK)) {
+		while (n && !aligned(d)) {
+			*--d = *--s;
+			n--;
+		}
+		while (n >= WORD_SIZE) {
+			d -= WORD_SIZE;
+			s -= WORD_SIZE;
+			*(word *)d = *(const word *)s;
+			n -= WORD_SIZE;
+		}
+	}
+	while (n--) {
+		*--d = *--s;
+	}
+	return dest;
+}
+
+void *memset(void *dest, int c, size_t n) {
+	unsigned char *d = (unsigned char *)dest;
+	if (n >= BLOCK_SIZE) {
+		const word w = (word)(unsigned char)c * ONES;
+		while (!aligned(d)) {
+			*d++ = (unsigned char)c;
+			n--;
+		}
+		word *dw = (word *)d;
+		size_t words = n / WORD_SIZE;
+		while (words >= 8) {
+			dw[0] = w; dw[1] = w; dw[2] = w; dw[3] = w;
+			dw[4] = w; dw[5] = w; dw[6] = w; dw[7] = w;
+			dw += 8;
+			words -= 8;
+		}
+		while (words--) {
+			*dw++ = w;
+		}
+		d = (unsigned char *)dw;
+		n &= WORD_MASK;
+	}
+	while (n--) {
+		*d++ = (unsigned char)c;
+	}
+	return dest;
+}
+
+int memcmp(const void *a, const void *b, size_t n) {
+	const unsigned char *x = (const unsigned char *)a;
+	const unsigned char *y = (const unsigned char *)b;
+	if (n >= WORD_SIZE && (((unsigned long)x ^ (unsigned long)y) & WORD_MASK) == 0) {
+		while (!aligned(x)) {
+			if (*x != *y) {
+				return *x - *y;
+			}
+			x++;
+			y++;
+			n--;
+		}
+		// Skip the words that match. The first one that doesn't is left
+		// to the byte loop to find out which byte it is.
+		while (n >= WORD_SIZE && *(const word *)x == *(const word *)y) {
+			x += WORD_SIZE;
+			y += WORD_SIZE;
+			n -= WORD_SIZE;
+		}
+	}
+	while (n--) {
+		if (*x != *y) {
+			return *x - *y;
+		}
+		x++;
+		y++;
+	}
+	return 0;
+}
+
+size_t strlen(const char *s) {
+	const char *p = s;
+	while (!aligned(p)) {
+		if (!*p) {
+			return p - s;
+		}
+		p++;
+	}
+	const word *w = (const word *)p;
+	while (!has_zero(*w)) {
+		w++;
+	}
+	p = (const char *)w;
+	while (*p) {
+		p++;
+	}
+	return p - s;
+}
+
+size_t strnlen(const char *s, size_t maxlen) {
+	// Count down rather than compare against s + maxlen, since people
+	// pass (size_t)-1 for no limit.
+	const char *p = s;
+	while (maxlen && !aligned(p)) {
+		if (!*p) {
+			return p - s;
+		}
+		p++;
+		maxlen--;
+	}
+	while (maxlen >= WORD_SIZE && !has_zero(*(const word *)p)) {
+		p += WORD_SIZE;
+		maxlen -= WORD_SIZE;
+	}
+	while (maxlen && *p) {
+		p++;
+		maxlen--;
+	}
+	return p - s;
+}
+
+int strcmp(const char *a, const char *b) {
+	const unsigned char *x = (const unsigned char *)a;
+	const unsigned char *y = (const unsigned char *)b;
+	if ((((unsigned long)x ^ (unsigned long)y) & WORD_MASK) == 0) {
+		while (!aligned(x)) {
+			if (*x != *y || !*x) {
+				return *x - *y;
+			}
+			x++;
+			y++;
+		}
+		// Equal words with no terminator in them can be skipped whole.
+		while (*(const word *)x == *(const word *)y && !has_zero(*(const word *)x)) {
+			x += WORD_SIZE;
+			y += WORD_SIZE;
+		}
+	}
+	while (*x == *y && *x) {
+		x++;
+		y++;
+	}
+	return *x - *y;
+}
@@ -0,0 +1,25 @@
+#pragma once
+// string.h
+// Memory and string routines for startlib
+// We're built -ffreestanding -nostdlib, so there's no libc to give us
+// these, and without them everything ends up in a byte loop. These work a
+// word (8 bytes) at a time whenever the pointers allow it, like memcpy in
+// the kernel's cpu.rs.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void *memcpy(void *dest, const void *src, size_t n);
+void *memmove(void *dest, const void *src, size_t n);
+void *memset(void *dest, int c, size_t n);
+int memcmp(const void *a, const void *b, size_t n);
+size_t strlen(const char *s);
+size_t strnlen(const char *s, size_t maxlen);
+int strcmp(const char *a, const char *b);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,76 @@
+#pragma once
+// swapchain.h
+// Double (or triple) buffered drawing
+// The kernel gives us a few whole frames of our own. We draw into one
+// while another is on the screen, and present it when it's done, which
+// sends all of it at once, so the screen never shows half a frame.
+// Presents go out at most once a frame, and a buffer can't be drawn into
+// again until the GPU has finished with it, so a loop of acquire, draw,
+// present runs at the frame rate without sleeping on its own.
+//
+//     Swapchain sc;
+//     if (swapchain_open(sc, GPU_DEVICE, 2)) {
+//         while (running) {
+//             Pixel *frame = (Pixel *)swapchain_acquire(sc);
+//             ... draw all of frame ...
+//             swapchain_present(sc);
+//         }
+//     }
+
+#include "syscall.h"
+
+// These must match gpu.rs.
+#define SWAP_VADDR       0x34000000UL
+#define SWAP_MAX_BUFFERS 3
+
+struct Swapchain {
+	unsigned long dev;
+	unsigned int count;
+	// The buffer we draw into next
+	unsigned int next;
+	// Bytes from one buffer to the next
+	unsigned long stride;
+	// The fence each buffer's last present carried, or 0
+	unsigned long fences[SWAP_MAX_BUFFERS];
+};
+
+// Ask for count buffers on dev. We might get fewer. Returns false if we
+// can't have any.
+static inline bool swapchain_open(Swapchain &sc, unsigned long dev, unsigned int count) {
+	unsigned long size = syscall_get_fb_size(dev);
+	unsigned long n = size == 0 ? 0 : syscall_swapchain(dev, count);
+	if (n == 0) {
+		return false;
+	}
+	unsigned long bytes = (size >> 32) * (size & 0xffffffff) * 4;
+	sc.dev = dev;
+	sc.count = n;
+	sc.next = 0;
+	sc.stride = (bytes + 4095) & ~4095UL;
+	for (unsigned int i = 0; i < SWAP_MAX_BUFFERS; i++) {
+		sc.fences[i] = 0;
+	}
+	return true;
+}
+
+// The buffer to draw the next frame into. If it's still on its way to
+// the screen, this waits until it isn't.
+static inline void *swapchain_acquire(Swapchain &sc) {
+	if (sc.fences[sc.next] != 0) {
+		syscall_fence_wait(sc.dev, sc.fences[sc.next]);
+		sc.fences[sc.next] = 0;
+	}
+	return (void *)(SWAP_VADDR + sc.next * sc.stride);
+}
+
+// Show the buffer we got from swapchain_acquire(). This waits for the
+// next frame if the last one went out less than a frame ago.
+static inline bool swapchain_present(Swapchain &sc) {
+	long fence = syscall_present_buffer(sc.dev, sc.next);
+	if (fence < 0) {
+		return false;
+	}
+	sc.fences[sc.next] = fence;
+	sc.next = (sc.next + 1) % sc.count;
+	return true;
+}
@@ -1,23 +1,120 @@
 #pragma once
 
-extern "C"
-{
-	unsigned long make_syscall(unsigned long sysno,
-				   unsigned long a1=0,
-				   unsigned long a2=0,
-				   unsigned long a3=0,
-				   unsigned long a4=0,
-				   unsigned long a5=0,
-				   unsigned long a6=0);
+// System calls are made inline, one stub per number of arguments, so a
+// call loads the registers it uses and goes straight to ecall. The number
+// goes in a7 and the arguments in a0 through a5, and the kernel gives the
+// result back in a0. The memory clobber is there because most calls read
+// or write our memory behind the compiler's back.
+
+static inline unsigned long make_syscall(unsigned long sysno) {
+	register unsigned long a7 asm("a7") = sysno;
+	register unsigned long a0 asm("a0");
+	asm volatile("ecall" : "=r"(a0) : "r"(a7) : "memory");
+	return a0;
+}
+
+static inline unsigned long make_syscall(unsigned long sysno, unsigned long x1) {
+	register unsigned long a7 asm("a7") = sysno;
+	register unsigned long a0 asm("a0") = x1;
+	asm volatile("ecall" : "+r"(a0) : "r"(a7) : "memory");
+	return a0;
+}
+
+static inline unsigned long make_syscall(unsigned long sysno, unsigned long x1, unsigned long x2) {
+	register unsigned long a7 asm("a7") = sysno;
+	register unsigned long a0 asm("a0") = x1;
+	register unsigned long a1 asm("a1") = x2;
+	asm volatile("ecall" : "+r"(a0) : "r"(a7), "r"(a1) : "memory");
+	return a0;
+}
+
+static inline unsigned long make_syscall(unsigned long sysno, unsigned long x1, unsigned long x2,
+                                         unsigned long x3) {
+	register unsigned long a7 asm("a7") = sysno;
+	register unsigned long a0 asm("a0") = x1;
+	register unsigned long a1 asm("a1") = x2;
+	register unsigned long a2 asm("a2") = x3;
+	asm volatile("ecall" : "+r"(a0) : "r"(a7), "r"(a1), "r"(a2) : "memory");
+	return a0;
+}
+
+static inline unsigned long make_syscall(unsigned long sysno, unsigned long x1, unsigned long x2,
+                                         unsigned long x3, unsigned long x4) {
+	register unsigned long a7 asm("a7") = sysno;
+	register unsigned long a0 asm("a0") = x1;
+	register unsigned long a1 asm("a1") = x2;
+	register unsigned long a2 asm("a2") = x3;
+	register unsigned long a3 asm("a3") = x4;
+	asm volatile("ecall" : "+r"(a0) : "r"(a7), "r"(a1), "r"(a2), "r"(a3) : "memory");
+	return a0;
+}
+
+static inline unsigned long make_syscall(unsigned long sysno, unsigned long x1, unsigned long x2,
+                                         unsigned long x3, unsigned long x4, unsigned long x5) {
+	register unsigned long a7 asm("a7") = sysno;
+	register unsigned long a0 asm("a0") = x1;
+	register unsigned long a1 asm("a1") = x2;
+	register unsigned long a2 asm("a2") = x3;
+	register unsigned long a3 asm("a3") = x4;
+	register unsigned long a4 asm("a4") = x5;
+	asm volatile("ecall" : "+r"(a0) : "r"(a7), "r"(a1), "r"(a2), "r"(a3), "r"(a4) : "memory");
+	return a0;
+}
+
+static inline unsigned long make_syscall(unsigned long sysno, unsigned long x1, unsigned long x2,
+                                         unsigned long x3, unsigned long x4, unsigned long x5,
+                                         unsigned long x6) {
+	register unsigned long a7 asm("a7") = sysno;
+	register unsigned long a0 asm("a0") = x1;
+	register unsigned long a1 asm("a1") = x2;
+	register unsigned long a2 asm("a2") = x3;
+	register unsigned long a3 asm("a3") = x4;
+	register unsigned long a4 asm("a4") = x5;
+	register unsigned long a5 asm("a5") = x6;
+	asm volatile("ecall" : "+r"(a0) : "r"(a7), "r"(a1), "r"(a2), "r"(a3), "r"(a4), "r"(a5) : "memory");
+	return a0;
 }
 #define syscall_exit()		make_syscall(93)
 #define syscall_get_char()	make_syscall(1)
 #define syscall_put_char(x)	make_syscall(2, (unsigned long)x)
 #define syscall_yield()		make_syscall(9)
 #define syscall_sleep(x)	make_syscall(10, (unsigned long)x)
+#define syscall_read(fd, buf, size)	make_syscall(63, (unsigned long)fd, (unsigned long)buf, (unsigned long)size)
+#define syscall_write(fd, buf, size)	make_syscall(64, (unsigned long)fd, (unsigned long)buf, (unsigned long)size)
+#define syscall_pwrite(fd, buf, size, off)	make_syscall(68, (unsigned long)fd, (unsigned long)buf, (unsigned long)size, (unsigned long)off)
+#define syscall_close(fd)	make_syscall(57, (unsigned long)fd)
+#define syscall_fsync(fd)	make_syscall(82, (unsigned long)fd)
+#define syscall_exit_group()	make_syscall(94)
+#define syscall_futex(addr, op, val)	make_syscall(98, (unsigned long)addr, (unsigned long)op, (unsigned long)val)
+#define syscall_brk(x)		make_syscall(214, (unsigned long)x)
+// Gives back how many bytes it wrote, or -11 (EAGAIN) with GRND_NONBLOCK
+// before the kernel is seeded. See random.h.
+#define syscall_getrandom(buf, len, flags)	make_syscall(278, (unsigned long)buf, (unsigned long)len, (unsigned long)flags)
+// Returns 0 in the child and the child's PID in the parent. Memory is
+// copied a page at a time as either side writes to it.
+#define syscall_fork()		make_syscall(1079)
+// Starts a thread at entry(arg) on the given stack. See thread.h.
+#define syscall_clone(entry, stack, arg, tid)	make_syscall(220, (unsigned long)entry, (unsigned long)stack, (unsigned long)arg, (unsigned long)tid)
 #define syscall_get_fb(x)	make_syscall(1000, (unsigned long)x)
 #define syscall_inv_rect(d, x, y, w, h) make_syscall(1001, (unsigned long) d, (unsigned long)x, (unsigned long)y, (unsigned long)w, (unsigned long)h)
 #define syscall_get_key(x, y)	make_syscall(1002, (unsigned long)x, (unsigned long)y)
 #define syscall_get_abs(x, y)	make_syscall(1004, (unsigned long)x, (unsigned long)y)
+#define syscall_get_fb_size(d)	make_syscall(1007, (unsigned long)d)
+#define syscall_get_damage(d)	make_syscall(1005, (unsigned long)d)
+#define syscall_present(d)	make_syscall(1006, (unsigned long)d)
+#define syscall_get_events()	make_syscall(1008)
+#define syscall_wait_events()	make_syscall(1009)
+#define syscall_nice(x)		make_syscall(1010, (unsigned long)x)
+// See swapchain.h.
+#define syscall_swapchain(d, n)	make_syscall(1011, (unsigned long)d, (unsigned long)n)
+#define syscall_present_buffer(d, i)	make_syscall(1012, (unsigned long)d, (unsigned long)i)
+#define syscall_fence_wait(d, f)	make_syscall(1013, (unsigned long)d, (unsigned long)f)
+#define syscall_io_setup()	make_syscall(1020)
+#define syscall_io_enter(n)	make_syscall(1021, (unsigned long)n)
+#define syscall_open(path, flags)	make_syscall(1024, (unsigned long)path, (unsigned long)flags)
+#define syscall_trace(op, buf, len)	make_syscall(1030, (unsigned long)op, (unsigned long)buf, (unsigned long)len)
+#define syscall_memstats(buf, len)	make_syscall(1031, (unsigned long)buf, (unsigned long)len)
+#define syscall_profile(op, a, b)	make_syscall(1040, (unsigned long)op, (unsigned long)a, (unsigned long)b)
+// clock.h reads the same value without a system call.
 #define syscall_get_time()  make_syscall(1062)
 
@@ -0,0 +1,80 @@
+// thread.cpp
+// Threads for startlib
+
+#include "thread.h"
+#include "malloc.h"
+
+extern "C" {
+// In syscall.S. Every thread starts there, with its ThreadState in a0, and
+// exits when this returns.
+void thread_start(sos::ThreadState *state);
+
+void thread_main(sos::ThreadState *state) {
+	state->run(state->fn);
+}
+}
+
+namespace sos {
+
+// Threads that nobody is going to join. We can't free a thread's stack
+// while it's running on it, so we free them here once they've exited.
+static mutex detached_lock;
+static ThreadState *detached = nullptr;
+
+static void reap_detached() {
+	lock_guard<mutex> g(detached_lock);
+	ThreadState **prev = &detached;
+	while (*prev != nullptr) {
+		ThreadState *s = *prev;
+		if (s->tid == 0) {
+			*prev = s->next_detached;
+			free(s->stack);
+			free(s);
+		}
+		else {
+			prev = &s->next_detached;
+		}
+	}
+}
+
+ThreadState *thread_spawn(void (*run)(void *), void *fn) {
+	reap_detached();
+	ThreadState *state = (ThreadState *)malloc(sizeof(ThreadState));
+	void *stack = malloc(THREAD_STACK_SIZE);
+	if (state == nullptr || stack == nullptr) {
+		free(state);
+		free(stack);
+		return nullptr;
+	}
+	state->tid = -1;
+	state->stack = stack;
+	state->run = run;
+	state->fn = fn;
+	state->next_detached = nullptr;
+	// The stack grows down from the end, which has to be 16-byte aligned.
+	unsigned long top = ((unsigned long)stack + THREAD_STACK_SIZE) & ~15UL;
+	long tid = (long)syscall_clone(thread_start, top, state, &state->tid);
+	if (tid < 0) {
+		free(stack);
+		free(state);
+		return nullptr;
+	}
+	return state;
+}
+
+void thread_join(ThreadState *state) {
+	int tid;
+	while ((tid = state->tid) != 0) {
+		futex_wait(&state->tid, tid);
+	}
+	free(state->stack);
+	free(state);
+}
+
+void thread_detach(ThreadState *state) {
+	lock_guard<mutex> g(detached_lock);
+	state->next_detached = detached;
+	detached = state;
+}
+
+}
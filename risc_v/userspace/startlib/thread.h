@@ -0,0 +1,219 @@
+#pragma once
+// thread.h
+// Threads, mutexes and condition variables
+// These follow std::thread, std::mutex, std::lock_guard, std::unique_lock
+// and std::condition_variable closely enough that code written against
+// those works with `using namespace sos;`. A thread is a process that
+// shares our address space (clone, 220). Nothing here spins on sleep():
+// a thread that has to wait sleeps on a futex until it's woken.
+//
+//     sos::mutex m;
+//     int count = 0;
+//     sos::thread t([&] { sos::lock_guard<sos::mutex> g(m); count++; });
+//     t.join();
+//
+// Threads share newlib's state, so two threads shouldn't printf() at the
+// same time. malloc() and new are safe.
+
+#include "futex.h"
+
+// How big the stack that thread gives each new thread is.
+#define THREAD_STACK_SIZE (64 * 1024)
+
+namespace sos {
+
+// What a new thread runs, and what join() waits on.
+struct ThreadState {
+	// The kernel stores the thread's id here before it starts and 0 here
+	// after it's gone.
+	volatile int tid;
+	void *stack;
+	void (*run)(void *fn);
+	void *fn;
+	ThreadState *next_detached;
+};
+
+// Start a thread running run(fn). Returns nullptr if we couldn't.
+ThreadState *thread_spawn(void (*run)(void *), void *fn);
+// Wait for the thread to exit, then free its stack and state.
+void thread_join(ThreadState *state);
+// Nobody is going to join it. It's freed some time after it exits.
+void thread_detach(ThreadState *state);
+
+class thread {
+public:
+	class id {
+	public:
+		id() : tid(0) {}
+		explicit id(int t) : tid(t) {}
+		bool operator==(const id &o) const { return tid == o.tid; }
+		bool operator!=(const id &o) const { return tid != o.tid; }
+		bool operator<(const id &o) const { return tid < o.tid; }
+		int native() const { return tid; }
+
+	private:
+		int tid;
+	};
+
+	thread() : state(nullptr) {}
+
+	// The arguments are copied, like std::thread does, so pass pointers
+	// to anything that should be shared.
+	template<typename F, typename... Args>
+	explicit thread(F f, Args... args) {
+		auto call = [=]() mutable { f(args...); };
+		typedef decltype(call) Call;
+		Call *fn = new Call(call);
+		state = thread_spawn(&thread::invoke<Call>, fn);
+		if (state == nullptr) {
+			delete fn;
+		}
+	}
+
+	thread(const thread &) = delete;
+	thread &operator=(const thread &) = delete;
+
+	thread(thread &&o) : state(o.state) { o.state = nullptr; }
+	thread &operator=(thread &&o) {
+		if (joinable()) {
+			__builtin_trap();
+		}
+		state = o.state;
+		o.state = nullptr;
+		return *this;
+	}
+
+	// Like std::thread, forgetting to join or detach is a bug, and it's
+	// fatal.
+	~thread() {
+		if (joinable()) {
+			__builtin_trap();
+		}
+	}
+
+	bool joinable() const { return state != nullptr; }
+	id get_id() const { return state == nullptr ? id() : id(state->tid); }
+
+	void join() {
+		thread_join(state);
+		state = nullptr;
+	}
+
+	void detach() {
+		thread_detach(state);
+		state = nullptr;
+	}
+
+private:
+	template<typename Call>
+	static void invoke(void *fn) {
+		Call *call = (Call *)fn;
+		(*call)();
+		delete call;
+	}
+
+	ThreadState *state;
+};
+
+namespace this_thread {
+inline thread::id get_id() {
+	// Our id is our PID.
+	return thread::id((int)make_syscall(172));
+}
+inline void yield() {
+	syscall_yield();
+}
+}
+
+class mutex {
+public:
+	constexpr mutex() : lock_{0} {}
+	mutex(const mutex &) = delete;
+	mutex &operator=(const mutex &) = delete;
+
+	void lock() { lock_.lock(); }
+	bool try_lock() { return lock_.try_lock(); }
+	void unlock() { lock_.unlock(); }
+
+private:
+	FutexLock lock_;
+};
+
+template<typename M>
+class lock_guard {
+public:
+	explicit lock_guard(M &m) : m(m) { m.lock(); }
+	~lock_guard() { m.unlock(); }
+	lock_guard(const lock_guard &) = delete;
+	lock_guard &operator=(const lock_guard &) = delete;
+
+private:
+	M &m;
+};
+
+template<typename M>
+class unique_lock {
+public:
+	explicit unique_lock(M &m) : m(&m), owns(true) { m.lock(); }
+	~unique_lock() {
+		if (owns) {
+			m->unlock();
+		}
+	}
+	unique_lock(const unique_lock &) = delete;
+	unique_lock &operator=(const unique_lock &) = delete;
+
+	void lock() {
+		m->lock();
+		owns = true;
+	}
+	void unlock() {
+		m->unlock();
+		owns = false;
+	}
+	bool owns_lock() const { return owns; }
+	M *mutex() const { return m; }
+
+private:
+	M *m;
+	bool owns;
+};
+
+// Waiters sleep on seq. Every notify bumps it first, so a waiter that
+// let go of the mutex but hasn't gone to sleep yet finds seq changed and
+// doesn't sleep through it.
+class condition_variable {
+public:
+	constexpr condition_variable() : seq(0) {}
+	condition_variable(const condition_variable &) = delete;
+	condition_variable &operator=(const condition_variable &) = delete;
+
+	void wait(unique_lock<mutex> &lock) {
+		int s = seq;
+		lock.unlock();
+		futex_wait(&seq, s);
+		lock.lock();
+	}
+
+	template<typename Pred>
+	void wait(unique_lock<mutex> &lock, Pred pred) {
+		while (!pred()) {
+			wait(lock);
+		}
+	}
+
+	void notify_one() {
+		__atomic_add_fetch(&seq, 1, __ATOMIC_RELEASE);
+		futex_wake(&seq, 1);
+	}
+
+	void notify_all() {
+		__atomic_add_fetch(&seq, 1, __ATOMIC_RELEASE);
+		futex_wake(&seq, 0x7fffffff);
+	}
+
+private:
+	volatile int seq;
+};
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+// trace.h
+// Reading the kernel's trace
+// Every hart keeps a ring of the last TRACE_RING_SIZE things it did, and
+// the kernel counts every system call by number with a histogram of how
+// long it took. syscall_trace() (1030) copies either of them out.
+
+#include "syscall.h"
+
+// These must match trace.rs.
+#define TRACE_RING_SIZE 256
+#define TRACE_HIST_BUCKETS 16
+
+#define TRACE_EVENTS 0
+#define TRACE_STATS  1
+#define TRACE_RESET  2
+#define TRACE_ENABLE 3
+
+#define EV_SYSCALL_ENTER 1 // arg = system call number
+#define EV_SYSCALL_EXIT  2 // arg = ticks it took
+#define EV_SWITCH        3 // pid = what we switched to, arg = what we switched from
+#define EV_INTERRUPT     4 // arg = PLIC source
+#define EV_BLOCK_DONE    5 // pid = who was waiting, arg = virtio status
+#define EV_GPU_DONE      6 // arg = descriptor
+
+struct TraceEvent {
+	unsigned long time; // mtime ticks
+	unsigned int arg;
+	unsigned short pid;
+	unsigned char kind;
+	unsigned char hart;
+};
+
+struct SyscallStat {
+	unsigned long number; // 0 counts calls there was no room for
+	unsigned long count;
+	unsigned long total;  // mtime ticks
+	unsigned long max;
+	// Bucket i counts calls under 2^i ticks. The last takes the rest.
+	unsigned int hist[TRACE_HIST_BUCKETS];
+};
+
+// Copy up to n events into events, every hart's oldest first. Returns how
+// many there were.
+static inline long trace_events(TraceEvent *events, unsigned long n) {
+	return syscall_trace(TRACE_EVENTS, events, n * sizeof(TraceEvent));
+}
+
+// Copy the count for up to n system call numbers into stats.
+static inline long trace_stats(SyscallStat *stats, unsigned long n) {
+	return syscall_trace(TRACE_STATS, stats, n * sizeof(SyscallStat));
+}
+
+// Empty the rings and zero the counts.
+static inline void trace_reset() {
+	syscall_trace(TRACE_RESET, 0, 0);
+}
+
+// Turn tracing on or off. Returns whether it was on.
+static inline bool trace_enable(bool on) {
+	return syscall_trace(TRACE_ENABLE, on, 0) != 0;
+}
@@ -0,0 +1,88 @@
+// trace.cpp
+// Print what the kernel has been doing
+// First the system calls, with how often they were made and how long the
+// kernel took on them, then everything still in the trace rings in the
+// order it happened.
+
+#include <cstdio>
+#include <cstdlib>
+#include <startlib/clock.h>
+#include <startlib/trace.h>
+
+#define MAX_EVENTS (TRACE_RING_SIZE * 8)
+#define MAX_STATS  64
+
+static const char *kind_name(unsigned char kind) {
+	switch (kind) {
+		case EV_SYSCALL_ENTER: return "syscall";
+		case EV_SYSCALL_EXIT:  return "sysret";
+		case EV_SWITCH:        return "switch";
+		case EV_INTERRUPT:     return "irq";
+		case EV_BLOCK_DONE:    return "block";
+		case EV_GPU_DONE:      return "gpu";
+		default:               return "?";
+	}
+}
+
+static void print_stats() {
+	SyscallStat *stats = (SyscallStat *)malloc(MAX_STATS * sizeof(SyscallStat));
+	long n = trace_stats(stats, MAX_STATS);
+	// Sort by number so that two runs line up.
+	for (long i = 1; i < n; i++) {
+		SyscallStat s = stats[i];
+		long j = i;
+		for (; j > 0 && stats[j - 1].number > s.number; j--) {
+			stats[j] = stats[j - 1];
+		}
+		stats[j] = s;
+	}
+	printf("# syscall count mean_ns max_ns hist(<2^i ticks)\n");
+	for (long i = 0; i < n; i++) {
+		const SyscallStat &s = stats[i];
+		printf("syscall %lu count=%lu mean_ns=%lu max_ns=%lu hist=", s.number, s.count,
+		       ticks_to_ns(s.total / s.count), ticks_to_ns(s.max));
+		for (int b = 0; b < TRACE_HIST_BUCKETS; b++) {
+			printf(b == 0 ? "%u" : ",%u", s.hist[b]);
+		}
+		printf("\n");
+	}
+	free(stats);
+}
+
+static void print_events() {
+	TraceEvent *events = (TraceEvent *)malloc(MAX_EVENTS * sizeof(TraceEvent));
+	long n = trace_events(events, MAX_EVENTS);
+	// Each hart's events are in order already, so this is a merge, but an
+	// insertion sort is simple and it's only a couple thousand.
+	for (long i = 1; i < n; i++) {
+		TraceEvent e = events[i];
+		long j = i;
+		for (; j > 0 && events[j - 1].time > e.time; j--) {
+			events[j] = events[j - 1];
+		}
+		events[j] = e;
+	}
+	printf("# time_ns hart pid event arg\n");
+	for (long i = 0; i < n; i++) {
+		const TraceEvent &e = events[i];
+		printf("%lu %u %u %s ", ticks_to_ns(e.time), e.hart, e.pid, kind_name(e.kind));
+		if (e.kind == EV_SYSCALL_EXIT) {
+			printf("%luns\n", ticks_to_ns(e.arg));
+		}
+		else {
+			printf("%u\n", e.arg);
+		}
+	}
+	free(events);
+}
+
+int main()
+{
+	// Stop tracing while we read, so that our own system calls don't push
+	// out what we came to see.
+	bool was = trace_enable(false);
+	print_stats();
+	print_events();
+	trace_enable(was);
+	return 0;
+}